@@ -57,6 +57,7 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     lock[=DURATION]         - profile contended locks overflowing the DURATION ns bucket (default: 10us)
 //     wall[=NS]               - run wall clock profiling together with CPU profiling
 //     nobatch                 - legacy wall clock sampling without batch events
+//     wallthreads=N           - number of threads sending wall clock signals (default: 1)
 //     proc[=S]                - collect process stats (default: 30s)
 //     collapsed               - dump collapsed stacks (the format used by FlameGraph script)
 //     flamegraph              - produce Flame Graph in HTML format
@@ -71,6 +72,8 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     total                   - count the total value (time, bytes, etc.) instead of samples
 //     chunksize=N             - approximate size of JFR chunk in bytes (default: 100 MB)
 //     chunktime=N             - duration of JFR chunk in seconds (default: 1 hour)
+//     tracemem=N[:M]          - evict call traces idle for M chunks when storage exceeds N bytes
+//     compress[=lz4]          - compress JFR output on a background thread
 //     timeout=TIME            - automatically stop profiler at TIME (absolute or relative)
 //     loop=TIME               - run profiler in a loop (continuous profiling)
 //     interval=N              - sampling interval in ns (default: 10'000'000, i.e. 10 ms)
@@ -93,6 +96,14 @@ const size_t EXTRA_BUF_SIZE = 512;
 //     fdtransfer              - use fdtransfer to pass fds to the profiler
 //     target-cpu=CPU          - sample threads on a specific CPU (perf_events only, default: -1)
 //     record-cpu              - record which cpu a sample was taken on
+//     percpu                  - open one perf_event per CPU instead of one per thread
+//     perfbatch=N             - deliver one perf_events signal per N samples
+//     counters                - record thread performance counter deltas with every CPU sample (JFR only)
+//     sharded                 - keep separate sample counters per lock stripe to reduce contention
+//     threadbuf               - record samples into per-thread buffers instead of shared lock-striped ones
+//     compact                 - store call traces as a prefix tree sharing common frames
+//     iouring                 - batch output file writes with io_uring when available
+//     lazysymbols             - parse symbols and unwind tables of libraries in background
 //     simple                  - simple class names instead of FQN
 //     dot                     - dotted class names
 //     norm                    - normalize names of hidden classes / lambdas
@@ -217,6 +228,22 @@ Error Arguments::parse(const char* args) {
                     msg = "Invalid chunktime";
                 }
 
+            CASE("tracemem")
+                char* age = value != NULL ? strchr(value, ':') : NULL;
+                if (age != NULL) *age++ = 0;
+
+                if (value == NULL || (_trace_mem = parseUnits(value, BYTES)) < 0) {
+                    msg = "Invalid tracemem";
+                } else if (age != NULL && (_trace_age = atoi(age)) <= 0) {
+                    msg = "Invalid tracemem";
+                }
+
+            CASE("compress")
+                if (value != NULL && strcmp(value, "lz4") != 0) {
+                    msg = "Unsupported compression codec";
+                }
+                _compress = true;
+
             // Basic options
             CASE("event")
                 if (value == NULL || value[0] == 0) {
@@ -394,15 +421,46 @@ Error Arguments::parse(const char* args) {
             CASE("record-cpu")
                 _record_cpu = true;
 
+            CASE("percpu")
+                _per_cpu = true;
+
+            CASE("counters")
+                _counters = true;
+
+            CASE("perfbatch")
+                if (value == NULL || (_perf_batch = atoi(value)) <= 0) {
+                    msg = "perfbatch must be > 0";
+                }
+
             CASE("live")
                 _live = true;
 
             CASE("nobatch")
                 _nobatch = true;
 
+            CASE("wallthreads")
+                if (value == NULL || (_wall_threads = atoi(value)) <= 0 || _wall_threads > MAX_WALL_THREADS) {
+                    msg = "wallthreads must be between 1 and 16";
+                }
+
             CASE("alluser")
                 _alluser = true;
 
+            CASE("sharded")
+                _sharded = true;
+
+            CASE("threadbuf")
+                _thread_buffers = true;
+
+            CASE("compact")
+                _compact = true;
+
+            CASE("iouring")
+                _io_ring = true;
+
+            CASE("lazysymbols")
+                _lazy_symbols = true;
+
             CASE("cstack")
                 if (value != NULL) {
                     if (strcmp(value, "fp") == 0) {
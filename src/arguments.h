@@ -15,6 +15,7 @@ const long DEFAULT_ALLOC_INTERVAL = 524287;  // 512 KiB
 const long DEFAULT_LOCK_INTERVAL = 10000;    // 10 us
 const long DEFAULT_PROC_INTERVAL = 30;       // 30 seconds
 const int DEFAULT_JSTACKDEPTH = 2048;
+const int MAX_WALL_THREADS = 16;
 
 const char* const EVENT_CPU        = "cpu";
 const char* const EVENT_ALLOC      = "alloc";
@@ -201,12 +202,21 @@ class Arguments {
     bool _threads;
     bool _sched;
     bool _record_cpu;
+    bool _per_cpu;
+    int _perf_batch;
+    bool _counters;
     bool _live;
     bool _nofree;
     bool _nobatch;
+    int _wall_threads;
     bool _nostop;
     bool _alluser;
     bool _fdtransfer;
+    bool _sharded;
+    bool _thread_buffers;
+    bool _compact;
+    bool _io_ring;
+    bool _lazy_symbols;
     const char* _fdtransfer_path;
     int _target_cpu;
     int _style;
@@ -215,6 +225,9 @@ class Arguments {
     Clock _clock;
     Output _output;
     long _chunk_size;
+    long _trace_mem;
+    int _trace_age;
+    bool _compress;
     long _chunk_time;
     const char* _jfr_sync;
     int _jfr_options;
@@ -262,12 +275,21 @@ class Arguments {
         _threads(false),
         _sched(false),
         _record_cpu(false),
+        _per_cpu(false),
+        _perf_batch(1),
+        _counters(false),
         _live(false),
         _nofree(false),
         _nobatch(false),
+        _wall_threads(1),
         _nostop(false),
         _alluser(false),
         _fdtransfer(false),
+        _sharded(false),
+        _thread_buffers(false),
+        _compact(false),
+        _io_ring(false),
+        _lazy_symbols(false),
         _fdtransfer_path(NULL),
         _target_cpu(-1),
         _style(0),
@@ -276,6 +298,9 @@ class Arguments {
         _clock(CLK_DEFAULT),
         _output(OUTPUT_NONE),
         _chunk_size(100 * 1024 * 1024),
+        _trace_mem(0),
+        _trace_age(2),
+        _compress(false),
         _chunk_time(3600),
         _jfr_sync(NULL),
         _jfr_options(0),
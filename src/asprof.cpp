@@ -39,7 +39,7 @@ DLLEXPORT asprof_error_t asprof_execute(const char* command, asprof_writer_t out
             return NULL;
         }
     } else {
-        FileWriter out(args.file());
+        FileWriter out(args.file(), args._io_ring);
         if (!out.is_open()) {
             return asprof_error("Could not open output file");
         }
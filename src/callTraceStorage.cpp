@@ -3,6 +3,8 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
+#include <stdlib.h>
 #include <string.h>
 #include "callTraceStorage.h"
 #include "os.h"
@@ -11,7 +13,13 @@
 
 static const u32 INITIAL_CAPACITY = 65536;
 static const u32 CALL_TRACE_CHUNK = 8 * 1024 * 1024;
+static const u32 DUMP_CHUNK = 1024 * 1024;
+static const u32 NODE_BUCKETS = 256 * 1024;
 static const u32 OVERFLOW_TRACE_ID = 0x7fffffff;
+static const u32 EVICTED_TRACE_ID = 0x7ffffffe;
+static const u32 MAX_ID_BASE = 0x40000000;
+// Rebuilding the storage is not worth it unless at least 1/8 of stored traces are idle
+static const u32 MIN_EVICTED_SHARE = 8;
 
 
 class LongHashTable {
@@ -19,21 +27,25 @@ class LongHashTable {
     LongHashTable* _prev;
     void* _padding0;
     u32 _capacity;
-    u32 _padding1[15];
+    u32 _shards;
+    u32 _padding1[14];
     volatile u32 _size;
     u32 _padding2[15];
 
-    static size_t getSize(u32 capacity) {
-        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity;
+    static size_t getSize(u32 capacity, u32 shards) {
+        size_t size = sizeof(LongHashTable) + (sizeof(u64) + sizeof(CallTraceSample)) * capacity
+                    + sizeof(CallTraceCounter) * capacity * shards + capacity / 8 + sizeof(u32) * capacity
+                    + capacity / 8 * shards;
         return (size + OS::page_mask) & ~OS::page_mask;
     }
 
   public:
-    static LongHashTable* allocate(LongHashTable* prev, u32 capacity) {
-        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity));
+    static LongHashTable* allocate(LongHashTable* prev, u32 capacity, u32 shards) {
+        LongHashTable* table = (LongHashTable*)OS::safeAlloc(getSize(capacity, shards));
         if (table != NULL) {
             table->_prev = prev;
             table->_capacity = capacity;
+            table->_shards = shards;
             table->_size = 0;
         }
         return table;
@@ -41,12 +53,12 @@ class LongHashTable {
 
     LongHashTable* destroy() {
         LongHashTable* prev = _prev;
-        OS::safeFree(this, getSize(_capacity));
+        OS::safeFree(this, getSize(_capacity, _shards));
         return prev;
     }
 
     size_t usedMemory() {
-        return getSize(_capacity);
+        return getSize(_capacity, _shards);
     }
 
     LongHashTable* prev() {
@@ -57,6 +69,10 @@ class LongHashTable {
         return _capacity;
     }
 
+    u32 shards() {
+        return _shards;
+    }
+
     u32 size() {
         return _size;
     }
@@ -73,23 +89,50 @@ class LongHashTable {
         return (CallTraceSample*)(keys() + _capacity);
     }
 
+    // Each shard has its own contiguous array of counters,
+    // so that different shards never share a cache line
+    CallTraceCounter* counters(u32 shard) {
+        return (CallTraceCounter*)(values() + _capacity) + (size_t)shard * _capacity;
+    }
+
+    // Bitmap of slots referenced by events of the current JFR chunk
+    u64* referenced() {
+        return (u64*)counters(_shards);
+    }
+
+    // Number of the last JFR chunk that referenced each slot
+    u32* lastChunks() {
+        return (u32*)(referenced() + _capacity / 64);
+    }
+
+    // Per-shard bitmap of slots whose counters have not been merged yet
+    u64* dirty(u32 shard) {
+        return (u64*)(lastChunks() + _capacity) + (size_t)shard * (_capacity / 64);
+    }
+
     void clear() {
-        memset(keys(), 0, (sizeof(u64) + sizeof(CallTraceSample)) * _capacity);
+        memset(keys(), 0, (char*)dirty(_shards) - (char*)keys());
         _size = 0;
     }
 };
 
 CallTrace CallTraceStorage::_overflow_trace = {1, {BCI_ERROR, LP64_ONLY(0 COMMA) (jmethodID)"storage_overflow"}};
+CallTrace CallTraceStorage::_evicted_trace = {1, {BCI_ERROR, LP64_ONLY(0 COMMA) (jmethodID)"evicted_trace"}};
 
-CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK) {
-    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY);
+CallTraceStorage::CallTraceStorage() : _allocator(CALL_TRACE_CHUNK), _dump_allocator(DUMP_CHUNK) {
+    _current_table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, 0);
+    _node_buckets = NULL;
     _overflow = 0;
+    _evicted = 0;
+    _id_base = 0;
+    _chunk = 0;
 }
 
 CallTraceStorage::~CallTraceStorage() {
     while (_current_table != NULL) {
         _current_table = _current_table->destroy();
     }
+    setCompact(false);
 }
 
 void CallTraceStorage::clear() {
@@ -98,7 +141,44 @@ void CallTraceStorage::clear() {
     }
     _current_table->clear();
     _allocator.clear();
+    _dump_allocator.clear();
+    if (_node_buckets != NULL) {
+        memset(_node_buckets, 0, NODE_BUCKETS * sizeof(FrameNode*));
+    }
     _overflow = 0;
+    _evicted = 0;
+    _id_base = 0;
+    _chunk = 0;
+    std::vector<std::pair<u32, u32> >().swap(_remap);
+}
+
+// Switches between a single set of sample counters and per-shard counters.
+// With shards, concurrent put() calls from different shards do not contend for the same
+// cache lines; the counters are merged back into CallTraceSample when collected.
+// Each shard costs 16 bytes per hash table slot, i.e. 1 MB for the initial 64K slots,
+// and the cost doubles with every table resize.
+// Must be called on an empty storage, i.e. right after clear().
+void CallTraceStorage::setShards(u32 shards) {
+    if (_current_table->shards() != shards) {
+        LongHashTable* table = LongHashTable::allocate(NULL, INITIAL_CAPACITY, shards);
+        if (table != NULL) {
+            _current_table->destroy();
+            _current_table = table;
+        }
+    }
+}
+
+// In compact mode, call traces are stored as leaf nodes of a prefix tree,
+// so that traces with a common root part do not duplicate frames.
+// Flat CallTrace copies are made only when traces are collected.
+// Must be called on an empty storage, i.e. right after clear().
+void CallTraceStorage::setCompact(bool compact) {
+    if (compact && _node_buckets == NULL) {
+        _node_buckets = (FrameNode**)OS::safeAlloc(NODE_BUCKETS * sizeof(FrameNode*));
+    } else if (!compact && _node_buckets != NULL) {
+        OS::safeFree(_node_buckets, NODE_BUCKETS * sizeof(FrameNode*));
+        _node_buckets = NULL;
+    }
 }
 
 u32 CallTraceStorage::capacity() {
@@ -108,37 +188,77 @@ u32 CallTraceStorage::capacity() {
 }
 
 size_t CallTraceStorage::usedMemory() {
-    size_t bytes = _allocator.usedMemory();
+    size_t bytes = _allocator.usedMemory() + _dump_allocator.usedMemory();
+    if (_node_buckets != NULL) {
+        bytes += NODE_BUCKETS * sizeof(FrameNode*);
+    }
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         bytes += table->usedMemory();
     }
-    return bytes;
+    return bytes + _remap.capacity() * sizeof(_remap[0]);
+}
+
+void CallTraceStorage::mergeShards() {
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        CallTraceSample* values = table->values();
+        u32 capacity = table->capacity();
+
+        for (u32 shard = 0; shard < table->shards(); shard++) {
+            CallTraceCounter* counters = table->counters(shard);
+            u64* dirty = table->dirty(shard);
+            for (u32 i = 0; i < capacity / 64; i++) {
+                if (dirty[i] == 0) {
+                    continue;
+                }
+                for (u64 bits = __atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQ_REL); bits != 0; bits &= bits - 1) {
+                    u32 slot = i * 64 + __builtin_ctzll(bits);
+                    atomicInc(values[slot].counter, __atomic_exchange_n(&counters[slot].counter, 0, __ATOMIC_ACQ_REL));
+                    atomicInc(values[slot].samples, __atomic_exchange_n(&counters[slot].samples, 0, __ATOMIC_ACQ_REL));
+                }
+            }
+        }
+    }
 }
 
+// Collects call traces referenced by events of the current JFR chunk and starts a new chunk.
+// Only the reference bitmaps are scanned, so the cost depends on the chunk's activity
+// rather than on the total number of stored traces.
 void CallTraceStorage::collectTraces(std::map<u32, CallTrace*>& map) {
+    _dump_allocator.clear();
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        u64* keys = table->keys();
+        u64* referenced = table->referenced();
+        u32* last_chunks = table->lastChunks();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
+        u32 first_id = _id_base + capacity - (INITIAL_CAPACITY - 1);
 
-        for (u32 slot = 0; slot < capacity; slot++) {
-            if (keys[slot] != 0 && loadAcquire(values[slot].samples) != 0) {
-                // Reset samples to avoid duplication of call traces between JFR chunks
-                values[slot].samples = 0;
-                CallTrace* trace = values[slot].acquireTrace();
+        for (u32 i = 0; i < capacity / 64; i++) {
+            if (referenced[i] == 0) {
+                continue;
+            }
+            for (u64 bits = __atomic_exchange_n(&referenced[i], 0, __ATOMIC_ACQ_REL); bits != 0; bits &= bits - 1) {
+                u32 slot = i * 64 + __builtin_ctzll(bits);
+                last_chunks[slot] = _chunk;
+                CallTrace* trace = expandTrace(values[slot].acquireTrace());
                 if (trace != NULL) {
-                    map[capacity - (INITIAL_CAPACITY - 1) + slot] = trace;
+                    map[first_id + slot] = trace;
                 }
             }
         }
     }
+    _chunk++;
 
     if (_overflow > 0) {
         map[OVERFLOW_TRACE_ID] = &_overflow_trace;
     }
+    if (_evicted > 0) {
+        map[EVICTED_TRACE_ID] = &_evicted_trace;
+    }
 }
 
 void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
+    mergeShards();
+    _dump_allocator.clear();
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
@@ -146,13 +266,27 @@ void CallTraceStorage::collectSamples(std::vector<CallTraceSample*>& samples) {
 
         for (u32 slot = 0; slot < capacity; slot++) {
             if (keys[slot] != 0) {
-                samples.push_back(&values[slot]);
+                if (_node_buckets == NULL) {
+                    samples.push_back(&values[slot]);
+                    continue;
+                }
+
+                // Compact traces are returned as a snapshot with expanded frames
+                CallTraceSample* s = (CallTraceSample*)_dump_allocator.alloc(sizeof(CallTraceSample));
+                if (s != NULL) {
+                    s->samples = loadAcquire(values[slot].samples);
+                    s->counter = loadAcquire(values[slot].counter);
+                    s->trace = expandTrace(values[slot].acquireTrace());
+                    samples.push_back(s);
+                }
             }
         }
     }
 }
 
 void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
+    mergeShards();
+    _dump_allocator.clear();
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
@@ -160,52 +294,96 @@ void CallTraceStorage::collectSamples(std::map<u64, CallTraceSample>& map) {
 
         for (u32 slot = 0; slot < capacity; slot++) {
             if (keys[slot] != 0 && values[slot].acquireTrace() != NULL) {
-                map[keys[slot]] += values[slot];
+                CallTraceSample s = values[slot];
+                s.trace = expandTrace(s.trace);
+                map[keys[slot]] += s;
             }
         }
     }
 }
 
-// Adaptation of MurmurHash64A by Austin Appleby
-u64 CallTraceStorage::calcHash(int num_frames, ASGCT_CallFrame* frames) {
-    const u64 M = 0xc6a4a7935bd1e995ULL;
-    const int R = 47;
+CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
+    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    if (buf != NULL) {
+        buf->num_frames = num_frames;
+        // Do not use memcpy inside signal handler
+        for (int i = 0; i < num_frames; i++) {
+            buf->frames[i] = frames[i];
+        }
+    }
+    return buf;
+}
 
-    int len = num_frames * sizeof(ASGCT_CallFrame);
-    u64 h = len * M;
+// Returns the existing node with the given parent and frame, or atomically inserts a new one.
+// Buckets are lock-free lists that only grow at the head, so a failed CAS requires
+// checking only the nodes inserted after the previously observed head.
+FrameNode* CallTraceStorage::findOrInsertNode(FrameNode* parent, const ASGCT_CallFrame& frame) {
+    u64 h = (u64)(uintptr_t)parent * 0xc6a4a7935bd1e995ULL + (u64)(uintptr_t)frame.method_id * 31 + frame.bci;
+    h ^= h >> 29;
+    FrameNode** bucket = &_node_buckets[h & (NODE_BUCKETS - 1)];
+
+    FrameNode* head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    FrameNode* seen = NULL;
+    FrameNode* node = NULL;
+
+    while (true) {
+        for (FrameNode* n = head; n != seen; n = n->next) {
+            if (n->parent == parent && n->frame.method_id == frame.method_id && n->frame.bci == frame.bci) {
+                // A node allocated in the previous iteration is wasted, which is a very rare case
+                return n;
+            }
+        }
 
-    const u64* data = (const u64*)frames;
-    const u64* end = data + len / 8;
+        if (node == NULL) {
+            node = (FrameNode*)_allocator.alloc(sizeof(FrameNode));
+            if (node == NULL) {
+                return NULL;
+            }
+            node->parent = parent;
+            node->frame = frame;
+        }
 
-    while (data != end) {
-        u64 k = *data++;
-        k *= M;
-        k ^= k >> R;
-        k *= M;
-        h ^= k;
-        h *= M;
+        node->next = head;
+        if (__sync_bool_compare_and_swap(bucket, head, node)) {
+            return node;
+        }
+        seen = head;
+        head = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
     }
+}
 
-    if (len & 4) {
-        h ^= *(u32*)data;
-        h *= M;
+CallTrace* CallTraceStorage::storeCompactTrace(int num_frames, ASGCT_CallFrame* frames) {
+    // The last frame is the root of the stack
+    FrameNode* node = NULL;
+    for (int i = num_frames - 1; i >= 0; i--) {
+        if ((node = findOrInsertNode(node, frames[i])) == NULL) {
+            return NULL;
+        }
     }
+    return (CallTrace*)node;
+}
 
-    h ^= h >> R;
-    h *= M;
-    h ^= h >> R;
+// In compact mode, CallTraceSample::trace refers to a leaf FrameNode.
+// Make a flat copy of the trace that lives until the next collection.
+CallTrace* CallTraceStorage::expandTrace(CallTrace* trace) {
+    if (_node_buckets == NULL || trace == NULL) {
+        return trace;
+    }
 
-    return h;
-}
+    FrameNode* leaf = (FrameNode*)trace;
+    int num_frames = 0;
+    for (FrameNode* n = leaf; n != NULL; n = n->parent) {
+        num_frames++;
+    }
 
-CallTrace* CallTraceStorage::storeCallTrace(int num_frames, ASGCT_CallFrame* frames) {
     const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
-    CallTrace* buf = (CallTrace*)_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
+    CallTrace* buf = (CallTrace*)_dump_allocator.alloc(header_size + num_frames * sizeof(ASGCT_CallFrame));
     if (buf != NULL) {
         buf->num_frames = num_frames;
-        // Do not use memcpy inside signal handler
-        for (int i = 0; i < num_frames; i++) {
-            buf->frames[i] = frames[i];
+        int i = 0;
+        for (FrameNode* n = leaf; n != NULL; n = n->parent) {
+            buf->frames[i++] = n->frame;
         }
     }
     return buf;
@@ -230,9 +408,14 @@ CallTrace* CallTraceStorage::findCallTrace(LongHashTable* table, u64 hash) {
     return table->values()[slot].trace;
 }
 
-u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter) {
-    u64 hash = calcHash(num_frames, frames);
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard) {
+    CallTraceHasher hasher;
+    hasher.update(frames, num_frames);
+    return put(num_frames, frames, counter, shard, hasher.finish());
+}
 
+// The hash must be computed by CallTraceHasher over the same frames
+u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard, u64 hash) {
     LongHashTable* table = _current_table;
     u64* keys = table->keys();
     u32 capacity = table->capacity();
@@ -247,16 +430,18 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
 
             // Increment the table size, and if the load factor exceeds 0.75, reserve a new table
             if (table->incSize() == capacity * 3 / 4) {
-                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2);
+                LongHashTable* new_table = LongHashTable::allocate(table, capacity * 2, table->shards());
                 if (new_table != NULL) {
                     __sync_bool_compare_and_swap(&_current_table, table, new_table);
                 }
             }
 
+            table->lastChunks()[slot] = _chunk;
+
             // Migrate from a previous table to save space
             CallTrace* trace = table->prev() == NULL ? NULL : findCallTrace(table->prev(), hash);
             if (trace == NULL) {
-                trace = storeCallTrace(num_frames, frames);
+                trace = _node_buckets != NULL ? storeCompactTrace(num_frames, frames) : storeCallTrace(num_frames, frames);
             }
             table->values()[slot].setTrace(trace);
             break;
@@ -272,32 +457,211 @@ u32 CallTraceStorage::put(int num_frames, ASGCT_CallFrame* frames, u64 counter)
     }
 
     if (counter != 0) {
-        CallTraceSample& s = table->values()[slot];
-        atomicInc(s.samples);
-        atomicInc(s.counter, counter);
+        if (table->shards() != 0) {
+            shard %= table->shards();
+            CallTraceCounter& c = table->counters(shard)[slot];
+            atomicInc(c.counter, counter);
+            atomicInc(c.samples);
+            // Set the dirty bit after the counters, so that mergeShards() never misses them
+            u64* word = &table->dirty(shard)[slot / 64];
+            u64 bit = 1ULL << (slot % 64);
+            if ((loadAcquire(*word) & bit) == 0) {
+                __sync_fetch_and_or(word, bit);
+            }
+        } else {
+            CallTraceSample& s = table->values()[slot];
+            atomicInc(s.samples);
+            atomicInc(s.counter, counter);
+        }
     }
 
-    return capacity - (INITIAL_CAPACITY - 1) + slot;
+    return _id_base + capacity - (INITIAL_CAPACITY - 1) + slot;
 }
 
-void CallTraceStorage::add(u32 call_trace_id, u64 samples, u64 counter) {
-    if (call_trace_id > capacity()) {  // this also covers call_trace_id == OVERFLOW_TRACE_ID
-        return;
+// Finds the table and the slot of a call trace by its ID
+LongHashTable* CallTraceStorage::findTable(u32 call_trace_id, u32* slot) {
+    // This also covers OVERFLOW_TRACE_ID, EVICTED_TRACE_ID and IDs issued before the last eviction
+    if (call_trace_id <= _id_base || call_trace_id - _id_base > capacity()) {
+        return NULL;
     }
 
-    call_trace_id += (INITIAL_CAPACITY - 1);
+    u32 index = call_trace_id - _id_base + (INITIAL_CAPACITY - 1);
     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
-        if (call_trace_id >= table->capacity()) {
-            CallTraceSample& s = table->values()[call_trace_id - table->capacity()];
-            atomicInc(s.samples, samples);
-            atomicInc(s.counter, counter);
-            break;
+        if (index >= table->capacity()) {
+            *slot = index - table->capacity();
+            return table;
+        }
+    }
+    return NULL;
+}
+
+// Returns the current ID of a call trace that survived eviction under the given old ID,
+// or 0 if the trace has been evicted
+u32 CallTraceStorage::remap(u32 call_trace_id) {
+    size_t low = 0;
+    size_t high = _remap.size();
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (_remap[mid].first < call_trace_id) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < _remap.size() && _remap[low].first == call_trace_id ? _remap[low].second : 0;
+}
+
+// Marks a call trace as referenced by an event of the current JFR chunk.
+// Called from signal handlers concurrently with put().
+void CallTraceStorage::markReferenced(u32 call_trace_id) {
+    u32 slot;
+    LongHashTable* table = findTable(call_trace_id, &slot);
+    if (table != NULL) {
+        u64* word = &table->referenced()[slot / 64];
+        u64 bit = 1ULL << (slot % 64);
+        // Hot traces are marked many times per chunk: avoid contended writes
+        if ((loadAcquire(*word) & bit) == 0) {
+            __sync_fetch_and_or(word, bit);
+        }
+    }
+}
+
+// Adds samples to a previously stored call trace. Returns the ID under which
+// the samples were accounted: a trace that survived eviction has got a new ID,
+// while samples of an evicted trace go to a synthetic trace that marks the loss.
+u32 CallTraceStorage::add(u32 call_trace_id, u64 samples, u64 counter) {
+    u32 slot;
+    LongHashTable* table = findTable(call_trace_id, &slot);
+    if (table == NULL) {
+        if (call_trace_id == 0 || call_trace_id == OVERFLOW_TRACE_ID) {
+            return call_trace_id;
+        }
+        u32 new_id = call_trace_id <= _id_base ? remap(call_trace_id) : 0;
+        if (new_id == 0 || (table = findTable(new_id, &slot)) == NULL) {
+            atomicInc(_evicted, samples);
+            return EVICTED_TRACE_ID;
+        }
+        call_trace_id = new_id;
+    }
+
+    CallTraceSample& s = table->values()[slot];
+    atomicInc(s.samples, samples);
+    atomicInc(s.counter, counter);
+    return call_trace_id;
+}
+
+// Rebuilds the storage, keeping only call traces referenced within the last max_idle_chunks chunks.
+// Surviving traces get new IDs, all of them greater than any ID issued before, so that add()
+// can tell IDs of evicted traces from old IDs of surviving ones, which it translates to new IDs.
+// Must be called when no other thread accesses the storage, right after collectTraces()
+// has written out all traces referenced by the finished chunk.
+// IDs are never reused, since a caller may hold an old ID indefinitely, e.g. for a sleeping
+// thread or a live object. Returns the number of evicted hash table entries, or 0 if too few
+// entries are idle to be worth a rebuild. Returns -1 once the ID space is exhausted.
+int CallTraceStorage::evict(u32 max_idle_chunks) {
+    // Chunks up to _chunk - 1 have been collected: a trace referenced in the last one is not idle
+    u32 stored = 0;
+    u32 idle = 0;
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u64* keys = table->keys();
+        u32* last = table->lastChunks();
+        u32 capacity = table->capacity();
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (keys[slot] != 0) {
+                stored++;
+                if (_chunk - last[slot] > max_idle_chunks) idle++;
+            }
+        }
+    }
+
+    if (idle == 0 || idle < stored / MIN_EVICTED_SHARE) {
+        return 0;
+    }
+
+    u32 id_base = _id_base + capacity();
+    if (id_base >= MAX_ID_BASE) {
+        return -1;
+    }
+
+    mergeShards();
+    _dump_allocator.clear();
+
+    std::vector<CallTrace*> survivors;
+    std::vector<u32> old_ids;
+    std::vector<u32> last_chunks;
+    const size_t header_size = sizeof(CallTrace) - sizeof(ASGCT_CallFrame);
+
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+        u64* keys = table->keys();
+        CallTraceSample* values = table->values();
+        u32* last = table->lastChunks();
+        u32 capacity = table->capacity();
+        u32 first_id = _id_base + capacity - (INITIAL_CAPACITY - 1);
+
+        for (u32 slot = 0; slot < capacity; slot++) {
+            if (keys[slot] == 0 || _chunk - last[slot] > max_idle_chunks) {
+                continue;
+            }
+
+            CallTrace* trace = expandTrace(values[slot].acquireTrace());
+            if (trace != NULL) {
+                size_t size = header_size + trace->num_frames * sizeof(ASGCT_CallFrame);
+                CallTrace* copy = (CallTrace*)malloc(size);
+                if (copy != NULL) {
+                    memcpy(copy, trace, size);
+                    survivors.push_back(copy);
+                    old_ids.push_back(first_id + slot);
+                    last_chunks.push_back(last[slot]);
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<u32, u32> > prev_remap;
+    prev_remap.swap(_remap);
+    u64 overflow = _overflow;
+    u64 evicted = _evicted;
+    u32 chunk = _chunk;
+    clear();
+    _id_base = id_base;
+    _overflow = overflow;
+    _evicted = evicted;
+    _chunk = chunk;
+
+    std::vector<std::pair<u32, u32> > new_ids;
+    for (size_t i = 0; i < survivors.size(); i++) {
+        CallTrace* trace = survivors[i];
+        u32 new_id = put(trace->num_frames, trace->frames, 0, 0);
+        u32 slot;
+        LongHashTable* table = findTable(new_id, &slot);
+        if (table != NULL) {
+            table->lastChunks()[slot] = last_chunks[i];
+            new_ids.push_back(std::make_pair(old_ids[i], new_id));
+        }
+        free(trace);
+    }
+    std::sort(new_ids.begin(), new_ids.end());
+
+    // Old IDs from earlier evictions keep pointing to the same trace. They are all lower
+    // than the IDs issued since, so the remap table stays sorted by the old ID.
+    _remap.swap(new_ids);
+    std::vector<std::pair<u32, u32> > remap_table;
+    for (size_t i = 0; i < prev_remap.size(); i++) {
+        u32 new_id = remap(prev_remap[i].second);
+        if (new_id != 0) {
+            remap_table.push_back(std::make_pair(prev_remap[i].first, new_id));
         }
     }
+    remap_table.insert(remap_table.end(), _remap.begin(), _remap.end());
+    _remap.swap(remap_table);
+
+    return (int)idle;
 }
 
 void CallTraceStorage::resetCounters() {
-     for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
+    mergeShards();
+
+    for (LongHashTable* table = _current_table; table != NULL; table = table->prev()) {
         u64* keys = table->keys();
         CallTraceSample* values = table->values();
         u32 capacity = table->capacity();
@@ -20,6 +20,14 @@ struct CallTrace {
     ASGCT_CallFrame frames[1];
 };
 
+// Node of a prefix tree of call traces growing from the root frame towards the leaf.
+// A compact trace is represented by its leaf node, sharing all parent nodes with other traces.
+struct FrameNode {
+    FrameNode* parent;
+    FrameNode* next;
+    ASGCT_CallFrame frame;
+};
+
 struct CallTraceSample {
     CallTrace* trace;
     u64 samples;
@@ -41,33 +49,103 @@ struct CallTraceSample {
     }
 };
 
+// Resumable hash of a call trace: frames can be added in several steps,
+// e.g. right after each stack walker has produced them.
+// Unlike MurmurHash64A over the raw buffer, bci and method_id are folded in
+// two independent chains, which doubles instruction level parallelism,
+// and padding bytes of ASGCT_CallFrame do not affect the result.
+class CallTraceHasher {
+  private:
+    static const u64 M = 0xc6a4a7935bd1e995ULL;
+    static const int R = 47;
+
+    u64 _h1;
+    u64 _h2;
+    u64 _frames;
+
+    static u64 mix(u64 k) {
+        k *= M;
+        k ^= k >> R;
+        return k * M;
+    }
+
+  public:
+    CallTraceHasher() : _h1(0x9e3779b97f4a7c15ULL), _h2(M), _frames(0) {
+    }
+
+    void update(const ASGCT_CallFrame* frames, int count) {
+        u64 h1 = _h1;
+        u64 h2 = _h2;
+        for (int i = 0; i < count; i++) {
+            h1 = (h1 ^ mix((u32)frames[i].bci)) * M;
+            h2 = (h2 ^ mix((u64)(uintptr_t)frames[i].method_id)) * M;
+        }
+        _h1 = h1;
+        _h2 = h2;
+        _frames += count;
+    }
+
+    u64 finish() const {
+        u64 h = _h1 ^ (_h2 << 31 | _h2 >> 33) ^ _frames * M;
+        h ^= h >> R;
+        h *= M;
+        h ^= h >> R;
+        return h;
+    }
+};
+
+// Per-shard portion of CallTraceSample counters
+struct CallTraceCounter {
+    u64 samples;
+    u64 counter;
+};
+
 class CallTraceStorage {
   private:
     static CallTrace _overflow_trace;
+    static CallTrace _evicted_trace;
 
     LinearAllocator _allocator;
+    LinearAllocator _dump_allocator;
     LongHashTable* _current_table;
+    FrameNode** _node_buckets;
     u64 _overflow;
+    u64 _evicted;
+    u32 _id_base;
+    u32 _chunk;
+    // Old and new IDs of call traces that survived eviction, sorted by the old ID
+    std::vector<std::pair<u32, u32> > _remap;
 
-    u64 calcHash(int num_frames, ASGCT_CallFrame* frames);
+    void mergeShards();
     CallTrace* storeCallTrace(int num_frames, ASGCT_CallFrame* frames);
+    CallTrace* storeCompactTrace(int num_frames, ASGCT_CallFrame* frames);
+    FrameNode* findOrInsertNode(FrameNode* parent, const ASGCT_CallFrame& frame);
+    CallTrace* expandTrace(CallTrace* trace);
     CallTrace* findCallTrace(LongHashTable* table, u64 hash);
+    LongHashTable* findTable(u32 call_trace_id, u32* slot);
+    u32 remap(u32 call_trace_id);
 
   public:
     CallTraceStorage();
     ~CallTraceStorage();
 
     void clear();
+    void setShards(u32 shards);
+    void setCompact(bool compact);
     u32 capacity();
     size_t usedMemory();
     u64 overflow() { return _overflow; }
+    u64 evicted() { return _evicted; }
 
     void collectTraces(std::map<u32, CallTrace*>& map);
     void collectSamples(std::vector<CallTraceSample*>& samples);
     void collectSamples(std::map<u64, CallTraceSample>& map);
 
-    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter);
-    void add(u32 call_trace_id, u64 samples, u64 counter);
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard);
+    u32 put(int num_frames, ASGCT_CallFrame* frames, u64 counter, u32 shard, u64 hash);
+    u32 add(u32 call_trace_id, u64 samples, u64 counter);
+    void markReferenced(u32 call_trace_id);
+    int evict(u32 max_idle_chunks);
     void resetCounters();
 };
 
@@ -3,6 +3,7 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,20 +49,59 @@ CodeCache::CodeCache(const char* name, short lib_index,
     _debug_symbols = false;
 
     _dwarf_table = NULL;
-    _dwarf_table_length = 0;
 
     _capacity = INITIAL_CODE_CACHE_CAPACITY;
     _count = 0;
     _blobs = new CodeBlob[_capacity];
+
+    _retired_count = 0;
+    _retired_blobs = NULL;
+
+    _symbol_index = NULL;
+    _retired_index = NULL;
 }
 
 CodeCache::~CodeCache() {
     for (int i = 0; i < _count; i++) {
         NativeFunc::destroy(_blobs[i]._name);
     }
+    for (int i = 0; i < _retired_count; i++) {
+        NativeFunc::destroy(_retired_blobs[i]._name);
+    }
     NativeFunc::destroy(_name);
     delete[] _blobs;
-    free(_dwarf_table);
+    delete[] _retired_blobs;
+    delete _symbol_index;
+    delete _retired_index;
+    DwarfTable::destroy(_dwarf_table);
+}
+
+// Blob positions change while the CodeCache is being filled, when no lookups run yet
+void CodeCache::resetSymbolIndex() {
+    if (_symbol_index != NULL) {
+        delete _symbol_index;
+        _symbol_index = NULL;
+    }
+}
+
+SymbolIndex* CodeCache::symbolIndex() {
+    SymbolIndex* index = __atomic_load_n(&_symbol_index, __ATOMIC_ACQUIRE);
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    const CodeBlob* blobs = __atomic_load_n(&_blobs, __ATOMIC_ACQUIRE);
+    if (index != NULL && index->blobs() == blobs && index->count() == count) {
+        return index;
+    }
+
+    // No index yet, or a lookup that raced with moveSymbols() has published one for the old array.
+    // Concurrent lookups may still use the stale index, so the new one keeps it alive.
+    SymbolIndex* new_index = new SymbolIndex(blobs, count, index);
+    if (__atomic_compare_exchange_n(&_symbol_index, &index, new_index, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return new_index;
+    }
+
+    new_index->detachStale();
+    delete new_index;
+    return index != NULL && index->blobs() == blobs ? index : NULL;
 }
 
 void CodeCache::expand() {
@@ -75,7 +115,8 @@ void CodeCache::expand() {
     delete[] old_blobs;
 }
 
-void CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
+// Returns the stored copy of the name, which lives as long as the CodeCache
+char* CodeCache::add(const void* start, int length, const char* name, bool update_bounds) {
     char* name_copy = NativeFunc::create(name, _lib_index);
     // Replace non-printable characters
     for (char* s = name_copy; *s != 0; s++) {
@@ -85,6 +126,7 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     if (_count >= _capacity) {
         expand();
     }
+    resetSymbolIndex();
 
     const void* end = (const char*)start + length;
     _blobs[_count]._start = start;
@@ -95,6 +137,7 @@ void CodeCache::add(const void* start, int length, const char* name, bool update
     if (update_bounds) {
         updateBounds(start, end);
     }
+    return name_copy;
 }
 
 void CodeCache::updateBounds(const void* start, const void* end) {
@@ -105,50 +148,88 @@ void CodeCache::updateBounds(const void* start, const void* end) {
 void CodeCache::sort() {
     if (_count == 0) return;
 
+    resetSymbolIndex();
     qsort(_blobs, _count, sizeof(CodeBlob), CodeBlob::comparator);
 
     if (_min_address == NO_MIN_ADDRESS) _min_address = _blobs[0]._start;
     if (_max_address == NO_MAX_ADDRESS) _max_address = _blobs[_count - 1]._end;
 }
 
-CodeBlob* CodeCache::findBlob(const char* name) {
-    for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
-        if (blob_name != NULL && strcmp(blob_name, name) == 0) {
-            return &_blobs[i];
+// Takes over symbols and the unwind table that another CodeCache has parsed for the same
+// library, while lookups may run concurrently. A lookup that has already read the old count
+// may see the new array, so the new array is padded to at least the old count.
+void CodeCache::moveSymbols(CodeCache* other) {
+    int count = other->_count;
+    if (count > 0 && _retired_blobs == NULL) {
+        while (other->_capacity < _count) {
+            other->expand();
+        }
+        for (int i = count; i < _count; i++) {
+            other->_blobs[i] = other->_blobs[count - 1];
         }
+
+        _retired_count = _count;
+        _retired_blobs = _blobs;
+        _capacity = other->_capacity;
+        _debug_symbols = other->_debug_symbols;
+        __atomic_store_n(&_blobs, other->_blobs, __ATOMIC_RELEASE);
+        __atomic_store_n(&_count, count, __ATOMIC_RELEASE);
+        _retired_index = __atomic_exchange_n(&_symbol_index, (SymbolIndex*)NULL, __ATOMIC_ACQ_REL);
+
+        other->_count = 0;
+        other->_blobs = NULL;
+    }
+
+    if (_dwarf_table == NULL && other->_dwarf_table != NULL) {
+        _plt_offset = other->_plt_offset;
+        _plt_size = other->_plt_size;
+        __atomic_store_n(&_dwarf_table, other->_dwarf_table, __ATOMIC_RELEASE);
+        other->_dwarf_table = NULL;
     }
-    return NULL;
 }
 
-CodeBlob* CodeCache::findBlobByAddress(const void* address) {
-    for (int i = 0; i < _count; i++) {
-        if (address >= _blobs[i]._start && address < _blobs[i]._end) {
-            return &_blobs[i];
+CodeBlob* CodeCache::findBlob(const char* name) {
+    SymbolIndex* index = symbolIndex();
+    if (index != NULL && index->useHashTable()) {
+        int pos = index->find(name);
+        if (pos != NO_SYMBOL_INDEX) {
+            return pos >= 0 ? (CodeBlob*)&index->blobs()[pos] : NULL;
+        }
+    }
+
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    CodeBlob* blobs = __atomic_load_n(&_blobs, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        const char* blob_name = blobs[i]._name;
+        if (blob_name != NULL && strcmp(blob_name, name) == 0) {
+            return &blobs[i];
         }
     }
     return NULL;
 }
 
 const char* CodeCache::binarySearch(const void* address) {
+    // The count is read first, see moveSymbols()
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    const CodeBlob* blobs = __atomic_load_n(&_blobs, __ATOMIC_ACQUIRE);
     int low = 0;
-    int high = _count - 1;
+    int high = count - 1;
 
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_blobs[mid]._end <= address) {
+        if (blobs[mid]._end <= address) {
             low = mid + 1;
-        } else if (_blobs[mid]._start > address) {
+        } else if (blobs[mid]._start > address) {
             high = mid - 1;
         } else {
-            return _blobs[mid]._name;
+            return blobs[mid]._name;
         }
     }
 
     // Symbols with zero size can be valid functions: e.g. ASM entry points or kernel code.
     // Also, in some cases (endless loop) the return address may point beyond the function.
-    if (low > 0 && (_blobs[low - 1]._start == _blobs[low - 1]._end || _blobs[low - 1]._end == address)) {
-        return _blobs[low - 1]._name;
+    if (low > 0 && (blobs[low - 1]._start == blobs[low - 1]._end || blobs[low - 1]._end == address)) {
+        return blobs[low - 1]._name;
     }
     return _name;
 }
@@ -163,11 +244,21 @@ const void* CodeCache::findSymbolByPrefix(const char* prefix) {
 }
 
 const void* CodeCache::findSymbolByPrefix(const char* prefix, int prefix_len) {
+    SymbolIndex* index = symbolIndex();
+    if (index != NULL && index->useSorted()) {
+        int pos = index->findByPrefix(prefix, prefix_len);
+        if (pos != NO_SYMBOL_INDEX) {
+            return pos >= 0 ? index->blobs()[pos]._start : NULL;
+        }
+    }
+
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    const CodeBlob* blobs = __atomic_load_n(&_blobs, __ATOMIC_ACQUIRE);
     const void* result = NULL;
-    for (int i = 0; i < _count; i++) {
-        const char* blob_name = _blobs[i]._name;
+    for (int i = 0; i < count; i++) {
+        const char* blob_name = blobs[i]._name;
         if (blob_name != NULL && strncmp(blob_name, prefix, prefix_len) == 0) {
-            result = _blobs[i]._start;
+            result = blobs[i]._start;
             // Symbols which contain a dot are only patched if no alternative is found,
             // see #1247
             if (strchr(blob_name + prefix_len, '.') == NULL) {
@@ -286,42 +377,397 @@ bool CodeCache::makeImportsPatchable() {
     return true;
 }
 
-void CodeCache::setDwarfTable(FrameDesc* table, int length) {
+void CodeCache::setDwarfTable(DwarfTable* table) {
     _dwarf_table = table;
-    _dwarf_table_length = length;
 }
 
 FrameDesc* CodeCache::findFrameDesc(const void* pc) {
     u32 target_loc = (const char*)pc - _text_base;
+    DwarfTable* table = __atomic_load_n(&_dwarf_table, __ATOMIC_ACQUIRE);
+    FrameDesc* f = table != NULL ? table->find(target_loc) : NULL;
+
+    if (f != NULL) {
+        return f;
+    } else if (target_loc - _plt_offset < _plt_size) {
+        return &FrameDesc::empty_frame;
+    } else {
+        return &FrameDesc::default_frame;
+    }
+}
+
+size_t CodeCache::usedMemory() {
+    int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    const CodeBlob* blobs = __atomic_load_n(&_blobs, __ATOMIC_ACQUIRE);
+    DwarfTable* table = __atomic_load_n(&_dwarf_table, __ATOMIC_ACQUIRE);
+
+    size_t bytes = (_capacity + _retired_count) * sizeof(CodeBlob);
+    if (table != NULL) bytes += table->size;
+    bytes += NativeFunc::usedMemory(_name);
+    for (int i = 0; i < count; i++) {
+        bytes += NativeFunc::usedMemory(blobs[i]._name);
+    }
+    for (int i = 0; i < _retired_count; i++) {
+        bytes += NativeFunc::usedMemory(_retired_blobs[i]._name);
+    }
+
+    SymbolIndex* index = __atomic_load_n(&_symbol_index, __ATOMIC_ACQUIRE);
+    if (index != NULL) bytes += index->usedMemory();
+    if (_retired_index != NULL) bytes += _retired_index->usedMemory();
+    return bytes + sizeof(CodeCache);
+}
+
+
+SymbolIndex::SymbolIndex(const CodeBlob* blobs, int count, SymbolIndex* stale) : _blobs(blobs), _count(count), _stale(stale) {
+    _named_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (blobs[i]._name != NULL) _named_count++;
+    }
+
+    // Load factor does not exceed 0.5
+    unsigned int size = 16;
+    while (size < (unsigned int)_named_count * 2) {
+        size *= 2;
+    }
+    _hash_mask = size - 1;
+    _hash_table = NULL;
+    _sorted = NULL;
+    _lookups = 0;
+    _prefix_lookups = 0;
+}
+
+SymbolIndex::~SymbolIndex() {
+    free(_hash_table);
+    free(_sorted);
+    delete _stale;
+}
+
+// Same as Dictionary::hash, but without calculating length first
+unsigned int SymbolIndex::hash(const char* name) {
+    unsigned int h = 2166136261U;
+    for (; *name != 0; name++) {
+        h = (h ^ *name) * 16777619;
+    }
+    return h;
+}
+
+// Blobs are inserted in the array order, so the first blob with the given name
+// comes first in its probe sequence, exactly like in the linear search
+int* SymbolIndex::buildHashTable() {
+    int* table = (int*)malloc((_hash_mask + 1) * sizeof(int));
+    if (table == NULL) {
+        return NULL;
+    }
+    memset(table, 0xff, (_hash_mask + 1) * sizeof(int));
+
+    for (int i = 0; i < _count; i++) {
+        const char* name = _blobs[i]._name;
+        if (name != NULL) {
+            unsigned int slot = hash(name) & _hash_mask;
+            while (table[slot] >= 0) {
+                slot = (slot + 1) & _hash_mask;
+            }
+            table[slot] = i;
+        }
+    }
+    return table;
+}
+
+int* SymbolIndex::buildSorted() {
+    int* sorted = (int*)malloc(_named_count * sizeof(int));
+    if (sorted == NULL) {
+        return NULL;
+    }
+    int n = 0;
+    for (int i = 0; i < _count; i++) {
+        if (_blobs[i]._name != NULL) sorted[n++] = i;
+    }
+
+    const CodeBlob* blobs = _blobs;
+    std::sort(sorted, sorted + n, [blobs](int a, int b) {
+        int cmp = strcmp(blobs[a]._name, blobs[b]._name);
+        return cmp < 0 || (cmp == 0 && a < b);
+    });
+    return sorted;
+}
+
+int SymbolIndex::find(const char* name) {
+    int* table = __atomic_load_n(&_hash_table, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        int* new_table = buildHashTable();
+        if (new_table == NULL) {
+            return NO_SYMBOL_INDEX;
+        }
+        if (__atomic_compare_exchange_n(&_hash_table, &table, new_table, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            table = new_table;
+        } else {
+            free(new_table);
+        }
+    }
+
+    for (unsigned int slot = hash(name) & _hash_mask; table[slot] >= 0; slot = (slot + 1) & _hash_mask) {
+        if (strcmp(_blobs[table[slot]]._name, name) == 0) {
+            return table[slot];
+        }
+    }
+    return -1;
+}
+
+// Returns the same blob as the linear search in CodeCache::findSymbolByPrefix:
+// the first one without a dot after the prefix, otherwise the last matching one
+int SymbolIndex::findByPrefix(const char* prefix, int prefix_len) {
+    int* sorted = __atomic_load_n(&_sorted, __ATOMIC_ACQUIRE);
+    if (sorted == NULL) {
+        int* new_sorted = buildSorted();
+        if (new_sorted == NULL) {
+            return NO_SYMBOL_INDEX;
+        }
+        if (__atomic_compare_exchange_n(&_sorted, &sorted, new_sorted, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            sorted = new_sorted;
+        } else {
+            free(new_sorted);
+        }
+    }
+
+    // Find the first name which is not less than the prefix
     int low = 0;
-    int high = _dwarf_table_length - 1;
+    int high = _named_count;
+    while (low < high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (strncmp(_blobs[sorted[mid]]._name, prefix, prefix_len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    int first = -1;
+    int last = -1;
+    for (int i = low; i < _named_count; i++) {
+        int pos = sorted[i];
+        const char* name = _blobs[pos]._name;
+        if (strncmp(name, prefix, prefix_len) != 0) {
+            break;
+        }
+        if (strchr(name + prefix_len, '.') == NULL) {
+            if (first < 0 || pos < first) first = pos;
+        } else if (pos > last) {
+            last = pos;
+        }
+    }
+    return first >= 0 ? first : last;
+}
+
+size_t SymbolIndex::usedMemory() {
+    size_t bytes = sizeof(SymbolIndex);
+    if (_stale != NULL) bytes += _stale->usedMemory();
+    if (_hash_table != NULL) bytes += (_hash_mask + 1) * sizeof(int);
+    if (_sorted != NULL) bytes += _named_count * sizeof(int);
+    return bytes;
+}
+
+
+CodeBlobIndex::CodeBlobIndex() {
+    _entries = (Entry*)malloc(INITIAL_CODE_CACHE_CAPACITY * sizeof(Entry));
+    _capacity = _entries != NULL ? INITIAL_CODE_CACHE_CAPACITY : 0;
+    _count = 0;
+    _version = 0;
+    _chunk = NULL;
+    _retired_count = 0;
+    _used_memory = _capacity * sizeof(Entry);
+}
+
+CodeBlobIndex::~CodeBlobIndex() {
+    while (_chunk != NULL) {
+        Chunk* prev = _chunk->prev;
+        free(_chunk);
+        _chunk = prev;
+    }
+    for (int i = 0; i < _retired_count; i++) {
+        free(_retired[i]);
+    }
+    free(_entries);
+}
+
+CodeBlob* CodeBlobIndex::allocateBlob() {
+    if (_chunk == NULL || _chunk->used == BLOB_INDEX_CHUNK_SIZE) {
+        size_t size = sizeof(Chunk) + (BLOB_INDEX_CHUNK_SIZE - 1) * sizeof(CodeBlob);
+        Chunk* chunk = (Chunk*)malloc(size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->prev = _chunk;
+        chunk->used = 0;
+        _chunk = chunk;
+        _used_memory += size;
+    }
+    return &_chunk->blobs[_chunk->used++];
+}
+
+void CodeBlobIndex::add(const void* start, const void* end, char* name) {
+    Entry* entries = _entries;
+    int count = _count;
+    if (count == _capacity) {
+        // Old arrays may still be read by find(), so they are kept until the index is destroyed
+        int new_capacity = _capacity > 0 ? _capacity * 2 : INITIAL_CODE_CACHE_CAPACITY;
+        Entry* new_entries = _retired_count < MAX_RETIRED_ARRAYS ? (Entry*)malloc(new_capacity * sizeof(Entry)) : NULL;
+        if (new_entries == NULL) {
+            Log::warn("Runtime stub %s is not indexed: cannot grow the index of %d stubs", name, count);
+            return;
+        }
+        if (entries != NULL) {
+            memcpy(new_entries, entries, count * sizeof(Entry));
+            _retired[_retired_count++] = entries;
+        }
+        _used_memory += new_capacity * sizeof(Entry);
+        _capacity = new_capacity;
+        // Publish before the count grows, so that readers never see count > capacity
+        __atomic_store_n(&_entries, new_entries, __ATOMIC_RELEASE);
+        entries = new_entries;
+    }
+
+    CodeBlob* blob = allocateBlob();
+    if (blob == NULL) {
+        Log::warn("Runtime stub %s is not indexed: not enough memory", name);
+        return;
+    }
+    blob->_start = start;
+    blob->_end = end;
+    blob->_name = name;
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
+    int pos = count;
+    while (pos > 0 && entries[pos - 1].blob->_start > start) {
+        entries[pos] = entries[pos - 1];
+        pos--;
+    }
+    entries[pos].blob = blob;
+
+    for (int i = pos; i <= count; i++) {
+        const void* prev_end = i > 0 ? entries[i - 1].max_end : NO_MAX_ADDRESS;
+        const void* blob_end = entries[i].blob->_end;
+        entries[i].max_end = blob_end > prev_end ? blob_end : prev_end;
+    }
+
+    __atomic_store_n(&_count, count + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELEASE);
+}
+
+CodeBlob* CodeBlobIndex::search(Entry* entries, int count, const void* address) {
+    // Find the last blob that starts at or below the address
+    int low = 0;
+    int high = count - 1;
     while (low <= high) {
         int mid = (unsigned int)(low + high) >> 1;
-        if (_dwarf_table[mid].loc < target_loc) {
+        if (entries[mid].blob->_start <= address) {
             low = mid + 1;
-        } else if (_dwarf_table[mid].loc > target_loc) {
+        } else {
             high = mid - 1;
+        }
+    }
+
+    for (int i = high; i >= 0 && entries[i].max_end > address; i--) {
+        CodeBlob* blob = entries[i].blob;
+        if (address >= blob->_start && address < blob->_end) {
+            return blob;
+        }
+    }
+    return NULL;
+}
+
+// Signal safe and lock-free. Retries a few times if the index is being updated;
+// gives up if a signal handler interrupted the writer on the same thread.
+CodeBlob* CodeBlobIndex::find(const void* address) {
+    for (int attempt = 0; attempt < 16; attempt++) {
+        unsigned int version = __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
+        if (version & 1) {
+            spinPause();
+            continue;
+        }
+
+        // Load the count first: a larger count is always published after a larger array
+        int count = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+        Entry* entries = __atomic_load_n(&_entries, __ATOMIC_ACQUIRE);
+        CodeBlob* blob = search(entries, count, address);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&_version, __ATOMIC_RELAXED) == version) {
+            return blob;
+        }
+    }
+    return NULL;
+}
+
+// Called by a single writer, i.e. under Symbols::_parse_lock
+void CodeCacheArray::addToIndex(CodeCache* lib) {
+    const void* start = lib->minAddress();
+    const void* end = lib->maxAddress();
+    if (start >= end) {
+        // Library without known bounds never contains an address
+        return;
+    }
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    int pos = _sorted_count;
+    while (pos > 0 && _sorted[pos - 1]->minAddress() > start) {
+        _sorted[pos] = _sorted[pos - 1];
+        pos--;
+    }
+    _sorted[pos] = lib;
+    _sorted_count++;
+
+    for (int i = pos; i < _sorted_count; i++) {
+        const void* prev_end = i > 0 ? _max_end[i - 1] : NO_MAX_ADDRESS;
+        const void* lib_end = _sorted[i]->maxAddress();
+        _max_end[i] = lib_end > prev_end ? lib_end : prev_end;
+    }
+
+    __atomic_store_n(&_version, _version + 1, __ATOMIC_RELEASE);
+}
+
+CodeCache* CodeCacheArray::searchIndex(const void* address) {
+    // Find the last library that starts at or below the address
+    int low = 0;
+    int high = _sorted_count - 1;
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        CodeCache* lib = _sorted[mid];
+        if (lib != NULL && lib->minAddress() <= address) {
+            low = mid + 1;
         } else {
-            return &_dwarf_table[mid];
+            high = mid - 1;
         }
     }
 
-    if (low > 0) {
-        return &_dwarf_table[low - 1];
-    } else if (target_loc - _plt_offset < _plt_size) {
-        return &FrameDesc::empty_frame;
-    } else {
-        return &FrameDesc::default_frame;
+    // Ranges normally do not overlap, so this loop ends after the first iteration
+    for (int i = high; i >= 0 && _max_end[i] > address; i--) {
+        CodeCache* lib = _sorted[i];
+        if (lib != NULL && lib->contains(address)) {
+            return lib;
+        }
     }
+    return NULL;
 }
 
-size_t CodeCache::usedMemory() {
-    size_t bytes = _capacity * sizeof(CodeBlob);
-    bytes += _dwarf_table_length * sizeof(FrameDesc);
-    bytes += NativeFunc::usedMemory(_name);
-    for (int i = 0; i < _count; i++) {
-        bytes += NativeFunc::usedMemory(_blobs[i]._name);
+// Signal safe and lock-free: O(log n) unless the index is being updated concurrently
+CodeCache* CodeCacheArray::findByAddress(const void* address) {
+    unsigned int version = __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
+    if ((version & 1) == 0) {
+        CodeCache* lib = searchIndex(address);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&_version, __ATOMIC_RELAXED) == version) {
+            return lib;
+        }
     }
-    return bytes + sizeof(CodeCache);
+
+    const int count = this->count();
+    for (int i = 0; i < count; i++) {
+        if (_libs[i]->contains(address)) {
+            return _libs[i];
+        }
+    }
+    return NULL;
 }
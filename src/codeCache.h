@@ -7,6 +7,7 @@
 #define _CODECACHE_H
 
 #include <jvmti.h>
+#include "arch.h"
 
 
 #define NO_MIN_ADDRESS  ((const void*)-1)
@@ -14,6 +15,13 @@
 
 const int INITIAL_CODE_CACHE_CAPACITY = 1000;
 const int MAX_NATIVE_LIBS = 2048;
+const int BLOB_INDEX_CHUNK_SIZE = 256;
+const int MAX_RETIRED_ARRAYS = 32;
+
+// Building a hash table costs about as much as 20 linear name lookups, sorting about 200
+const int SYMBOL_HASH_THRESHOLD = 16;
+const int SYMBOL_SORT_THRESHOLD = 128;
+const int NO_SYMBOL_INDEX = -2;
 
 
 enum ImportId {
@@ -102,6 +110,61 @@ class CodeBlob {
 
 
 class FrameDesc;
+struct DwarfTable;
+
+// Name lookup tables over a snapshot of the blob array of a CodeCache:
+// a hash table for exact names and blob positions ordered by name for prefix search.
+// A table is built once the number of lookups pays off its cost; until then, the caller
+// falls back to the linear search. Concurrent builders race, and the loser discards its copy.
+class SymbolIndex {
+  private:
+    const CodeBlob* _blobs;
+    int _count;
+    SymbolIndex* _stale;
+    int _named_count;
+    unsigned int _hash_mask;
+    int* volatile _hash_table;
+    int* volatile _sorted;
+    volatile int _lookups;
+    volatile int _prefix_lookups;
+
+    static unsigned int hash(const char* name);
+
+    int* buildHashTable();
+    int* buildSorted();
+
+  public:
+    SymbolIndex(const CodeBlob* blobs, int count, SymbolIndex* stale);
+    ~SymbolIndex();
+
+    const CodeBlob* blobs() const {
+        return _blobs;
+    }
+
+    int count() const {
+        return _count;
+    }
+
+    // Ownership of the replaced index stays with the caller
+    void detachStale() {
+        _stale = NULL;
+    }
+
+    bool useHashTable() {
+        return _hash_table != NULL || atomicInc(_lookups) >= SYMBOL_HASH_THRESHOLD;
+    }
+
+    bool useSorted() {
+        return _sorted != NULL || atomicInc(_prefix_lookups) >= SYMBOL_SORT_THRESHOLD;
+    }
+
+    // Return a position in the blob array, -1 if not found,
+    // or NO_SYMBOL_INDEX if the index could not be allocated
+    int find(const char* name);
+    int findByPrefix(const char* prefix, int prefix_len);
+
+    size_t usedMemory();
+};
 
 class CodeCache {
   private:
@@ -119,14 +182,22 @@ class CodeCache {
     bool _imports_patchable;
     bool _debug_symbols;
 
-    FrameDesc* _dwarf_table;
-    int _dwarf_table_length;
+    DwarfTable* _dwarf_table;
 
     int _capacity;
     int _count;
     CodeBlob* _blobs;
 
+    // Blobs replaced by moveSymbols(): call traces may still refer to their names
+    int _retired_count;
+    CodeBlob* _retired_blobs;
+
+    SymbolIndex* volatile _symbol_index;
+    SymbolIndex* _retired_index;
+
     void expand();
+    void resetSymbolIndex();
+    SymbolIndex* symbolIndex();
     bool makeImportsPatchable();
     void saveImport(ImportId id, void** entry);
 
@@ -155,6 +226,10 @@ class CodeCache {
         return _image_base;
     }
 
+    short libIndex() const {
+        return _lib_index;
+    }
+
     bool contains(const void* address) const {
         return address >= _min_address && address < _max_address;
     }
@@ -176,9 +251,10 @@ class CodeCache {
         _debug_symbols = debug_symbols;
     }
 
-    void add(const void* start, int length, const char* name, bool update_bounds = false);
+    char* add(const void* start, int length, const char* name, bool update_bounds = false);
     void updateBounds(const void* start, const void* end);
     void sort();
+    void moveSymbols(CodeCache* other);
 
     template <typename NamePredicate>
     inline void mark(NamePredicate predicate, char value) {
@@ -200,13 +276,12 @@ class CodeCache {
     void patchImport(ImportId id, void* hook_func);
 
     CodeBlob* findBlob(const char* name);
-    CodeBlob* findBlobByAddress(const void* address);
     const char* binarySearch(const void* address);
     const void* findSymbol(const char* name);
     const void* findSymbolByPrefix(const char* prefix);
     const void* findSymbolByPrefix(const char* prefix, int prefix_len);
 
-    void setDwarfTable(FrameDesc* table, int length);
+    void setDwarfTable(DwarfTable* table);
     FrameDesc* findFrameDesc(const void* pc);
 
     size_t usedMemory();
@@ -215,14 +290,74 @@ class CodeCache {
 };
 
 
+// Address index of code blobs that are added at any time, e.g. runtime stubs reported
+// by DynamicCodeGenerated events, while stack walkers look them up from signal handlers.
+// Blobs never move once added. The index is an array of blobs sorted by start address,
+// modified under a sequence lock; a grown array replaces the old one, which is retired
+// rather than freed, since a concurrent lookup may still be reading it.
+class CodeBlobIndex {
+  private:
+    struct Entry {
+        CodeBlob* blob;
+        const void* max_end;
+    };
+
+    struct Chunk {
+        Chunk* prev;
+        int used;
+        CodeBlob blobs[1];
+    };
+
+    Entry* volatile _entries;
+    volatile int _count;
+    int _capacity;
+    volatile unsigned int _version;
+    Chunk* _chunk;
+    Entry* _retired[MAX_RETIRED_ARRAYS];
+    int _retired_count;
+    size_t _used_memory;
+
+    CodeBlob* allocateBlob();
+    static CodeBlob* search(Entry* entries, int count, const void* address);
+
+  public:
+    CodeBlobIndex();
+    ~CodeBlobIndex();
+
+    int count() {
+        return __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
+    }
+
+    size_t usedMemory() {
+        return _used_memory;
+    }
+
+    // Writers must be serialized by the caller. The name is not copied.
+    void add(const void* start, const void* end, char* name);
+    CodeBlob* find(const void* address);
+};
+
+
 class CodeCacheArray {
   private:
     CodeCache* _libs[MAX_NATIVE_LIBS];
     int _count;
     size_t _used_memory;
 
+    // Address index: libraries sorted by start address, and the maximum end address
+    // of all libraries up to each position, which bounds the backward search for
+    // overlapping ranges. Modified under a sequence lock: a lookup racing with an update
+    // (including a signal handler interrupting it) falls back to the linear scan.
+    CodeCache* _sorted[MAX_NATIVE_LIBS];
+    const void* _max_end[MAX_NATIVE_LIBS];
+    int _sorted_count;
+    volatile unsigned int _version;
+
+    void addToIndex(CodeCache* lib);
+    CodeCache* searchIndex(const void* address);
+
   public:
-    CodeCacheArray() : _count(0) {
+    CodeCacheArray() : _count(0), _used_memory(0), _sorted_count(0), _version(0) {
     }
 
     CodeCache* operator[](int index) {
@@ -237,12 +372,27 @@ class CodeCacheArray {
         return _used_memory;
     }
 
+    // Changes every time a library is added or updated; odd while the update is in progress
+    unsigned int version() {
+        return __atomic_load_n(&_version, __ATOMIC_ACQUIRE);
+    }
+
     void add(CodeCache* lib) {
         int index = __atomic_load_n(&_count, __ATOMIC_ACQUIRE);
         _libs[index] = lib;
         _used_memory += lib->usedMemory();
+        addToIndex(lib);
         __atomic_store_n(&_count, index + 1, __ATOMIC_RELEASE);
     }
+
+    // Symbols or unwind tables of an added library have been replaced:
+    // the version changes, so that lookups cached by stack walkers are dropped
+    void updated(CodeCache* lib, size_t old_used_memory) {
+        _used_memory += lib->usedMemory() - old_used_memory;
+        __atomic_store_n(&_version, _version + 2, __ATOMIC_RELEASE);
+    }
+
+    CodeCache* findByAddress(const void* address);
 };
 
 #endif // _CODECACHE_H
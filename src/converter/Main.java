@@ -95,7 +95,8 @@ public class Main {
         }
         byte[] buf = new byte[4];
         try (FileInputStream fis = new FileInputStream(fileName)) {
-            return fis.read(buf) == 4 && buf[0] == 'F' && buf[1] == 'L' && buf[2] == 'R' && buf[3] == 0;
+            return fis.read(buf) == 4 && (buf[0] == 'F' && buf[1] == 'L' && buf[2] == 'R' && buf[3] == 0 ||
+                    buf[0] == 0x04 && buf[1] == 0x22 && buf[2] == 0x4d && buf[3] == 0x18);
         }
     }
 
@@ -0,0 +1,226 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+package one.jfr;
+
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.channels.FileChannel;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+
+/**
+ * Reads JFR recordings written by async-profiler with the <code>compress</code> option.
+ * The file is a sequence of standard LZ4 frames, as produced by the <code>lz4</code> tool.
+ * See docs/OutputFormats.md.
+ */
+public class CompressedRecording {
+    public static final int MAGIC = 0x184d2204;
+
+    private static final int SKIPPABLE_MAGIC = 0x184d2a50;
+    private static final int SKIPPABLE_MASK = 0xfffffff0;
+    private static final int UNCOMPRESSED_BLOCK = 0x80000000;
+    private static final int WINDOW_SIZE = 64 * 1024;
+
+    public static boolean isCompressed(FileChannel ch) throws IOException {
+        ByteBuffer header = ByteBuffer.allocate(4).order(ByteOrder.LITTLE_ENDIAN);
+        return ch.read(header, 0) == 4 && header.getInt(0) == MAGIC;
+    }
+
+    /**
+     * Opens the given file for reading. A compressed recording is decompressed
+     * to a temporary file, which is deleted when the returned channel is closed.
+     */
+    public static FileChannel open(String fileName) throws IOException {
+        FileChannel ch = FileChannel.open(Paths.get(fileName), StandardOpenOption.READ);
+        if (!isCompressed(ch)) {
+            return ch;
+        }
+
+        try {
+            Path tmp = Files.createTempFile("async-profiler-", ".jfr");
+            FileChannel out = FileChannel.open(tmp, StandardOpenOption.READ, StandardOpenOption.WRITE,
+                    StandardOpenOption.DELETE_ON_CLOSE);
+            try {
+                decompress(ch, out);
+                out.position(0);
+                return out;
+            } catch (IOException | RuntimeException e) {
+                out.close();
+                throw e;
+            }
+        } finally {
+            ch.close();
+        }
+    }
+
+    public static void decompress(FileChannel in, FileChannel out) throws IOException {
+        ByteBuffer header = ByteBuffer.allocate(8).order(ByteOrder.LITTLE_ENDIAN);
+        long inSize = in.size();
+
+        for (long pos = 0; pos < inSize; ) {
+            header.clear();
+            readFully(in, header, pos);
+            int magic = header.getInt(0);
+            if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+                pos += 8 + (header.getInt(4) & 0xffffffffL);
+                continue;
+            } else if (magic != MAGIC) {
+                throw new IOException("Not an LZ4 frame at offset " + pos);
+            }
+            pos = decompressFrame(in, out, pos);
+        }
+    }
+
+    // Returns the offset past the end of the frame
+    private static long decompressFrame(FileChannel in, FileChannel out, long pos) throws IOException {
+        ByteBuffer header = ByteBuffer.allocate(7).order(ByteOrder.LITTLE_ENDIAN);
+        readFully(in, header, pos);
+
+        int flg = header.get(4) & 0xff;
+        int bd = header.get(5) & 0xff;
+        int blockSizeId = bd >>> 4 & 7;
+        if ((flg & 0xc0) != 0x40 || (flg & 0x01) != 0 || blockSizeId < 4) {
+            throw new IOException("Unsupported LZ4 frame at offset " + pos);
+        }
+        boolean linked = (flg & 0x20) == 0;
+        boolean blockChecksum = (flg & 0x10) != 0;
+        boolean contentSize = (flg & 0x08) != 0;
+        boolean contentChecksum = (flg & 0x04) != 0;
+        int maxBlockSize = 1 << (8 + 2 * blockSizeId);
+
+        // Content size is optional and not needed for decoding; the header checksum is not verified
+        pos += 7 + (contentSize ? 8 : 0);
+
+        ByteBuffer blockHeader = ByteBuffer.allocate(4).order(ByteOrder.LITTLE_ENDIAN);
+        byte[] src = new byte[0];
+        byte[] dst = new byte[WINDOW_SIZE + maxBlockSize];
+        int prefix = 0;
+
+        while (true) {
+            blockHeader.clear();
+            readFully(in, blockHeader, pos);
+            pos += 4;
+            int blockSize = blockHeader.getInt(0);
+            if (blockSize == 0) {
+                // EndMark
+                return pos + (contentChecksum ? 4 : 0);
+            }
+
+            boolean uncompressed = (blockSize & UNCOMPRESSED_BLOCK) != 0;
+            int storedSize = blockSize & ~UNCOMPRESSED_BLOCK;
+            if (storedSize > maxBlockSize) {
+                throw new IOException("Corrupted compressed JFR recording at offset " + pos);
+            }
+
+            if (src.length < storedSize) src = new byte[storedSize];
+            readFully(in, ByteBuffer.wrap(src, 0, storedSize), pos);
+            pos += storedSize + (blockChecksum ? 4 : 0);
+
+            // Linked blocks may refer to the last 64 KB of the previous blocks
+            if (!linked) {
+                prefix = 0;
+            } else if (prefix > WINDOW_SIZE) {
+                System.arraycopy(dst, prefix - WINDOW_SIZE, dst, 0, WINDOW_SIZE);
+                prefix = WINDOW_SIZE;
+            }
+
+            int rawSize;
+            if (uncompressed) {
+                System.arraycopy(src, 0, dst, prefix, storedSize);
+                rawSize = storedSize;
+            } else if ((rawSize = decompressBlock(src, storedSize, dst, prefix, prefix + maxBlockSize)) < 0) {
+                throw new IOException("Corrupted compressed JFR recording at offset " + pos);
+            }
+            writeFully(out, ByteBuffer.wrap(dst, prefix, rawSize));
+            prefix += rawSize;
+        }
+    }
+
+    /**
+     * Decodes a single LZ4 block into dst starting at dstOffset. Matches may refer to
+     * the bytes of dst before dstOffset. Returns the number of decoded bytes,
+     * or -1 if the block is malformed or does not fit before dstLimit.
+     */
+    public static int decompressBlock(byte[] src, int srcLength, byte[] dst, int dstOffset, int dstLimit) {
+        int ip = 0;
+        int op = dstOffset;
+
+        while (ip < srcLength) {
+            int token = src[ip++] & 0xff;
+
+            int literals = token >>> 4;
+            if (literals == 15) {
+                int b;
+                do {
+                    if (ip >= srcLength) return -1;
+                    literals += b = src[ip++] & 0xff;
+                } while (b == 255);
+            }
+            if (literals > srcLength - ip || literals > dstLimit - op) {
+                return -1;
+            }
+            System.arraycopy(src, ip, dst, op, literals);
+            ip += literals;
+            op += literals;
+
+            if (ip == srcLength) {
+                // The last sequence has literals only
+                break;
+            }
+
+            if (srcLength - ip < 2) return -1;
+            int offset = (src[ip] & 0xff) | (src[ip + 1] & 0xff) << 8;
+            ip += 2;
+            if (offset == 0 || offset > op) {
+                return -1;
+            }
+
+            int matchLength = token & 15;
+            if (matchLength == 15) {
+                int b;
+                do {
+                    if (ip >= srcLength) return -1;
+                    matchLength += b = src[ip++] & 0xff;
+                } while (b == 255);
+            }
+            matchLength += 4;
+            if (matchLength > dstLimit - op) {
+                return -1;
+            }
+
+            if (offset >= matchLength) {
+                System.arraycopy(dst, op - offset, dst, op, matchLength);
+            } else {
+                // Overlapping copy replicates a short period
+                for (int i = 0; i < matchLength; i++) {
+                    dst[op + i] = dst[op - offset + i];
+                }
+            }
+            op += matchLength;
+        }
+
+        return op - dstOffset;
+    }
+
+    private static void readFully(FileChannel ch, ByteBuffer buf, long pos) throws IOException {
+        while (buf.hasRemaining()) {
+            int bytes = ch.read(buf, pos);
+            if (bytes < 0) {
+                throw new IOException("Unexpected end of compressed JFR recording");
+            }
+            pos += bytes;
+        }
+    }
+
+    private static void writeFully(FileChannel ch, ByteBuffer buf) throws IOException {
+        while (buf.hasRemaining()) {
+            ch.write(buf);
+        }
+    }
+}
@@ -3,9 +3,18 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "dwarf.h"
 #include "log.h"
+#include "os.h"
 
 
 enum {
@@ -58,6 +67,214 @@ enum {
 FrameDesc FrameDesc::empty_frame = {0, DW_REG_SP | EMPTY_FRAME_SIZE << 8, DW_SAME_FP, INITIAL_PC_OFFSET};
 FrameDesc FrameDesc::default_frame = {0, DW_REG_FP | LINKED_FRAME_SIZE << 8, -LINKED_FRAME_SIZE, -LINKED_FRAME_SIZE + DW_STACK_SLOT};
 
+static const u32 DWARF_TABLE_MAGIC = 0x54555341;  // "ASUT"
+static const u16 DWARF_TABLE_VERSION = 2;
+static const u32 MAX_DWARF_RULES = 65536;
+
+
+static u32 ruleHash(const FrameDesc* f) {
+    u32 h = (u32)f->cfa * 0x9e3779b1;
+    h = (h ^ (u32)f->fp_off) * 0x9e3779b1;
+    h = (h ^ (u32)f->pc_off) * 0x9e3779b1;
+    return h ^ h >> 15;
+}
+
+static bool sameRule(const FrameDesc* f1, const FrameDesc* f2) {
+    return f1->cfa == f2->cfa && f1->fp_off == f2->fp_off && f1->pc_off == f2->pc_off;
+}
+
+static size_t tableSize(u32 count, u32 rule_count) {
+    size_t index_size = rule_count < count ? count * sizeof(u16) : 0;
+    size_t rules_offset = (sizeof(DwarfTable) + count * sizeof(u32) + index_size + 7) & ~(size_t)7;
+    return rules_offset + rule_count * sizeof(FrameDesc);
+}
+
+FrameDesc* DwarfTable::find(u32 loc) const {
+    const u32* locs = this->locs();
+    int low = 0;
+    int high = count - 1;
+
+    while (low <= high) {
+        int mid = (unsigned int)(low + high) >> 1;
+        if (locs[mid] < loc) {
+            low = mid + 1;
+        } else if (locs[mid] > loc) {
+            high = mid - 1;
+        } else {
+            return &rules()[indexed() ? ruleIndex()[mid] : mid];
+        }
+    }
+
+    if (low == 0) {
+        return NULL;
+    }
+    return &rules()[indexed() ? ruleIndex()[low - 1] : low - 1];
+}
+
+// Builds a compact table from the parsed records. If the records have too many distinct
+// unwind rules to be referenced by a 16-bit index, all records are stored as they are.
+// Returns NULL only if memory cannot be allocated.
+DwarfTable* DwarfTable::create(const FrameDesc* table, int count, const char* build_id, int build_id_len) {
+    u32 hash_size = 16;
+    while (hash_size < (u32)count * 2 && hash_size < MAX_DWARF_RULES * 2) {
+        hash_size *= 2;
+    }
+
+    u32* hash = (u32*)calloc(hash_size, sizeof(u32));
+    u16* index = (u16*)malloc(count * sizeof(u16));
+    FrameDesc* rules = (FrameDesc*)malloc((count < MAX_DWARF_RULES ? count : MAX_DWARF_RULES) * sizeof(FrameDesc));
+    if (hash == NULL || (count > 0 && (index == NULL || rules == NULL))) {
+        free(rules);
+        free(index);
+        free(hash);
+        return NULL;
+    }
+    u32 rule_count = 0;
+
+    for (int i = 0; i < count; i++) {
+        u32 slot = ruleHash(&table[i]) & (hash_size - 1);
+        while (hash[slot] != 0 && !sameRule(&rules[hash[slot] - 1], &table[i])) {
+            slot = (slot + 1) & (hash_size - 1);
+        }
+
+        if (hash[slot] == 0) {
+            if (rule_count == MAX_DWARF_RULES) {
+                Log::debug("Too many distinct unwind rules, storing %d records uncompressed", count);
+                rule_count = count;
+                break;
+            }
+            rules[rule_count] = table[i];
+            rules[rule_count].loc = 0;
+            hash[slot] = ++rule_count;
+        }
+        index[i] = (u16)(hash[slot] - 1);
+    }
+
+    size_t size = tableSize(count, rule_count);
+    DwarfTable* result = (DwarfTable*)OS::safeAlloc(size);
+    if (result != NULL) {
+        memset(result, 0, sizeof(DwarfTable));
+        result->magic = DWARF_TABLE_MAGIC;
+        result->version = DWARF_TABLE_VERSION;
+        result->word_size = sizeof(void*);
+        result->count = count;
+        result->rule_count = rule_count;
+        result->size = size;
+        if (build_id_len > 0 && build_id_len <= (int)sizeof(result->build_id)) {
+            result->build_id_len = build_id_len;
+            memcpy(result->build_id, build_id, build_id_len);
+        }
+
+        u32* locs = (u32*)result->locs();
+        for (int i = 0; i < count; i++) {
+            locs[i] = table[i].loc;
+        }
+        if (result->indexed()) {
+            memcpy((u16*)result->ruleIndex(), index, count * sizeof(u16));
+            memcpy(result->rules(), rules, rule_count * sizeof(FrameDesc));
+        } else {
+            memcpy(result->rules(), table, count * sizeof(FrameDesc));
+        }
+    }
+
+    free(rules);
+    free(index);
+    free(hash);
+    return result;
+}
+
+// Maps a cached table read-only, so that processes loading the same library share
+// the pages of the table through the page cache. save() replaces the file by rename
+// and never truncates it in place, so the mapping stays valid while the library is loaded.
+// The table is validated, since it will be read in signal handlers: a stale or corrupted file is ignored.
+DwarfTable* DwarfTable::load(const char* path, const char* build_id, int build_id_len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat st;
+    DwarfTable* table = NULL;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)sizeof(DwarfTable)) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            table = (DwarfTable*)addr;
+        }
+    }
+    close(fd);
+
+    if (table == NULL) {
+        return NULL;
+    }
+
+    bool valid = table->magic == DWARF_TABLE_MAGIC
+        && table->version == DWARF_TABLE_VERSION
+        && table->word_size == sizeof(void*)
+        && table->build_id_len == build_id_len
+        && memcmp(table->build_id, build_id, build_id_len) == 0
+        && table->size == (u64)st.st_size
+        && (table->rule_count <= MAX_DWARF_RULES || table->rule_count == table->count)
+        && table->count <= (st.st_size - sizeof(DwarfTable)) / sizeof(u32)
+        && tableSize(table->count, table->rule_count) == table->size;
+
+    if (valid && table->indexed()) {
+        const u16* index = table->ruleIndex();
+        for (u32 i = 0; valid && i < table->count; i++) {
+            valid = index[i] < table->rule_count;
+        }
+    }
+
+    if (!valid) {
+        Log::debug("Ignoring invalid unwind cache %s", path);
+        OS::safeFree(table, st.st_size);
+        return NULL;
+    }
+    return table;
+}
+
+void DwarfTable::destroy(DwarfTable* table) {
+    if (table != NULL) {
+        OS::safeFree(table, table->size);
+    }
+}
+
+// Written to a temporary file first, so that concurrent readers never see a partial table.
+// On failure, errno describes the call that failed, not the cleanup after it
+bool DwarfTable::save(const char* path) const {
+    char tmp_path[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, OS::processId()) >= (int)sizeof(tmp_path)) {
+        return false;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1) {
+        return false;
+    }
+
+    const char* data = (const char*)this;
+    size_t remaining = size;
+    while (remaining > 0) {
+        ssize_t bytes = write(fd, data, remaining);
+        if (bytes <= 0) {
+            int err = bytes == 0 ? ENOSPC : errno;
+            close(fd);
+            unlink(tmp_path);
+            errno = err;
+            return false;
+        }
+        data += bytes;
+        remaining -= bytes;
+    }
+
+    if (close(fd) != 0 || rename(tmp_path, path) != 0) {
+        int err = errno;
+        unlink(tmp_path);
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
 
 DwarfParser::DwarfParser(const char* name, const char* image_base, const char* eh_frame_hdr) {
     _name = name;
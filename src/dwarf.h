@@ -7,6 +7,7 @@
 #define _DWARF_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include "arch.h"
 
 
@@ -83,6 +84,48 @@ struct FrameDesc {
 };
 
 
+// Compact unwind table of a library. The binary search touches only the sorted array
+// of locations, while unwind rules, which repeat a lot, are stored once and referenced
+// by a 16-bit index: 6 bytes per record instead of sizeof(FrameDesc).
+// A table with more distinct rules than a 16-bit index can address has no index array:
+// every record keeps its own rule, as in the plain DwarfParser output.
+// The table is a single block with the same layout in memory and in the on-disk cache.
+struct DwarfTable {
+    u32 magic;
+    u16 version;
+    u8 word_size;
+    u8 build_id_len;
+    u32 count;
+    u32 rule_count;
+    u64 size;
+    char build_id[64];
+
+    const u32* locs() const {
+        return (const u32*)(this + 1);
+    }
+
+    bool indexed() const {
+        return rule_count < count;
+    }
+
+    const u16* ruleIndex() const {
+        return (const u16*)(locs() + count);
+    }
+
+    FrameDesc* rules() const {
+        uintptr_t end = (uintptr_t)(ruleIndex() + (indexed() ? count : 0));
+        return (FrameDesc*)((end + 7) & ~(uintptr_t)7);
+    }
+
+    FrameDesc* find(u32 loc) const;
+
+    static DwarfTable* create(const FrameDesc* table, int count, const char* build_id, int build_id_len);
+    static DwarfTable* load(const char* path, const char* build_id, int build_id_len);
+    static void destroy(DwarfTable* table);
+    bool save(const char* path) const;
+};
+
+
 class DwarfParser {
   private:
     const char* _name;
@@ -37,12 +37,24 @@ class EventWithClassId : public Event {
     u32 _class_id;
 };
 
+// Thread counters read at every CPU sample in the counters mode
+enum PerfCounterId {
+    COUNTER_TASK_CLOCK,
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_CONTEXT_SWITCHES,
+    PERF_COUNTERS
+};
+
 class ExecutionEvent : public Event {
   public:
     u64 _start_time;
     ThreadState _thread_state;
+    // Counter deltas since the previous sample of the same thread, if available
+    const u64* _counters;
 
-    ExecutionEvent(u64 start_time) : _start_time(start_time), _thread_state(THREAD_UNKNOWN) {}
+    ExecutionEvent(u64 start_time) : _start_time(start_time), _thread_state(THREAD_UNKNOWN), _counters(NULL) {}
 };
 
 class MethodTraceEvent : public Event {
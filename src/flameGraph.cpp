@@ -4,6 +4,7 @@
  */
 
 #include <algorithm>
+#include <string>
 #include <vector>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +15,10 @@
 // Browsers refuse to draw on canvas larger than 32767 px
 const int MAX_CANVAS_HEIGHT = 32767;
 
+const size_t ARENA_CHUNK_SIZE = 1024 * 1024;
+const u32 INITIAL_CHILDREN_CAPACITY = 4096;
+const u32 INITIAL_NAMES_CAPACITY = 1024;
+
 INCBIN(FLAMEGRAPH_TEMPLATE, "src/res/flame.html")
 INCBIN(TREE_TEMPLATE, "src/res/tree.html")
 
@@ -26,14 +31,14 @@ class StringUtils {
         }
     }
 
-    static size_t getCommonPrefix(const std::string& a, const std::string& b) {
-        size_t length = a.size() < b.size() ? a.size() : b.size();
-        for (size_t i = 0; i < length; i++) {
+    static size_t getCommonPrefix(const char* a, const char* b) {
+        size_t i = 0;
+        for (; a[i] != 0; i++) {
             if (a[i] != b[i] || a[i] > 127) {
                 return i;
             }
         }
-        return length;
+        return i;
     }
 };
 
@@ -67,52 +72,225 @@ class Format {
 
 class Node {
   public:
-    u32 _key;
     u32 _order;
     const Trie* _trie;
 
-    Node(u32 key, u32 order, const Trie* trie) : _key(key), _order(order), _trie(trie) {
+    Node(u32 order, const Trie* trie) : _order(order), _trie(trie) {
     }
 
+    // Ties are broken by key to make the output stable
     static bool orderByName(const Node& a, const Node& b) {
-        return a._order < b._order;
+        return a._order < b._order || (a._order == b._order && a._trie->_key < b._trie->_key);
     }
 
     static bool orderByTotal(const Node& a, const Node& b) {
-        return a._trie->_total > b._trie->_total;
+        return a._trie->_total > b._trie->_total ||
+               (a._trie->_total == b._trie->_total && a._trie->_key < b._trie->_key);
     }
 };
 
 
+static inline u32 childHash(const Trie* parent, u32 key) {
+    u64 h = ((u64)(uintptr_t)parent ^ key) * 0x9e3779b97f4a7c15ULL;
+    return (u32)(h >> 32);
+}
+
+// FNV-1a, like Dictionary::hash
+static inline u32 nameHash(const char* name, size_t len) {
+    u32 h = 2166136261U;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ name[i]) * 16777619;
+    }
+    return h;
+}
+
+FlameGraph::FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted) :
+    _arena(ARENA_CHUNK_SIZE),
+    _title(title),
+    _counter(counter),
+    _minwidth(minwidth),
+    _reverse(reverse),
+    _inverted(inverted),
+    _last_level(0),
+    _last_x(0),
+    _last_total(0) {
+    _buf[sizeof(_buf) - 1] = 0;
+
+    memset(&_root, 0, sizeof(_root));
+    _root._key = FRAME_NATIVE << 28;
+
+    _children = (Trie**)calloc(INITIAL_CHILDREN_CAPACITY, sizeof(Trie*));
+    _children_mask = INITIAL_CHILDREN_CAPACITY - 1;
+    _node_count = 0;
+
+    // Name index 0 is reserved for the root frame
+    _name_table = (u32*)calloc(INITIAL_NAMES_CAPACITY, sizeof(u32));
+    _name_mask = INITIAL_NAMES_CAPACITY - 1;
+    _names = (const char**)malloc(INITIAL_NAMES_CAPACITY / 2 * sizeof(const char*));
+    _name_count = 0;
+
+    if (_names == NULL) {
+        // addChild() fails without lookup tables
+        free(_name_table);
+        _name_table = NULL;
+    } else {
+        _names[0] = "all";
+    }
+}
+
+FlameGraph::~FlameGraph() {
+    free(_children);
+    free(_name_table);
+    free(_names);
+}
+
+// Returns 0, the index of the root frame, if there is not enough memory
+u32 FlameGraph::internName(const char* name, size_t len) {
+    u32 slot = nameHash(name, len) & _name_mask;
+    for (u32 index; (index = _name_table[slot]) != 0; slot = (slot + 1) & _name_mask) {
+        const char* s = _names[index];
+        if (strncmp(s, name, len) == 0 && s[len] == 0) {
+            return index;
+        }
+    }
+
+    char* s = (char*)_arena.alloc((len + 8) & ~(size_t)7);
+    if (s == NULL) {
+        return 0;
+    }
+    memcpy(s, name, len);
+    s[len] = 0;
+
+    u32 index = ++_name_count;
+    _names[index] = s;
+    _name_table[slot] = index;
+    if (_name_count >= _name_mask / 2 && !growNames()) {
+        return 0;
+    }
+    return index;
+}
+
+bool FlameGraph::growNames() {
+    u32 capacity = (_name_mask + 1) * 2;
+    u32* name_table = (u32*)calloc(capacity, sizeof(u32));
+    const char** names = (const char**)realloc(_names, capacity / 2 * sizeof(const char*));
+    if (names != NULL) {
+        _names = names;
+    }
+    if (name_table == NULL || names == NULL) {
+        free(name_table);
+        return false;
+    }
+
+    free(_name_table);
+    _name_table = name_table;
+    _name_mask = capacity - 1;
+
+    for (u32 index = 1; index <= _name_count; index++) {
+        const char* s = _names[index];
+        u32 slot = nameHash(s, strlen(s)) & _name_mask;
+        while (_name_table[slot] != 0) {
+            slot = (slot + 1) & _name_mask;
+        }
+        _name_table[slot] = index;
+    }
+    return true;
+}
+
+// Returns NULL if there is not enough memory
+Trie* FlameGraph::child(Trie* parent, u32 key) {
+    u32 slot = childHash(parent, key) & _children_mask;
+    for (Trie* node; (node = _children[slot]) != NULL; slot = (slot + 1) & _children_mask) {
+        if (node->_parent == parent && node->_key == key) {
+            return node;
+        }
+    }
+
+    Trie* node = (Trie*)_arena.alloc(sizeof(Trie));
+    if (node == NULL) {
+        return NULL;
+    }
+    memset(node, 0, sizeof(Trie));
+    node->_key = key;
+    node->_parent = parent;
+    node->_next_sibling = parent->_first_child;
+    parent->_first_child = node;
+    parent->_child_count++;
+
+    _children[slot] = node;
+    if (++_node_count >= _children_mask / 2 && !growChildren()) {
+        return NULL;
+    }
+    return node;
+}
+
+bool FlameGraph::growChildren() {
+    u32 capacity = (_children_mask + 1) * 2;
+    Trie** old_children = _children;
+    u32 old_capacity = _children_mask + 1;
+
+    Trie** children = (Trie**)calloc(capacity, sizeof(Trie*));
+    if (children == NULL) {
+        return false;
+    }
+    _children = children;
+    _children_mask = capacity - 1;
+    for (u32 i = 0; i < old_capacity; i++) {
+        Trie* node = old_children[i];
+        if (node != NULL) {
+            u32 slot = childHash(node->_parent, node->_key) & _children_mask;
+            while (_children[slot] != NULL) {
+                slot = (slot + 1) & _children_mask;
+            }
+            _children[slot] = node;
+        }
+    }
+    free(old_children);
+    return true;
+}
+
+// Returns NULL if there is not enough memory, or if the graph has already been dumped.
+// The caller is expected to stop building the graph then.
 Trie* FlameGraph::addChild(Trie* f, const char* name, FrameTypeId type, u64 value) {
+    if (_children == NULL || _name_table == NULL) {
+        return NULL;
+    }
+
     size_t len = strlen(name);
     bool has_suffix = len > 4 && name[len - 4] == '_' && name[len - 3] == '[' && name[len - 1] == ']';
-    std::string s(name, has_suffix ? len - 4 : len);
-
-    u32 name_index = _cpool[s];
+    u32 name_index = internName(name, has_suffix ? len - 4 : len);
     if (name_index == 0) {
-        name_index = _cpool[s] = _cpool.size();
+        return NULL;
     }
 
     f->_total += value;
 
     switch (type) {
         case FRAME_INLINED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_inlined += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_inlined += value;
             return f;
         case FRAME_C1_COMPILED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_c1_compiled += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_c1_compiled += value;
             return f;
         case FRAME_INTERPRETED:
-            (f = f->child(name_index, FRAME_JIT_COMPILED))->_interpreted += value;
+            (f = child(f, name_index | FRAME_JIT_COMPILED << 28))->_interpreted += value;
             return f;
         default:
-            return f->child(name_index, type);
+            return child(f, name_index | type << 28);
     }
 }
 
 void FlameGraph::dump(Writer& out, bool tree) {
-    _name_order = new u32[_cpool.size() + 1]();
+    // The tree is complete, lookup tables are no longer needed
+    free(_children);
+    free(_name_table);
+    _children = NULL;
+    _name_table = NULL;
+    _last_level = 0;
+    _last_x = 0;
+    _last_total = 0;
+
+    _name_order = new u32[_name_count + 1]();
     _mintotal = _minwidth == 0 && tree ? _root._total / 1000 : (u64)(_root._total * _minwidth / 100);
     int depth = _root.depth(_mintotal, _name_order);
 
@@ -130,12 +308,7 @@ void FlameGraph::dump(Writer& out, bool tree) {
 
         tail = printTill(out, tail, "/*tree:*/");
 
-        const char** names = new const char*[_cpool.size() + 1];
-        for (std::map<std::string, u32>::const_iterator it = _cpool.begin(); it != _cpool.end(); ++it) {
-            names[it->second] = it->first.c_str();
-        }
-        printTreeFrame(out, _root, 0, names);
-        delete[] names;
+        printTreeFrame(out, _root, 0);
 
         out << tail;
     } else {
@@ -159,7 +332,7 @@ void FlameGraph::dump(Writer& out, bool tree) {
         printCpool(out);
 
         tail = printTill(out, tail, "/*frames:*/");
-        printFrame(out, FRAME_NATIVE << 28, _root, 0, 0);
+        printFrame(out, _root, 0, 0);
 
         tail = printTill(out, tail, "/*highlight:*/");
 
@@ -169,8 +342,8 @@ void FlameGraph::dump(Writer& out, bool tree) {
     delete[] _name_order;
 }
 
-void FlameGraph::printFrame(Writer& out, u32 key, const Trie& f, int level, u64 x) {
-    u32 name_and_type = _name_order[f.nameIndex(key)] << 3 | f.type(key);
+void FlameGraph::printFrame(Writer& out, const Trie& f, int level, u64 x) {
+    u32 name_and_type = _name_order[f.nameIndex()] << 3 | f.type();
     bool has_extra_types = (f._inlined | f._c1_compiled | f._interpreted) &&
                            f._inlined < f._total && f._interpreted < f._total;
 
@@ -197,48 +370,46 @@ void FlameGraph::printFrame(Writer& out, u32 key, const Trie& f, int level, u64
     _last_x = x;
     _last_total = f._total;
 
-    if (f._children.empty()) {
+    if (f._first_child == NULL) {
         return;
     }
 
     std::vector<Node> children;
-    children.reserve(f._children.size());
-    for (auto it = f._children.begin(); it != f._children.end(); ++it) {
-        children.push_back(Node(it->first, _name_order[f.nameIndex(it->first)], it->second));
+    children.reserve(f._child_count);
+    for (const Trie* child = f._first_child; child != NULL; child = child->_next_sibling) {
+        children.push_back(Node(_name_order[child->nameIndex()], child));
     }
     std::sort(children.begin(), children.end(), Node::orderByName);
 
     x += f._self;
     for (size_t i = 0; i < children.size(); i++) {
-        u32 key = children[i]._key;
         const Trie* trie = children[i]._trie;
         if (trie->_total >= _mintotal) {
-            printFrame(out, key, *trie, level + 1, x);
+            printFrame(out, *trie, level + 1, x);
         }
         x += trie->_total;
     }
 }
 
-void FlameGraph::printTreeFrame(Writer& out, const Trie& f, int level, const char** names) {
+void FlameGraph::printTreeFrame(Writer& out, const Trie& f, int level) {
     std::vector<Node> children;
-    children.reserve(f._children.size());
-    for (auto it = f._children.begin(); it != f._children.end(); ++it) {
-        children.push_back(Node(it->first, 0, it->second));
+    children.reserve(f._child_count);
+    for (const Trie* child = f._first_child; child != NULL; child = child->_next_sibling) {
+        children.push_back(Node(0, child));
     }
     std::sort(children.begin(), children.end(), Node::orderByTotal);
 
     double pct = 100.0 / _root._total;
     for (size_t i = 0; i < children.size(); i++) {
-        u32 key = children[i]._key;
         const Trie* trie = children[i]._trie;
 
-        u32 type = trie->type(key);
-        std::string name = names[trie->nameIndex(key)];
+        u32 type = trie->type();
+        std::string name = _names[trie->nameIndex()];
         StringUtils::replace(name, '&', "&amp;", 5);
         StringUtils::replace(name, '<', "&lt;", 4);
         StringUtils::replace(name, '>', "&gt;", 4);
 
-        const char* div_class = trie->_children.empty() ? " class=\"o\"" : "";
+        const char* div_class = trie->_first_child == NULL ? " class=\"o\"" : "";
 
         if (_reverse) {
             snprintf(_buf, sizeof(_buf) - 1,
@@ -254,10 +425,10 @@ void FlameGraph::printTreeFrame(Writer& out, const Trie& f, int level, const cha
         }
         out << _buf;
 
-        if (!trie->_children.empty()) {
+        if (trie->_first_child != NULL) {
             out << "<ul>\n";
             if (trie->_total >= _mintotal) {
-                printTreeFrame(out, *trie, level + 1, names);
+                printTreeFrame(out, *trie, level + 1);
             } else {
                 out << "<li>...\n";
             }
@@ -269,29 +440,34 @@ void FlameGraph::printTreeFrame(Writer& out, const Trie& f, int level, const cha
 void FlameGraph::printCpool(Writer& out) {
     out << "'all'";
 
-    std::string prev;
-    u32 index = 0;
-    for (std::map<std::string, u32>::const_iterator it = _cpool.begin(); it != _cpool.end(); ++it) {
-        if (_name_order[it->second]) {
-            _name_order[it->second] = ++index;
-
-            size_t prefix_len = StringUtils::getCommonPrefix(prev, it->first);
-            prev = it->first;
-
-            if (prefix_len > 95) prefix_len = 95;
-            std::string s(1, (char)(prefix_len + ' '));
-            s.append(it->first, prefix_len, std::string::npos);
-
-            StringUtils::replace(s, '\\', "\\\\", 2);
-            StringUtils::replace(s, '\'', "\\'", 2);
-            out << ",\n'";
-            out.write(s.data(), s.size());
-            out << "'";
-        }
+    // Only the names of visible frames, in alphabetical order
+    std::vector<u32> sorted;
+    for (u32 i = 1; i <= _name_count; i++) {
+        if (_name_order[i]) sorted.push_back(i);
+    }
+    const char** names = _names;
+    std::sort(sorted.begin(), sorted.end(), [names](u32 a, u32 b) {
+        return strcmp(names[a], names[b]) < 0;
+    });
+
+    const char* prev = "";
+    for (size_t i = 0; i < sorted.size(); i++) {
+        const char* name = _names[sorted[i]];
+        _name_order[sorted[i]] = i + 1;
+
+        size_t prefix_len = StringUtils::getCommonPrefix(prev, name);
+        prev = name;
+
+        if (prefix_len > 95) prefix_len = 95;
+        std::string s(1, (char)(prefix_len + ' '));
+        s.append(name + prefix_len);
+
+        StringUtils::replace(s, '\\', "\\\\", 2);
+        StringUtils::replace(s, '\'', "\\'", 2);
+        out << ",\n'";
+        out.write(s.data(), s.size());
+        out << "'";
     }
-
-    // Release cpool memory, since frame names are never used beyond this point
-    _cpool = std::map<std::string, u32>();
 }
 
 const char* FlameGraph::printTill(Writer& out, const char* data, const char* till) {
@@ -6,31 +6,28 @@
 #ifndef _FLAMEGRAPH_H
 #define _FLAMEGRAPH_H
 
-#include <map>
-#include <string>
 #include "arch.h"
 #include "arguments.h"
+#include "linearAllocator.h"
 #include "vmEntry.h"
 #include "writer.h"
 
 
+// A node of the call tree. Nodes are allocated in the arena of the FlameGraph
+// and never freed individually. Children of a node form a linked list for iteration;
+// a child with the given key is found through the hash table of the FlameGraph.
 class Trie {
   public:
-    std::map<u32, Trie*> _children;
+    u32 _key;
+    u32 _child_count;
+    Trie* _parent;
+    Trie* _first_child;
+    Trie* _next_sibling;
     u64 _total;
     u64 _self;
     u64 _inlined, _c1_compiled, _interpreted;
 
-    Trie() : _children(), _total(0), _self(0), _inlined(0), _c1_compiled(0), _interpreted(0) {
-    }
-
-    ~Trie() {
-        for (const auto& entry : _children) {
-            delete entry.second;
-        }
-    }
-
-    FrameTypeId type(u32 key) const {
+    FrameTypeId type() const {
         if (_inlined * 3 >= _total) {
             return FRAME_INLINED;
         } else if (_c1_compiled * 2 >= _total) {
@@ -38,28 +35,20 @@ class Trie {
         } else if (_interpreted * 2 >= _total) {
             return FRAME_INTERPRETED;
         } else {
-            return (FrameTypeId)(key >> 28);
+            return (FrameTypeId)(_key >> 28);
         }
     }
 
-    u32 nameIndex(u32 key) const {
-        return key & ((1 << 28) - 1);
-    }
-
-    Trie* child(u32 name_index, FrameTypeId type) {
-        Trie** ptr = &_children[name_index | type << 28];
-        if (*ptr == nullptr) {
-            *ptr = new Trie();
-        }
-        return *ptr;
+    u32 nameIndex() const {
+        return _key & ((1 << 28) - 1);
     }
 
     int depth(u64 cutoff, u32* name_order) const {
         int max_depth = 0;
-        for (auto it = _children.begin(); it != _children.end(); ++it) {
-            if (it->second->_total >= cutoff) {
-                name_order[nameIndex(it->first)] = 1;
-                int d = it->second->depth(cutoff, name_order);
+        for (const Trie* child = _first_child; child != NULL; child = child->_next_sibling) {
+            if (child->_total >= cutoff) {
+                name_order[child->nameIndex()] = 1;
+                int d = child->depth(cutoff, name_order);
                 if (d > max_depth) max_depth = d;
             }
         }
@@ -70,8 +59,19 @@ class Trie {
 
 class FlameGraph {
   private:
+    LinearAllocator _arena;
     Trie _root;
-    std::map<std::string, u32> _cpool;
+
+    // Open addressing tables: children of all nodes by (parent, key),
+    // and frame names by string, which are interned in the arena
+    Trie** _children;
+    u32 _children_mask;
+    u32 _node_count;
+    u32* _name_table;
+    u32 _name_mask;
+    const char** _names;
+    u32 _name_count;
+
     u32* _name_order;
     u64 _mintotal;
     char _buf[4096];
@@ -86,25 +86,19 @@ class FlameGraph {
     u64 _last_x;
     u64 _last_total;
 
-    void printFrame(Writer& out, u32 key, const Trie& f, int level, u64 x);
-    void printTreeFrame(Writer& out, const Trie& f, int level, const char** names);
+    u32 internName(const char* name, size_t len);
+    Trie* child(Trie* parent, u32 key);
+    bool growChildren();
+    bool growNames();
+
+    void printFrame(Writer& out, const Trie& f, int level, u64 x);
+    void printTreeFrame(Writer& out, const Trie& f, int level);
     void printCpool(Writer& out);
     const char* printTill(Writer& out, const char* data, const char* till);
 
   public:
-    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted) :
-        _root(),
-        _cpool(),
-        _title(title),
-        _counter(counter),
-        _minwidth(minwidth),
-        _reverse(reverse),
-        _inverted(inverted),
-        _last_level(0),
-        _last_x(0),
-        _last_total(0) {
-        _buf[sizeof(_buf) - 1] = 0;
-    }
+    FlameGraph(const char* title, Counter counter, double minwidth, bool reverse, bool inverted);
+    ~FlameGraph();
 
     Trie* root() {
         return &_root;
@@ -112,6 +106,7 @@ class FlameGraph {
 
     Trie* addChild(Trie* f, const char* name, FrameTypeId type, u64 value);
 
+    // Releases the lookup tables: no frames can be added after the graph is dumped
     void dump(Writer& out, bool tree);
 };
 
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,8 +18,11 @@
 #include <unistd.h>
 #include "flightRecorder.h"
 #include "incbin.h"
+#include "ioRing.h"
 #include "jfrMetadata.h"
 #include "lookup.h"
+#include "lz4.h"
+#include "mutex.h"
 #include "os.h"
 #include "processSampler.h"
 #include "profiler.h"
@@ -42,7 +46,13 @@ const int SMALL_BUFFER_SIZE = 1024;
 const int SMALL_BUFFER_LIMIT = SMALL_BUFFER_SIZE - 128;
 const int RECORDING_BUFFER_SIZE = 65536;
 const int RECORDING_BUFFER_LIMIT = RECORDING_BUFFER_SIZE - 4096;
+const int THREAD_BUFFER_SIZE = 16384;
+const int THREAD_BUFFER_LIMIT = THREAD_BUFFER_SIZE - (RECORDING_BUFFER_SIZE - RECORDING_BUFFER_LIMIT);
 const int MAX_STRING_LENGTH = 8191;
+const u64 WRITER_INTERVAL_MICROS = 10000;
+const int IO_RING_ENTRIES = 64;
+const size_t COMPRESSED_BLOCK_SIZE = 1024 * 1024;
+const size_t COMPRESSED_BLOCK_HEADER = 4;
 const u64 MAX_JLONG = 0x7fffffffffffffffULL;
 const u64 MIN_JLONG = 0x8000000000000000ULL;
 
@@ -219,6 +229,214 @@ class RecordingBuffer : public Buffer {
     }
 };
 
+// Buffer owned by a SampleContext. Once filled, it is handed over to the writer
+// through a lock-free queue, and the owner thread continues with a spare buffer.
+// Allocated with mmap, which provides zero _offset and _next.
+class ThreadBuffer : public Buffer {
+  private:
+    char _buf[THREAD_BUFFER_SIZE - sizeof(Buffer)];
+
+  public:
+    ThreadBuffer* _next;
+};
+
+// Double buffer of a lock stripe. Events are recorded into the active buffer;
+// a filled buffer is handed over to the writer thread, and recording continues
+// into the other one while the first is being written.
+struct StripeBuffer {
+    RecordingBuffer* active;
+    RecordingBuffer* volatile pending;
+    RecordingBuffer buf[2];
+};
+
+
+
+// Magic, FLG (version 1, independent blocks, no checksums), BD (1 MB blocks) and
+// the header checksum: the second byte of XXH32 of FLG and BD
+static const char LZ4_FRAME_HEADER[7] = {0x04, 0x22, 0x4d, 0x18, 0x60, 0x60, 0x51};
+static const u32 LZ4_UNCOMPRESSED_BLOCK = 0x80000000;
+
+// Compresses finished chunks from a temporary file into the output file on a background thread,
+// releasing space of the temporary file as it goes. Every compressed range is a standard
+// LZ4 frame (https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md), so the output
+// is a concatenation of frames readable by the lz4 tool. See docs/OutputFormats.md.
+class ChunkCompressor {
+  private:
+    int _src_fd;
+    int _dst_fd;
+    off_t _position;
+    off_t _limit;
+    u64 _raw_bytes;
+    u64 _compressed_bytes;
+    char* _raw;
+    char* _packed;
+    pthread_t _thread;
+    volatile bool _running;
+    WaitableMutex _lock;
+
+    static void* threadEntry(void* compressor) {
+        ((ChunkCompressor*)compressor)->compressorLoop();
+        return NULL;
+    }
+
+    void compressorLoop() {
+        MutexLocker ml(_lock);
+        while (true) {
+            off_t limit = _limit;
+            if (_position < limit) {
+                _lock.unlock();
+                compressRange(_position, limit);
+                _lock.lock();
+                _position = limit;
+                _lock.notify();
+            } else if (_running) {
+                _lock.waitUntil(OS::micros() + 1000000);
+            } else {
+                break;
+            }
+        }
+    }
+
+    static void putLE32(char* dst, u32 value) {
+        dst[0] = (char)value;
+        dst[1] = (char)(value >> 8);
+        dst[2] = (char)(value >> 16);
+        dst[3] = (char)(value >> 24);
+    }
+
+    void compressRange(off_t from, off_t to) {
+        if (from >= to) {
+            return;
+        } else if (_raw == NULL || _packed == NULL) {
+            Log::warn("Not enough memory to compress JFR chunk");
+            return;
+        }
+
+        if (!writeFully(LZ4_FRAME_HEADER, sizeof(LZ4_FRAME_HEADER))) {
+            Log::warn("Failed to write compressed JFR: %s", strerror(errno));
+            return;
+        }
+        _compressed_bytes += sizeof(LZ4_FRAME_HEADER);
+
+        for (off_t pos = from; pos < to; ) {
+            size_t size = (size_t)(to - pos) < COMPRESSED_BLOCK_SIZE ? (size_t)(to - pos) : COMPRESSED_BLOCK_SIZE;
+            if (!readFully(_raw, size, pos)) {
+                Log::warn("Failed to read JFR chunk for compression: %s", strerror(errno));
+                return;
+            }
+
+            char* data = _packed + COMPRESSED_BLOCK_HEADER;
+            size_t stored_size = LZ4::compress(_raw, size, data);
+            if (stored_size >= size) {
+                memcpy(data, _raw, size);
+                stored_size = size;
+                putLE32(_packed, (u32)size | LZ4_UNCOMPRESSED_BLOCK);
+            } else {
+                putLE32(_packed, (u32)stored_size);
+            }
+
+            if (!writeFully(_packed, COMPRESSED_BLOCK_HEADER + stored_size)) {
+                Log::warn("Failed to write compressed JFR: %s", strerror(errno));
+                return;
+            }
+
+            _raw_bytes += size;
+            _compressed_bytes += COMPRESSED_BLOCK_HEADER + stored_size;
+            pos += size;
+        }
+
+        // EndMark completes the frame, so that the output is valid after every chunk
+        static const char end_mark[4] = {0, 0, 0, 0};
+        if (!writeFully(end_mark, sizeof(end_mark))) {
+            Log::warn("Failed to write compressed JFR: %s", strerror(errno));
+            return;
+        }
+        _compressed_bytes += sizeof(end_mark);
+
+        OS::discardFileRange(_src_fd, from, to - from);
+    }
+
+    bool readFully(char* buf, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t bytes = pread(_src_fd, buf, size, offset);
+            if (bytes <= 0) {
+                if (bytes < 0 && errno == EINTR) continue;
+                return false;
+            }
+            buf += bytes;
+            size -= bytes;
+            offset += bytes;
+        }
+        return true;
+    }
+
+    bool writeFully(const char* buf, size_t size) {
+        while (size > 0) {
+            ssize_t bytes = write(_dst_fd, buf, size);
+            if (bytes <= 0) {
+                if (bytes < 0 && errno == EINTR) continue;
+                return false;
+            }
+            buf += bytes;
+            size -= bytes;
+        }
+        return true;
+    }
+
+  public:
+    ChunkCompressor(int src_fd, int dst_fd) : _src_fd(src_fd), _dst_fd(dst_fd), _position(0), _limit(0),
+                                              _raw_bytes(0), _compressed_bytes(0) {
+        _raw = (char*)malloc(COMPRESSED_BLOCK_SIZE);
+        _packed = (char*)malloc(COMPRESSED_BLOCK_HEADER + LZ4::maxCompressedSize(COMPRESSED_BLOCK_SIZE));
+
+        // Appending to an existing compressed recording adds more frames after it
+        lseek(_dst_fd, 0, SEEK_END);
+
+        _running = true;
+        if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
+            Log::warn("Unable to create JFR compressor thread, chunks will be compressed inline");
+            _running = false;
+        }
+    }
+
+    ~ChunkCompressor() {
+        if (_running) {
+            _lock.lock();
+            _running = false;
+            _lock.notify();
+            _lock.unlock();
+            pthread_join(_thread, NULL);
+        }
+
+        Log::debug("Compressed JFR recording: %llu bytes to %llu bytes",
+                   (unsigned long long)_raw_bytes, (unsigned long long)_compressed_bytes);
+
+        free(_packed);
+        free(_raw);
+        close(_dst_fd);
+    }
+
+    // Everything in the temporary file up to the given offset is complete and can be compressed
+    void submit(off_t limit) {
+        MutexLocker ml(_lock);
+        _limit = limit;
+        if (_running) {
+            _lock.notify();
+        } else {
+            compressRange(_position, limit);
+            _position = limit;
+        }
+    }
+
+    // Waits until all submitted chunks are written to the output file
+    void drain() {
+        MutexLocker ml(_lock);
+        while (_position < _limit && _running) {
+            _lock.waitUntil(OS::micros() + WRITER_INTERVAL_MICROS);
+        }
+    }
+};
+
 
 class Recording {
   private:
@@ -227,7 +445,18 @@ class Recording {
     static char* _jvm_flags;
     static char* _java_command;
 
-    RecordingBuffer _buf[CONCURRENCY_LEVEL];
+    StripeBuffer* _stripes;
+    int _buf_count;
+    ThreadBuffer* volatile _full_buffers;
+    ThreadBuffer* volatile _spare_buffers;
+    volatile u32 _thread_buffer_count;
+    pthread_t _writer_thread;
+    volatile bool _writer_running;
+    WaitableMutex _writer_lock;
+    volatile u32 _queue_depth;
+    u64 _writer_stalls;
+    IoRing _io_ring;
+    ChunkCompressor* _compressor;
     int _fd;
     int _memfd;
     char* _master_recording_file;
@@ -262,7 +491,15 @@ class Recording {
     }
 
   public:
-    Recording(int fd, const char* master_recording_file, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+    Recording(int fd, int compressed_fd, const char* master_recording_file, Arguments& args) : _fd(fd), _thread_set(), _method_map() {
+        _buf_count = Profiler::instance()->concurrencyLevel();
+        _stripes = new StripeBuffer[_buf_count];
+        for (int i = 0; i < _buf_count; i++) {
+            _stripes[i].active = &_stripes[i].buf[0];
+            _stripes[i].pending = NULL;
+        }
+        RecordingBuffer* buf = _stripes[0].active;
+
         _master_recording_file = master_recording_file == NULL ? NULL : strdup(master_recording_file);
         _chunk_start = lseek(_fd, 0, SEEK_END);
         _start_time = OS::micros();
@@ -271,30 +508,35 @@ class Recording {
         _bytes_written = 0;
         _memfd = -1;
         _in_memory = false;
+        _full_buffers = NULL;
+        _spare_buffers = NULL;
+        _thread_buffer_count = 0;
+        _queue_depth = 0;
+        _writer_stalls = 0;
 
         _chunk_size = args._chunk_size <= 0 ? MAX_JLONG : (args._chunk_size < 262144 ? 262144 : args._chunk_size);
         _chunk_time = args._chunk_time <= 0 ? MAX_JLONG : (args._chunk_time < 5 ? 5 : args._chunk_time) * 1000000ULL;
 
         _available_processors = OS::getCpuCount();
 
-        writeHeader(_buf);
-        writeMetadata(_buf);
-        writeRecordingInfo(_buf);
-        writeSettings(_buf, args);
+        writeHeader(buf);
+        writeMetadata(buf);
+        writeRecordingInfo(buf);
+        writeSettings(buf, args);
         if (!args.hasOption(NO_SYSTEM_INFO)) {
-            writeOsCpuInfo(_buf);
-            writeJvmInfo(_buf);
+            writeOsCpuInfo(buf);
+            writeJvmInfo(buf);
         }
         if (!args.hasOption(NO_SYSTEM_PROPS)) {
-            writeSystemProperties(_buf);
+            writeSystemProperties(buf);
         }
         if (!args.hasOption(NO_NATIVE_LIBS)) {
             _recorded_lib_count = 0;
-            writeNativeLibraries(_buf);
+            writeNativeLibraries(buf);
         } else {
             _recorded_lib_count = -1;
         }
-        flush(_buf);
+        flush(buf);
 
         if (args.hasOption(IN_MEMORY) && (_memfd = OS::createMemoryFile("async-profiler-recording")) >= 0) {
             _in_memory = true;
@@ -312,10 +554,24 @@ class Recording {
         if (args._proc > 0) {
             _process_sampler.enable(args._proc * 1000000);
         }
+
+        if (args._io_ring && !_io_ring.open(IO_RING_ENTRIES)) {
+            Log::warn("io_uring is not available, using synchronous writes");
+        }
+
+        _compressor = compressed_fd >= 0 ? new ChunkCompressor(fd, compressed_fd) : NULL;
+
+        _writer_running = true;
+        if (pthread_create(&_writer_thread, NULL, writerThreadEntry, this) != 0) {
+            Log::warn("Unable to create JFR writer thread, buffers will be written inline");
+            _writer_running = false;
+        }
     }
 
     ~Recording() {
+        stopWriter();
         off_t chunk_end = finishChunk();
+        delete _compressor;
 
         if (_memfd >= 0) {
             close(_memfd);
@@ -326,17 +582,30 @@ class Recording {
             free(_master_recording_file);
         }
 
+        releaseThreadBuffers();
+        delete[] _stripes;
         close(_fd);
     }
 
     off_t finishChunk() {
+        // Keep the writer thread away until the chunk is complete
+        MutexLocker ml(_writer_lock);
+        writePendingBuffers();
+
         flush(&_monitor_buf);
         flush(&_proc_buf);
 
-        writeNativeLibraries(_buf);
+        RecordingBuffer* buf = _stripes[0].active;
+        writeNativeLibraries(buf);
+
+        for (int i = 0; i < _buf_count; i++) {
+            flush(_stripes[i].active);
+        }
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
-            flush(&_buf[i]);
+        for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) {
+            if (ctx->jfr_buffer != NULL) {
+                flush((ThreadBuffer*)ctx->jfr_buffer);
+            }
         }
 
         _stop_time = OS::micros();
@@ -348,16 +617,11 @@ class Recording {
         }
 
         off_t cpool_offset = lseek(_fd, 0, SEEK_CUR);
-        writeCpool(_buf);
-        flush(_buf);
+        writeCpool(buf);
+        flush(buf);
 
         off_t chunk_end = lseek(_fd, 0, SEEK_CUR);
 
-        // Patch cpool size field
-        _buf->putVar32(0, chunk_end - cpool_offset);
-        ssize_t result = pwrite(_fd, _buf->data(), 5, cpool_offset);
-        (void)result;
-
         // Workaround for JDK-8191415: compute actual TSC frequency, in case JFR is wrong
         u64 tsc_frequency;
         if (TSC::enabled()) {
@@ -367,34 +631,49 @@ class Recording {
             tsc_frequency = TSC::frequency();
         }
 
-        // Patch chunk header
-        _buf->put64(chunk_end - _chunk_start);
-        _buf->put64(cpool_offset - _chunk_start);
-        _buf->put64(68);
-        _buf->put64(_start_time * 1000);
-        _buf->put64((_stop_time - _start_time) * 1000);
-        _buf->put64(_start_ticks);
-        _buf->put64(tsc_frequency);
-        result = pwrite(_fd, _buf->data(), 56, _chunk_start + 8);
-        (void)result;
+        // Patch cpool size field and chunk header
+        buf->putVar32(0, chunk_end - cpool_offset);
+        buf->skip(8);
+        buf->put64(chunk_end - _chunk_start);
+        buf->put64(cpool_offset - _chunk_start);
+        buf->put64(68);
+        buf->put64(_start_time * 1000);
+        buf->put64((_stop_time - _start_time) * 1000);
+        buf->put64(_start_ticks);
+        buf->put64(tsc_frequency);
+
+        if (_io_ring.active()) {
+            _io_ring.write(_fd, buf->data(), 5, cpool_offset);
+            _io_ring.write(_fd, buf->data() + 8, 56, _chunk_start + 8);
+            _io_ring.submitAndWait();
+        } else {
+            ssize_t result = pwrite(_fd, buf->data(), 5, cpool_offset);
+            result = pwrite(_fd, buf->data() + 8, 56, _chunk_start + 8);
+            (void)result;
+        }
 
-        OS::freePageCache(_fd, _chunk_start);
+        if (_compressor != NULL) {
+            _compressor->submit(chunk_end);
+        } else {
+            OS::freePageCache(_fd, _chunk_start);
+        }
 
-        _buf->reset();
+        buf->reset();
         return chunk_end;
     }
 
     void switchChunk() {
+        RecordingBuffer* buf = _stripes[0].active;
         _chunk_start = finishChunk();
         _start_time = _stop_time;
         _start_ticks = _stop_ticks;
         _base_id += 0x1000000;
         _bytes_written = 0;
 
-        writeHeader(_buf);
-        writeMetadata(_buf);
-        writeRecordingInfo(_buf);
-        flush(_buf);
+        writeHeader(buf);
+        writeMetadata(buf);
+        writeRecordingInfo(buf);
+        flush(buf);
 
         if (_memfd >= 0) {
             while (ftruncate(_memfd, 0) < 0 && errno == EINTR);  // restart if interrupted
@@ -408,6 +687,8 @@ class Recording {
 
     size_t usedMemory() {
         return _method_map.usedMemory() + _thread_set.usedMemory() +
+               (size_t)_buf_count * sizeof(StripeBuffer) +
+               (size_t)_thread_buffer_count * sizeof(ThreadBuffer) +
                (_memfd >= 0 ? lseek(_memfd, 0, SEEK_CUR) : 0);
     }
 
@@ -470,6 +751,12 @@ class Recording {
         }
     }
 
+    void drainCompressor() {
+        if (_compressor != NULL) {
+            _compressor->drain();
+        }
+    }
+
     bool hasMasterRecording() const {
         return _master_recording_file != NULL;
     }
@@ -486,7 +773,238 @@ class Recording {
     }
 
     Buffer* buffer(int lock_index) {
-        return &_buf[lock_index];
+        return _stripes[lock_index].active;
+    }
+
+    u32 queueDepth() {
+        return _queue_depth;
+    }
+
+    u64 writerStalls() {
+        return _writer_stalls;
+    }
+
+    static void* writerThreadEntry(void* rec) {
+        ((Recording*)rec)->writerLoop();
+        return NULL;
+    }
+
+    // The writer thread owns file I/O for buffers filled on the sampling path
+    void writerLoop() {
+        MutexLocker ml(_writer_lock);
+        while (_writer_running) {
+            writePendingBuffers();
+            _writer_lock.waitUntil(OS::micros() + WRITER_INTERVAL_MICROS);
+        }
+    }
+
+    void stopWriter() {
+        if (_writer_running) {
+            _writer_lock.lock();
+            _writer_running = false;
+            _writer_lock.notify();
+            _writer_lock.unlock();
+            pthread_join(_writer_thread, NULL);
+        }
+    }
+
+    // Called with _writer_lock held
+    void writePendingBuffers() {
+        Buffer* batch[IO_RING_ENTRIES];
+        int stripes[IO_RING_ENTRIES];
+        int count = 0;
+
+        for (int i = 0; i < _buf_count; i++) {
+            RecordingBuffer* buf = __atomic_load_n(&_stripes[i].pending, __ATOMIC_ACQUIRE);
+            if (buf != NULL) {
+                stripes[count] = i;
+                batch[count++] = buf;
+            }
+            if (count == IO_RING_ENTRIES || (i == _buf_count - 1 && count > 0)) {
+                flushBatch(batch, count);
+                for (int j = 0; j < count; j++) {
+                    __atomic_store_n(&_stripes[stripes[j]].pending, (RecordingBuffer*)NULL, __ATOMIC_RELEASE);
+                }
+                atomicInc(_queue_depth, -count);
+                count = 0;
+            }
+        }
+
+        flushThreadBuffers();
+    }
+
+    // Writes a number of buffers with a single io_uring submission, if available.
+    // The file region is reserved by lseek, which is atomic with respect to write() calls
+    // from other threads, so that concurrent flush() never overlaps the batch.
+    void flushBatch(Buffer** batch, int count) {
+        int fd = _in_memory ? _memfd : _fd;
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            total += batch[i]->offset();
+        }
+
+        off_t end;
+        if (count < 2 || !_io_ring.active() || (end = lseek(fd, total, SEEK_CUR)) < 0) {
+            for (int i = 0; i < count; i++) {
+                flush(batch[i]);
+            }
+            return;
+        }
+
+        u64 offset = end - total;
+        for (int i = 0; i < count; i++) {
+            _io_ring.write(fd, batch[i]->data(), batch[i]->offset(), offset);
+            offset += batch[i]->offset();
+        }
+
+        ssize_t result = _io_ring.submitAndWait();
+        if (result > 0) {
+            atomicInc(_bytes_written, result);
+        }
+        for (int i = 0; i < count; i++) {
+            batch[i]->reset();
+        }
+    }
+
+    // Called on the sampling path with the stripe locked. Does not issue syscalls,
+    // unless the writer thread has not yet written the previous buffer of the same stripe.
+    void submitIfNeeded(int lock_index) {
+        StripeBuffer& stripe = _stripes[lock_index];
+        RecordingBuffer* buf = stripe.active;
+        if (buf->offset() < RECORDING_BUFFER_LIMIT) {
+            return;
+        }
+
+        if (!_writer_running || __atomic_load_n(&stripe.pending, __ATOMIC_ACQUIRE) != NULL) {
+            if (_writer_running) {
+                atomicInc(_writer_stalls);
+            }
+            flush(buf);
+            return;
+        }
+
+        stripe.active = buf == &stripe.buf[0] ? &stripe.buf[1] : &stripe.buf[0];
+        atomicInc(_queue_depth);
+        __atomic_store_n(&stripe.pending, buf, __ATOMIC_RELEASE);
+    }
+
+    Buffer* threadBuffer(SampleContext* ctx) {
+        if (ctx->jfr_buffer == NULL) {
+            ctx->jfr_buffer = takeSpareBuffer();
+        }
+        return (ThreadBuffer*)ctx->jfr_buffer;
+    }
+
+    // Called by the owner of the buffer with the context locked
+    void flushThreadBufferIfNeeded(SampleContext* ctx) {
+        ThreadBuffer* buf = (ThreadBuffer*)ctx->jfr_buffer;
+        if (buf->offset() < THREAD_BUFFER_LIMIT) {
+            return;
+        }
+
+        ThreadBuffer* spare = takeSpareBuffer();
+        if (spare == NULL) {
+            atomicInc(_writer_stalls);
+            flush(buf);
+            return;
+        }
+
+        handOverThreadBuffer(buf);
+        ctx->jfr_buffer = spare;
+    }
+
+    // Called with the context locked when its owner thread terminates
+    void releaseThreadBuffer(SampleContext* ctx) {
+        ThreadBuffer* buf = (ThreadBuffer*)ctx->jfr_buffer;
+        ctx->jfr_buffer = NULL;
+
+        if (buf->offset() == 0) {
+            putSpareBuffers(buf);
+        } else {
+            handOverThreadBuffer(buf);
+        }
+    }
+
+    void handOverThreadBuffer(ThreadBuffer* buf) {
+        atomicInc(_queue_depth);
+        do {
+            buf->_next = _full_buffers;
+        } while (!__sync_bool_compare_and_swap(&_full_buffers, buf->_next, buf));
+    }
+
+    ThreadBuffer* takeSpareBuffer() {
+        // Unlike popping a single element, taking the entire list at once is not prone to ABA
+        ThreadBuffer* buf = __atomic_exchange_n(&_spare_buffers, (ThreadBuffer*)NULL, __ATOMIC_ACQ_REL);
+        if (buf == NULL) {
+            if ((buf = (ThreadBuffer*)OS::safeAlloc(sizeof(ThreadBuffer))) != NULL) {
+                atomicInc(_thread_buffer_count);
+            }
+            return buf;
+        }
+
+        if (buf->_next != NULL) {
+            putSpareBuffers(buf->_next);
+            buf->_next = NULL;
+        }
+        return buf;
+    }
+
+    void putSpareBuffers(ThreadBuffer* head) {
+        ThreadBuffer* tail = head;
+        while (tail->_next != NULL) {
+            tail = tail->_next;
+        }
+
+        do {
+            tail->_next = _spare_buffers;
+        } while (!__sync_bool_compare_and_swap(&_spare_buffers, tail->_next, head));
+    }
+
+    // Write out buffers handed over by sampling threads
+    void flushThreadBuffers() {
+        ThreadBuffer* buf = __atomic_exchange_n(&_full_buffers, (ThreadBuffer*)NULL, __ATOMIC_ACQ_REL);
+        if (buf == NULL) {
+            return;
+        }
+
+        // Restore the order in which buffers were filled
+        ThreadBuffer* head = NULL;
+        while (buf != NULL) {
+            ThreadBuffer* next = buf->_next;
+            buf->_next = head;
+            head = buf;
+            buf = next;
+        }
+
+        Buffer* batch[IO_RING_ENTRIES];
+        int count = 0;
+        for (buf = head; buf != NULL; buf = buf->_next) {
+            batch[count++] = buf;
+            if (count == IO_RING_ENTRIES || buf->_next == NULL) {
+                flushBatch(batch, count);
+                atomicInc(_queue_depth, -count);
+                count = 0;
+            }
+        }
+        putSpareBuffers(head);
+    }
+
+    // Must be called when no sampling thread can use its context, i.e. under Profiler::lockAll()
+    void releaseThreadBuffers() {
+        for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) {
+            if (ctx->jfr_buffer != NULL) {
+                OS::safeFree(ctx->jfr_buffer, sizeof(ThreadBuffer));
+                ctx->jfr_buffer = NULL;
+            }
+        }
+
+        ThreadBuffer* buf = _spare_buffers;
+        while (buf != NULL) {
+            ThreadBuffer* next = buf->_next;
+            OS::safeFree(buf, sizeof(ThreadBuffer));
+            buf = next;
+        }
+        _spare_buffers = NULL;
     }
 
     bool parseAgentProperties() {
@@ -595,9 +1113,9 @@ class Recording {
 
         const Index& strings = JfrMetadata::strings();
         buf->putVar32(strings.size());
-        strings.forEachOrdered([&] (size_t idx, const std::string& s) {
-            buf->putUtf8(s.c_str());
-        });
+        for (size_t idx = 0; idx < strings.size(); idx++) {
+            buf->putUtf8(strings.value(idx), strings.length(idx));
+        }
 
         writeElement(buf, JfrMetadata::root());
 
@@ -1007,20 +1525,23 @@ class Recording {
 
     void writePackages(Buffer* buf, Lookup* lookup) {
         writePoolHeader(buf, T_PACKAGE, lookup->_packages->size());
-        lookup->_packages->forEachOrdered([&] (size_t idx, const std::string& s) {
+        Index* packages = lookup->_packages;
+        for (size_t idx = 1; idx <= packages->size(); idx++) {
             buf->putVar64(idx | _base_id);
-            buf->putVar64(lookup->_symbols->indexOf(s) | _base_id);
+            buf->putVar64(lookup->_symbols->indexOf(packages->value(idx), packages->length(idx)) | _base_id);
             flushIfNeeded(buf);
-        });
+        }
     }
 
     void writeSymbols(Buffer* buf, Lookup* lookup) {
         writePoolHeader(buf, T_SYMBOL, lookup->_symbols->size());
-        lookup->_symbols->forEachOrdered([&] (size_t idx, const std::string& s) {
+        Index* symbols = lookup->_symbols;
+        for (size_t idx = 1; idx <= symbols->size(); idx++) {
             flushIfNeeded(buf, RECORDING_BUFFER_LIMIT - MAX_STRING_LENGTH);
+            size_t len = symbols->length(idx);
             buf->putVar64(idx | _base_id);
-            buf->putUtf8(s.c_str());
-        });
+            buf->putUtf8(symbols->value(idx), len < MAX_STRING_LENGTH ? len : MAX_STRING_LENGTH);
+        }
     }
 
     void writeLogLevels(Buffer* buf) {
@@ -1052,6 +1573,23 @@ class Recording {
         buf->putVar32(call_trace_id);
         buf->putVar32(event->_thread_state);
         buf->put8(start, buf->offset() - start);
+
+        if (event->_counters != NULL) {
+            recordPerfCounters(buf, tid, call_trace_id, event);
+        }
+    }
+
+    // Counters of a group are scheduled together, so their ratios are exact even when multiplexed
+    void recordPerfCounters(Buffer* buf, int tid, u32 call_trace_id, ExecutionEvent* event) {
+        int start = buf->skip(1);
+        buf->put8(T_PERF_COUNTERS);
+        buf->putVar64(event->_start_time);
+        buf->putVar32(tid);
+        buf->putVar32(call_trace_id);
+        for (int i = 0; i < PERF_COUNTERS; i++) {
+            buf->putVar64(event->_counters[i]);
+        }
+        buf->put8(start, buf->offset() - start);
     }
 
     void recordMethodTrace(Buffer* buf, int tid, u32 call_trace_id, MethodTraceEvent* event) {
@@ -1258,6 +1796,11 @@ class Recording {
             _thread_set.add(tid);
         }
     }
+
+    // Only call traces referenced by the chunk's events are written to its constant pool
+    void addCallTrace(u32 call_trace_id) {
+        Profiler::instance()->_call_trace_storage.markReferenced(call_trace_id);
+    }
 };
 
 char* Recording::_agent_properties = NULL;
@@ -1275,6 +1818,9 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
     char* filename_tmp = NULL;
     const char* master_recording_file = NULL;
     if (args._jfr_sync != NULL) {
+        if (args._compress) {
+            return Error("compress is not compatible with jfrsync");
+        }
         Error error = startMasterRecording(args, master_recording_file = filename);
         if (error) {
             return error;
@@ -1299,7 +1845,38 @@ Error FlightRecorder::start(Arguments& args, bool reset) {
         free(filename_tmp);
     }
 
-    _rec = new Recording(fd, master_recording_file, args);
+    // Compressed and uncompressed chunks cannot be mixed in one file
+    char magic[4];
+    ssize_t magic_bytes = reset ? 0 : pread(fd, magic, sizeof(magic), 0);
+    if (magic_bytes > 0) {
+        bool compressed = magic_bytes == sizeof(magic) && memcmp(magic, LZ4_FRAME_HEADER, sizeof(magic)) == 0;
+        if (compressed != args._compress) {
+            close(fd);
+            return Error(compressed ? "Cannot append uncompressed chunks to a compressed recording"
+                                    : "Cannot append compressed chunks to an uncompressed recording");
+        }
+    }
+
+    // With compression, events are recorded to a temporary file, and finished chunks
+    // are compressed into the actual output file
+    int compressed_fd = -1;
+    if (args._compress) {
+        size_t len = strlen(filename);
+        filename_tmp = (char*)malloc(len + 16);
+        snprintf(filename_tmp, len + 16, "%s.%d~", filename, OS::processId());
+
+        compressed_fd = fd;
+        fd = open(filename_tmp, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        unlink(filename_tmp);
+        free(filename_tmp);
+
+        if (fd == -1) {
+            close(compressed_fd);
+            return Error("Could not create temporary file for JFR compression");
+        }
+    }
+
+    _rec = new Recording(fd, compressed_fd, master_recording_file, args);
     _rec_lock.unlock();
     return Error::OK;
 }
@@ -1325,6 +1902,13 @@ void FlightRecorder::flush() {
     }
 }
 
+void FlightRecorder::drain() {
+    if (_rec_lock.tryLockShared()) {
+        _rec->drainCompressor();
+        _rec_lock.unlockShared();
+    }
+}
+
 size_t FlightRecorder::usedMemory() {
     size_t bytes = 0;
     if (_rec != NULL) {
@@ -1335,6 +1919,24 @@ size_t FlightRecorder::usedMemory() {
     return bytes;
 }
 
+u32 FlightRecorder::writerQueueDepth() {
+    u32 depth = 0;
+    if (_rec_lock.tryLockShared()) {
+        depth = _rec->queueDepth();
+        _rec_lock.unlockShared();
+    }
+    return depth;
+}
+
+u64 FlightRecorder::writerStalls() {
+    u64 stalls = 0;
+    if (_rec_lock.tryLockShared()) {
+        stalls = _rec->writerStalls();
+        _rec_lock.unlockShared();
+    }
+    return stalls;
+}
+
 bool FlightRecorder::timerTick(u64 wall_time, u32 gc_id) {
     if (!_rec_lock.tryLockShared()) {
         // No active recording
@@ -1425,51 +2027,78 @@ void FlightRecorder::recordEvent(int lock_index, int tid, u32 call_trace_id,
         ThreadLocalData::incrementSampleCounter();
 
         Buffer* buf = _rec->buffer(lock_index);
-        switch (event_type) {
-            case PERF_SAMPLE:
-            case EXECUTION_SAMPLE:
-            case INSTRUMENTED_METHOD:
-                _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
-                break;
-            case METHOD_TRACE:
-                _rec->recordMethodTrace(buf, tid, call_trace_id, (MethodTraceEvent*)event);
-                break;
-            case WALL_CLOCK_SAMPLE:
-                _rec->recordWallClockSample(buf, tid, call_trace_id, (WallClockEvent*)event);
-                break;
-            case MALLOC_SAMPLE:
-                _rec->recordMallocSample(buf, tid, call_trace_id, (MallocEvent*)event);
-                break;
-            case ALLOC_SAMPLE:
-                _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
-                break;
-            case ALLOC_OUTSIDE_TLAB:
-                _rec->recordAllocationOutsideTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
-                break;
-            case LIVE_OBJECT:
-                _rec->recordLiveObject(buf, tid, call_trace_id, (LiveObject*)event);
-                break;
-            case LOCK_SAMPLE:
-                _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
-            case PARK_SAMPLE:
-                _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
-                break;
-            case NATIVE_LOCK_SAMPLE:
-                _rec->recordNativeLockSample(buf, tid, call_trace_id, (NativeLockEvent*)event);
-                break;
-            case PROFILING_WINDOW:
-                _rec->recordWindow(buf, tid, (ProfilingWindow*)event);
-                break;
-            case USER_EVENT:
-                _rec->recordUserEvent(buf, tid, (UserEvent*)event);
-                break;
+        writeEvent(buf, tid, call_trace_id, event_type, event);
+        _rec->addCallTrace(call_trace_id);
+        _rec->submitIfNeeded(lock_index);
+        _rec->addThread(tid);
+    }
+}
+
+void FlightRecorder::recordEvent(SampleContext* ctx, int tid, u32 call_trace_id,
+                                 EventType event_type, Event* event) {
+    if (_rec != NULL) {
+        ThreadLocalData::incrementSampleCounter();
+
+        Buffer* buf = _rec->threadBuffer(ctx);
+        if (buf != NULL) {
+            writeEvent(buf, tid, call_trace_id, event_type, event);
+            _rec->addCallTrace(call_trace_id);
+            _rec->flushThreadBufferIfNeeded(ctx);
         }
-        _rec->flushIfNeeded(buf);
         _rec->addThread(tid);
     }
 }
 
+void FlightRecorder::releaseThreadBuffer(SampleContext* ctx) {
+    if (_rec != NULL && ctx->jfr_buffer != NULL) {
+        _rec->releaseThreadBuffer(ctx);
+    }
+}
+
+void FlightRecorder::writeEvent(Buffer* buf, int tid, u32 call_trace_id,
+                                EventType event_type, Event* event) {
+    switch (event_type) {
+        case PERF_SAMPLE:
+        case EXECUTION_SAMPLE:
+        case INSTRUMENTED_METHOD:
+            _rec->recordExecutionSample(buf, tid, call_trace_id, (ExecutionEvent*)event);
+            break;
+        case METHOD_TRACE:
+            _rec->recordMethodTrace(buf, tid, call_trace_id, (MethodTraceEvent*)event);
+            break;
+        case WALL_CLOCK_SAMPLE:
+            _rec->recordWallClockSample(buf, tid, call_trace_id, (WallClockEvent*)event);
+            break;
+        case MALLOC_SAMPLE:
+            _rec->recordMallocSample(buf, tid, call_trace_id, (MallocEvent*)event);
+            break;
+        case ALLOC_SAMPLE:
+            _rec->recordAllocationInNewTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+            break;
+        case ALLOC_OUTSIDE_TLAB:
+            _rec->recordAllocationOutsideTLAB(buf, tid, call_trace_id, (AllocEvent*)event);
+            break;
+        case LIVE_OBJECT:
+            _rec->recordLiveObject(buf, tid, call_trace_id, (LiveObject*)event);
+            break;
+        case LOCK_SAMPLE:
+            _rec->recordMonitorBlocked(buf, tid, call_trace_id, (LockEvent*)event);
+            break;
+        case PARK_SAMPLE:
+            _rec->recordThreadPark(buf, tid, call_trace_id, (LockEvent*)event);
+            break;
+        case NATIVE_LOCK_SAMPLE:
+            _rec->recordNativeLockSample(buf, tid, call_trace_id, (NativeLockEvent*)event);
+            break;
+        case PROFILING_WINDOW:
+            _rec->recordWindow(buf, tid, (ProfilingWindow*)event);
+            break;
+        case USER_EVENT:
+            _rec->recordUserEvent(buf, tid, (UserEvent*)event);
+            break;
+    }
+}
+
 void FlightRecorder::recordLog(LogLevel level, const char* message, size_t len) {
     if (!_rec_lock.tryLockShared()) {
         // No active recording
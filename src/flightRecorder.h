@@ -11,7 +11,9 @@
 #include "event.h"
 #include "log.h"
 
+class Buffer;
 class Recording;
+struct SampleContext;
 
 class FlightRecorder {
   private:
@@ -20,6 +22,9 @@ class FlightRecorder {
     Error startMasterRecording(Arguments& args, const char* filename);
     void stopMasterRecording();
 
+    void writeEvent(Buffer* buf, int tid, u32 call_trace_id,
+                    EventType event_type, Event* event);
+
   public:
     static const LogLevel MIN_LOG_LEVEL = LogLevel::LOG_DEBUG;
 
@@ -29,7 +34,10 @@ class FlightRecorder {
     Error start(Arguments& args, bool reset);
     void stop();
     void flush();
+    void drain();
     size_t usedMemory();
+    u32 writerQueueDepth();
+    u64 writerStalls();
     bool timerTick(u64 wall_time, u32 gc_id);
 
     bool active() const {
@@ -38,6 +46,9 @@ class FlightRecorder {
 
     void recordEvent(int lock_index, int tid, u32 call_trace_id,
                      EventType event_type, Event* event);
+    void recordEvent(SampleContext* ctx, int tid, u32 call_trace_id,
+                     EventType event_type, Event* event);
+    void releaseThreadBuffer(SampleContext* ctx);
 
     void recordLog(LogLevel level, const char* message, size_t len);
 };
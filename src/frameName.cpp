@@ -71,7 +71,175 @@ bool Matcher::matches(const char* s) {
 }
 
 
-JMethodCache FrameName::_cache;
+// Only these styles affect names of Java methods and classes
+static const int NAME_CACHE_STYLES = STYLE_SIMPLE | STYLE_DOTTED | STYLE_NORMALIZE | STYLE_SIGNATURES | STYLE_NO_SEMICOLON;
+static const u32 NAME_CACHE_INITIAL_CAPACITY = 4096;
+
+// jmethodIDs are aligned pointers, so class keys never collide with them
+static inline uintptr_t classKey(unsigned int class_id) {
+    return (uintptr_t)class_id << 1 | 1;
+}
+
+u32 NameCache::hash(uintptr_t key, int style) {
+    u64 h = (u64)key * 0x9e3779b97f4a7c15ULL ^ (u64)style;
+    return (u32)(h >> 32) ^ (u32)h;
+}
+
+NameCache::Table* NameCache::allocateTable(u32 capacity) {
+    Table* table = (Table*)calloc(1, sizeof(Table) + (capacity - 1) * sizeof(Entry));
+    if (table != NULL) {
+        table->capacity = capacity;
+    }
+    return table;
+}
+
+NameCache::Entry* NameCache::find(Table* table, uintptr_t key, int style) {
+    u32 mask = table->capacity - 1;
+    for (u32 slot = hash(key, style) & mask; ; slot = (slot + 1) & mask) {
+        Entry* e = &table->entries[slot];
+        uintptr_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+        if (k == key && e->style == style) {
+            return e;
+        } else if (k == 0) {
+            return NULL;
+        }
+    }
+}
+
+// Called with _lock held or on a table not yet published
+void NameCache::put(Table* table, const Entry& e) {
+    u32 mask = table->capacity - 1;
+    u32 slot = hash(e.key, e.style) & mask;
+    while (table->entries[slot].key != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    Entry* dst = &table->entries[slot];
+    dst->name = e.name;
+    dst->style = e.style;
+    dst->epoch = e.epoch;
+    __atomic_store_n(&dst->key, e.key, __ATOMIC_RELEASE);
+    table->size++;
+}
+
+const char* NameCache::lookup(uintptr_t key, int style, unsigned char epoch) {
+    Table* table = __atomic_load_n(&_table, __ATOMIC_ACQUIRE);
+    if (table == NULL) {
+        return NULL;
+    }
+
+    Entry* e = find(table, key, style);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    // Concurrent readers all store the same value
+    if (e->epoch != epoch) {
+        e->epoch = epoch;
+    }
+    return e->name;
+}
+
+const char* NameCache::insert(uintptr_t key, int style, unsigned char epoch, const char* name) {
+    MutexLocker ml(_lock);
+
+    Table* table = _table;
+    if (table != NULL) {
+        // Another thread might have resolved the same name meanwhile
+        Entry* e = find(table, key, style);
+        if (e != NULL) {
+            return e->name;
+        }
+    }
+
+    if (table == NULL || (table->size + 1) * 4 > table->capacity * 3) {
+        Table* new_table = allocateTable(table == NULL ? NAME_CACHE_INITIAL_CAPACITY : table->capacity * 2);
+        if (new_table == NULL) {
+            return name;
+        }
+        if (table != NULL) {
+            for (u32 i = 0; i < table->capacity; i++) {
+                if (table->entries[i].key != 0) {
+                    put(new_table, table->entries[i]);
+                }
+            }
+            // Readers may still walk the old table
+            _retired.push_back(table);
+        }
+        __atomic_store_n(&_table, new_table, __ATOMIC_RELEASE);
+        table = new_table;
+    }
+
+    size_t length = strlen(name) + 1;
+    char* interned = (char*)malloc(length);
+    if (interned == NULL) {
+        return name;
+    }
+    memcpy(interned, name, length);
+    _name_bytes += length;
+
+    Entry e = {key, interned, style, epoch};
+    put(table, e);
+    return interned;
+}
+
+void NameCache::evict(unsigned char epoch, unsigned char max_age, bool classes_only) {
+    MutexLocker ml(_lock);
+
+    for (size_t i = 0; i < _retired.size(); i++) {
+        free(_retired[i]);
+    }
+    _retired.clear();
+
+    Table* table = _table;
+    if (table == NULL) {
+        return;
+    }
+
+    // Rebuild the table, since open addressing does not allow removing entries in place.
+    // The new table is allocated at the first surviving entry; if that fails,
+    // the surviving entries are dropped too: they will be resolved again on the next dump
+    Table* new_table = NULL;
+    bool drop_all = false;
+    for (u32 i = 0; i < table->capacity; i++) {
+        Entry* e = &table->entries[i];
+        if (e->key == 0) continue;
+
+        bool evicted = drop_all ||
+                       (classes_only ? (e->key & 1) != 0 : (unsigned char)(epoch - e->epoch) >= max_age);
+        if (!evicted && new_table == NULL && (new_table = allocateTable(table->capacity)) == NULL) {
+            drop_all = evicted = true;
+        }
+
+        if (evicted) {
+            _name_bytes -= strlen(e->name) + 1;
+            free((void*)e->name);
+            continue;
+        }
+        put(new_table, *e);
+    }
+
+    _table = new_table;
+    free(table);
+}
+
+size_t NameCache::usedMemory() {
+    MutexLocker ml(_lock);
+
+    size_t bytes = _name_bytes;
+    if (_table != NULL) {
+        bytes += sizeof(Table) + (_table->capacity - 1) * sizeof(Entry);
+    }
+    for (size_t i = 0; i < _retired.size(); i++) {
+        bytes += sizeof(Table) + (_retired[i]->capacity - 1) * sizeof(Entry);
+    }
+    return bytes;
+}
+
+
+NameCache FrameName::_cache;
+Mutex FrameName::_instances_lock;
+int FrameName::_instances = 0;
 
 FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names) :
     _class_names(),
@@ -91,26 +259,33 @@ FrameName::FrameName(Arguments& args, int style, int epoch, Mutex& thread_names_
     for (const char* s : args._include) _include.push_back(s);
     for (const char* s : args._exclude) _exclude.push_back(s);
 
-    Profiler::instance()->classMap()->collect(_class_names);
+    MutexLocker ml(_instances_lock);
+    _instances++;
 }
 
 FrameName::~FrameName() {
-    if (_cache_max_age == 0) {
-        _cache.clear();
-    } else {
-        // Remove stale methods from the cache, leave the fresh ones for the next profiling session
-        for (JMethodCache::iterator it = _cache.begin(); it != _cache.end(); ) {
-            if (_cache_epoch - (unsigned char)it->second[0] >= _cache_max_age) {
-                _cache.erase(it++);
-            } else {
-                ++it;
-            }
-        }
+    // Evict stale names when the last instance is gone, e.g. after all dump threads have finished.
+    // Fresh ones are left for the next profiling session
+    _instances_lock.lock();
+    if (--_instances == 0) {
+        _cache.evict(_cache_epoch, _cache_max_age);
     }
+    _instances_lock.unlock();
 
     freelocale(uselocale(_saved_locale));
 }
 
+void FrameName::resetClassNames() {
+    MutexLocker ml(_instances_lock);
+    if (_instances == 0) {
+        _cache.evict(0, 0, true);
+    }
+}
+
+size_t FrameName::cacheMemory() {
+    return _cache.usedMemory();
+}
+
 const char* FrameName::decodeNativeSymbol(const char* name) {
     const char* lib_name = (_style & STYLE_LIB_NAMES) ? Profiler::instance()->getLibraryName(name) : NULL;
 
@@ -147,6 +322,23 @@ const char* FrameName::typeSuffix(FrameTypeId type) {
     return NULL;
 }
 
+const char* FrameName::className(unsigned int class_id) {
+    int style = (_style | STYLE_DOTTED) & NAME_CACHE_STYLES;
+    const char* name = _cache.lookup(classKey(class_id), style, _cache_epoch);
+    if (name != NULL) {
+        return name;
+    }
+
+    // Copying the class map is only needed when some name is not cached yet
+    if (_class_names.empty()) {
+        Profiler::instance()->classMap()->collect(_class_names);
+    }
+
+    const char* symbol = _class_names[class_id];
+    javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
+    return _cache.insert(classKey(class_id), style, _cache_epoch, _str.c_str());
+}
+
 void FrameName::javaMethodName(jmethodID method) {
     if (VMMethod::isStaleMethodId(method)) {
         _str.assign("[stale_jmethodID]");
@@ -260,12 +452,11 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         case BCI_ALLOC_OUTSIDE_TLAB:
         case BCI_LOCK:
         case BCI_PARK: {
-            const char* symbol = _class_names[(uintptr_t)frame.method_id];
-            javaClassName(symbol, strlen(symbol), _style | STYLE_DOTTED);
+            const char* class_name = className((unsigned int)(uintptr_t)frame.method_id);
             if (!for_matching && !(_style & STYLE_DOTTED)) {
-                _str += frame.bci == BCI_ALLOC_OUTSIDE_TLAB ? "_[k]" : "_[i]";
+                return _str.assign(class_name).append(frame.bci == BCI_ALLOC_OUTSIDE_TLAB ? "_[k]" : "_[i]").c_str();
             }
-            return _str.c_str();
+            return class_name;
         }
 
         case BCI_THREAD_ID: {
@@ -304,22 +495,17 @@ const char* FrameName::name(ASGCT_CallFrame& frame, bool for_matching) {
         default: {
             const char* type_suffix = typeSuffix(FrameType::decode(frame.bci));
 
-            JMethodCache::iterator it = _cache.lower_bound(frame.method_id);
-            if (it != _cache.end() && it->first == frame.method_id) {
-                it->second[0] = _cache_epoch;
-                const char* name = it->second.c_str() + 1;
-                if (type_suffix != NULL) {
-                    return _str.assign(name).append(type_suffix).c_str();
-                }
-                return name;
+            int style = _style & NAME_CACHE_STYLES;
+            const char* name = _cache.lookup((uintptr_t)frame.method_id, style, _cache_epoch);
+            if (name == NULL) {
+                javaMethodName(frame.method_id);
+                name = _cache.insert((uintptr_t)frame.method_id, style, _cache_epoch, _str.c_str());
             }
 
-            javaMethodName(frame.method_id);
-            _cache.insert(it, JMethodCache::value_type(frame.method_id, std::string(1, _cache_epoch) + _str));
             if (type_suffix != NULL) {
-                _str += type_suffix;
+                return _str.assign(name).append(type_suffix).c_str();
             }
-            return _str.c_str();
+            return name;
         }
     }
 }
@@ -8,6 +8,7 @@
 
 #include <jvmti.h>
 #include <locale.h>
+#include <stdint.h>
 #include <map>
 #include <vector>
 #include <string>
@@ -20,7 +21,6 @@
 #endif
 
 
-typedef std::map<jmethodID, std::string> JMethodCache;
 typedef std::map<int, std::string> ThreadMap;
 typedef std::map<unsigned int, const char*> ClassMap;
 
@@ -50,9 +50,57 @@ class Matcher {
 };
 
 
+// Resolved names of Java methods and classes shared by all FrameName instances,
+// so that repeated dumps do not call JVMTI for methods seen before.
+// Lookups are lock-free; insertions are serialized, as a miss is expensive anyway.
+// Entries remember the epoch of the last dump that used them.
+class NameCache {
+  private:
+    struct Entry {
+        volatile uintptr_t key;
+        const char* name;
+        int style;
+        volatile unsigned char epoch;
+    };
+
+    struct Table {
+        u32 capacity;
+        u32 size;
+        Entry entries[1];
+    };
+
+    Table* volatile _table;
+    std::vector<Table*> _retired;
+    Mutex _lock;
+    size_t _name_bytes;
+
+    static u32 hash(uintptr_t key, int style);
+    static Table* allocateTable(u32 capacity);
+    static Entry* find(Table* table, uintptr_t key, int style);
+    static void put(Table* table, const Entry& e);
+
+  public:
+    NameCache() : _table(NULL), _retired(), _lock(), _name_bytes(0) {
+    }
+
+    ~NameCache() {
+        evict(0, 0);
+    }
+
+    const char* lookup(uintptr_t key, int style, unsigned char epoch);
+    const char* insert(uintptr_t key, int style, unsigned char epoch, const char* name);
+
+    // The following methods require that no other thread uses the cache
+    void evict(unsigned char epoch, unsigned char max_age, bool classes_only = false);
+    size_t usedMemory();
+};
+
+
 class FrameName {
   private:
-    static JMethodCache _cache;
+    static NameCache _cache;
+    static Mutex _instances_lock;
+    static int _instances;
 
     JNIEnv* _jni;
     ClassMap _class_names;
@@ -68,6 +116,7 @@ class FrameName {
 
     const char* decodeNativeSymbol(const char* name);
     const char* typeSuffix(FrameTypeId type);
+    const char* className(unsigned int class_id);
     void javaMethodName(jmethodID method);
     void javaClassName(const char* symbol, size_t length, int style);
 
@@ -83,6 +132,10 @@ class FrameName {
 
     bool include(const char* frame_name);
     bool exclude(const char* frame_name);
+
+    // Class IDs are reused after the class map is reset
+    static void resetClassNames();
+    static size_t cacheMemory();
 };
 
 #endif // _FRAMENAME_H
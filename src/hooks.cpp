@@ -13,8 +13,10 @@
 #include "cpuEngine.h"
 #include "mallocTracer.h"
 #include "nativeLockTracer.h"
+#include "perfEvents.h"
 #include "profiler.h"
 #include "symbols.h"
+#include "wallClock.h"
 
 
 #define ADDRESS_OF(sym) ({ \
@@ -60,11 +62,17 @@ static void* thread_start_wrapper(void* e) {
     unsigned long current_thread = (unsigned long)(uintptr_t)pthread_self();
     Log::debug("thread_start: 0x%lx", current_thread);
     CpuEngine::onThreadStart();
+    WallClock::onThreadStart();
+    PerfCounters::onThreadStart();
+    Profiler::instance()->initSampleContext();
 
     void* result = start_routine(arg);
 
     Log::debug("thread_end: 0x%lx", current_thread);
     CpuEngine::onThreadEnd();
+    WallClock::onThreadEnd();
+    PerfCounters::onThreadEnd();
+    Profiler::instance()->releaseSampleContext();
 
     return result;
 }
@@ -84,6 +92,9 @@ static int pthread_create_hook(pthread_t* thread, const pthread_attr_t* attr, Th
 static void pthread_exit_hook(void* retval) {
     Log::debug("thread_exit: 0x%lx", (unsigned long)(uintptr_t)pthread_self());
     CpuEngine::onThreadEnd();
+    WallClock::onThreadEnd();
+    PerfCounters::onThreadEnd();
+    Profiler::instance()->releaseSampleContext();
 
     _orig_pthread_exit(retval);
 }
@@ -6,20 +6,46 @@
 #ifndef _INDEX_H
 #define _INDEX_H
 
-#include <functional>
+#include <string.h>
 #include <string>
-#include <unordered_map>
 #include <vector>
 #include "arch.h"
 
-// Keeps track of values seen and their index of occurrence
+// Keeps track of values seen and their index of occurrence.
+// Values are stored back to back in one buffer and looked up through
+// an open addressing table of indices, so each value costs a few bytes of overhead.
 class Index {
   private:
-    std::unordered_map<std::string, size_t> _idx_map;
+    std::vector<char> _data;
+    std::vector<u32> _offsets;
+    std::vector<u32> _hashes;
+    std::vector<u32> _table;
     size_t _start_index;
 
+    static u32 hash(const char* value, size_t len) {
+        u32 h = 2166136261U;
+        for (size_t i = 0; i < len; i++) {
+            h = (h ^ (unsigned char)value[i]) * 16777619U;
+        }
+        return h;
+    }
+
+    void grow() {
+        std::vector<u32> table(_table.empty() ? 256 : _table.size() * 2);
+        u32 mask = table.size() - 1;
+        for (u32 i = 0; i < _hashes.size(); i++) {
+            u32 slot = _hashes[i] & mask;
+            while (table[slot] != 0) {
+                slot = (slot + 1) & mask;
+            }
+            table[slot] = i + 1;
+        }
+        _table.swap(table);
+    }
+
   public:
     Index(size_t start_index = 0) : _start_index(start_index) {
+        _offsets.push_back(0);
         // The first index should contain the empty string
         indexOf("");
     }
@@ -30,33 +56,58 @@ class Index {
     Index& operator=(Index&&) = delete;
 
     size_t indexOf(const char* value) {
-        return indexOf(std::string(value));
+        return indexOf(value, strlen(value));
+    }
+
+    size_t indexOf(const std::string& value) {
+        return indexOf(value.data(), value.length());
     }
 
     size_t indexOf(const char* value, size_t len) {
-        return indexOf(std::string(value, len));
+        u32 h = hash(value, len);
+        if (!_table.empty()) {
+            u32 mask = _table.size() - 1;
+            for (u32 slot = h & mask; _table[slot] != 0; slot = (slot + 1) & mask) {
+                u32 i = _table[slot] - 1;
+                if (_hashes[i] == h && _offsets[i + 1] - _offsets[i] == len && memcmp(_data.data() + _offsets[i], value, len) == 0) {
+                    return _start_index + i;
+                }
+            }
+        }
+
+        if ((_hashes.size() + 1) * 4 > _table.size() * 3) {
+            grow();
+        }
+
+        u32 i = _hashes.size();
+        _data.insert(_data.end(), value, value + len);
+        _offsets.push_back(_data.size());
+        _hashes.push_back(h);
+
+        u32 mask = _table.size() - 1;
+        u32 slot = h & mask;
+        while (_table[slot] != 0) {
+            slot = (slot + 1) & mask;
+        }
+        _table[slot] = i + 1;
+        return _start_index + i;
     }
 
-    size_t indexOf(const std::string& value) {
-        return _idx_map.insert({value, _start_index + _idx_map.size()}).first->second;
+    size_t size() const {
+        return _hashes.size();
     }
 
-    size_t indexOf(std::string&& value) {
-        return _idx_map.insert({std::move(value), _start_index + _idx_map.size()}).first->second;
+    // Values are not NUL-terminated
+    const char* value(size_t index) const {
+        return _data.data() + _offsets[index - _start_index];
     }
 
-    size_t size() const {
-        return _idx_map.size();
+    size_t length(size_t index) const {
+        return _offsets[index - _start_index + 1] - _offsets[index - _start_index];
     }
 
-    void forEachOrdered(const std::function<void(size_t idx, const std::string&)>& consumer) const {
-        std::vector<const std::string*> arr(_idx_map.size());
-        for (const auto& it : _idx_map) {
-            arr[it.second - _start_index] = &it.first;
-        }
-        for (size_t idx = 0; idx < size(); ++idx) {
-            consumer(idx + _start_index, *arr[idx]);
-        }
+    size_t usedMemory() const {
+        return _data.capacity() + (_offsets.capacity() + _hashes.capacity() + _table.capacity()) * sizeof(u32);
     }
 };
 
@@ -0,0 +1,129 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _IORING_H
+#define _IORING_H
+
+#include <sys/types.h>
+#include "arch.h"
+
+// File offset that refers to the current position of a file descriptor
+const u64 CURRENT_POSITION = (u64)-1;
+
+#ifdef __linux__
+
+struct IoRequest {
+    int fd;
+    const char* data;
+    size_t len;
+    u64 offset;
+};
+
+// Minimal io_uring wrapper for batching file writes: a number of writes is queued
+// and then submitted with a single syscall. Not thread safe; the owner is responsible
+// for serializing access. If the kernel does not support io_uring, or it is disabled
+// by sysctl or seccomp, open() fails, and callers are expected to use plain write().
+class IoRing {
+  private:
+    int _ring_fd;
+    u32 _entries;
+    u32 _queued;
+    u32 _in_flight;
+    ssize_t _completed;
+    int _err;
+
+    char* _sq_ring;
+    char* _cq_ring;
+    size_t _sq_ring_size;
+    size_t _cq_ring_size;
+    void* _sqes;
+
+    u32* _sq_tail;
+    u32* _sq_mask;
+    u32* _sq_array;
+    u32* _cq_head;
+    u32* _cq_tail;
+    u32* _cq_mask;
+    void* _cqes;
+
+    IoRequest* _requests;
+
+    int enter(u32 to_submit, u32 min_complete, u32 flags);
+
+  public:
+    IoRing();
+    ~IoRing();
+
+    bool open(u32 entries);
+    void close();
+
+    bool active() const {
+        return _ring_fd >= 0;
+    }
+
+    // Number of writes that can be queued before the next submit()
+    u32 available() const {
+        return _entries - _queued - _in_flight;
+    }
+
+    // Error of the last failed write, if any
+    int error() const {
+        return _err;
+    }
+
+    bool write(int fd, const char* data, size_t len, u64 offset);
+    bool submit();
+    ssize_t wait();
+
+    ssize_t submitAndWait() {
+        bool submitted = submit();
+        ssize_t bytes = wait();
+        return submitted ? bytes : -1;
+    }
+};
+
+#else
+
+class IoRing {
+  public:
+    bool open(u32 entries) {
+        return false;
+    }
+
+    void close() {
+    }
+
+    bool active() const {
+        return false;
+    }
+
+    u32 available() const {
+        return 0;
+    }
+
+    int error() const {
+        return 0;
+    }
+
+    bool write(int fd, const char* data, size_t len, u64 offset) {
+        return false;
+    }
+
+    bool submit() {
+        return false;
+    }
+
+    ssize_t wait() {
+        return 0;
+    }
+
+    ssize_t submitAndWait() {
+        return -1;
+    }
+};
+
+#endif // __linux__
+
+#endif // _IORING_H
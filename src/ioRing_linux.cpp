@@ -0,0 +1,329 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "ioRing.h"
+#include "log.h"
+
+
+// io_uring syscalls have the same numbers on all supported architectures
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup  425
+#define __NR_io_uring_enter  426
+#endif
+
+// Kernel ABI structures, defined here to avoid dependency on recent kernel headers
+struct SqRingOffsets {
+    u32 head;
+    u32 tail;
+    u32 ring_mask;
+    u32 ring_entries;
+    u32 flags;
+    u32 dropped;
+    u32 array;
+    u32 resv1;
+    u64 resv2;
+};
+
+struct CqRingOffsets {
+    u32 head;
+    u32 tail;
+    u32 ring_mask;
+    u32 ring_entries;
+    u32 overflow;
+    u32 cqes;
+    u32 flags;
+    u32 resv1;
+    u64 resv2;
+};
+
+struct IoRingParams {
+    u32 sq_entries;
+    u32 cq_entries;
+    u32 flags;
+    u32 sq_thread_cpu;
+    u32 sq_thread_idle;
+    u32 features;
+    u32 wq_fd;
+    u32 resv[3];
+    SqRingOffsets sq_off;
+    CqRingOffsets cq_off;
+};
+
+struct IoRingSqe {
+    u8 opcode;
+    u8 flags;
+    u16 ioprio;
+    int fd;
+    u64 off;
+    u64 addr;
+    u32 len;
+    u32 rw_flags;
+    u64 user_data;
+    u64 pad[3];
+};
+
+struct IoRingCqe {
+    u64 user_data;
+    int res;
+    u32 flags;
+};
+
+static const u8 IO_OP_WRITE = 23;
+static const u32 IO_ENTER_GETEVENTS = 1;
+static const u32 IO_FEAT_SINGLE_MMAP = 1;
+static const u32 IO_FEAT_RW_CUR_POS = 8;
+static const off_t IO_OFF_SQ_RING = 0;
+static const off_t IO_OFF_CQ_RING = 0x8000000;
+static const off_t IO_OFF_SQES = 0x10000000;
+
+
+static ssize_t writeFully(int fd, const char* data, size_t len, u64 offset) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t bytes = offset == CURRENT_POSITION ? ::write(fd, data + total, len - total)
+                                                   : pwrite(fd, data + total, len - total, offset + total);
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += bytes;
+    }
+    return total;
+}
+
+IoRing::IoRing() : _ring_fd(-1), _entries(0), _queued(0), _in_flight(0), _completed(0), _err(0),
+                   _sq_ring(NULL), _cq_ring(NULL), _sqes(NULL), _requests(NULL) {
+}
+
+IoRing::~IoRing() {
+    close();
+}
+
+bool IoRing::open(u32 entries) {
+    IoRingParams params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        Log::debug("io_uring_setup failed: %s", strerror(errno));
+        return false;
+    }
+
+    // Writes at the current file position (and IORING_OP_WRITE itself) appeared in Linux 5.6
+    if (!(params.features & IO_FEAT_RW_CUR_POS)) {
+        Log::debug("io_uring is too old");
+        ::close(fd);
+        return false;
+    }
+
+    IoRequest* requests = (IoRequest*)calloc(params.sq_entries, sizeof(IoRequest));
+    if (requests == NULL) {
+        Log::debug("Not enough memory for io_uring requests");
+        ::close(fd);
+        return false;
+    }
+
+    _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+    _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(IoRingCqe);
+    if (params.features & IO_FEAT_SINGLE_MMAP) {
+        if (_cq_ring_size > _sq_ring_size) _sq_ring_size = _cq_ring_size;
+        _cq_ring_size = _sq_ring_size;
+    }
+
+    void* sq_ring = mmap(NULL, _sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IO_OFF_SQ_RING);
+    void* cq_ring = sq_ring;
+    if (sq_ring != MAP_FAILED && !(params.features & IO_FEAT_SINGLE_MMAP)) {
+        cq_ring = mmap(NULL, _cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IO_OFF_CQ_RING);
+    }
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(IoRingSqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IO_OFF_SQES);
+
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        Log::debug("Failed to map io_uring: %s", strerror(errno));
+        if (sqes != MAP_FAILED) munmap(sqes, params.sq_entries * sizeof(IoRingSqe));
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, _cq_ring_size);
+        if (sq_ring != MAP_FAILED) munmap(sq_ring, _sq_ring_size);
+        free(requests);
+        ::close(fd);
+        return false;
+    }
+
+    _ring_fd = fd;
+    _entries = params.sq_entries;
+    _queued = 0;
+    _in_flight = 0;
+    _completed = 0;
+    _err = 0;
+    _sq_ring = (char*)sq_ring;
+    _cq_ring = (char*)cq_ring;
+    _sqes = sqes;
+    _sq_tail = (u32*)(_sq_ring + params.sq_off.tail);
+    _sq_mask = (u32*)(_sq_ring + params.sq_off.ring_mask);
+    _sq_array = (u32*)(_sq_ring + params.sq_off.array);
+    _cq_head = (u32*)(_cq_ring + params.cq_off.head);
+    _cq_tail = (u32*)(_cq_ring + params.cq_off.tail);
+    _cq_mask = (u32*)(_cq_ring + params.cq_off.ring_mask);
+    _cqes = _cq_ring + params.cq_off.cqes;
+    _requests = requests;
+    return true;
+}
+
+void IoRing::close() {
+    if (_ring_fd < 0) {
+        return;
+    }
+
+    wait();
+
+    munmap(_sqes, _entries * sizeof(IoRingSqe));
+    if (_cq_ring != _sq_ring) {
+        munmap(_cq_ring, _cq_ring_size);
+    }
+    munmap(_sq_ring, _sq_ring_size);
+    ::close(_ring_fd);
+    free(_requests);
+
+    _ring_fd = -1;
+    _requests = NULL;
+}
+
+int IoRing::enter(u32 to_submit, u32 min_complete, u32 flags) {
+    int result;
+    while ((result = syscall(__NR_io_uring_enter, _ring_fd, to_submit, min_complete, flags, NULL, 0)) < 0 && errno == EINTR);
+    return result;
+}
+
+// Queues a write of len bytes at the given file offset. The data must stay intact until wait() returns.
+// Returns false if the submission queue is full.
+bool IoRing::write(int fd, const char* data, size_t len, u64 offset) {
+    if (available() == 0) {
+        return false;
+    }
+
+    u32 tail = *_sq_tail + _queued;
+    u32 index = tail & *_sq_mask;
+
+    IoRingSqe* sqe = (IoRingSqe*)_sqes + index;
+    memset(sqe, 0, sizeof(IoRingSqe));
+    sqe->opcode = IO_OP_WRITE;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (u64)(uintptr_t)data;
+    sqe->len = (u32)len;
+    sqe->user_data = index;
+    _sq_array[index] = index;
+
+    IoRequest& request = _requests[index];
+    request.fd = fd;
+    request.data = data;
+    request.len = len;
+    request.offset = offset;
+
+    _queued++;
+    return true;
+}
+
+// Submits all queued writes with a single syscall, unless the kernel is short of resources
+bool IoRing::submit() {
+    if (_queued == 0) {
+        return true;
+    }
+
+    u32 tail = *_sq_tail + _queued;
+    __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (_queued > 0) {
+        int submitted = enter(_queued, 0, 0);
+        if (submitted <= 0) {
+            break;
+        }
+        _in_flight += submitted;
+        _queued -= submitted;
+    }
+
+    if (_queued == 0) {
+        return true;
+    }
+
+    // Without SQPOLL, the kernel consumes entries only during io_uring_enter,
+    // so the rest can be taken back and written synchronously
+    _err = errno;
+    __atomic_store_n(_sq_tail, tail - _queued, __ATOMIC_RELEASE);
+    bool ok = true;
+    for (u32 i = 0; i < _queued; i++) {
+        IoRequest& request = _requests[(tail - _queued + i) & *_sq_mask];
+        ssize_t bytes = writeFully(request.fd, request.data, request.len, request.offset);
+        if (bytes < 0) {
+            _err = errno;
+            ok = false;
+        } else {
+            _completed += bytes;
+        }
+    }
+    _queued = 0;
+    return ok;
+}
+
+// Waits until all submitted writes complete. A failed or short write is finished synchronously.
+// Returns the total number of bytes written, or -1 if any of the writes failed.
+ssize_t IoRing::wait() {
+    ssize_t total = _completed;
+    _completed = 0;
+    bool failed = false;
+
+    while (_in_flight > 0) {
+        u32 head = *_cq_head;
+        u32 tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (enter(0, 1, IO_ENTER_GETEVENTS) < 0) {
+                _err = errno;
+                return -1;
+            }
+            continue;
+        }
+
+        for (; head != tail; head++) {
+            IoRingCqe* cqe = (IoRingCqe*)_cqes + (head & *_cq_mask);
+            IoRequest& request = _requests[cqe->user_data];
+            ssize_t bytes = cqe->res;
+
+            if (bytes < 0) {
+                // The kernel may reject a request it cannot handle asynchronously, e.g. with EAGAIN
+                Log::warn("io_uring write failed: %s, retrying synchronously", strerror(-cqe->res));
+                bytes = 0;
+            }
+
+            if ((size_t)bytes < request.len) {
+                if (bytes > 0) {
+                    Log::debug("io_uring short write: %ld of %ld bytes", (long)bytes, (long)request.len);
+                }
+                u64 offset = request.offset == CURRENT_POSITION ? CURRENT_POSITION : request.offset + bytes;
+                ssize_t rest = writeFully(request.fd, request.data + bytes, request.len - bytes, offset);
+                if (rest < 0) {
+                    _err = errno;
+                    failed = true;
+                } else {
+                    total += bytes + rest;
+                }
+            } else {
+                total += bytes;
+            }
+            _in_flight--;
+        }
+        __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return failed ? -1 : total;
+}
+
+#endif // __linux__
@@ -80,7 +80,7 @@ Java_one_profiler_AsyncProfiler_execute0(JNIEnv* env, jobject unused, jstring co
             return env->NewStringUTF(out.buf());
         }
     } else {
-        FileWriter out(args.file());
+        FileWriter out(args.file(), args._io_ring);
         if (!out.is_open()) {
             throwNew(env, "java/io/IOException", strerror(errno));
             return NULL;
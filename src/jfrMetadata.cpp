@@ -239,6 +239,17 @@ JfrMetadata::JfrMetadata() : Element("root") {
                 << field("state", T_THREAD_STATE, "Thread State", F_CPOOL)
                 << field("samples", T_INT, "Samples", F_UNSIGNED))
 
+            << (type("profiler.PerfCounters", T_PERF_COUNTERS, "Performance Counters")
+                << category("Java Virtual Machine", "Profiling")
+                << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
+                << field("sampledThread", T_THREAD, "Thread", F_CPOOL)
+                << field("stackTrace", T_STACK_TRACE, "Stack Trace", F_CPOOL)
+                << field("taskClock", T_LONG, "Task Clock", F_DURATION_NANOS)
+                << field("cycles", T_LONG, "Cycles", F_UNSIGNED)
+                << field("instructions", T_LONG, "Instructions", F_UNSIGNED)
+                << field("cacheMisses", T_LONG, "Cache Misses", F_UNSIGNED)
+                << field("contextSwitches", T_LONG, "Context Switches", F_UNSIGNED))
+
             << (type("profiler.Malloc", T_MALLOC, "malloc")
                 << category("Java Virtual Machine", "Native Memory")
                 << field("startTime", T_LONG, "Start Time", F_TIME_TICKS)
@@ -68,6 +68,7 @@ enum JfrType {
     T_USER_EVENT = 122,
     T_PROCESS_SAMPLE = 123,
     T_NATIVE_LOCK = 124,
+    T_PERF_COUNTERS = 125,
 
     // types after T_ANNOTATION inherit from java.lang.annotation.Annotation, see JfrMetadata::type
     T_ANNOTATION = 200,
@@ -0,0 +1,184 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "arch.h"
+#include "lz4.h"
+
+
+static const size_t MIN_MATCH = 4;
+static const size_t LAST_LITERALS = 5;
+static const size_t MF_LIMIT = 12;
+static const size_t MAX_DISTANCE = 65535;
+static const int HASH_BITS = 12;
+static const int SKIP_TRIGGER = 6;
+
+
+static inline u32 read32(const char* p) {
+    u32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u64 read64(const char* p) {
+    u64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline u32 hash(u32 sequence) {
+    return (sequence * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Continuation bytes of a length that does not fit in a 4-bit token field
+static inline char* putLength(char* op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)len;
+    return op;
+}
+
+static inline char* putLiterals(char* op, u8 match_token, const char* literals, size_t len) {
+    *op++ = (char)((len < 15 ? len : 15) << 4 | match_token);
+    if (len >= 15) {
+        op = putLength(op, len - 15);
+    }
+    memcpy(op, literals, len);
+    return op + len;
+}
+
+// Length of the common prefix of two sequences, limited by the end of the input
+static inline size_t commonLength(const char* p, const char* ref, const char* limit) {
+    const char* start = p;
+    while (p + 8 <= limit) {
+        u64 diff = read64(p) ^ read64(ref);
+        if (diff != 0) {
+            // All supported architectures are little-endian
+            return p - start + (__builtin_ctzll(diff) >> 3);
+        }
+        p += 8;
+        ref += 8;
+    }
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p - start;
+}
+
+size_t LZ4::compress(const char* src, size_t size, char* dst) {
+    const char* const end = src + size;
+    const char* anchor = src;
+    char* op = dst;
+
+    if (size > MF_LIMIT) {
+        // Positions are relative to src; stale and empty slots are rejected by comparing bytes
+        u32 table[1 << HASH_BITS];
+        memset(table, 0, sizeof(table));
+
+        const char* const match_limit = end - MF_LIMIT;
+        const char* const copy_limit = end - LAST_LITERALS;
+        const char* ip = src + 1;
+
+        while (ip < match_limit) {
+            u32 sequence = read32(ip);
+            u32* slot = &table[hash(sequence)];
+            const char* ref = src + *slot;
+            *slot = (u32)(ip - src);
+
+            if (ref >= ip || (size_t)(ip - ref) > MAX_DISTANCE || read32(ref) != sequence) {
+                // Move faster through incompressible data
+                ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+                continue;
+            }
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+
+            size_t match_len = commonLength(ip + MIN_MATCH, ref + MIN_MATCH, copy_limit);
+            u16 offset = (u16)(ip - ref);
+
+            op = putLiterals(op, match_len < 15 ? match_len : 15, anchor, ip - anchor);
+            *op++ = (char)offset;
+            *op++ = (char)(offset >> 8);
+            if (match_len >= 15) {
+                op = putLength(op, match_len - 15);
+            }
+
+            ip += MIN_MATCH + match_len;
+            anchor = ip;
+
+            if (ip - 2 > src && ip < match_limit) {
+                table[hash(read32(ip - 2))] = (u32)(ip - 2 - src);
+            }
+        }
+    }
+
+    op = putLiterals(op, 0, anchor, end - anchor);
+    return op - dst;
+}
+
+ssize_t LZ4::decompress(const char* src, size_t size, char* dst, size_t capacity) {
+    const u8* ip = (const u8*)src;
+    const u8* const end = ip + size;
+    char* op = dst;
+    char* const op_end = dst + capacity;
+
+    while (ip < end) {
+        u8 token = *ip++;
+
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            u8 b;
+            do {
+                if (ip >= end) return -1;
+                literals += (b = *ip++);
+            } while (b == 255);
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        ip += literals;
+        op += literals;
+
+        if (ip == end) {
+            // The last sequence has literals only
+            break;
+        }
+
+        if (end - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -1;
+        }
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            u8 b;
+            do {
+                if (ip >= end) return -1;
+                match_len += (b = *ip++);
+            } while (b == 255);
+        }
+        match_len += MIN_MATCH;
+        if (match_len > (size_t)(op_end - op)) {
+            return -1;
+        }
+
+        // Source and destination may overlap: byte by byte copy replicates a short period
+        const char* ref = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return op - dst;
+}
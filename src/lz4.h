@@ -0,0 +1,31 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+
+// Self-contained encoder and decoder of the LZ4 block format:
+// https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+// Compression is greedy with a single-entry hash table, which is
+// the same trade-off as LZ4_compress_fast() with default acceleration.
+class LZ4 {
+  public:
+    static size_t maxCompressedSize(size_t size) {
+        return size + size / 255 + 16;
+    }
+
+    // dst must have room for at least maxCompressedSize(size) bytes
+    static size_t compress(const char* src, size_t size, char* dst);
+
+    // Returns the number of decoded bytes, or -1 if the input is malformed
+    // or does not fit in capacity
+    static ssize_t decompress(const char* src, size_t size, char* dst, size_t capacity);
+};
+
+#endif // _LZ4_H
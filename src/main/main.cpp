@@ -76,6 +76,7 @@ static const char USAGE_STRING[] =
     "  --lock time         lock profiling threshold in nanoseconds\n"
     "  --nativelock time   pthread mutex/rwlock profiling threshold in nanoseconds\n"
     "  --wall interval     wall clock profiling interval\n"
+    "  --wallthreads n     number of wall clock sampler threads\n"
     "  --proc interval     process sampling interval (default: 30s)\n"
     "  --all               shorthand for enabling cpu, wall, alloc, live,\n"
     "                      nativemem and lock profiling simultaneously\n"
@@ -91,10 +92,20 @@ static const char USAGE_STRING[] =
     "  --nostop            do not stop profiling outside --begin/--end window\n"
     "  --jfropts opts      JFR recording options: mem\n"
     "  --jfrsync config    synchronize profiler with JFR recording\n"
+    "  --tracemem size[:n] evict traces idle for n chunks above size\n"
+    "  --compress          compress JFR output with LZ4\n"
     "  --libpath path      full path to libasyncProfiler.so in the container\n"
     "  --fdtransfer        run separate fdtransfer process to serve perf requests\n"
     "                      from the non-privileged target\n"
     "  --target-cpu cpu    sample threads on a specific CPU (perf_events only, default: -1)\n"
+    "  --percpu            open one perf_event per CPU instead of one per thread\n"
+    "  --perfbatch n       deliver one perf_events signal per n samples\n"
+    "  --counters          record performance counters with CPU samples (JFR only)\n"
+    "  --sharded           shard sample counters to reduce contention\n"
+    "  --threadbuf         record samples into per-thread buffers\n"
+    "  --compact           share common frames between stored call traces\n"
+    "  --iouring           batch output writes with io_uring\n"
+    "  --lazysymbols       parse library symbols in background\n"
     "\n"
     "<pid> is a numeric process ID of the target JVM\n"
     "      or 'jps' keyword to find running JVM automatically\n"
@@ -505,9 +516,9 @@ int main(int argc, const char** argv) {
             format << "," << (arg.str() + 2);
 
         } else if (arg == "--alloc" || arg == "--nativemem" || arg == "--nativelock" || arg == "--lock" ||
-                   arg == "--wall" || arg == "--trace" || arg == "--chunksize" || arg == "--chunktime" ||
+                   arg == "--wall" || arg == "--trace" || arg == "--chunksize" || arg == "--chunktime" || arg == "--tracemem" ||
                    arg == "--cstack" || arg == "--signal" || arg == "--clock" || arg == "--begin" || arg == "--end" ||
-                   arg == "--target-cpu" || arg == "--proc") {
+                   arg == "--target-cpu" || arg == "--proc" || arg == "--wallthreads" || arg == "--perfbatch") {
             params << "," << (arg.str() + 2) << "=" << args.next();
 
         } else if (arg == "--ttsp") {
@@ -522,6 +533,30 @@ int main(int argc, const char** argv) {
         } else if (arg == "--all-user") {
             params << ",alluser";
 
+        } else if (arg == "--counters") {
+            params << ",counters";
+
+        } else if (arg == "--percpu") {
+            params << ",percpu";
+
+        } else if (arg == "--sharded") {
+            params << ",sharded";
+
+        } else if (arg == "--threadbuf") {
+            params << ",threadbuf";
+
+        } else if (arg == "--compact") {
+            params << ",compact";
+
+        } else if (arg == "--iouring") {
+            params << ",iouring";
+
+        } else if (arg == "--lazysymbols") {
+            params << ",lazysymbols";
+
+        } else if (arg == "--compress") {
+            params << ",compress";
+
         } else if (arg == "--safe-mode") {
             params << ",safemode=" << args.next();
 
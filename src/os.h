@@ -130,12 +130,14 @@ class OS {
 
     static bool getCpuDescription(char* buf, size_t size);
     static int getCpuCount();
+    static bool bindToCpu(int index);
     static u64 getProcessCpuTime(u64* utime, u64* stime);
     static u64 getTotalCpuTime(u64* utime, u64* stime);
 
     static int createMemoryFile(const char* name);
     static void copyFile(int src_fd, int dst_fd, off_t offset, size_t size);
     static void freePageCache(int fd, off_t start_offset);
+    static void discardFileRange(int fd, off_t offset, size_t size);
     static int mprotect(void* addr, size_t size, int prot);
 
     static bool checkPreloaded();
@@ -352,6 +352,25 @@ int OS::getCpuCount() {
     return sysconf(_SC_NPROCESSORS_ONLN);
 }
 
+// Pins the current thread to the index-th of CPUs it is allowed to run on
+bool OS::bindToCpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) <= 1) {
+        return false;
+    }
+
+    index %= CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return sched_setaffinity(0, sizeof(set), &set) == 0;
+        }
+    }
+    return false;
+}
+
 u64 OS::getProcessCpuTime(u64* utime, u64* stime) {
     struct tms buf;
     clock_t real = times(&buf);
@@ -400,6 +419,11 @@ void OS::freePageCache(int fd, off_t start_offset) {
     posix_fadvise(fd, start_offset & ~page_mask, 0, POSIX_FADV_DONTNEED);
 }
 
+void OS::discardFileRange(int fd, off_t offset, size_t size) {
+    // Punch a hole to release disk blocks, the file size remains the same
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size);
+}
+
 int OS::mprotect(void* addr, size_t size, int prot) {
     return ::mprotect(addr, size, prot);
 }
@@ -332,6 +332,11 @@ int OS::getCpuCount() {
     return sysctlbyname("hw.logicalcpu", &cpu_count, &size, NULL, 0) == 0 ? cpu_count : 1;
 }
 
+bool OS::bindToCpu(int index) {
+    // Thread affinity is only a hint on macOS
+    return false;
+}
+
 u64 OS::getProcessCpuTime(u64* utime, u64* stime) {
     struct tms buf;
     clock_t real = times(&buf);
@@ -395,6 +400,10 @@ void OS::freePageCache(int fd, off_t start_offset) {
     // Not supported on macOS
 }
 
+void OS::discardFileRange(int fd, off_t offset, size_t size) {
+    // Not supported on macOS
+}
+
 int OS::mprotect(void* addr, size_t size, int prot) {
     if (prot & PROT_WRITE) prot |= VM_PROT_COPY;
     return vm_protect(mach_task_self(), (vm_address_t)addr, size, 0, prot);
@@ -0,0 +1,167 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "otlp.h"
+#include "otlpWriter.h"
+
+using namespace Otlp;
+
+// Dictionary entries are collected in a small buffer before passing them to the Writer
+static const size_t OTLP_FLUSH_THRESHOLD = 65536;
+
+
+OtlpWriter::OtlpWriter(u64 time_nanos, u64 duration_nanos) :
+    _head(OTLP_BUFFER_INITIAL_SIZE),
+    _samples(OTLP_BUFFER_INITIAL_SIZE),
+    _locations(OTLP_BUFFER_INITIAL_SIZE),
+    _location_count(0),
+    _strings(),
+    _thread_names(),
+    _functions(),
+    _string_functions() {
+
+    _head.field(Profile::time_nanos, time_nanos);
+    _head.field(Profile::duration_nanos, duration_nanos);
+
+    // Function 0 has an empty name, like string 0
+    _functions.push_back(0);
+    _string_functions.push_back(1);
+}
+
+void OtlpWriter::addSampleType(const char* type, const char* units) {
+    protobuf_mark_t sample_type_mark = _head.startMessage(Profile::sample_type, 1);
+    _head.field(ValueType::type_strindex, _strings.indexOf(type));
+    _head.field(ValueType::unit_strindex, _strings.indexOf(units));
+    _head.field(ValueType::aggregation_temporality, AggregationTemporality::cumulative);
+    _head.commitMessage(sample_type_mark);
+}
+
+u32 OtlpWriter::functionIndex(const char* name) {
+    u32 string_index = (u32) _strings.indexOf(name);
+    if (string_index >= _string_functions.size()) {
+        _string_functions.resize(string_index + 1);
+    }
+
+    u32 function_index = _string_functions[string_index];
+    if (function_index == 0) {
+        _functions.push_back(string_index);
+        function_index = _string_functions[string_index] = _functions.size();
+    }
+    return function_index - 1;
+}
+
+void OtlpWriter::addLocation(const char* function_name) {
+    _locations.putVarInt(functionIndex(function_name));
+    _location_count++;
+}
+
+void OtlpWriter::addSample(u32 locations, const char* thread_name, u64 samples, u64 counter) {
+    protobuf_mark_t sample_mark = _samples.startMessage(Profile::sample, 1);
+    _samples.field(Sample::locations_start_index, _location_count - locations);
+    _samples.field(Sample::locations_length, locations);
+    // Attribute 0 is reserved for the empty thread name
+    size_t thread_name_idx = thread_name != NULL ? _thread_names.indexOf(thread_name) : 0;
+    if (thread_name_idx != 0) {
+        _samples.field(Sample::attribute_indices, thread_name_idx);
+    }
+
+    protobuf_mark_t sample_value_mark = _samples.startMessage(Sample::value, 1);
+    _samples.putVarInt(samples);
+    _samples.putVarInt(counter);
+    _samples.commitMessage(sample_value_mark);
+    _samples.commitMessage(sample_mark);
+}
+
+// Without a Writer, only computes the size of the dictionary contents
+void OtlpWriter::flush(ProtoBuffer& buf, Writer* out, size_t* size) {
+    *size += buf.offset();
+    if (out != NULL) {
+        out->write((const char*) buf.data(), buf.offset());
+    }
+    buf.reset();
+}
+
+size_t OtlpWriter::writeDictionary(ProtoBuffer& buf, Writer* out) {
+    size_t size = 0;
+
+    // Write mapping_table. Not currently used, but required by some parsers
+    protobuf_mark_t mapping_mark = buf.startMessage(ProfilesDictionary::mapping_table, 1);
+    buf.commitMessage(mapping_mark);
+
+    // Write function_table
+    for (size_t i = 0; i < _functions.size(); i++) {
+        protobuf_mark_t function_mark = buf.startMessage(ProfilesDictionary::function_table, 1);
+        buf.field(Function::name_strindex, (u64) _functions[i]);
+        buf.commitMessage(function_mark);
+        if (buf.offset() >= OTLP_FLUSH_THRESHOLD) flush(buf, out, &size);
+    }
+
+    // Write location_table
+    for (size_t function_idx = 0; function_idx < _functions.size(); function_idx++) {
+        protobuf_mark_t location_mark = buf.startMessage(ProfilesDictionary::location_table, 1);
+        // TODO: set to the proper mapping when new mappings are added.
+        // For now we keep a dummy default mapping_index for all locations because some parsers
+        // would fail otherwise
+        buf.field(Location::mapping_index, (u64)0);
+        protobuf_mark_t line_mark = buf.startMessage(Location::line, 1);
+        buf.field(Line::function_index, function_idx);
+        buf.commitMessage(line_mark);
+        buf.commitMessage(location_mark);
+        if (buf.offset() >= OTLP_FLUSH_THRESHOLD) flush(buf, out, &size);
+    }
+
+    // Write string_table
+    for (size_t i = 0; i < _strings.size(); i++) {
+        if (out == NULL) {
+            size += ProtoBuffer::fieldSize(ProfilesDictionary::string_table, _strings.length(i));
+            continue;
+        }
+        buf.field(ProfilesDictionary::string_table, _strings.value(i), _strings.length(i));
+        if (buf.offset() >= OTLP_FLUSH_THRESHOLD) flush(buf, out, &size);
+    }
+
+    // Write attribute_table (only threads for now)
+    for (size_t i = 0; i < _thread_names.size(); i++) {
+        protobuf_mark_t attr_mark = buf.startMessage(ProfilesDictionary::attribute_table);
+        buf.field(Key::key, OTLP_THREAD_NAME);
+        protobuf_mark_t value_mark = buf.startMessage(Key::value);
+        buf.field(AnyValue::string_value, _thread_names.value(i), _thread_names.length(i));
+        buf.commitMessage(value_mark);
+        buf.commitMessage(attr_mark);
+        if (buf.offset() >= OTLP_FLUSH_THRESHOLD) flush(buf, out, &size);
+    }
+
+    flush(buf, out, &size);
+    return size;
+}
+
+void OtlpWriter::write(Writer& out) {
+    size_t profile_size = _head.offset() + _samples.offset() +
+                          ProtoBuffer::fieldSize(Profile::location_indices, _locations.offset());
+    size_t scope_profiles_size = ProtoBuffer::fieldSize(ScopeProfiles::profiles, profile_size);
+    size_t resource_profiles_size = ProtoBuffer::fieldSize(ResourceProfiles::scope_profiles, scope_profiles_size);
+
+    ProtoBuffer buf(OTLP_FLUSH_THRESHOLD + OTLP_BUFFER_INITIAL_SIZE);
+    buf.fieldHeader(ProfilesData::resource_profiles, resource_profiles_size);
+    buf.fieldHeader(ResourceProfiles::scope_profiles, scope_profiles_size);
+    buf.fieldHeader(ScopeProfiles::profiles, profile_size);
+    out.write((const char*) buf.data(), buf.offset());
+    buf.reset();
+
+    out.write((const char*) _head.data(), _head.offset());
+    out.write((const char*) _samples.data(), _samples.offset());
+
+    buf.fieldHeader(Profile::location_indices, _locations.offset());
+    out.write((const char*) buf.data(), buf.offset());
+    buf.reset();
+    out.write((const char*) _locations.data(), _locations.offset());
+
+    // The first pass computes the length of the dictionary, the second one writes it
+    size_t dictionary_size = writeDictionary(buf, NULL);
+    buf.fieldHeader(ProfilesData::dictionary, dictionary_size);
+    out.write((const char*) buf.data(), buf.offset());
+    buf.reset();
+    writeDictionary(buf, &out);
+}
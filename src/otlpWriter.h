@@ -0,0 +1,47 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _OTLPWRITER_H
+#define _OTLPWRITER_H
+
+#include <vector>
+#include "index.h"
+#include "protobuf.h"
+#include "writer.h"
+
+// Produces OTLP ProfilesData with a single Profile.
+// Samples and location indices are encoded as they are added; the rest of the profile
+// is written straight to the Writer at the end, with message lengths computed in advance,
+// so the whole output is never assembled in memory.
+class OtlpWriter {
+  private:
+    ProtoBuffer _head;
+    ProtoBuffer _samples;
+    ProtoBuffer _locations;
+    u32 _location_count;
+    Index _strings;
+    Index _thread_names;
+    // String index of every function
+    std::vector<u32> _functions;
+    // Function index + 1 for every string that names a function, 0 otherwise
+    std::vector<u32> _string_functions;
+
+    u32 functionIndex(const char* name);
+    size_t writeDictionary(ProtoBuffer& buf, Writer* out);
+    void flush(ProtoBuffer& buf, Writer* out, size_t* size);
+
+  public:
+    OtlpWriter(u64 time_nanos, u64 duration_nanos);
+
+    void addSampleType(const char* type, const char* units);
+
+    // Locations of a sample are added first, from the top frame
+    void addLocation(const char* function_name);
+    void addSample(u32 locations, const char* thread_name, u64 samples, u64 counter);
+
+    void write(Writer& out);
+};
+
+#endif // _OTLPWRITER_H
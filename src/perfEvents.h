@@ -6,14 +6,20 @@
 #ifndef _PERFEVENTS_H
 #define _PERFEVENTS_H
 
+#include <pthread.h>
 #include "arch.h"
 #include "cpuEngine.h"
+#include "event.h"
 
 #ifdef __linux__
 
+class PerfCounterGroup;
 class PerfEvent;
 class PerfEventType;
 class StackContext;
+struct perf_event_attr;
+struct perf_event_mmap_page;
+struct pollfd;
 
 class PerfEvents : public CpuEngine {
   private:
@@ -25,14 +31,43 @@ class PerfEvents : public CpuEngine {
     static bool _use_perf_mmap;
     static bool _record_cpu;
     static int _target_cpu;
+    static int _batch;
+    static int _ring_pages;
+
+    // Per-CPU mode: events are indexed by CPU and drained by the reader thread
+    static bool _per_cpu;
+    static int _cpu_events;
+    static PerfEvent* _cpu_event;
+    static u64 _lost_samples;
+    volatile bool _running;
+    pthread_t _reader;
+    ASGCT_CallFrame* _reader_frames;
+    struct pollfd* _reader_fds;
 
     static u64 readCounter(siginfo_t* siginfo, void* ucontext);
     static void signalHandler(int signo, siginfo_t* siginfo, void* ucontext);
     static void signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext);
+    static void signalHandlerBatch(int signo, siginfo_t* siginfo, void* ucontext);
+    static void drainRing(struct perf_event_mmap_page* page, int data_pages, ASGCT_CallFrame* frames);
+
+    static void initEventAttr(struct perf_event_attr* attr);
 
     int createForThread(int tid);
     void destroyForThread(int tid);
 
+    int createForCpu(int cpu, int cgroup_fd);
+    void destroyCpuEvents();
+    Error startPerCpu();
+    void stopPerCpu();
+
+    static void* readerEntry(void* perf_events) {
+        ((PerfEvents*)perf_events)->readerLoop();
+        return NULL;
+    }
+
+    void readerLoop();
+    void freeReaderBuffers();
+
   public:
     Error start(Arguments& args);
     void stop();
@@ -51,6 +86,32 @@ class PerfEvents : public CpuEngine {
     static const char* getEventName(int event_id);
 };
 
+// Counts task-clock, cycles, instructions, cache misses and context switches
+// of every thread in a perf_event group, read with PERF_FORMAT_GROUP at each CPU sample
+class PerfCounters {
+  private:
+    static int _max_groups;
+    static PerfCounterGroup* _groups;
+    static PerfEventType* _types[PERF_COUNTERS];
+    static int _group_size;
+    static bool _exclude_kernel;
+    static volatile bool _running;
+
+    static int openCounter(int counter, int tid, int group_fd);
+    static void createForThread(int tid);
+    static void destroyForThread(int tid);
+
+  public:
+    static Error start(Arguments& args);
+    static void stop();
+
+    // Returns counter deltas of the current thread since its previous read
+    static bool read(int tid, u64* deltas);
+
+    static void onThreadStart();
+    static void onThreadEnd();
+};
+
 #else
 
 class StackContext;
@@ -77,6 +138,26 @@ class PerfEvents : public CpuEngine {
     }
 };
 
+class PerfCounters {
+  public:
+    static Error start(Arguments& args) {
+        return Error("Performance counters are not supported on this platform");
+    }
+
+    static void stop() {
+    }
+
+    static bool read(int tid, u64* deltas) {
+        return false;
+    }
+
+    static void onThreadStart() {
+    }
+
+    static void onThreadEnd() {
+    }
+};
+
 #endif // __linux__
 
 #endif // _PERFEVENTS_H
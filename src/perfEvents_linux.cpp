@@ -14,6 +14,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
@@ -50,6 +52,26 @@ struct f_owner_ex {
 #define PERF_FLAG_FD_CLOEXEC  8
 #endif // PERF_FLAG_FD_CLOEXEC
 
+#ifndef PERF_FLAG_PID_CGROUP
+#define PERF_FLAG_PID_CGROUP  4
+#endif // PERF_FLAG_PID_CGROUP
+
+// Data pages of a per-CPU ring buffer, must be a power of 2
+const int CPU_RING_PAGES = 64;
+
+// The reader thread drains per-CPU rings at least this often, even if none of them is half full
+const int CPU_READER_TIMEOUT_MS = 10;
+
+// Upper estimate of a sample record with a full call chain, used to size batch rings
+const size_t MAX_RING_SAMPLE_SIZE = 1024;
+
+// Samples read from a ring are timestamped by the kernel, if it can use our clock
+#ifdef PERF_ATTR_SIZE_VER5
+const u64 RING_SAMPLE_TIME = PERF_SAMPLE_TIME;
+#else
+const u64 RING_SAMPLE_TIME = 0;
+#endif
+
 enum {
     HW_BREAKPOINT_R  = 1,
     HW_BREAKPOINT_W  = 2,
@@ -153,6 +175,47 @@ static void adjustFDLimit() {
     }
 }
 
+// Opens the cgroup directory of the current process, so that per-CPU events
+// count only tasks of this cgroup. Returns -1 for the root cgroup.
+static int openProcessCgroup() {
+    FILE* f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int fd = -1;
+    char line[PATH_MAX];
+    char dir[PATH_MAX];
+    while (fd == -1 && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = 0;
+
+        // perf_event controller may be mounted separately in cgroup v1
+        const char* path;
+        const char* roots[] = {"/sys/fs/cgroup", "/sys/fs/cgroup/unified"};
+        if (strncmp(line, "0::", 3) == 0) {
+            path = line + 3;
+        } else if ((path = strstr(line, ":perf_event:")) != NULL) {
+            path += 12;
+            roots[0] = roots[1] = "/sys/fs/cgroup/perf_event";
+        } else {
+            continue;
+        }
+
+        if (strcmp(path, "/") == 0) {
+            continue;
+        }
+
+        for (int i = 0; i < 2 && fd == -1; i++) {
+            if (snprintf(dir, sizeof(dir), "%s%s", roots[i], path) < (int)sizeof(dir)) {
+                fd = open(dir, O_RDONLY | O_CLOEXEC);
+            }
+        }
+    }
+
+    fclose(f);
+    return fd;
+}
+
 struct FunctionWithCounter {
     const char* name;
     int counter_arg;
@@ -169,7 +232,7 @@ struct PerfEventType {
 
     enum {
         IDX_CPU = 0,
-        IDX_PREDEFINED = 12,
+        IDX_PREDEFINED = 13,
         IDX_RAW,
         IDX_PMU,
         IDX_BREAKPOINT,
@@ -465,6 +528,8 @@ PerfEventType PerfEventType::AVAILABLE_EVENTS[] = {
     {"LLC-load-misses",          1000, PERF_TYPE_HW_CACHE, LOAD_MISS(PERF_COUNT_HW_CACHE_LL)},
     {"dTLB-load-misses",         1000, PERF_TYPE_HW_CACHE, LOAD_MISS(PERF_COUNT_HW_CACHE_DTLB)},
 
+    {"task-clock",   DEFAULT_INTERVAL, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+
     /* End of IDX_PREDEFINED events */
 
     {"rNNN",                     1000, PERF_TYPE_RAW, 0}, /* IDX_RAW */
@@ -497,24 +562,25 @@ class RingBuffer {
   private:
     const char* _start;
     unsigned long _offset;
+    unsigned long _mask;
 
   public:
-    RingBuffer(struct perf_event_mmap_page* page) {
+    RingBuffer(struct perf_event_mmap_page* page, unsigned long mask = OS::page_mask) : _mask(mask) {
         _start = (const char*)page + OS::page_size;
     }
 
     struct perf_event_header* seek(u64 offset) {
-        _offset = (unsigned long)offset & OS::page_mask;
+        _offset = (unsigned long)offset & _mask;
         return (struct perf_event_header*)(_start + _offset);
     }
 
     u64 next() {
-        _offset = (_offset + sizeof(u64)) & OS::page_mask;
+        _offset = (_offset + sizeof(u64)) & _mask;
         return *(u64*)(_start + _offset);
     }
 
     u64 peek(unsigned long words) {
-        unsigned long peek_offset = (_offset + words * sizeof(u64)) & OS::page_mask;
+        unsigned long peek_offset = (_offset + words * sizeof(u64)) & _mask;
         return *(u64*)(_start + peek_offset);
     }
 };
@@ -528,6 +594,14 @@ class PerfEvent : public SpinLock {
     friend class PerfEvents;
 };
 
+class PerfCounterGroup : public SpinLock {
+  private:
+    int _fd[PERF_COUNTERS];
+    u64 _last[PERF_COUNTERS];
+
+    friend class PerfCounters;
+};
+
 
 int PerfEvents::_max_events = 0;
 PerfEvent* PerfEvents::_events = NULL;
@@ -537,68 +611,90 @@ bool PerfEvents::_kernel_stack;
 bool PerfEvents::_use_perf_mmap;
 bool PerfEvents::_record_cpu;
 int PerfEvents::_target_cpu;
-
-int PerfEvents::createForThread(int tid) {
-    if (tid >= _max_events) {
-        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
-        return -1;
-    }
-
-    // Mark _events[tid] early to prevent duplicates. Real fd will be put later.
-    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
-        // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
-        return -1;
-    }
-
+int PerfEvents::_batch = 1;
+int PerfEvents::_ring_pages = 1;
+bool PerfEvents::_per_cpu = false;
+int PerfEvents::_cpu_events = 0;
+PerfEvent* PerfEvents::_cpu_event = NULL;
+u64 PerfEvents::_lost_samples;
+
+void PerfEvents::initEventAttr(struct perf_event_attr* attr) {
     PerfEventType* event_type = _event_type;
-    struct perf_event_attr attr = {0};
-    attr.size = sizeof(attr);
-    attr.type = event_type->type;
+    attr->size = sizeof(*attr);
+    attr->type = event_type->type;
 
-    if (attr.type == PERF_TYPE_BREAKPOINT) {
-        attr.bp_type = event_type->config;
+    if (attr->type == PERF_TYPE_BREAKPOINT) {
+        attr->bp_type = event_type->config;
     } else {
-        attr.config = event_type->config;
+        attr->config = event_type->config;
     }
-    attr.config1 = event_type->config1;
-    attr.config2 = event_type->config2;
+    attr->config1 = event_type->config1;
+    attr->config2 = event_type->config2;
 
     // Hardware events may not always support zero skid
-    if (attr.type == PERF_TYPE_SOFTWARE) {
-        attr.precise_ip = 2;
+    if (attr->type == PERF_TYPE_SOFTWARE) {
+        attr->precise_ip = 2;
     }
 
-    attr.sample_period = _interval;
-    attr.sample_type = PERF_SAMPLE_CALLCHAIN;
-    attr.disabled = 1;
-    attr.wakeup_events = 1;
+    attr->sample_period = _interval;
+    attr->sample_type = PERF_SAMPLE_CALLCHAIN;
+    attr->disabled = 1;
+    attr->wakeup_events = 1;
 
     if (_alluser) {
-        attr.exclude_kernel = 1;
+        attr->exclude_kernel = 1;
     }
 
     if (!_kernel_stack) {
-        attr.exclude_callchain_kernel = 1;
+        attr->exclude_callchain_kernel = 1;
     }
 
     if (_cstack >= CSTACK_FP) {
-        attr.exclude_callchain_user = 1;
+        attr->exclude_callchain_user = 1;
     }
 
 #ifdef PERF_ATTR_SIZE_VER5
     if (_cstack == CSTACK_LBR) {
-        attr.sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
-        attr.branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
-        attr.sample_regs_user = 1ULL << PERF_REG_PC;
+        attr->sample_type |= PERF_SAMPLE_BRANCH_STACK | PERF_SAMPLE_REGS_USER;
+        attr->branch_sample_type = PERF_SAMPLE_BRANCH_USER | PERF_SAMPLE_BRANCH_CALL_STACK;
+        attr->sample_regs_user = 1ULL << PERF_REG_PC;
     }
 #else
 #warning "Compiling without LBR support. Kernel headers 4.1+ required"
 #endif
 
     if (_record_cpu) {
-        attr.sample_type |= PERF_SAMPLE_CPU;
+        attr->sample_type |= PERF_SAMPLE_CPU;
     }
 
+    if (_per_cpu || _batch > 1) {
+        // Samples are read from the ring outside the signal context of the sampled thread,
+        // so each one carries its thread, time and period, and the kernel unwinds user stacks
+        attr->sample_type |= PERF_SAMPLE_TID | PERF_SAMPLE_PERIOD | RING_SAMPLE_TIME;
+        attr->exclude_callchain_user = _cstack == CSTACK_NO ? 1 : 0;
+        attr->wakeup_events = _batch;
+#ifdef PERF_ATTR_SIZE_VER5
+        attr->use_clockid = 1;
+        attr->clockid = CLOCK_MONOTONIC;
+#endif
+    }
+}
+
+int PerfEvents::createForThread(int tid) {
+    if (tid >= _max_events) {
+        Log::warn("tid[%d] > pid_max[%d]. Restart profiler after changing pid_max", tid, _max_events);
+        return -1;
+    }
+
+    // Mark _events[tid] early to prevent duplicates. Real fd will be put later.
+    if (!__sync_bool_compare_and_swap(&_events[tid]._fd, 0, -1)) {
+        // Lost race. The event is created either from PerfEvents::start() or from pthread hook.
+        return -1;
+    }
+
+    struct perf_event_attr attr = {0};
+    initEventAttr(&attr);
+
     int fd;
     if (FdTransferClient::hasPeer()) {
         fd = FdTransferClient::requestPerfFd(&tid, _target_cpu, &attr, PerfEventType::probe_func);
@@ -623,10 +719,17 @@ int PerfEvents::createForThread(int tid) {
 
     void* page = NULL;
     if (_use_perf_mmap) {
-        page = mmap(NULL, 2 * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        page = mmap(NULL, (1 + _ring_pages) * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
         if (page == MAP_FAILED) {
-            Log::warn("perf_event mmap failed: %s", strerror(errno));
+            int err = errno;
+            Log::warn("perf_event mmap failed: %s", strerror(err));
             page = NULL;
+            if (_batch > 1) {
+                // Batched samples are read only from the ring buffer, and would be lost
+                close(fd);
+                _events[tid]._fd = 0;
+                return err;
+            }
         }
     }
 
@@ -642,7 +745,7 @@ int PerfEvents::createForThread(int tid) {
     if (fcntl(fd, F_SETFL, O_ASYNC) < 0 || fcntl(fd, F_SETSIG, _signal) < 0 || fcntl(fd, F_SETOWN_EX, &ex) < 0) {
         err = errno;
         Log::warn("perf_event fcntl failed: %s", strerror(err));
-    } else if (ioctl(fd, PERF_EVENT_IOC_RESET, 0) < 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) < 0) {
+    } else if (ioctl(fd, PERF_EVENT_IOC_RESET, 0) < 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, _batch) < 0) {
         err = errno;
         Log::warn("perf_event ioctl failed: %s", strerror(err));
     } else {
@@ -651,7 +754,7 @@ int PerfEvents::createForThread(int tid) {
 
     // Failed to setup perf_event - rollback changes
     if (page != NULL) {
-        munmap(page, 2 * OS::page_size);
+        munmap(page, (1 + _ring_pages) * OS::page_size);
         _events[tid]._page = NULL;
     }
     close(fd);
@@ -673,12 +776,275 @@ void PerfEvents::destroyForThread(int tid) {
     }
     if (event->_page != NULL) {
         event->lock();
-        munmap(event->_page, 2 * OS::page_size);
+        munmap(event->_page, (1 + _ring_pages) * OS::page_size);
         event->_page = NULL;
         event->unlock();
     }
 }
 
+int PerfEvents::createForCpu(int cpu, int cgroup_fd) {
+    struct perf_event_attr attr = {0};
+    initEventAttr(&attr);
+
+    // Samples of all threads share one ring, which is drained when half full
+    attr.watermark = 1;
+    attr.wakeup_watermark = CPU_RING_PAGES * OS::page_size / 2;
+
+    int fd = -1;
+    if (cgroup_fd != -1) {
+        fd = syscall(__NR_perf_event_open, &attr, cgroup_fd, cpu, -1, PERF_FLAG_FD_CLOEXEC | PERF_FLAG_PID_CGROUP);
+    }
+    if (fd == -1) {
+        fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd == -1) {
+        return errno;
+    }
+
+    void* page = mmap(NULL, (1 + CPU_RING_PAGES) * OS::page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (page == MAP_FAILED) {
+        int err = errno;
+        Log::warn("perf_event mmap failed: %s", strerror(err));
+        close(fd);
+        return err;
+    }
+
+    _cpu_event[cpu]._fd = fd;
+    _cpu_event[cpu]._page = (struct perf_event_mmap_page*)page;
+    return 0;
+}
+
+void PerfEvents::destroyCpuEvents() {
+    for (int cpu = 0; cpu < _cpu_events; cpu++) {
+        PerfEvent* event = &_cpu_event[cpu];
+        if (event->_page != NULL) {
+            munmap(event->_page, (1 + CPU_RING_PAGES) * OS::page_size);
+            event->_page = NULL;
+        }
+        if (event->_fd > 0) {
+            close(event->_fd);
+            event->_fd = 0;
+        }
+    }
+}
+
+Error PerfEvents::startPerCpu() {
+    if (FdTransferClient::hasPeer()) {
+        return Error("percpu mode cannot be used with fdtransfer");
+    }
+
+    int cpu_events = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpu_events != _cpu_events) {
+        free(_cpu_event);
+        _cpu_event = (PerfEvent*)calloc(cpu_events, sizeof(PerfEvent));
+        _cpu_events = _cpu_event != NULL ? cpu_events : 0;
+        if (_cpu_event == NULL) {
+            return Error("Not enough memory for per-CPU perf events");
+        }
+    }
+
+    int cgroup_fd = openProcessCgroup();
+    int created = 0;
+    int err = 0;
+    for (int cpu = 0; cpu < _cpu_events; cpu++) {
+        if (_target_cpu >= 0 && cpu != _target_cpu) {
+            continue;
+        }
+        int result = createForCpu(cpu, cgroup_fd);
+        if (result == 0) {
+            created++;
+        } else if (result != ENODEV) {
+            // ENODEV means the CPU is offline; any other error is fatal
+            err = result;
+            break;
+        }
+    }
+    if (cgroup_fd != -1) {
+        close(cgroup_fd);
+    }
+
+    if (err != 0 || created == 0) {
+        destroyCpuEvents();
+        if (err == EACCES || err == EPERM) {
+            return Error("Per-CPU perf events unavailable. Try 'sysctl kernel.perf_event_paranoid=0' or CAP_PERFMON");
+        }
+        return Error("Per-CPU perf events unavailable");
+    }
+
+    // convertNativeTrace may add a pseudo frame next to a native one
+    _reader_frames = (ASGCT_CallFrame*)malloc((MAX_NATIVE_FRAMES * 2 + RESERVED_FRAMES) * sizeof(ASGCT_CallFrame));
+    _reader_fds = (struct pollfd*)calloc(_cpu_events, sizeof(struct pollfd));
+    if (_reader_frames == NULL || _reader_fds == NULL) {
+        freeReaderBuffers();
+        destroyCpuEvents();
+        return Error("Not enough memory for perf_events reader thread");
+    }
+
+    _lost_samples = 0;
+    _running = true;
+    if (pthread_create(&_reader, NULL, readerEntry, this) != 0) {
+        _running = false;
+        freeReaderBuffers();
+        destroyCpuEvents();
+        return Error("Unable to create perf_events reader thread");
+    }
+
+    for (int cpu = 0; cpu < _cpu_events; cpu++) {
+        if (_cpu_event[cpu]._fd > 0) {
+            ioctl(_cpu_event[cpu]._fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    return Error::OK;
+}
+
+void PerfEvents::stopPerCpu() {
+    for (int cpu = 0; cpu < _cpu_events; cpu++) {
+        if (_cpu_event[cpu]._fd > 0) {
+            ioctl(_cpu_event[cpu]._fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    if (_running) {
+        _running = false;
+        pthread_join(_reader, NULL);
+    }
+    freeReaderBuffers();
+    destroyCpuEvents();
+
+    if (_lost_samples > 0) {
+        Log::warn("Per-CPU perf_event rings overflowed, %llu samples lost", (unsigned long long)_lost_samples);
+    }
+}
+
+// Converts a call chain unwound by the kernel. Unlike a signal handler,
+// the reader thread cannot call AsyncGetCallTrace for the sampled thread,
+// so compiled Java frames are resolved directly from the CodeHeap.
+static int convertCallchain(int depth, const void** callchain, ASGCT_CallFrame* frames) {
+    Profiler* profiler = Profiler::instance();
+    int num_frames = 0;
+    int native_start = 0;
+
+    for (int i = 0; i < depth; i++) {
+        if (!CodeHeap::contains(callchain[i])) {
+            continue;
+        }
+
+        num_frames += profiler->convertNativeTrace(i - native_start, callchain + native_start, frames + num_frames, PERF_SAMPLE);
+        native_start = i + 1;
+
+        NMethod* nmethod = CodeHeap::findNMethod(callchain[i]);
+        if (nmethod == NULL) {
+            continue;
+        } else if (nmethod->isNMethod() && nmethod->isAlive() && VMStructs::hasMethodStructs()) {
+            VMMethod* method = nmethod->method();
+            jmethodID method_id = method != NULL ? method->id() : NULL;
+            if (method_id != NULL) {
+                frames[num_frames].bci = FrameType::encode(FRAME_JIT_COMPILED, 0);
+                frames[num_frames].method_id = method_id;
+                num_frames++;
+                continue;
+            }
+        }
+        frames[num_frames].bci = BCI_NATIVE_FRAME;
+        frames[num_frames].method_id = (jmethodID)nmethod->name();
+        num_frames++;
+    }
+
+    return num_frames + profiler->convertNativeTrace(depth - native_start, callchain + native_start, frames + num_frames, PERF_SAMPLE);
+}
+
+// Records every sample queued in the ring; the ring is not accessed concurrently
+void PerfEvents::drainRing(struct perf_event_mmap_page* page, int data_pages, ASGCT_CallFrame* frames) {
+    u64 tail = page->data_tail;
+    u64 head = page->data_head;
+    rmb();
+
+    RingBuffer ring(page, data_pages * OS::page_size - 1);
+    int pid = OS::processId();
+    const void* callchain[MAX_NATIVE_FRAMES];
+
+    while (tail < head) {
+        struct perf_event_header* hdr = ring.seek(tail);
+        tail += hdr->size;
+
+        if (hdr->type == PERF_RECORD_LOST) {
+            ring.next();
+            atomicInc(_lost_samples, ring.next());
+            continue;
+        } else if (hdr->type != PERF_RECORD_SAMPLE || !_enabled) {
+            continue;
+        }
+
+        // Records are laid out in the order of sample_type bits
+        u64 pid_tid = ring.next();
+        if ((int)(u32)pid_tid != pid) {
+            continue;
+        }
+        int tid = (int)(pid_tid >> 32);
+        u64 time = RING_SAMPLE_TIME ? ring.next() : 0;
+        u64 cpu = _record_cpu ? ring.next() : 0;
+        u64 counter = ring.next();
+
+        int depth = 0;
+        for (u64 nr = ring.next(); nr > 0; nr--) {
+            u64 ip = ring.next();
+            if (ip < PERF_CONTEXT_MAX && depth < MAX_NATIVE_FRAMES) {
+                callchain[depth++] = (const void*)ip;
+            }
+        }
+
+        int num_frames = convertCallchain(depth, callchain, frames);
+        if (_record_cpu) {
+            frames[num_frames].bci = BCI_CPU;
+            frames[num_frames].method_id = (jmethodID)(uintptr_t)((u32)cpu | 0x8000);
+            num_frames++;
+        }
+
+        // Convert CLOCK_MONOTONIC time of the sample to the clock of other events
+        u64 start_time = TSC::ticks();
+        u64 now = OS::nanotime();
+        if (time != 0 && time < now) {
+            start_time -= (u64)((double)(now - time) * TSC::frequency() / NANOTIME_FREQ);
+        }
+
+        ExecutionEvent execution_event(start_time);
+        execution_event._thread_state = THREAD_RUNNING;
+        Profiler::instance()->recordExternalSample(counter, tid, PERF_SAMPLE, &execution_event, num_frames, frames);
+    }
+
+    __atomic_store_n(&page->data_tail, head, __ATOMIC_RELEASE);
+}
+
+void PerfEvents::freeReaderBuffers() {
+    free(_reader_fds);
+    free(_reader_frames);
+    _reader_fds = NULL;
+    _reader_frames = NULL;
+}
+
+void PerfEvents::readerLoop() {
+    ASGCT_CallFrame* frames = _reader_frames;
+    struct pollfd* fds = _reader_fds;
+
+    int nfds = 0;
+    for (int cpu = 0; cpu < _cpu_events; cpu++) {
+        if (_cpu_event[cpu]._fd > 0) {
+            fds[nfds].fd = _cpu_event[cpu]._fd;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+    }
+
+    while (_running) {
+        poll(fds, nfds, CPU_READER_TIMEOUT_MS);
+        for (int cpu = 0; cpu < _cpu_events; cpu++) {
+            if (_cpu_event[cpu]._page != NULL) {
+                drainRing(_cpu_event[cpu]._page, CPU_RING_PAGES, frames);
+            }
+        }
+    }
+}
+
 u64 PerfEvents::readCounter(siginfo_t* siginfo, void* ucontext) {
     switch (_event_type->counter_arg) {
         case 1: return StackFrame(ucontext).arg0();
@@ -730,6 +1096,26 @@ void PerfEvents::signalHandlerJ9(int signo, siginfo_t* siginfo, void* ucontext)
     ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, 1);
 }
 
+void PerfEvents::signalHandlerBatch(int signo, siginfo_t* siginfo, void* ucontext) {
+    if (siginfo->si_code <= 0) {
+        // Looks like an external signal; don't treat as a profiling event
+        return;
+    }
+
+    PerfEvent* event = &_events[OS::threadId()];
+    if (event->tryLock()) {
+        if (event->_page != NULL) {
+            // convertNativeTrace may add a pseudo frame next to a native one
+            ASGCT_CallFrame frames[MAX_NATIVE_FRAMES * 2 + RESERVED_FRAMES];
+            drainRing(event->_page, _ring_pages, frames);
+        }
+        event->unlock();
+    }
+
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(siginfo->si_fd, PERF_EVENT_IOC_REFRESH, _batch);
+}
+
 const char* PerfEvents::title() {
     if (_event_type == NULL || strcmp(_event_type->name, "cpu-clock") == 0) {
         return "CPU profile";
@@ -779,6 +1165,29 @@ Error PerfEvents::start(Arguments& args) {
     }
     _use_perf_mmap = _kernel_stack || _cstack == CSTACK_DEFAULT || _cstack == CSTACK_LBR || _record_cpu;
 
+    _per_cpu = args._per_cpu;
+    _batch = _per_cpu ? 1 : args._perf_batch;
+    if (_per_cpu || _batch > 1) {
+        if (_event_type->counter_arg > 0) {
+            return Error("Function arguments cannot be counted in percpu or perfbatch mode");
+        } else if (_cstack != CSTACK_DEFAULT && _cstack != CSTACK_FP && _cstack != CSTACK_NO) {
+            return Error("percpu and perfbatch modes support only frame pointer stack walking");
+        } else if (VM::isOpenJ9()) {
+            return Error("percpu and perfbatch modes are not supported on OpenJ9");
+        }
+        _use_perf_mmap = true;
+    }
+
+    if (_per_cpu) {
+        return startPerCpu();
+    }
+
+    // Leave enough room for a batch of samples with deep call chains
+    _ring_pages = 1;
+    while (_ring_pages < CPU_RING_PAGES && _ring_pages * OS::page_size < _batch * MAX_RING_SAMPLE_SIZE) {
+        _ring_pages *= 2;
+    }
+
     adjustFDLimit();
 
     int max_events = OS::getMaxThreadId();
@@ -795,7 +1204,7 @@ Error PerfEvents::start(Arguments& args) {
             return error;
         }
     } else {
-        OS::installSignalHandler(_signal, signalHandler);
+        OS::installSignalHandler(_signal, _batch > 1 ? signalHandlerBatch : signalHandler);
     }
 
     // Enable pthread hook before traversing currently running threads
@@ -817,6 +1226,11 @@ Error PerfEvents::start(Arguments& args) {
 }
 
 void PerfEvents::stop() {
+    if (_per_cpu) {
+        stopPerCpu();
+        return;
+    }
+
     disableThreadHook();
     for (int i = 0; i < _max_events; i++) {
         destroyForThread(i);
@@ -948,6 +1362,184 @@ bool PerfEvents::supported() {
     return true;
 }
 
+PerfCounterGroup* PerfCounters::_groups = NULL;
+int PerfCounters::_max_groups = 0;
+PerfEventType* PerfCounters::_types[PERF_COUNTERS];
+int PerfCounters::_group_size = 0;
+bool PerfCounters::_exclude_kernel;
+volatile bool PerfCounters::_running = false;
+
+// Counter events in the order of PerfCounterId. The first one leads the group
+static const char* const COUNTER_EVENTS[PERF_COUNTERS] = {
+    "task-clock", "cycles", "instructions", "cache-misses", "context-switches"
+};
+
+int PerfCounters::openCounter(int counter, int tid, int group_fd) {
+    struct perf_event_attr attr = {0};
+    attr.size = sizeof(attr);
+    attr.type = _types[counter]->type;
+    attr.config = _types[counter]->config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = _exclude_kernel;
+    attr.exclude_hv = 1;
+
+    return syscall(__NR_perf_event_open, &attr, tid, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+void PerfCounters::createForThread(int tid) {
+    if (tid >= _max_groups) {
+        return;
+    }
+
+    // Mark the group early to prevent duplicates, like in PerfEvents::createForThread
+    PerfCounterGroup* group = &_groups[tid];
+    if (!__sync_bool_compare_and_swap(&group->_fd[0], 0, -1)) {
+        return;
+    }
+
+    int fd[PERF_COUNTERS] = {0};
+    if ((fd[0] = openCounter(0, tid, -1)) < 0) {
+        group->_fd[0] = 0;
+        return;
+    }
+    for (int i = 1; i < PERF_COUNTERS; i++) {
+        if (_types[i] != NULL && (fd[i] = openCounter(i, tid, fd[0])) < 0) {
+            // The group layout must match the one probed at start
+            while (--i >= 0) {
+                if (fd[i] > 0) close(fd[i]);
+            }
+            group->_fd[0] = 0;
+            return;
+        }
+    }
+
+    memset(group->_last, 0, sizeof(group->_last));
+    for (int i = PERF_COUNTERS - 1; i >= 0; i--) {
+        group->_fd[i] = fd[i];
+    }
+}
+
+void PerfCounters::destroyForThread(int tid) {
+    if (tid >= _max_groups) {
+        return;
+    }
+
+    PerfCounterGroup* group = &_groups[tid];
+    int leader = group->_fd[0];
+    if (leader > 0 && __sync_bool_compare_and_swap(&group->_fd[0], leader, 0)) {
+        group->lock();
+        for (int i = 1; i < PERF_COUNTERS; i++) {
+            if (group->_fd[i] > 0) {
+                close(group->_fd[i]);
+                group->_fd[i] = 0;
+            }
+        }
+        close(leader);
+        group->unlock();
+    }
+}
+
+Error PerfCounters::start(Arguments& args) {
+    for (int i = 0; i < PERF_COUNTERS; i++) {
+        _types[i] = PerfEventType::forName(COUNTER_EVENTS[i]);
+    }
+
+    // Probe which counters are available on this machine
+    _exclude_kernel = args._alluser;
+    int leader = openCounter(0, 0, -1);
+    if (leader < 0 && (errno == EACCES || errno == EPERM) && !_exclude_kernel) {
+        _exclude_kernel = true;
+        leader = openCounter(0, 0, -1);
+    }
+    if (leader < 0) {
+        return Error("Performance counters unavailable. Try 'sysctl kernel.perf_event_paranoid=1'");
+    }
+
+    _group_size = 1;
+    for (int i = 1; i < PERF_COUNTERS; i++) {
+        int fd = openCounter(i, 0, leader);
+        if (fd < 0) {
+            Log::warn("%s counter is not available: %s", COUNTER_EVENTS[i], strerror(errno));
+            _types[i] = NULL;
+        } else {
+            close(fd);
+            _group_size++;
+        }
+    }
+    close(leader);
+
+    // Each thread consumes a file descriptor per counter
+    adjustFDLimit();
+
+    int max_groups = OS::getMaxThreadId();
+    if (max_groups != _max_groups) {
+        free(_groups);
+        _groups = (PerfCounterGroup*)calloc(max_groups, sizeof(PerfCounterGroup));
+        _max_groups = max_groups;
+    }
+
+    // Enable the thread hook before traversing currently running threads
+    __atomic_store_n(&_running, true, __ATOMIC_RELEASE);
+
+    ThreadList* thread_list = OS::listThreads();
+    while (thread_list->hasNext()) {
+        createForThread(thread_list->next());
+    }
+    delete thread_list;
+
+    return Error::OK;
+}
+
+void PerfCounters::stop() {
+    if (!__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&_running, false, __ATOMIC_RELEASE);
+    for (int i = 0; i < _max_groups; i++) {
+        destroyForThread(i);
+    }
+}
+
+bool PerfCounters::read(int tid, u64* deltas) {
+    if (tid >= _max_groups) {
+        return false;
+    }
+
+    PerfCounterGroup* group = &_groups[tid];
+    if (!group->tryLock()) {
+        return false;  // the group is being destroyed
+    }
+
+    // PERF_FORMAT_GROUP layout: the number of counters, then their values in the order of creation
+    u64 values[1 + PERF_COUNTERS];
+    bool result = false;
+    int fd = group->_fd[0];
+    if (fd > 0 && ::read(fd, values, sizeof(values)) == (ssize_t)((1 + _group_size) * sizeof(u64))) {
+        for (int i = 0, slot = 1; i < PERF_COUNTERS; i++) {
+            u64 value = _types[i] != NULL ? values[slot++] : 0;
+            deltas[i] = value - group->_last[i];
+            group->_last[i] = value;
+        }
+        result = true;
+    }
+
+    group->unlock();
+    return result;
+}
+
+void PerfCounters::onThreadStart() {
+    if (__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        createForThread(OS::threadId());
+    }
+}
+
+void PerfCounters::onThreadEnd() {
+    if (__atomic_load_n(&_running, __ATOMIC_ACQUIRE)) {
+        destroyForThread(OS::threadId());
+    }
+}
+
 const char* PerfEvents::getEventName(int event_id) {
     if (event_id >= 0 && (size_t)event_id < sizeof(PerfEventType::AVAILABLE_EVENTS) / sizeof(PerfEventType)) {
         return PerfEventType::AVAILABLE_EVENTS[event_id].name;
@@ -13,7 +13,6 @@
 #include <string.h>
 #include <sys/param.h>
 #include <time.h>
-#include "index.h"
 #include "profiler.h"
 #include "perfEvents.h"
 #include "ctimer.h"
@@ -33,11 +32,13 @@
 #include "fdtransferClient.h"
 #include "frameName.h"
 #include "os.h"
-#include "otlp.h"
+#include "otlpWriter.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
 #include "stackWalker.h"
 #include "symbols.h"
+#include "threadLocalData.h"
+#include "traceNames.h"
 #include "tsc.h"
 #include "vmStructs.h"
 
@@ -116,6 +117,42 @@ static inline int makeFrame(ASGCT_CallFrame* frames, jint type, const char* id)
     return makeFrame(frames, type, (jmethodID)id);
 }
 
+// Folds frames into the call trace hash right after a stack walker has produced them,
+// while they are still hot in cache. A timed hash accumulates the time of all steps.
+class FrameHasher {
+  private:
+    CallTraceHasher _hasher;
+    const ASGCT_CallFrame* _frames;
+    int _hashed_frames;
+    bool _timed;
+    u64 _time;
+
+  public:
+    FrameHasher(const ASGCT_CallFrame* frames, bool timed) :
+        _hasher(), _frames(frames), _hashed_frames(0), _timed(timed), _time(0) {
+    }
+
+    // Hashes frames added since the previous call
+    void update(int num_frames) {
+        u64 begin = _timed ? OS::nanotime() : 0;
+        _hasher.update(_frames + _hashed_frames, num_frames - _hashed_frames);
+        _hashed_frames = num_frames;
+        if (_timed) _time += OS::nanotime() - begin;
+    }
+
+    u64 finish() const {
+        return _hasher.finish();
+    }
+
+    bool timed() const {
+        return _timed;
+    }
+
+    u64 time() const {
+        return _time;
+    }
+};
+
 
 void Profiler::addJavaMethod(const void* address, int length, jmethodID method) {
     CodeHeap::updateBounds(address, (const char*)address + length);
@@ -123,7 +160,8 @@ void Profiler::addJavaMethod(const void* address, int length, jmethodID method)
 
 void Profiler::addRuntimeStub(const void* address, int length, const char* name) {
     _stubs_lock.lock();
-    _runtime_stubs.add(address, length, name, true);
+    char* stub_name = _runtime_stubs.add(address, length, name, true);
+    _runtime_stub_index.add(address, (const char*)address + length, stub_name);
     _stubs_lock.unlock();
 
     if (strcmp(name, "call_stub") == 0) {
@@ -138,6 +176,9 @@ void Profiler::onThreadStart(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     if (_thread_filter.enabled()) {
         _thread_filter.remove(OS::threadId());
     }
+    WallClock::onThreadStart();
+    PerfCounters::onThreadStart();
+    initSampleContext();
     updateThreadName(jvmti, jni, thread);
 }
 
@@ -145,6 +186,9 @@ void Profiler::onThreadEnd(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread) {
     if (_thread_filter.enabled()) {
         _thread_filter.remove(OS::threadId());
     }
+    WallClock::onThreadEnd();
+    PerfCounters::onThreadEnd();
+    releaseSampleContext();
     updateThreadName(jvmti, jni, thread);
 }
 
@@ -189,9 +233,30 @@ inline u32 Profiler::getLockIndex(int tid) {
     u32 lock_index = tid;
     lock_index ^= lock_index >> 8;
     lock_index ^= lock_index >> 4;
-    return lock_index % CONCURRENCY_LEVEL;
+    return lock_index % _concurrency_level;
 }
 
+// Lock one of the stripes assigned to the thread. The index is validated after locking:
+// a stripe above the current concurrency level may be held by a signal handler that computed
+// its index before the level was lowered, whereas lockAll() covers only the current level
+bool Profiler::tryLockStripe(int tid, u32* lock_index) {
+    u32 index = getLockIndex(tid);
+    if (!_locks[index].tryLock() &&
+        !_locks[index = (index + 1) % _concurrency_level].tryLock() &&
+        !_locks[index = (index + 2) % _concurrency_level].tryLock()) {
+        return false;
+    }
+
+    if (index >= (u32)_concurrency_level) {
+        _locks[index].unlock();
+        return false;
+    }
+
+    *lock_index = index;
+    return true;
+}
+
+
 void Profiler::updateSymbols(bool kernel_symbols) {
     Symbols::parseLibraries(&_native_libs, kernel_symbols);
 }
@@ -276,13 +341,7 @@ CodeCache* Profiler::findLibraryByName(const char* lib_name) {
 }
 
 CodeCache* Profiler::findLibraryByAddress(const void* address) {
-    const int native_lib_count = _native_libs.count();
-    for (int i = 0; i < native_lib_count; i++) {
-        if (_native_libs[i]->contains(address)) {
-            return _native_libs[i];
-        }
-    }
-    return NULL;
+    return _native_libs.findByAddress(address);
 }
 
 const char* Profiler::findNativeMethod(const void* address) {
@@ -291,7 +350,7 @@ const char* Profiler::findNativeMethod(const void* address) {
 }
 
 CodeBlob* Profiler::findRuntimeStub(const void* address) {
-    return _runtime_stubs.findBlobByAddress(address);
+    return _runtime_stub_index.find(address);
 }
 
 bool Profiler::isAddressInCode(const void* pc) {
@@ -323,7 +382,12 @@ int Profiler::getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType
     } else if (_cstack == CSTACK_VM) {
         return 0;
     } else if (_cstack == CSTACK_DWARF) {
+        u64 walk_begin = _features.stats ? OS::nanotime() : 0;
         native_frames = StackWalker::walkDwarf(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
+        if (walk_begin != 0) {
+            atomicInc(_total_dwarf_walk_time, OS::nanotime() - walk_begin);
+            atomicInc(_total_dwarf_frames, native_frames);
+        }
     } else {
         native_frames = StackWalker::walkFP(ucontext, callchain, MAX_NATIVE_FRAMES, java_ctx);
     }
@@ -604,29 +668,14 @@ void Profiler::fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod*
     }
 }
 
-u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Event* event) {
-    atomicInc(_total_samples);
-
-    int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
-        // Too many concurrent signals already
-        atomicInc(_failures[-ticks_skipped]);
-
-        if (event_type == PERF_SAMPLE) {
-            // Need to reset PerfEvents ring buffer, even though we discard the collected trace
-            PerfEvents::resetBuffer(tid);
-        }
-        return 0;
-    }
-
+int Profiler::getStackTrace(void* ucontext, CallTraceBuffer* buffer, int tid, EventType event_type, Event* event, u64* hash) {
     u64 stack_walk_begin = _features.stats ? OS::nanotime() : 0;
 
-    ASGCT_CallFrame* frames = _calltrace_buffer[lock_index]->_asgct_frames;
-    jvmtiFrameInfo* jvmti_frames = _calltrace_buffer[lock_index]->_jvmti_frames;
+    ASGCT_CallFrame* frames = buffer->_asgct_frames;
+    jvmtiFrameInfo* jvmti_frames = buffer->_jvmti_frames;
+
+    // Timing every hash step would double the clock reads per sample, so only a subset is timed
+    FrameHasher hasher(frames, stack_walk_begin != 0 && _total_samples % HASH_TIMING_PERIOD == 0);
 
     int num_frames = 0;
     if (_add_event_frame && event_type >= ALLOC_SAMPLE && event_type <= PARK_SAMPLE) {
@@ -647,6 +696,7 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
             num_frames += getNativeTrace(ucontext, frames + num_frames, event_type, tid, &java_ctx);
         }
     }
+    hasher.update(num_frames);
 
     if (_features.mixed) {
         num_frames += StackWalker::walkVM(ucontext, frames + num_frames, _max_stack_depth, _features, event_type);
@@ -676,6 +726,7 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         int start_depth = event_type == INSTRUMENTED_METHOD ? 1 : event_type == METHOD_TRACE ? 2 : 0;
         num_frames += getJavaTraceJvmti(jvmti_frames + num_frames, frames + num_frames, start_depth, _max_stack_depth);
     }
+    hasher.update(num_frames);
 
     if (num_frames == 0) {
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, "no_Java_frame");
@@ -691,12 +742,127 @@ u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Ev
         num_frames += makeFrame(frames + num_frames, BCI_CPU, java_ctx.cpu | 0x8000);
     }
 
+    hasher.update(num_frames);
+    *hash = hasher.finish();
+
     if (stack_walk_begin != 0) {
-        u64 stack_walk_end = OS::nanotime();
-        atomicInc(_total_stack_walk_time, stack_walk_end - stack_walk_begin);
+        atomicInc(_total_stack_walk_time, OS::nanotime() - stack_walk_begin);
+        if (hasher.timed()) {
+            atomicInc(_total_hash_time, hasher.time());
+            atomicInc(_timed_hashes);
+        }
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
+    return num_frames;
+}
+
+CallTraceBuffer* Profiler::getThreadBuffer(SampleContext* ctx) {
+    if (ctx->frames == NULL) {
+        size_t size = (_max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES) * sizeof(CallTraceBuffer);
+        if ((ctx->frames = OS::safeAlloc(size)) != NULL) {
+            ctx->frames_size = size;
+        }
+    }
+    return (CallTraceBuffer*)ctx->frames;
+}
+
+// Called when a thread starts. Threads that existed before the profiler started
+// have no context and record samples through the shared lock-striped buffers.
+void Profiler::initSampleContext() {
+    if (!_thread_buffers || _state != RUNNING || ThreadLocalData::getSampleContext() != NULL) {
+        return;
+    }
+
+    // New contexts are registered only under a stripe lock, so that lockAll() covers all of them.
+    // Do not wait for the lock: the thread may be started by the holder of lockAll()
+    int tid = OS::threadId();
+    u32 lock_index;
+    if (tryLockStripe(tid, &lock_index)) {
+        ThreadLocalData::initSampleContext(tid);
+        _locks[lock_index].unlock();
+    }
+}
+
+// Called when a thread terminates. A signal arriving meanwhile fails to lock
+// the context and falls back to the shared buffers.
+void Profiler::releaseSampleContext() {
+    SampleContext* ctx = ThreadLocalData::getSampleContext();
+    if (ctx == NULL) {
+        return;
+    }
+
+    // The context is locked by lockAll(), whose holder may be waiting for this thread to terminate.
+    // In this case, the buffers are left to the next owner of the context
+    if (ctx->lock.tryLock()) {
+        _jfr.releaseThreadBuffer(ctx);
+        if (ctx->frames != NULL) {
+            OS::safeFree(ctx->frames, ctx->frames_size);
+            ctx->frames = NULL;
+        }
+        ctx->lock.unlock();
+    }
+
+    ThreadLocalData::releaseSampleContext(ctx);
+}
+
+void Profiler::releaseThreadBuffers() {
+    for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) {
+        if (ctx->frames != NULL) {
+            OS::safeFree(ctx->frames, ctx->frames_size);
+            ctx->frames = NULL;
+        }
+    }
+}
+
+u64 Profiler::recordSample(void* ucontext, u64 counter, EventType event_type, Event* event) {
+    atomicInc(_total_samples);
+
+    int tid = OS::threadId();
+
+    // Reading counters consumes their deltas, so they are read only after a sample slot is locked
+    u64 counters[PERF_COUNTERS];
+    bool read_counters = _perf_counters && event_type <= EXECUTION_SAMPLE;
+
+    // With per-thread buffers, a thread competes for a shared lock only when it has no context,
+    // or when a signal interrupts another sample. Contexts are never created in a signal handler.
+    SampleContext* ctx = _thread_buffers ? ThreadLocalData::getSampleContext() : NULL;
+    if (ctx != NULL && ctx->lock.tryLock()) {
+        CallTraceBuffer* buffer = getThreadBuffer(ctx);
+        if (buffer != NULL) {
+            if (read_counters && PerfCounters::read(tid, counters)) {
+                ((ExecutionEvent*)event)->_counters = counters;
+            }
+
+            u64 hash;
+            int num_frames = getStackTrace(ucontext, buffer, tid, event_type, event, &hash);
+            u32 call_trace_id = _call_trace_storage.put(num_frames, buffer->_asgct_frames, counter, getLockIndex(tid), hash);
+            _jfr.recordEvent(ctx, tid, call_trace_id, event_type, event);
+
+            ctx->lock.unlock();
+            return (u64)tid << 32 | call_trace_id;
+        }
+        ctx->lock.unlock();
+    }
+
+    u32 lock_index;
+    if (!tryLockStripe(tid, &lock_index)) {
+        // Too many concurrent signals already
+        atomicInc(_failures[-ticks_skipped]);
+
+        if (event_type == PERF_SAMPLE) {
+            // Need to reset PerfEvents ring buffer, even though we discard the collected trace
+            PerfEvents::resetBuffer(tid);
+        }
+        return 0;
+    }
+
+    if (read_counters && PerfCounters::read(tid, counters)) {
+        ((ExecutionEvent*)event)->_counters = counters;
+    }
+
+    u64 hash;
+    int num_frames = getStackTrace(ucontext, _calltrace_buffer[lock_index], tid, event_type, event, &hash);
+    u32 call_trace_id = _call_trace_storage.put(num_frames, _calltrace_buffer[lock_index]->_asgct_frames, counter, lock_index, hash);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
 
     _locks[lock_index].unlock();
@@ -713,34 +879,30 @@ void Profiler::recordExternalSample(u64 counter, int tid, EventType event_type,
         num_frames += makeFrame(frames + num_frames, BCI_ERROR, OS::schedPolicy(tid));
     }
 
-    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter);
-
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    // The storage is accessed under a stripe lock, since call traces may be evicted under lockAll()
+    u32 lock_index;
+    if (!tryLockStripe(tid, &lock_index)) {
         // Too many concurrent signals already
         atomicInc(_failures[-ticks_skipped]);
         return;
     }
 
+    u32 call_trace_id = _call_trace_storage.put(num_frames, frames, counter, lock_index);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
 
     _locks[lock_index].unlock();
 }
 
 void Profiler::recordExternalSamples(u64 samples, u64 counter, int tid, u32 call_trace_id, EventType event_type, Event* event) {
-    _call_trace_storage.add(call_trace_id, samples, counter);
-
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    u32 lock_index;
+    if (!tryLockStripe(tid, &lock_index)) {
+        // Do not wait for lockAll(): wall clock sampling must not stall while a profile is dumped
+        atomicInc(_failures[-ticks_skipped]);
         return;
     }
 
+    // A cached call trace may have been evicted since it was recorded
+    call_trace_id = _call_trace_storage.add(call_trace_id, samples, counter);
     _jfr.recordEvent(lock_index, tid, call_trace_id, event_type, event);
 
     _locks[lock_index].unlock();
@@ -752,11 +914,8 @@ void Profiler::recordEventOnly(EventType event_type, Event* event) {
     }
 
     int tid = OS::threadId();
-    u32 lock_index = getLockIndex(tid);
-    if (!_locks[lock_index].tryLock() &&
-        !_locks[lock_index = (lock_index + 1) % CONCURRENCY_LEVEL].tryLock() &&
-        !_locks[lock_index = (lock_index + 2) % CONCURRENCY_LEVEL].tryLock())
-    {
+    u32 lock_index;
+    if (!tryLockStripe(tid, &lock_index)) {
         return;
     }
 
@@ -1110,20 +1269,47 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    if (args._compress && args._output != OUTPUT_JFR) {
+        return Error("compress requires JFR output format");
+    }
+
     // Save the arguments for shutdown or restart
     args.save();
 
+    // One lock stripe per CPU: more stripes than CPUs do not reduce contention,
+    // while every stripe costs a calltrace buffer and a JFR recording buffer
+    int concurrency_level = OS::getCpuCount();
+    if (concurrency_level < MIN_CONCURRENCY_LEVEL) {
+        concurrency_level = MIN_CONCURRENCY_LEVEL;
+    } else if (concurrency_level > MAX_CONCURRENCY_LEVEL) {
+        concurrency_level = MAX_CONCURRENCY_LEVEL;
+    }
+
     if (reset || _start_time == 0) {
         // Reset counters
         _total_samples = 0;
         _total_stack_walk_time = 0;
+        _total_hash_time = 0;
+        _timed_hashes = 0;
+        _total_dwarf_walk_time = 0;
+        _total_dwarf_frames = 0;
+        StackWalker::resetUnwindCacheStats();
         memset(_failures, 0, sizeof(_failures));
 
         // Reset dictionaries and bitmaps
         lockAll();
         _class_map.clear();
+        FrameName::resetClassNames();
         _thread_filter.clear();
         _call_trace_storage.clear();
+        // One shard of sample counters per lock stripe, up to MAX_CALL_TRACE_SHARDS:
+        // beyond that, several stripes share a shard, otherwise the counters of a large host
+        // would take hundreds of megabytes
+        int shards = concurrency_level < MAX_CALL_TRACE_SHARDS ? concurrency_level : MAX_CALL_TRACE_SHARDS;
+        _call_trace_storage.setShards(args._sharded ? shards : 0);
+        _call_trace_storage.setCompact(args._compact);
+        _trace_mem = args._output == OUTPUT_JFR && args._trace_mem > 0 ? args._trace_mem : 0;
+        _trace_age = args._trace_age;
         // Make sure frame structure is consistent throughout the entire recording
         _add_event_frame = args._output != OUTPUT_JFR;
         _add_thread_frame = args._threads && args._output != OUTPUT_JFR;
@@ -1140,10 +1326,21 @@ Error Profiler::start(Arguments& args, bool reset) {
     // (Re-)allocate calltrace buffers
     if (_max_stack_depth != args._jstackdepth) {
         _max_stack_depth = args._jstackdepth;
-        size_t nelem = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        // Per-thread buffers are lazily allocated with the new size
+        lockAll();
+        releaseThreadBuffers();
+        unlockAll();
+
+        for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
             free(_calltrace_buffer[i]);
+            _calltrace_buffer[i] = NULL;
+        }
+    }
+
+    size_t nelem = _max_stack_depth + MAX_NATIVE_FRAMES + RESERVED_FRAMES;
+    for (int i = 0; i < concurrency_level; i++) {
+        if (_calltrace_buffer[i] == NULL) {
             _calltrace_buffer[i] = (CallTraceBuffer*)calloc(nelem, sizeof(CallTraceBuffer));
             if (_calltrace_buffer[i] == NULL) {
                 _max_stack_depth = 0;
@@ -1152,7 +1349,19 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    // Buffers of the stripes above the new level are kept, since a signal handler
+    // may still hold an index computed with the previous level.
+    // Stripes of both levels are held while the level changes, see tryLockStripe()
+    lockAll();
+    for (int i = _concurrency_level; i < concurrency_level; i++) _locks[i].lock();
+    int prev_level = _concurrency_level;
+    _concurrency_level = concurrency_level;
+    for (int i = concurrency_level; i < prev_level; i++) _locks[i].unlock();
+    unlockAll();
+
     _features = args._features;
+    _thread_buffers = args._thread_buffers;
+    _perf_counters = args._counters;
     if (VM::hotspot_version() < 8) {
         _features.java_anchor = 0;
         _features.gc_traces = 0;
@@ -1176,6 +1385,10 @@ Error Profiler::start(Arguments& args, bool reset) {
         return Error("record-cpu is only supported with perf_events");
     } else if (_engine == &instrument && !args._trace.empty()) {
         return Error("Running method tracing and Java method sampling in parallel is not supported");
+    } else if (args._counters && args._output != OUTPUT_JFR) {
+        return Error("counters are only recorded in JFR output");
+    } else if (args._counters && (args._per_cpu || args._perf_batch > 1)) {
+        return Error("counters are not supported with percpu or perfbatch");
     }
 
     _cstack = args._cstack;
@@ -1202,6 +1415,7 @@ Error Profiler::start(Arguments& args, bool reset) {
     }
 
     // Kernel symbols are useful only for perf_events without --all-user
+    Symbols::setLazy(args._lazy_symbols);
     updateSymbols(_engine == &perf_events && !args._alluser);
 
     error = installTraps(args._begin, args._end, args._nostop);
@@ -1219,6 +1433,13 @@ Error Profiler::start(Arguments& args, bool reset) {
         }
     }
 
+    if (args._counters) {
+        error = PerfCounters::start(args);
+        if (error) {
+            goto error1;
+        }
+    }
+
     error = _engine->start(args);
     if (error) {
         goto error1;
@@ -1294,6 +1515,7 @@ error2:
     _engine->stop();
 
 error1:
+    PerfCounters::stop();
     uninstallTraps();
     switchLibraryTrap(false);
 
@@ -1321,6 +1543,7 @@ Error Profiler::stop(bool restart) {
     if (_event_mask & EM_METHOD_TRACE) instrument.stop();
 
     _engine->stop();
+    PerfCounters::stop();
 
     switchLibraryTrap(false);
     switchThreadEvents(JVMTI_DISABLE);
@@ -1362,11 +1585,30 @@ Error Profiler::flushJfr() {
 
     lockAll();
     _jfr.flush();
+    evictCallTraces();
     unlockAll();
 
     return Error::OK;
 }
 
+// Called under lockAll() right after a JFR chunk is finished,
+// so that no recorded event refers to a call trace being evicted
+void Profiler::evictCallTraces() {
+    if (_trace_mem == 0 || _call_trace_storage.usedMemory() <= _trace_mem) {
+        return;
+    }
+
+    size_t before = _call_trace_storage.usedMemory();
+    int evicted = _call_trace_storage.evict(_trace_age);
+    if (evicted < 0) {
+        Log::warn("Call trace IDs are exhausted, tracemem limit is no longer enforced");
+        _trace_mem = 0;
+    } else if (evicted > 0) {
+        Log::debug("Evicted %d idle call traces, storage memory: %zu -> %zu KB",
+                   evicted, before / 1024, _call_trace_storage.usedMemory() / 1024);
+    }
+}
+
 Error Profiler::dump(Writer& out, Arguments& args) {
     MutexLocker ml(_state_lock);
     if (_state != IDLE && _state != RUNNING) {
@@ -1383,11 +1625,9 @@ Error Profiler::dump(Writer& out, Arguments& args) {
             dumpCollapsed(out, args);
             break;
         case OUTPUT_FLAMEGRAPH:
-            dumpFlameGraph(out, args, false);
-            break;
+            return dumpFlameGraph(out, args, false);
         case OUTPUT_TREE:
-            dumpFlameGraph(out, args, true);
-            break;
+            return dumpFlameGraph(out, args, true);
         case OUTPUT_TEXT:
             dumpText(out, args);
             break;
@@ -1395,7 +1635,9 @@ Error Profiler::dump(Writer& out, Arguments& args) {
             if (_state == RUNNING) {
                 lockAll();
                 _jfr.flush();
+                evictCallTraces();
                 unlockAll();
+                _jfr.drain();
             }
             break;
         case OUTPUT_OTLP:
@@ -1414,17 +1656,47 @@ void Profiler::writeMetrics(Writer& out) {
     out << "mem_flightrecorder_kb " << (u64) _jfr.usedMemory() / KB << '\n';
     out << "mem_classmap_kb " << (u64) _class_map.usedMemory() / KB << '\n';
     out << "mem_threadfilter_kb " << (u64) _thread_filter.usedMemory() / KB << '\n';
-    out << "mem_runtimestubs_kb " << (u64) _runtime_stubs.usedMemory() / KB << '\n';
+    out << "mem_runtimestubs_kb " << (u64) (_runtime_stubs.usedMemory() + _runtime_stub_index.usedMemory()) / KB << '\n';
     out << "mem_nativelibs_kb " << (u64) _native_libs.usedMemory() / KB << '\n';
+    size_t name_cache_memory = FrameName::cacheMemory();
+    if (name_cache_memory != 0) {
+        out << "mem_namecache_kb " << (u64) name_cache_memory / KB << '\n';
+    }
 
     out << "samples_total " << _total_samples << '\n';
     out << "samples_skipped_total " << _failures[-ticks_skipped] << '\n';
     out << "calltracestorage_overflows_total " << _call_trace_storage.overflow() << '\n';
+    out << "calltracestorage_evicted_samples_total " << _call_trace_storage.evicted() << '\n';
+    out << "concurrency_level " << _concurrency_level << '\n';
+    out << "jfr_writer_queue_depth " << (u64) _jfr.writerQueueDepth() << '\n';
+    out << "jfr_writer_stalls_total " << _jfr.writerStalls() << '\n';
 
     if (_total_stack_walk_time != 0) {
         out << "stackwalk_ns_total " << _total_stack_walk_time << '\n';
         u64 stacks = _total_samples - _failures[-ticks_skipped];
         out << "stackwalk_ns_avg " << (_total_stack_walk_time / stacks) << '\n';
+        if (_timed_hashes != 0) {
+            out << "hash_ns_avg " << (_total_hash_time / _timed_hashes) << '\n';
+        }
+    }
+
+    if (_total_dwarf_frames != 0) {
+        out << "stackwalk_dwarf_frames_total " << _total_dwarf_frames << '\n';
+        out << "stackwalk_dwarf_ns_per_frame " << (_total_dwarf_walk_time / _total_dwarf_frames) << '\n';
+    }
+
+    u64 wall_interval_avg, wall_interval_max;
+    if (wall_clock.achievedInterval(&wall_interval_avg, &wall_interval_max)) {
+        out << "wall_interval_ns_avg " << wall_interval_avg << '\n';
+        out << "wall_interval_ns_max " << wall_interval_max << '\n';
+    }
+
+    u64 unwind_cache_lookups, unwind_cache_hits;
+    StackWalker::unwindCacheStats(&unwind_cache_lookups, &unwind_cache_hits);
+    if (unwind_cache_lookups != 0) {
+        out << "unwind_cache_lookups_total " << unwind_cache_lookups << '\n';
+        out << "unwind_cache_hits_total " << unwind_cache_hits << '\n';
+        out << "unwind_cache_hit_percent " << (unwind_cache_hits * 100 / unwind_cache_lookups) << '\n';
     }
 }
 
@@ -1433,15 +1705,20 @@ void Profiler::logStats() {
 
     u64 stacks = _total_samples - _failures[-ticks_skipped];
     u64 avg_time = stacks == 0 ? 0 : _total_stack_walk_time / stacks;
-    Log::info("Collected %llu stacks, avg time = %llu ns", stacks, avg_time);
+    u64 avg_hash_time = _timed_hashes == 0 ? 0 : _total_hash_time / _timed_hashes;
+    Log::info("Collected %llu stacks, avg time = %llu ns, avg hash time = %llu ns", stacks, avg_time, avg_hash_time);
 }
 
+// Stripes above the concurrency level are never held for longer than it takes
+// tryLockStripe() to reject them, so they need not be locked here
 void Profiler::lockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].lock();
+    for (int i = 0; i < _concurrency_level; i++) _locks[i].lock();
+    for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) ctx->lock.lock();
 }
 
 void Profiler::unlockAll() {
-    for (int i = 0; i < CONCURRENCY_LEVEL; i++) _locks[i].unlock();
+    for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) ctx->lock.unlock();
+    for (int i = 0; i < _concurrency_level; i++) _locks[i].unlock();
 }
 
 void Profiler::switchThreadEvents(jvmtiEventMode mode) {
@@ -1459,32 +1736,45 @@ void Profiler::switchThreadEvents(jvmtiEventMode mode) {
  * <frame>;<frame>;...;<topmost frame> <count>
  */
 void Profiler::dumpCollapsed(Writer& out, Arguments& args) {
-    FrameName fn(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names_lock, _thread_names);
     char buf[32];
     u64 printed_sample_count = 0;
 
     std::vector<CallTraceSample*> samples;
     _call_trace_storage.collectSamples(samples);
 
+    std::vector<CallTrace*> traces;
+    std::vector<u64> counters;
     for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
         CallTrace* trace = (*it)->acquireTrace();
-        if (trace == NULL || excludeTrace(&fn, trace)) continue;
-
         u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
-        if (counter == 0) continue;
+        if (trace == NULL || counter == 0) continue;
 
-        for (int j = trace->num_frames - 1; j >= 0; j--) {
-            const char* frame_name = fn.name(trace->frames[j]);
-            out << frame_name << (j == 0 ? ' ' : ';');
+        traces.push_back(trace);
+        counters.push_back(counter);
+    }
+
+    TraceNames names(args, args._style | STYLE_NO_SEMICOLON, _epoch, _thread_names_lock, _thread_names,
+                     TraceNames::threadsFor(traces.size()));
+
+    for (size_t start = 0; start < traces.size(); start += names.batchSize()) {
+        size_t count = std::min(traces.size() - start, names.batchSize());
+        names.resolve(&traces[start], count);
+
+        for (size_t i = 0; i < count; i++) {
+            if (names.excluded(i)) continue;
+
+            for (int j = traces[start + i]->num_frames - 1; j >= 0; j--) {
+                out << names.name(i, j) << (j == 0 ? ' ' : ';');
+            }
+            // Beware of locale-sensitive conversion
+            out.write(buf, snprintf(buf, sizeof(buf), "%llu\n", counters[start + i]));
+            printed_sample_count++;
         }
-        // Beware of locale-sensitive conversion
-        out.write(buf, snprintf(buf, sizeof(buf), "%llu\n", counter));
-        printed_sample_count++;
     }
     logEmptyOutput(args, printed_sample_count, out);
 }
 
-void Profiler::dumpFlameGraph(Writer& out, Arguments& args, bool tree) {
+Error Profiler::dumpFlameGraph(Writer& out, Arguments& args, bool tree) {
     char title[64];
     if (args._title == NULL) {
         Engine* active_engine = activeEngine();
@@ -1499,56 +1789,68 @@ void Profiler::dumpFlameGraph(Writer& out, Arguments& args, bool tree) {
     u64 printed_sample_count = 0;
 
     {
-        FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
-
         std::vector<CallTraceSample*> samples;
         _call_trace_storage.collectSamples(samples);
 
+        std::vector<CallTrace*> traces;
+        std::vector<u64> counters;
         for (std::vector<CallTraceSample*>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
             CallTrace* trace = (*it)->acquireTrace();
-            if (trace == NULL || excludeTrace(&fn, trace)) continue;
-
             u64 counter = args._counter == COUNTER_SAMPLES ? (*it)->samples : (*it)->counter;
-            if (counter == 0) continue;
+            if (trace == NULL || counter == 0) continue;
 
-            int num_frames = trace->num_frames;
+            traces.push_back(trace);
+            counters.push_back(counter);
+        }
 
-            Trie* f = flamegraph.root();
-            if (args._reverse) {
-                // Thread frames always come first
-                if (_add_sched_frame) {
-                    const char* frame_name = fn.name(trace->frames[--num_frames]);
-                    f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter);
-                }
-                if (_add_thread_frame) {
-                    const char* frame_name = fn.name(trace->frames[--num_frames]);
-                    f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter);
-                }
-                if (_add_cpu_frame) {
-                    const char* frame_name = fn.name(trace->frames[--num_frames]);
-                    f = flamegraph.addChild(f, frame_name, FRAME_NATIVE, counter);
-                }
+        TraceNames names(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names,
+                         TraceNames::threadsFor(traces.size()));
+
+        for (size_t start = 0; start < traces.size(); start += names.batchSize()) {
+            size_t count = std::min(traces.size() - start, names.batchSize());
+            names.resolve(&traces[start], count);
+
+            for (size_t i = 0; i < count; i++) {
+                if (names.excluded(i)) continue;
+
+                u64 counter = counters[start + i];
+                int num_frames = traces[start + i]->num_frames;
+
+                Trie* f = flamegraph.root();
+                if (args._reverse) {
+                    // Thread frames always come first
+                    if (_add_sched_frame && f != NULL) {
+                        f = flamegraph.addChild(f, names.name(i, --num_frames), FRAME_NATIVE, counter);
+                    }
+                    if (_add_thread_frame && f != NULL) {
+                        f = flamegraph.addChild(f, names.name(i, --num_frames), FRAME_NATIVE, counter);
+                    }
+                    if (_add_cpu_frame && f != NULL) {
+                        f = flamegraph.addChild(f, names.name(i, --num_frames), FRAME_NATIVE, counter);
+                    }
 
-                for (int j = 0; j < num_frames; j++) {
-                    const char* frame_name = fn.name(trace->frames[j]);
-                    FrameTypeId frame_type = fn.type(trace->frames[j]);
-                    f = flamegraph.addChild(f, frame_name, frame_type, counter);
+                    for (int j = 0; j < num_frames && f != NULL; j++) {
+                        f = flamegraph.addChild(f, names.name(i, j), names.type(i, j), counter);
+                    }
+                } else {
+                    for (int j = num_frames - 1; j >= 0 && f != NULL; j--) {
+                        f = flamegraph.addChild(f, names.name(i, j), names.type(i, j), counter);
+                    }
                 }
-            } else {
-                for (int j = num_frames - 1; j >= 0; j--) {
-                    const char* frame_name = fn.name(trace->frames[j]);
-                    FrameTypeId frame_type = fn.type(trace->frames[j]);
-                    f = flamegraph.addChild(f, frame_name, frame_type, counter);
+
+                if (f == NULL) {
+                    return Error("Not enough memory to build a flame graph");
                 }
+                f->_total += counter;
+                f->_self += counter;
+                printed_sample_count++;
             }
-            f->_total += counter;
-            f->_self += counter;
-            printed_sample_count++;
         }
     }
 
     flamegraph.dump(out, tree);
     logEmptyOutput(args, printed_sample_count, out);
+    return Error::OK;
 }
 
 void Profiler::dumpText(Writer& out, Arguments& args) {
@@ -1556,11 +1858,16 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     char buf[1024] = {0};
 
     std::vector<CallTraceSample> samples;
+    std::map<std::string, MethodSample> histogram;
     u64 total_counter = 0;
     {
         std::map<u64, CallTraceSample> map;
         _call_trace_storage.collectSamples(map);
-        samples.reserve(map.size());
+
+        std::vector<CallTraceSample> candidates;
+        std::vector<CallTrace*> traces;
+        candidates.reserve(map.size());
+        traces.reserve(map.size());
 
         for (std::map<u64, CallTraceSample>::const_iterator it = map.begin(); it != map.end(); ++it) {
             CallTrace* trace = it->second.trace;
@@ -1568,8 +1875,29 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
             if (trace == NULL || counter == 0) continue;
 
             total_counter += counter;
-            if (trace->num_frames == 0 || excludeTrace(&fn, trace)) continue;
-            samples.push_back(it->second);
+            if (trace->num_frames == 0) continue;
+            candidates.push_back(it->second);
+            traces.push_back(trace);
+        }
+
+        // Only top frames are needed for the flat profile; top call stacks are named with fn
+        TraceNames names(args, args._style | STYLE_DOTTED, _epoch, _thread_names_lock, _thread_names,
+                         TraceNames::threadsFor(traces.size()), 1);
+        samples.reserve(traces.size());
+
+        for (size_t start = 0; start < traces.size(); start += names.batchSize()) {
+            size_t count = std::min(traces.size() - start, names.batchSize());
+            names.resolve(&traces[start], count);
+
+            for (size_t i = 0; i < count; i++) {
+                if (names.excluded(i)) continue;
+
+                const CallTraceSample& sample = candidates[start + i];
+                samples.push_back(sample);
+                if (args._dump_flat > 0) {
+                    histogram[names.name(i, 0)].add(sample.samples, sample.counter);
+                }
+            }
         }
     }
 
@@ -1618,12 +1946,6 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
 
     // Print top methods
     if (args._dump_flat > 0) {
-        std::map<std::string, MethodSample> histogram;
-        for (std::vector<CallTraceSample>::const_iterator it = samples.begin(); it != samples.end(); ++it) {
-            const char* frame_name = fn.name(it->trace->frames[0]);
-            histogram[frame_name].add(it->samples, it->counter);
-        }
-
         std::vector<NamedMethodSample> methods(histogram.begin(), histogram.end());
         std::sort(methods.begin(), methods.end(), sortByCounter);
 
@@ -1640,133 +1962,64 @@ void Profiler::dumpText(Writer& out, Arguments& args) {
     }
 }
 
-static void recordSampleType(ProtoBuffer& otlp_buffer, Index& strings, const char* type, const char* units) {
-    using namespace Otlp;
-    protobuf_mark_t sample_type_mark = otlp_buffer.startMessage(Profile::sample_type, 1);
-    otlp_buffer.field(ValueType::type_strindex, strings.indexOf(type));
-    otlp_buffer.field(ValueType::unit_strindex, strings.indexOf(units));
-    otlp_buffer.field(ValueType::aggregation_temporality, AggregationTemporality::cumulative);
-    otlp_buffer.commitMessage(sample_type_mark);
-}
-
 void Profiler::dumpOtlp(Writer& out, Arguments& args) {
-    using namespace Otlp;
-    ProtoBuffer otlp_buffer(OTLP_BUFFER_INITIAL_SIZE);
-    Index strings;
-    Index functions;
-    // Eventually this is going to be Index<Attribute>, for now we keep it simple
-    Index thread_names;
-
-    protobuf_mark_t resource_profiles_mark = otlp_buffer.startMessage(ProfilesData::resource_profiles);
-    protobuf_mark_t scope_profiles_mark = otlp_buffer.startMessage(ResourceProfiles::scope_profiles);
-    protobuf_mark_t profile_mark = otlp_buffer.startMessage(ScopeProfiles::profiles);
-
     u64 time_nanos = _start_time * 1000ULL;
     u64 duration_nanos = (OS::micros() - _start_time) * 1000ULL;
 
-    otlp_buffer.field(Profile::time_nanos, time_nanos);
-    otlp_buffer.field(Profile::duration_nanos, duration_nanos);
-
-    recordSampleType(otlp_buffer, strings, _engine->type(), "count");
-    recordSampleType(otlp_buffer, strings, _engine->type(), _engine->units());
+    OtlpWriter otlp(time_nanos, duration_nanos);
+    otlp.addSampleType(_engine->type(), "count");
+    otlp.addSampleType(_engine->type(), _engine->units());
 
     std::vector<CallTraceSample*> call_trace_samples;
     _call_trace_storage.collectSamples(call_trace_samples);
 
-    std::vector<size_t> location_indices;
-    location_indices.reserve(call_trace_samples.size());
-
-    FrameName fn(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names);
-    size_t frames_seen = 0;
+    std::vector<CallTraceSample*> samples;
+    std::vector<CallTrace*> traces;
     for (const auto& cts : call_trace_samples) {
         CallTrace* trace = cts->acquireTrace();
-        if (trace == NULL || excludeTrace(&fn, trace) || cts->samples == 0) continue;
-
-        protobuf_mark_t sample_mark = otlp_buffer.startMessage(Profile::sample, 1);
-        otlp_buffer.field(Sample::locations_start_index, frames_seen);
-        otlp_buffer.field(Sample::locations_length, trace->num_frames);
-
-        u32 thread_name_idx = 0;
-        for (int j = 0; j < trace->num_frames; j++) {
-            if (trace->frames[j].bci == BCI_THREAD_ID) {
-                int tid = (int)(uintptr_t) trace->frames[j].method_id;
-                MutexLocker ml(_thread_names_lock);
-                ThreadMap::iterator it = _thread_names.find(tid);
-                if (it != _thread_names.end()) {
-                    thread_name_idx = thread_names.indexOf(it->second);
-                }
-                continue;
-            }
-
-            // To be written below in Profile.location_indices
-            location_indices.push_back(functions.indexOf(fn.name(trace->frames[j])));
-            ++frames_seen;
-        }
-        if (thread_name_idx != 0) {
-            otlp_buffer.field(Sample::attribute_indices, thread_name_idx);
-        }
-
-        protobuf_mark_t sample_value_mark = otlp_buffer.startMessage(Sample::value, 1);
-        otlp_buffer.putVarInt(cts->samples);
-        otlp_buffer.putVarInt(cts->counter);
-        otlp_buffer.commitMessage(sample_value_mark);
-        otlp_buffer.commitMessage(sample_mark);
-    }
+        if (trace == NULL || cts->samples == 0) continue;
 
-    protobuf_mark_t location_indices_mark = otlp_buffer.startMessage(Profile::location_indices);
-    for (size_t i : location_indices) {
-        otlp_buffer.putVarInt(i);
+        samples.push_back(cts);
+        traces.push_back(trace);
     }
-    otlp_buffer.commitMessage(location_indices_mark);
-
-    otlp_buffer.commitMessage(profile_mark);
-    otlp_buffer.commitMessage(scope_profiles_mark);
-    otlp_buffer.commitMessage(resource_profiles_mark);
 
-    protobuf_mark_t dictionary_mark = otlp_buffer.startMessage(ProfilesData::dictionary);
+    TraceNames names(args, args._style & ~STYLE_ANNOTATE, _epoch, _thread_names_lock, _thread_names,
+                     TraceNames::threadsFor(traces.size()));
+    std::string thread_name;
 
-    // Write mapping_table. Not currently used, but required by some parsers
-    protobuf_mark_t mapping_mark = otlp_buffer.startMessage(ProfilesDictionary::mapping_table, 1);
-    otlp_buffer.commitMessage(mapping_mark);
+    for (size_t start = 0; start < traces.size(); start += names.batchSize()) {
+        size_t count = std::min(traces.size() - start, names.batchSize());
+        names.resolve(&traces[start], count);
 
-    // Write function_table
-    functions.forEachOrdered([&] (size_t idx, const std::string& function_name) {
-        protobuf_mark_t function_mark = otlp_buffer.startMessage(ProfilesDictionary::function_table, 1);
-        otlp_buffer.field(Function::name_strindex, strings.indexOf(function_name));
-        otlp_buffer.commitMessage(function_mark);
-    });
+        for (size_t i = 0; i < count; i++) {
+            if (names.excluded(i)) continue;
 
-    // Write location_table
-    for (size_t function_idx = 0; function_idx < functions.size(); ++function_idx) {
-        protobuf_mark_t location_mark = otlp_buffer.startMessage(ProfilesDictionary::location_table, 1);
-        // TODO: set to the proper mapping when new mappings are added.
-        // For now we keep a dummy default mapping_index for all locations because some parsers
-        // would fail otherwise
-        otlp_buffer.field(Location::mapping_index, (u64)0);
-        protobuf_mark_t line_mark = otlp_buffer.startMessage(Location::line, 1);
-        otlp_buffer.field(Line::function_index, function_idx);
-        otlp_buffer.commitMessage(line_mark);
-        otlp_buffer.commitMessage(location_mark);
-    }
+            CallTraceSample* cts = samples[start + i];
+            CallTrace* trace = traces[start + i];
 
-    // Write string_table
-    strings.forEachOrdered([&] (size_t idx, const std::string& s) {
-        otlp_buffer.field(ProfilesDictionary::string_table, s.data(), s.length());
-    });
+            bool has_thread_name = false;
+            u32 locations = 0;
+            for (int j = 0; j < trace->num_frames; j++) {
+                if (trace->frames[j].bci == BCI_THREAD_ID) {
+                    int tid = (int)(uintptr_t) trace->frames[j].method_id;
+                    MutexLocker ml(_thread_names_lock);
+                    ThreadMap::iterator it = _thread_names.find(tid);
+                    if (it != _thread_names.end()) {
+                        thread_name = it->second;
+                        has_thread_name = true;
+                    }
+                    continue;
+                }
 
-    // Write attribute_table (only threads for now)
-    thread_names.forEachOrdered([&] (size_t idx, const std::string& s) {
-        protobuf_mark_t attr_mark = otlp_buffer.startMessage(ProfilesDictionary::attribute_table);
-        otlp_buffer.field(Key::key, OTLP_THREAD_NAME);
-        protobuf_mark_t value_mark = otlp_buffer.startMessage(Key::value);
-        otlp_buffer.field(AnyValue::string_value, s.data(), s.length());
-        otlp_buffer.commitMessage(value_mark);
-        otlp_buffer.commitMessage(attr_mark);
-    });
+                otlp.addLocation(names.name(i, j));
+                locations++;
+            }
 
-    otlp_buffer.commitMessage(dictionary_mark);
+            otlp.addSample(locations, has_thread_name ? thread_name.c_str() : NULL, cts->samples, cts->counter);
+        }
+    }
 
-    out.write((const char*) otlp_buffer.data(), otlp_buffer.offset());
+    otlp.write(out);
 }
 
 u64 Profiler::addTimeout(u64 start_micros, int timeout) {
@@ -1987,7 +2240,7 @@ Error Profiler::run(Arguments& args) {
     } else {
         // Open output file under the lock to avoid races with background timer
         MutexLocker ml(_state_lock);
-        FileWriter out(args.file());
+        FileWriter out(args.file(), args._io_ring);
         if (!out.is_open()) {
             return Error("Could not open output file");
         }
@@ -2004,7 +2257,7 @@ Error Profiler::restart(Arguments& args) {
     }
 
     if (args._file != NULL && args._output != OUTPUT_NONE && args._output != OUTPUT_JFR) {
-        FileWriter out(args.file());
+        FileWriter out(args.file(), args._io_ring);
         if (!out.is_open()) {
             return Error("Could not open output file");
         }
@@ -27,7 +27,10 @@
 
 const int MAX_NATIVE_FRAMES = 128;
 const int RESERVED_FRAMES   = 10;  // for synthetic frames
-const int CONCURRENCY_LEVEL = 16;
+const int MIN_CONCURRENCY_LEVEL = 4;
+const int MAX_CONCURRENCY_LEVEL = 256;
+const int MAX_CALL_TRACE_SHARDS = 16;  // 16 bytes per shard per call trace slot
+const int HASH_TIMING_PERIOD = 64;  // with stats, time hashing of every Nth sample only
 
 
 union CallTraceBuffer {
@@ -39,6 +42,7 @@ union CallTraceBuffer {
 class FrameName;
 class NMethod;
 class StackContext;
+struct SampleContext;
 
 enum State {
     NEW,
@@ -75,10 +79,15 @@ class Profiler {
 
     u64 _total_samples;
     u64 _total_stack_walk_time;
+    u64 _total_hash_time;
+    u64 _timed_hashes;
+    u64 _total_dwarf_walk_time;
+    u64 _total_dwarf_frames;
     u64 _failures[ASGCT_FAILURE_TYPES];
 
-    SpinLock _locks[CONCURRENCY_LEVEL];
-    CallTraceBuffer* _calltrace_buffer[CONCURRENCY_LEVEL];
+    int _concurrency_level;
+    SpinLock _locks[MAX_CONCURRENCY_LEVEL];
+    CallTraceBuffer* _calltrace_buffer[MAX_CONCURRENCY_LEVEL];
     int _max_stack_depth;
     StackWalkFeatures _features;
     CStack _cstack;
@@ -86,11 +95,16 @@ class Profiler {
     bool _add_thread_frame;
     bool _add_sched_frame;
     bool _add_cpu_frame;
+    bool _thread_buffers;
+    bool _perf_counters;
     bool _update_thread_names;
+    size_t _trace_mem;
+    u32 _trace_age;
     volatile jvmtiEventMode _thread_events_state;
 
     SpinLock _stubs_lock;
     CodeCache _runtime_stubs;
+    CodeBlobIndex _runtime_stub_index;
     CodeCacheArray _native_libs;
     const void* _call_stub_begin;
     const void* _call_stub_end;
@@ -112,15 +126,20 @@ class Profiler {
 
     const char* asgctError(int code);
     u32 getLockIndex(int tid);
+    bool tryLockStripe(int tid, u32* lock_index);
     jmethodID getCurrentCompileTask();
     int getNativeTrace(void* ucontext, ASGCT_CallFrame* frames, EventType event_type, int tid, StackContext* java_ctx);
     int getJavaTraceAsync(void* ucontext, ASGCT_CallFrame* frames, int max_depth, StackContext* java_ctx);
     int getJavaTraceJvmti(jvmtiFrameInfo* jvmti_frames, ASGCT_CallFrame* frames, int start_depth, int max_depth);
     void fillFrameTypes(ASGCT_CallFrame* frames, int num_frames, NMethod* nmethod);
+    int getStackTrace(void* ucontext, CallTraceBuffer* buffer, int tid, EventType event_type, Event* event, u64* hash);
+    CallTraceBuffer* getThreadBuffer(SampleContext* ctx);
+    void releaseThreadBuffers();
     void setThreadInfo(int tid, const char* name, jlong java_thread_id);
     void updateThreadName(jvmtiEnv* jvmti, JNIEnv* jni, jthread thread);
     void updateJavaThreadNames();
     void updateNativeThreadNames();
+    void evictCallTraces();
     bool excludeTrace(FrameName* fn, CallTrace* trace);
     void mangle(const char* name, char* buf, size_t size);
     Engine* selectEngine(const char* event_name);
@@ -148,7 +167,7 @@ class Profiler {
     void unlockAll();
 
     void dumpCollapsed(Writer& out, Arguments& args);
-    void dumpFlameGraph(Writer& out, Arguments& args, bool tree);
+    Error dumpFlameGraph(Writer& out, Arguments& args, bool tree);
     void dumpText(Writer& out, Arguments& args);
     void dumpOtlp(Writer& out, Arguments& args);
 
@@ -166,16 +185,22 @@ class Profiler {
         _epoch(0),
         _gc_id(0),
         _timer_id(NULL),
+        _concurrency_level(MIN_CONCURRENCY_LEVEL),
         _max_stack_depth(0),
+        _thread_buffers(false),
+        _perf_counters(false),
+        _trace_mem(0),
+        _trace_age(0),
         _thread_events_state(JVMTI_DISABLE),
         _stubs_lock(),
         _runtime_stubs("[stubs]"),
+        _runtime_stub_index(),
         _native_libs(),
         _call_stub_begin(NULL),
         _call_stub_end(NULL),
         _dlopen_entry(NULL) {
 
-        for (int i = 0; i < CONCURRENCY_LEVEL; i++) {
+        for (int i = 0; i < MAX_CONCURRENCY_LEVEL; i++) {
             _calltrace_buffer[i] = NULL;
         }
     }
@@ -185,6 +210,7 @@ class Profiler {
     }
 
     u64 total_samples() { return _total_samples; }
+    int concurrencyLevel() { return _concurrency_level; }
     long uptime()       { return (OS::micros() - _start_time) / 1000000ULL; }
 
     Dictionary* classMap() { return &_class_map; }
@@ -209,6 +235,8 @@ class Profiler {
     void recordExternalSamples(u64 samples, u64 counter, int tid, u32 call_trace_id, EventType event_type, Event* event);
     void recordEventOnly(EventType event_type, Event* event);
     void tryResetCounters();
+    void initSampleContext();
+    void releaseSampleContext();
     void writeLog(LogLevel level, const char* message);
     void writeLog(LogLevel level, const char* message, size_t len);
 
@@ -253,6 +281,7 @@ class Profiler {
     }
 
     friend class Recording;
+    friend class TraceNames;
 };
 
 #endif // _PROFILER_H
@@ -28,6 +28,10 @@ size_t ProtoBuffer::varIntSize(u64 value) {
     return (640 - __builtin_clzll(value | 1) * 9) / 64;
 }
 
+size_t ProtoBuffer::fieldSize(protobuf_index_t index, size_t len) {
+    return varIntSize((u64) (index << 3 | LEN)) + varIntSize((u64) len) + len;
+}
+
 void ProtoBuffer::ensureCapacity(size_t new_data_size) {
     size_t expected_capacity = _offset + new_data_size;
     if (expected_capacity <= _capacity) return;
@@ -70,6 +74,11 @@ void ProtoBuffer::field(protobuf_index_t index, const unsigned char* s, size_t l
     _offset += len;
 }
 
+void ProtoBuffer::fieldHeader(protobuf_index_t index, size_t len) {
+    tag(index, LEN);
+    putVarInt((u64) len);
+}
+
 protobuf_mark_t ProtoBuffer::startMessage(protobuf_index_t index, size_t max_len_byte_count) {
     tag(index, LEN);
 
@@ -50,8 +50,13 @@ class ProtoBuffer {
     protobuf_mark_t startMessage(protobuf_index_t index, size_t max_len_byte_count = NESTED_FIELD_BYTE_COUNT);
     void commitMessage(protobuf_mark_t mark);
 
+    // Tag and length of a LEN field whose contents are written separately
+    void fieldHeader(protobuf_index_t index, size_t len);
+
     void putVarInt(u64 n);
     static size_t varIntSize(u64 value);
+    // Total size of a LEN field with the given contents length
+    static size_t fieldSize(protobuf_index_t index, size_t len);
 };
 
 #endif // _PROTOBUF_H
@@ -9,6 +9,7 @@
 #include "profiler.h"
 #include "safeAccess.h"
 #include "stackFrame.h"
+#include "unwindCache.h"
 #include "vmStructs.h"
 
 
@@ -17,9 +18,12 @@ const uintptr_t MAX_WALK_SIZE = 0x100000;
 const intptr_t MAX_FRAME_SIZE = 0x40000;
 const intptr_t MAX_INTERPRETER_FRAME_SIZE = 0x1000;
 const intptr_t DEAD_ZONE = 0x1000;
+const int UNWIND_CACHE_STRIPES = 32;
 
 static ucontext_t empty_ucontext{};
 
+static UnwindCache unwind_caches[UNWIND_CACHE_STRIPES];
+
 
 static inline bool aligned(uintptr_t ptr) {
     return (ptr & (sizeof(uintptr_t) - 1)) == 0;
@@ -58,6 +62,33 @@ static inline void fillFrame(ASGCT_CallFrame& frame, FrameTypeId type, int bci,
     frame.method_id = method;
 }
 
+// Threads run on different stacks, so the stack address spreads them across stripes
+static UnwindCache* acquireUnwindCache(Profiler* profiler) {
+    unsigned int version = profiler->nativeLibs()->version();
+    if (version & 1) {
+        // The list of libraries is being updated
+        return NULL;
+    }
+
+    uintptr_t sp = (uintptr_t)&version;
+    UnwindCache* cache = &unwind_caches[(sp >> 16 ^ sp >> 24) % UNWIND_CACHE_STRIPES];
+    return cache->tryAcquire(version) ? cache : NULL;
+}
+
+static FrameDesc* findFrameDesc(Profiler* profiler, UnwindCache* cache, const void* pc) {
+    FrameDesc* f;
+    if (cache != NULL && (f = cache->lookup(pc)) != NULL) {
+        return f;
+    }
+
+    CodeCache* cc = profiler->findLibraryByAddress(pc);
+    f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+    if (cache != NULL) {
+        cache->insert(pc, f);
+    }
+    return f;
+}
+
 static jmethodID getMethodId(VMMethod* method) {
     if (!inDeadZone(method) && aligned((uintptr_t)method)) {
         return method->validatedId();
@@ -135,6 +166,7 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
 
     int depth = 0;
     Profiler* profiler = Profiler::instance();
+    UnwindCache* cache = acquireUnwindCache(profiler);
 
     // Walk until the bottom of the stack or until the first Java frame
     while (depth < max_depth) {
@@ -148,8 +180,7 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         callchain[depth++] = pc;
 
         uintptr_t prev_sp = sp;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        FrameDesc* f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+        FrameDesc* f = findFrameDesc(profiler, cache, pc);
 
         u8 cfa_reg = (u8)f->cfa;
         int cfa_off = f->cfa >> 8;
@@ -203,6 +234,8 @@ int StackWalker::walkDwarf(void* ucontext, const void** callchain, int max_depth
         }
     }
 
+    if (cache != NULL) cache->release();
+
     return depth;
 }
 
@@ -253,11 +286,13 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
 
     // Should be preserved across setjmp/longjmp
     volatile int depth = 0;
+    UnwindCache* volatile cache = NULL;
 
     if (vm_thread != NULL) {
         vm_thread->exception() = &crash_protection_ctx;
         if (setjmp(crash_protection_ctx) != 0) {
             vm_thread->exception() = saved_exception;
+            if (cache != NULL) cache->release();
             if (depth < max_depth) {
                 fillFrame(frames[depth++], BCI_ERROR, "break_not_walkable");
             }
@@ -273,6 +308,8 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         anchor = vm_thread->anchor();
     }
 
+    cache = acquireUnwindCache(profiler);
+
     unwind_loop:
     while (depth < max_depth) {
         if (CodeHeap::contains(pc)) {
@@ -444,8 +481,7 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
         }
 
         uintptr_t prev_sp = sp;
-        CodeCache* cc = profiler->findLibraryByAddress(pc);
-        FrameDesc* f = cc != NULL ? cc->findFrameDesc(pc) : &FrameDesc::default_frame;
+        FrameDesc* f = findFrameDesc(profiler, cache, pc);
 
         u8 cfa_reg = (u8)f->cfa;
         int cfa_off = f->cfa >> 8;
@@ -508,10 +544,26 @@ int StackWalker::walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth,
     }
 
     if (vm_thread != NULL) vm_thread->exception() = saved_exception;
+    if (cache != NULL) cache->release();
 
     return depth;
 }
 
+void StackWalker::unwindCacheStats(u64* lookups, u64* hits) {
+    *lookups = 0;
+    *hits = 0;
+    for (int i = 0; i < UNWIND_CACHE_STRIPES; i++) {
+        *lookups += unwind_caches[i].lookups();
+        *hits += unwind_caches[i].hits();
+    }
+}
+
+void StackWalker::resetUnwindCacheStats() {
+    for (int i = 0; i < UNWIND_CACHE_STRIPES; i++) {
+        unwind_caches[i].resetStats();
+    }
+}
+
 void StackWalker::checkFault() {
     if (VMThread::key() < 0) {
         // JVM has not been loaded or VMStructs have not been initialized yet
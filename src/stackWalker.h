@@ -40,6 +40,9 @@ class StackWalker {
     static int walkVM(void* ucontext, ASGCT_CallFrame* frames, int max_depth, JavaFrameAnchor* anchor, EventType event_type);
 
     static void checkFault();
+
+    static void unwindCacheStats(u64* lookups, u64* hits);
+    static void resetUnwindCacheStats();
 };
 
 #endif // _STACKWALKER_H
@@ -10,16 +10,28 @@
 #include "mutex.h"
 
 
+struct SharedLibrary;
+
 class Symbols {
   private:
     static Mutex _parse_lock;
     static bool _have_kernel_symbols;
     static bool _libs_limit_reported;
+    static bool _lazy;
+
+    static void* lazyParserThread(void* unused);
+    static void enqueueLazyParsing(CodeCacheArray* array, CodeCache* cc, const SharedLibrary& lib);
 
   public:
     static void parseKernelSymbols(CodeCache* cc);
     static void parseLibraries(CodeCacheArray* array, bool kernel_symbols);
 
+    // In lazy mode, symbols and unwind tables of newly found libraries are parsed
+    // in a background thread, except for the libraries the profiler itself depends on
+    static void setLazy(bool lazy) {
+        _lazy = lazy;
+    }
+
     static bool haveKernelSymbols() {
         return _have_kernel_symbols;
     }
@@ -6,8 +6,10 @@
 #ifdef __linux__
 
 #include <dlfcn.h>
+#include <pthread.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -266,6 +268,7 @@ class ElfParser {
     void calcVirtualLoadAddress();
     void parseDynamicSection();
     void parseDwarfInfo();
+    int findBuildId(const char** build_id);
     uint32_t getSymbolCount(uint32_t* gnu_hash);
     void loadSymbols(bool use_debug);
     bool loadSymbolsFromDebug(const char* build_id, const int build_id_len);
@@ -277,7 +280,7 @@ class ElfParser {
     const char* getDebuginfodCache();
 
   public:
-    static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn);
+    static void parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn, bool parse_dwarf = true);
     static bool parseFile(CodeCache* cc, const char* base, const char* file_name, bool use_debug);
 };
 
@@ -333,13 +336,15 @@ bool ElfParser::parseFile(CodeCache* cc, const char* base, const char* file_name
     return true;
 }
 
-void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn) {
+void ElfParser::parseProgramHeaders(CodeCache* cc, const char* base, const char* end, bool relocate_dyn, bool parse_dwarf) {
     ElfParser elf(cc, base, base, NULL, relocate_dyn);
     if (elf.validHeader() && base + elf._header->e_phoff < end) {
         cc->setTextBase(base);
         elf.calcVirtualLoadAddress();
         elf.parseDynamicSection();
-        elf.parseDwarfInfo();
+        if (parse_dwarf) {
+            elf.parseDwarfInfo();
+        }
     }
 }
 
@@ -453,20 +458,76 @@ void ElfParser::parseDynamicSection() {
     }
 }
 
+// The unwind cache directory is opt-in, since tables are written there for other processes
+static bool getUnwindCachePath(char* path, size_t size, const char* build_id, int build_id_len) {
+    const char* dir = getenv("ASPROF_UNWIND_CACHE");
+    if (dir == NULL || dir[0] == 0) {
+        return false;
+    }
+
+    size_t len = snprintf(path, size, "%s/", dir);
+    for (int i = 0; i < build_id_len && len < size; i++) {
+        len += snprintf(path + len, size - len, "%02hhx", build_id[i]);
+    }
+    return len < size && (len += snprintf(path + len, size - len, ".unwind")) < size;
+}
+
 void ElfParser::parseDwarfInfo() {
     if (!DWARF_SUPPORTED) return;
 
     ElfProgramHeader* eh_frame_hdr = findProgramHeader(PT_GNU_EH_FRAME);
     if (eh_frame_hdr != NULL) {
         if (eh_frame_hdr->p_vaddr != 0) {
-            DwarfParser dwarf(_cc->name(), _base, at(eh_frame_hdr));
-            _cc->setDwarfTable(dwarf.table(), dwarf.count());
+            const char* build_id = NULL;
+            int build_id_len = findBuildId(&build_id);
+
+            char cache_path[PATH_MAX];
+            bool use_cache = build_id_len > 0 && getUnwindCachePath(cache_path, sizeof(cache_path), build_id, build_id_len);
+
+            DwarfTable* table = use_cache ? DwarfTable::load(cache_path, build_id, build_id_len) : NULL;
+            if (table == NULL) {
+                DwarfParser dwarf(_cc->name(), _base, at(eh_frame_hdr));
+                table = DwarfTable::create(dwarf.table(), dwarf.count(), build_id, build_id_len);
+                free(dwarf.table());
+
+                if (table == NULL) {
+                    Log::warn("Could not allocate unwind table for %s", _cc->name());
+                } else if (use_cache && !table->save(cache_path)) {
+                    int err = errno;
+                    Log::debug("Could not save unwind cache %s: %s", cache_path, strerror(err));
+                }
+            }
+            _cc->setDwarfTable(table);
         } else if (strcmp(_cc->name(), "[vdso]") == 0) {
-            FrameDesc* table = (FrameDesc*)malloc(sizeof(FrameDesc));
-            *table = FrameDesc::empty_frame;
-            _cc->setDwarfTable(table, 1);
+            _cc->setDwarfTable(DwarfTable::create(&FrameDesc::empty_frame, 1, NULL, 0));
+        }
+    }
+}
+
+// Finds GNU build ID among the notes of the loaded image
+int ElfParser::findBuildId(const char** build_id) {
+    const char* pheaders = (const char*)_header + _header->e_phoff;
+    for (int i = 0; i < _header->e_phnum; i++) {
+        ElfProgramHeader* pheader = (ElfProgramHeader*)(pheaders + i * _header->e_phentsize);
+        if (pheader->p_type != PT_NOTE) {
+            continue;
+        }
+
+        const char* note_ptr = at(pheader);
+        const char* note_end = note_ptr + pheader->p_memsz;
+        while (note_ptr + sizeof(ElfNote) <= note_end) {
+            ElfNote* note = (ElfNote*)note_ptr;
+            const char* name = note_ptr + sizeof(ElfNote);
+            const char* desc = name + ((note->n_namesz + 3) & ~3);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(name, "GNU", 4) == 0
+                    && note->n_descsz <= 64 && desc + note->n_descsz <= note_end) {
+                *build_id = desc;
+                return note->n_descsz;
+            }
+            note_ptr = desc + ((note->n_descsz + 3) & ~3);
         }
     }
+    return 0;
 }
 
 uint32_t ElfParser::getSymbolCount(uint32_t* gnu_hash) {
@@ -675,9 +736,90 @@ void ElfParser::addRelocationSymbols(ElfSection* reltab, const char* plt) {
 Mutex Symbols::_parse_lock;
 bool Symbols::_have_kernel_symbols = false;
 bool Symbols::_libs_limit_reported = false;
+bool Symbols::_lazy = false;
 static std::unordered_set<u64> _parsed_inodes;
 static bool _in_parse_libraries = false;
 
+// A library registered by parseLibraries() in lazy mode, whose symbols are not parsed yet
+struct PendingLibrary {
+    CodeCacheArray* array;
+    CodeCache* cc;
+    SharedLibrary lib;
+};
+
+static Mutex _pending_lock;
+static std::vector<PendingLibrary> _pending_libs;
+static bool _lazy_parser_running = false;
+
+// Symbols, imports and unwind tables of these libraries are needed as soon as the profiler starts
+static bool needsEagerParsing(const SharedLibrary& lib) {
+    if (strstr(lib.file, "libjvm") != NULL || strstr(lib.file, "libj9") != NULL) {
+        return true;
+    }
+    const char* self = (const char*)(const void*)Symbols::parseLibraries;
+    return self >= lib.map_start && self < lib.map_end;
+}
+
+static void parseLibrary(CodeCache* cc, const SharedLibrary& lib) {
+    // Parse debug symbols first
+    ElfParser::parseFile(cc, lib.image_base, lib.file, true);
+
+    UnloadProtection handle(cc);
+    if (handle.isValid()) {
+        ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl());
+    }
+}
+
+// Parses pending libraries off to the side, then publishes the results in the live CodeCache,
+// which may be in use by stack walkers and symbol lookups at the same time
+void* Symbols::lazyParserThread(void* unused) {
+    while (true) {
+        PendingLibrary pending;
+        {
+            MutexLocker ml(_pending_lock);
+            if (_pending_libs.empty()) {
+                _lazy_parser_running = false;
+                return NULL;
+            }
+            pending = _pending_libs.back();
+            _pending_libs.pop_back();
+        }
+
+        SharedLibrary& lib = pending.lib;
+        CodeCache* cc = pending.cc;
+        // Names keep the index of the live library, which is how call traces refer to it
+        CodeCache staging(lib.file, cc->libIndex(), lib.map_start, lib.map_end, lib.image_base);
+        parseLibrary(&staging, lib);
+        staging.sort();
+
+        {
+            MutexLocker ml(_parse_lock);
+            size_t used_memory = cc->usedMemory();
+            cc->moveSymbols(&staging);
+            pending.array->updated(cc, used_memory);
+        }
+        free(lib.file);
+    }
+}
+
+void Symbols::enqueueLazyParsing(CodeCacheArray* array, CodeCache* cc, const SharedLibrary& lib) {
+    MutexLocker ml(_pending_lock);
+    PendingLibrary pending = {array, cc, lib};
+    _pending_libs.push_back(pending);
+
+    if (!_lazy_parser_running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        _lazy_parser_running = pthread_create(&thread, &attr, lazyParserThread, NULL) == 0;
+        pthread_attr_destroy(&attr);
+        if (!_lazy_parser_running) {
+            Log::warn("Unable to create lazy symbol parser thread");
+        }
+    }
+}
+
 void Symbols::parseKernelSymbols(CodeCache* cc) {
     int fd;
     if (FdTransferClient::hasPeer()) {
@@ -807,6 +949,20 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
         SharedLibrary& lib = it.second;
         CodeCache* cc = new CodeCache(lib.file, array->count(), lib.map_start, lib.map_end, lib.image_base);
 
+        if (_lazy && lib.image_base != NULL && lib.file[0] == '/' && strchr(lib.file, ':') == NULL && !needsEagerParsing(lib)) {
+            // Exported symbols and imports now, everything else in the background
+            UnloadProtection handle(cc);
+            if (handle.isValid()) {
+                ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl(), false);
+            }
+
+            cc->sort();
+            applyPatch(cc);
+            array->add(cc);
+            enqueueLazyParsing(array, cc, lib);
+            continue;
+        }
+
         if (strchr(lib.file, ':') != NULL) {
             // Do not try to parse pseudofiles like anon_inode:name, /memfd:name
         } else if (strcmp(lib.file, "[vdso]") == 0) {
@@ -816,13 +972,7 @@ void Symbols::parseLibraries(CodeCacheArray* array, bool kernel_symbols) {
             // Be careful: executable file is not always ELF, e.g. classes.jsa
             ElfParser::parseFile(cc, lib.map_start, lib.file, true);
         } else {
-            // Parse debug symbols first
-            ElfParser::parseFile(cc, lib.image_base, lib.file, true);
-
-            UnloadProtection handle(cc);
-            if (handle.isValid()) {
-                ElfParser::parseProgramHeaders(cc, lib.image_base, lib.map_end, OS::isMusl());
-            }
+            parseLibrary(cc, lib);
         }
 
         free(lib.file);
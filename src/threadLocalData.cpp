@@ -4,6 +4,7 @@
  */
 
 #include <stdlib.h>
+#include "os.h"
 #include "threadLocalData.h"
 
 static pthread_key_t init_profiler_data_key() {
@@ -36,3 +37,62 @@ asprof_thread_local_data* ThreadLocalData::initThreadLocalData(pthread_key_t pro
     }
     return val;
 }
+
+// Thread destructor for threads that terminated without Profiler::releaseSampleContext():
+// make the context available to other threads, which will reuse its buffers
+static void release_sample_context(void* context) {
+    SampleContext* ctx = (SampleContext*) context;
+    __sync_fetch_and_and(&ctx->owner, 0);
+}
+
+static pthread_key_t init_sample_context_key() {
+    pthread_key_t sample_context_key;
+
+    if (pthread_key_create(&sample_context_key, release_sample_context) != 0) {
+        return -1;
+    }
+
+    return sample_context_key;
+}
+
+// A key that points to the SampleContext owned by the thread
+pthread_key_t ThreadLocalData::_sample_context_key = init_sample_context_key();
+
+SampleContext* volatile ThreadLocalData::_sample_contexts = NULL;
+
+SampleContext* ThreadLocalData::initSampleContext(int tid) {
+    if (_sample_context_key == -1) {
+        return NULL;
+    }
+
+    SampleContext* ctx;
+    for (ctx = _sample_contexts; ctx != NULL; ctx = ctx->next) {
+        if (ctx->owner == 0 && __sync_bool_compare_and_swap(&ctx->owner, 0, tid)) {
+            break;
+        }
+    }
+
+    if (ctx == NULL) {
+        ctx = (SampleContext*) OS::safeAlloc(sizeof(SampleContext));
+        if (ctx == NULL) {
+            return NULL;
+        }
+        ctx->owner = tid;
+
+        // Contexts are only added, never removed, so the list is not prone to ABA
+        do {
+            ctx->next = _sample_contexts;
+        } while (!__sync_bool_compare_and_swap(&_sample_contexts, ctx->next, ctx));
+    }
+
+    if (pthread_setspecific(_sample_context_key, ctx) != 0) {
+        __sync_fetch_and_and(&ctx->owner, 0);
+        return NULL;
+    }
+    return ctx;
+}
+
+void ThreadLocalData::releaseSampleContext(SampleContext* ctx) {
+    pthread_setspecific(_sample_context_key, NULL);
+    __sync_fetch_and_and(&ctx->owner, 0);
+}
@@ -7,7 +7,23 @@
 #define _ASPROF_THREAD_LOCAL_H
 
 #include "asprof.h"
+#include "spinLock.h"
 #include <pthread.h>
+#include <stddef.h>
+
+
+// Sampling state owned by a single thread, used instead of the shared
+// lock-striped buffers when the profiler runs with per-thread buffers.
+// A context is assigned when a thread starts. When the thread terminates,
+// its buffers are freed, and the context itself is later reused by another thread.
+struct SampleContext {
+    SpinLock lock;
+    volatile int owner;
+    SampleContext* next;
+    void* frames;
+    size_t frames_size;
+    void* jfr_buffer;
+};
 
 class ThreadLocalData {
   public:
@@ -39,9 +55,33 @@ class ThreadLocalData {
         return val;
     }
 
+    // Get the SampleContext of the current thread, or NULL if the thread has none yet.
+    // This function is async-signal safe.
+    static SampleContext* getSampleContext(void) {
+        if (_sample_context_key == -1) {
+            return NULL;
+        }
+        return (SampleContext*) pthread_getspecific(_sample_context_key);
+    }
+
+    // Assign a SampleContext to the current thread, preferably one released by a terminated thread.
+    // This function is NOT async-signal safe.
+    static SampleContext* initSampleContext(int tid);
+
+    // Detach the context from the current thread and make it available to other threads.
+    // The caller is responsible for freeing the buffers the context holds.
+    static void releaseSampleContext(SampleContext* ctx);
+
+    // The list of all contexts ever created, including released ones
+    static SampleContext* sampleContexts(void) {
+        return _sample_contexts;
+    }
+
   private:
     static asprof_thread_local_data* initThreadLocalData(pthread_key_t profiler_data_key);
     static pthread_key_t _profiler_data_key;
+    static pthread_key_t _sample_context_key;
+    static SampleContext* volatile _sample_contexts;
 };
 
 #endif // _ASPROF_THREAD_LOCAL_H
@@ -0,0 +1,160 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+#include "traceNames.h"
+#include "log.h"
+#include "os.h"
+#include "profiler.h"
+#include "vmEntry.h"
+
+
+void TraceChunk::clear() {
+    names.clear();
+    name_offsets.clear();
+    types.clear();
+    trace_offsets.clear();
+    excluded.clear();
+}
+
+int TraceNames::threadsFor(size_t total_traces) {
+    // Do not attach new threads to a JVM that is shutting down
+    if (VM::loaded() && VM::isTerminating()) {
+        return 1;
+    }
+
+    size_t chunks = (total_traces + TRACES_PER_CHUNK - 1) / TRACES_PER_CHUNK;
+    int threads = OS::getCpuCount();
+    if (threads > MAX_DUMP_THREADS) threads = MAX_DUMP_THREADS;
+    if ((size_t)threads > chunks) threads = (int)chunks;
+    return threads;
+}
+
+TraceNames::TraceNames(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names,
+                       int threads, int max_frames) :
+    _args(args),
+    _style(style),
+    _epoch(epoch),
+    _thread_names_lock(thread_names_lock),
+    _thread_names(thread_names),
+    _max_frames(max_frames),
+    _lock(),
+    _threads(),
+    _stop(false),
+    _traces(NULL),
+    _count(0),
+    _chunk_count(0),
+    _next_chunk(0),
+    _done_chunks(0),
+    _chunks(),
+    _fn(args, style, epoch, thread_names_lock, thread_names) {
+
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, threadEntry, this) != 0) {
+            Log::warn("Unable to create dump thread");
+            break;
+        }
+        _threads.push_back(thread);
+    }
+
+    _chunks.resize(this->threads() * CHUNKS_PER_THREAD);
+}
+
+TraceNames::~TraceNames() {
+    _lock.lock();
+    _stop = true;
+    _lock.notifyAll();
+    _lock.unlock();
+
+    for (size_t i = 0; i < _threads.size(); i++) {
+        pthread_join(_threads[i], NULL);
+    }
+}
+
+void* TraceNames::threadEntry(void* arg) {
+    TraceNames* trace_names = (TraceNames*)arg;
+    if (VM::loaded()) {
+        // Java method names are resolved through JVMTI, which needs an attached thread
+        if (VM::attachThread("Async-profiler Dump") == NULL) {
+            return NULL;
+        }
+        trace_names->workerLoop();
+        VM::detachThread();
+    } else {
+        trace_names->workerLoop();
+    }
+    return NULL;
+}
+
+void TraceNames::workerLoop() {
+    // FrameName destructor publishes new methods to the shared cache,
+    // which is safe only after all other threads have stopped reading it
+    FrameName fn(_args, _style, _epoch, _thread_names_lock, _thread_names);
+
+    _lock.lock();
+    while (!_stop) {
+        if (_next_chunk < _chunk_count) {
+            runChunks(&fn);
+        } else {
+            _lock.waitUntil(OS::micros() + 1000000);
+        }
+    }
+    _lock.unlock();
+}
+
+// Called and returns with _lock held
+void TraceNames::runChunks(FrameName* fn) {
+    while (_next_chunk < _chunk_count) {
+        int index = _next_chunk++;
+        _lock.unlock();
+        resolveChunk(fn, index);
+        _lock.lock();
+        if (++_done_chunks == _chunk_count) {
+            _lock.notifyAll();
+        }
+    }
+}
+
+void TraceNames::resolveChunk(FrameName* fn, int index) {
+    TraceChunk& c = _chunks[index];
+    c.clear();
+
+    size_t start = (size_t)index * TRACES_PER_CHUNK;
+    size_t end = start + TRACES_PER_CHUNK < _count ? start + TRACES_PER_CHUNK : _count;
+    Profiler* profiler = Profiler::instance();
+
+    for (size_t i = start; i < end; i++) {
+        CallTrace* trace = _traces[i];
+        bool excluded = profiler->excludeTrace(fn, trace);
+        c.excluded.push_back(excluded);
+        c.trace_offsets.push_back(c.name_offsets.size());
+        if (excluded || _threads.empty()) continue;
+
+        int num_frames = trace->num_frames < _max_frames ? trace->num_frames : _max_frames;
+        for (int j = 0; j < num_frames; j++) {
+            const char* frame_name = fn->name(trace->frames[j]);
+            c.name_offsets.push_back(c.names.size());
+            c.names.append(frame_name, strlen(frame_name) + 1);
+            c.types.push_back(fn->type(trace->frames[j]));
+        }
+    }
+}
+
+void TraceNames::resolve(CallTrace** traces, size_t count) {
+    _lock.lock();
+    _traces = traces;
+    _count = count;
+    _chunk_count = (int)((count + TRACES_PER_CHUNK - 1) / TRACES_PER_CHUNK);
+    _next_chunk = 0;
+    _done_chunks = 0;
+    _lock.notifyAll();
+
+    runChunks(&_fn);
+    while (_done_chunks < _chunk_count) {
+        _lock.waitUntil(OS::micros() + 1000000);
+    }
+    _lock.unlock();
+}
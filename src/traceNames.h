@@ -0,0 +1,112 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _TRACENAMES_H
+#define _TRACENAMES_H
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "callTraceStorage.h"
+#include "frameName.h"
+#include "mutex.h"
+
+
+const int MAX_DUMP_THREADS = 8;
+const int TRACES_PER_CHUNK = 1024;
+const int CHUNKS_PER_THREAD = 4;
+
+
+// Resolved frame names of a contiguous range of call traces
+struct TraceChunk {
+    std::string names;
+    std::vector<u32> name_offsets;
+    std::vector<u8> types;
+    std::vector<u32> trace_offsets;
+    std::vector<bool> excluded;
+
+    void clear();
+};
+
+// Resolves frame names of call traces on a small pool of dump threads.
+// Each batch of traces is split into chunks that threads grab in any order,
+// but the results are addressed by trace index, so the output stays deterministic.
+// Every thread owns its FrameName: JNI handles and the numeric locale are thread-local.
+class TraceNames {
+  private:
+    Arguments& _args;
+    int _style;
+    int _epoch;
+    Mutex& _thread_names_lock;
+    ThreadMap& _thread_names;
+    int _max_frames;
+
+    WaitableMutex _lock;
+    std::vector<pthread_t> _threads;
+    bool _stop;
+
+    CallTrace** _traces;
+    size_t _count;
+    int _chunk_count;
+    int _next_chunk;
+    int _done_chunks;
+    std::vector<TraceChunk> _chunks;
+
+    FrameName _fn;
+
+    static void* threadEntry(void* arg);
+    void workerLoop();
+    void runChunks(FrameName* fn);
+    void resolveChunk(FrameName* fn, int index);
+
+    TraceChunk& chunk(size_t i) {
+        return _chunks[i / TRACES_PER_CHUNK];
+    }
+
+  public:
+    // Names up to max_frames frames from the top of each trace; include/exclude filters
+    // always look at the entire trace
+    TraceNames(Arguments& args, int style, int epoch, Mutex& thread_names_lock, ThreadMap& thread_names,
+               int threads, int max_frames = 0x7fffffff);
+    ~TraceNames();
+
+    // Number of threads worth starting for a dump of the given size
+    static int threadsFor(size_t total_traces);
+
+    int threads() {
+        return (int)_threads.size() + 1;
+    }
+
+    size_t batchSize() {
+        return (size_t)threads() * CHUNKS_PER_THREAD * TRACES_PER_CHUNK;
+    }
+
+    // Resolves names of up to batchSize() traces; results of the previous batch are discarded
+    void resolve(CallTrace** traces, size_t count);
+
+    bool excluded(size_t i) {
+        return chunk(i).excluded[i % TRACES_PER_CHUNK];
+    }
+
+    // Without extra threads, names are not buffered but produced on demand,
+    // so the result is valid only until the next call
+    const char* name(size_t i, int frame) {
+        if (_threads.empty()) {
+            return _fn.name(_traces[i]->frames[frame]);
+        }
+        TraceChunk& c = chunk(i);
+        return c.names.data() + c.name_offsets[c.trace_offsets[i % TRACES_PER_CHUNK] + frame];
+    }
+
+    FrameTypeId type(size_t i, int frame) {
+        if (_threads.empty()) {
+            return _fn.type(_traces[i]->frames[frame]);
+        }
+        TraceChunk& c = chunk(i);
+        return (FrameTypeId)c.types[c.trace_offsets[i % TRACES_PER_CHUNK] + frame];
+    }
+};
+
+#endif // _TRACENAMES_H
@@ -0,0 +1,95 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _UNWINDCACHE_H
+#define _UNWINDCACHE_H
+
+#include <string.h>
+#include "arch.h"
+#include "spinLock.h"
+
+
+struct FrameDesc;
+
+// Direct-mapped cache of DWARF unwind records for recently walked native PCs.
+// Saves a library lookup and a binary search over the unwind table per frame.
+// Only the thread that acquired the cache may use it; acquire() never blocks,
+// so the cache is safe to use in a signal handler.
+class UnwindCache {
+  public:
+    static const u32 SIZE = 256;
+
+  private:
+    struct Entry {
+        const void* pc;
+        FrameDesc* frame;
+    };
+
+    SpinLock _lock;
+    unsigned int _version;
+    u64 _lookups;
+    u64 _hits;
+    Entry _entries[SIZE];
+
+    static u32 slot(const void* pc) {
+        uintptr_t key = (uintptr_t)pc;
+        return (u32)(key ^ key >> 8 ^ key >> 16) & (SIZE - 1);
+    }
+
+  public:
+    UnwindCache() : _lock(), _version(0), _lookups(0), _hits(0) {
+        memset(_entries, 0, sizeof(_entries));
+    }
+
+    // Cached records belong to the given version of the library list:
+    // when a library is loaded, all entries are dropped
+    bool tryAcquire(unsigned int version) {
+        if (!_lock.tryLock()) {
+            return false;
+        }
+        if (_version != version) {
+            memset(_entries, 0, sizeof(_entries));
+            _version = version;
+        }
+        return true;
+    }
+
+    void release() {
+        _lock.unlock();
+    }
+
+    FrameDesc* lookup(const void* pc) {
+        _lookups++;
+        Entry* e = &_entries[slot(pc)];
+        if (e->pc == pc && e->frame != NULL) {
+            _hits++;
+            return e->frame;
+        }
+        return NULL;
+    }
+
+    void insert(const void* pc, FrameDesc* frame) {
+        Entry* e = &_entries[slot(pc)];
+        e->pc = pc;
+        e->frame = frame;
+    }
+
+    u64 lookups() {
+        return _lookups;
+    }
+
+    u64 hits() {
+        return _hits;
+    }
+
+    void resetStats() {
+        _lock.lock();
+        _lookups = 0;
+        _hits = 0;
+        _lock.unlock();
+    }
+};
+
+#endif // _UNWINDCACHE_H
@@ -18,6 +18,7 @@
 #include "instrument.h"
 #include "lockTracer.h"
 #include "log.h"
+#include "symbols.h"
 #include "vmStructs.h"
 
 
@@ -469,6 +470,7 @@ Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
             Log::error("%s", error.message());
             return ARGUMENTS_ERROR;
         }
+        Symbols::setLazy(_global_args._lazy_symbols);
     }
 
     if (!VM::init(vm, false)) {
@@ -491,6 +493,7 @@ Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
         return ARGUMENTS_ERROR;
     }
 
+    Symbols::setLazy(args._lazy_symbols);
     if (!VM::init(vm, true)) {
         Log::error("JVM does not support Tool Interface");
         return COMMAND_ERROR;
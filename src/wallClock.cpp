@@ -3,12 +3,14 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <algorithm>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include "wallClock.h"
 #include "profiler.h"
 #include "stackFrame.h"
+#include "threadFilter.h"
 #include "tsc.h"
 
 
@@ -29,6 +31,10 @@ const u64 RUNNABLE_THRESHOLD_NS = 10000;
 // How many skipped idle samples can be recorded in a single WallClock event.
 const u32 MAX_IDLE_BATCH = 1000;
 
+// How often the set of live threads is checked against the full OS thread list.
+// Threads are normally added and removed by thread start/end hooks.
+const u64 THREAD_RESCAN_INTERVAL = 1000000000;
+
 
 struct ThreadSleepState {
     u64 start_time;
@@ -97,12 +103,22 @@ class ThreadCpuTimeBuffer {
     }
 };
 
-static ThreadCpuTimeBuffer _thread_cpu_time_buf;
+// One buffer per sampler thread. Allocated on demand and never released,
+// since a late signal may still find its way to the handler after stop()
+static ThreadCpuTimeBuffer* _thread_cpu_time_buf[MAX_WALL_THREADS];
+
+// Threads to walk, maintained incrementally while the timer loop is running
+static ThreadFilter _live_threads;
+static volatile bool _track_threads = false;
+
+// Sampler threads never signal each other
+static ThreadFilter _sampler_threads;
 
 
 long WallClock::_interval;
 int WallClock::_signal;
 WallClock::Mode WallClock::_mode;
+int WallClock::_samplers = 1;
 
 ThreadState WallClock::getThreadState(void* ucontext) {
     StackFrame frame(ucontext);
@@ -133,11 +149,19 @@ void WallClock::signalHandler(int signo, siginfo_t* siginfo, void* ucontext) {
         event._samples = 1;
         u64 trace = Profiler::instance()->recordSample(ucontext, _interval, WALL_CLOCK_SAMPLE, &event);
         if (event._thread_state == THREAD_SLEEPING && trace != 0) {
-            _thread_cpu_time_buf.add(trace);
+            _thread_cpu_time_buf[(u32)(trace >> 32) % _samplers]->add(trace);
+        }
+    } else if (_mode == CPU_ONLY) {
+        // The thread was picked by its recent CPU usage, but it may be blocked by now
+        if (getThreadState(ucontext) == THREAD_SLEEPING) {
+            return;
         }
+        ExecutionEvent event(TSC::ticks());
+        event._thread_state = THREAD_UNKNOWN;
+        Profiler::instance()->recordSample(ucontext, _interval, EXECUTION_SAMPLE, &event);
     } else {
         ExecutionEvent event(TSC::ticks());
-        event._thread_state = _mode == CPU_ONLY ? THREAD_UNKNOWN : getThreadState(ucontext);
+        event._thread_state = getThreadState(ucontext);
         Profiler::instance()->recordSample(ucontext, _interval, EXECUTION_SAMPLE, &event);
     }
 }
@@ -167,10 +191,35 @@ Error WallClock::start(Arguments& args) {
                                 : ((args._signal >> 8) > 0 ? args._signal >> 8 : args._signal);
     OS::installSignalHandler(_signal, signalHandler);
 
+    int samplers = args._wall_threads;
+    for (int i = 0; i < samplers; i++) {
+        if (_thread_cpu_time_buf[i] == NULL) {
+            _thread_cpu_time_buf[i] = new ThreadCpuTimeBuffer();
+        }
+    }
+    _samplers = samplers;
+
+    // Start tracking before the initial scan, so that no new thread is missed
+    _live_threads.clear();
+    __atomic_store_n(&_track_threads, true, __ATOMIC_RELEASE);
+    rescanThreads();
+
     _running = true;
 
-    if (pthread_create(&_thread, NULL, threadEntry, this) != 0) {
-        return Error("Unable to create timer thread");
+    for (int i = 0; i < samplers; i++) {
+        Sampler* sampler = &_sampler[i];
+        sampler->wall_clock = this;
+        sampler->index = i;
+        sampler->cycles = 0;
+        sampler->cycle_time = 0;
+        sampler->max_cycle_time = 0;
+    }
+
+    for (_started = 0; _started < samplers; _started++) {
+        if (pthread_create(&_sampler[_started].thread, NULL, threadEntry, &_sampler[_started]) != 0) {
+            stop();
+            return Error("Unable to create timer thread");
+        }
     }
 
     return Error::OK;
@@ -178,28 +227,115 @@ Error WallClock::start(Arguments& args) {
 
 void WallClock::stop() {
     _running = false;
-    pthread_kill(_thread, WAKEUP_SIGNAL);
-    pthread_join(_thread, NULL);
+    for (int i = 0; i < _started; i++) {
+        pthread_kill(_sampler[i].thread, WAKEUP_SIGNAL);
+    }
+    for (int i = 0; i < _started; i++) {
+        pthread_join(_sampler[i].thread, NULL);
+    }
+    _started = 0;
+    __atomic_store_n(&_track_threads, false, __ATOMIC_RELEASE);
+}
+
+bool WallClock::achievedInterval(u64* avg_ns, u64* max_ns) {
+    u64 total_cycles = 0;
+    u64 total_time = 0;
+    u64 max_interval = 0;
+    for (int i = 0; i < _samplers; i++) {
+        total_cycles += _sampler[i].cycles;
+        total_time += _sampler[i].cycle_time;
+        if (_sampler[i].max_cycle_time > max_interval) {
+            max_interval = _sampler[i].max_cycle_time;
+        }
+    }
+
+    if (total_cycles == 0) {
+        return false;
+    }
+    *avg_ns = total_time / total_cycles;
+    *max_ns = max_interval;
+    return true;
+}
+
+void WallClock::onThreadStart() {
+    if (__atomic_load_n(&_track_threads, __ATOMIC_ACQUIRE)) {
+        _live_threads.add(OS::threadId());
+    }
+}
+
+void WallClock::onThreadEnd() {
+    if (__atomic_load_n(&_track_threads, __ATOMIC_ACQUIRE)) {
+        _live_threads.remove(OS::threadId());
+    }
+}
+
+static void collectThreads(std::vector<int>& threads, int shard, int samplers) {
+    threads.clear();
+    _live_threads.collect(threads);
+    if (samplers > 1) {
+        threads.erase(std::remove_if(threads.begin(), threads.end(),
+                                     [=](int thread_id) { return thread_id % samplers != shard; }),
+                      threads.end());
+    }
 }
 
-void WallClock::timerLoop() {
-    int self = OS::threadId();
+// Catches threads that started before profiling or did not pass through the hooks,
+// e.g. JVM internal threads when async-profiler is loaded as an agent
+void WallClock::rescanThreads() {
+    std::vector<int> known_threads;
+    _live_threads.collect(known_threads);
+
+    std::vector<int> os_threads;
+    ThreadList* thread_list = OS::listThreads();
+    while (thread_list->hasNext()) {
+        int thread_id = thread_list->next();
+        // On macOS, task_threads() may sporadically return 0 or -1 among thread IDs
+        if (thread_id > 0) {
+            os_threads.push_back(thread_id);
+            _live_threads.add(thread_id);
+        }
+    }
+    delete thread_list;
+
+    // Threads registered after known_threads was collected are not touched
+    std::sort(os_threads.begin(), os_threads.end());
+    for (size_t i = 0; i < known_threads.size(); i++) {
+        if (!std::binary_search(os_threads.begin(), os_threads.end(), known_threads[i])) {
+            _live_threads.remove(known_threads[i]);
+        }
+    }
+}
+
+void WallClock::timerLoop(Sampler* sampler) {
+    int sampler_thread_id = OS::threadId();
+    _sampler_threads.add(sampler_thread_id);
     ThreadFilter* thread_filter = Profiler::instance()->threadFilter();
     bool thread_filter_enabled = thread_filter->enabled();
     Mode mode = _mode;
+    int shard = sampler->index;
+    int samplers = _samplers;
+    ThreadCpuTimeBuffer* thread_cpu_time_buf = _thread_cpu_time_buf[shard];
+
+    // Sampler threads should not compete with each other for a CPU
+    if (samplers > 1) {
+        OS::bindToCpu(shard);
+    }
 
     ThreadSleepMap thread_sleep_state;
-    ThreadList* thread_list = OS::listThreads();
-    _thread_cpu_time_buf.reset();
+    std::vector<int> threads;
+    collectThreads(threads, shard, samplers);
+    size_t thread_index = 0;
+    thread_cpu_time_buf->reset();
     u64 cycle_start_time = OS::nanotime();
+    u64 cycle_end_time = 0;
+    u64 rescan_time = cycle_start_time + THREAD_RESCAN_INTERVAL;
 
     while (_running) {
         bool enabled = _enabled;
 
-        for (int signaled_threads = 0; signaled_threads < THREADS_PER_TICK && thread_list->hasNext(); ) {
-            int thread_id = thread_list->next();
-            if (thread_id == self || thread_id <= 0) {
-                // On macOS, task_threads() may sporadically return 0 or -1 among thread IDs
+        for (int signaled_threads = 0; signaled_threads < THREADS_PER_TICK && thread_index < threads.size(); ) {
+            int thread_id = threads[thread_index++];
+            if (_sampler_threads.accept(thread_id)) {
                 continue;
             }
             if (thread_filter_enabled && !thread_filter->accept(thread_id)) {
@@ -207,7 +343,15 @@ void WallClock::timerLoop() {
             }
 
             if (mode == CPU_ONLY) {
-                if (!enabled || OS::threadState(thread_id) == THREAD_SLEEPING) {
+                if (!enabled) {
+                    continue;
+                }
+                // Skip threads that have not consumed CPU since the previous cycle
+                ThreadSleepState& tss = thread_sleep_state[thread_id];
+                u64 new_thread_cpu_time = OS::threadCpuTime(thread_id);
+                u64 last_cpu_time = tss.last_cpu_time;
+                tss.last_cpu_time = new_thread_cpu_time;
+                if (new_thread_cpu_time - last_cpu_time <= RUNNABLE_THRESHOLD_NS) {
                     continue;
                 }
             } else if (mode == WALL_BATCH) {
@@ -225,18 +369,33 @@ void WallClock::timerLoop() {
                 }
             }
 
-            if (enabled && OS::sendSignalToThread(thread_id, _signal)) {
-                signaled_threads++;
+            if (enabled) {
+                if (OS::sendSignalToThread(thread_id, _signal)) {
+                    signaled_threads++;
+                } else {
+                    // The thread has terminated without passing through the hooks
+                    _live_threads.remove(thread_id);
+                }
             }
         }
 
         u64 current_time = OS::nanotime();
-        if (thread_list->hasNext()) {
+        if (thread_index < threads.size()) {
             // Try to keep interval stable regardless of the number of profiled threads
-            long long sleep_time = cycle_start_time + (u64)_interval * thread_list->index() / thread_list->count() - current_time;
+            long long sleep_time = cycle_start_time + (u64)_interval * thread_index / threads.size() - current_time;
             OS::uninterruptibleSleep(sleep_time < MIN_INTERVAL ? MIN_INTERVAL : sleep_time, &_running);
         } else {
             // Cycle has ended: prepare for the next cycle
+            if (cycle_end_time != 0) {
+                u64 cycle_time = current_time - cycle_end_time;
+                sampler->cycle_time += cycle_time;
+                sampler->cycles++;
+                if (cycle_time > sampler->max_cycle_time) {
+                    sampler->max_cycle_time = cycle_time;
+                }
+            }
+            cycle_end_time = current_time;
+
             cycle_start_time += (u64)_interval;
             long long sleep_time = cycle_start_time - current_time;
             if (sleep_time < MIN_INTERVAL) {
@@ -244,15 +403,33 @@ void WallClock::timerLoop() {
                 sleep_time = MIN_INTERVAL;
             }
             OS::uninterruptibleSleep(sleep_time, &_running);
-            thread_list->update();
+
+            if (current_time >= rescan_time) {
+                rescan_time = current_time + THREAD_RESCAN_INTERVAL;
+                if (shard == 0) {
+                    rescanThreads();
+                }
+                // Flush and forget the state of terminated threads
+                for (ThreadSleepMap::iterator it = thread_sleep_state.begin(); it != thread_sleep_state.end(); ) {
+                    if (_live_threads.accept(it->first)) {
+                        ++it;
+                        continue;
+                    }
+                    if (it->second.counter != 0) {
+                        recordWallClock(it->second.start_time, THREAD_SLEEPING, it->second.counter, it->first, it->second.call_trace_id);
+                    }
+                    thread_sleep_state.erase(it++);
+                }
+            }
+
+            collectThreads(threads, shard, samplers);
+            thread_index = 0;
         }
 
         // Sync thread CPU times updated since the previous iteration
-        _thread_cpu_time_buf.drain(thread_sleep_state);
+        thread_cpu_time_buf->drain(thread_sleep_state);
     }
 
-    delete thread_list;
-
     // Flush remaining WallClock batches
     for (ThreadSleepMap::const_iterator it = thread_sleep_state.begin(); it != thread_sleep_state.end(); ++it) {
         const ThreadSleepState& tss = it->second;
@@ -260,4 +437,6 @@ void WallClock::timerLoop() {
             recordWallClock(tss.start_time, THREAD_SLEEPING, tss.counter, it->first, tss.call_trace_id);
         }
     }
+
+    _sampler_threads.remove(sampler_thread_id);
 }
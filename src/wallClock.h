@@ -12,7 +12,6 @@
 #include "engine.h"
 #include "os.h"
 
-
 class WallClock : public Engine {
   private:
     enum Mode {
@@ -21,17 +20,29 @@ class WallClock : public Engine {
         WALL_LEGACY
     };
 
+    // Each sampler thread walks its own share of threads: those with thread_id % samplers == index
+    struct Sampler {
+        WallClock* wall_clock;
+        int index;
+        pthread_t thread;
+        volatile u64 cycles;
+        volatile u64 cycle_time;
+        volatile u64 max_cycle_time;
+    };
+
     static long _interval;
     static int _signal;
     static Mode _mode;
+    static int _samplers;
 
     volatile bool _running;
-    pthread_t _thread;
+    int _started;
+    Sampler _sampler[MAX_WALL_THREADS];
 
-    void timerLoop();
+    void timerLoop(Sampler* sampler);
 
-    static void* threadEntry(void* wall_clock) {
-        ((WallClock*)wall_clock)->timerLoop();
+    static void* threadEntry(void* sampler) {
+        ((Sampler*)sampler)->wall_clock->timerLoop((Sampler*)sampler);
         return NULL;
     }
 
@@ -41,6 +52,8 @@ class WallClock : public Engine {
 
     static void recordWallClock(u64 start_time, ThreadState state, u32 samples, int tid, u32 call_trace_id);
 
+    static void rescanThreads();
+
   public:
     const char* type() {
         return "wall";
@@ -56,6 +69,13 @@ class WallClock : public Engine {
 
     Error start(Arguments& args);
     void stop();
+
+    // Average and the longest time between two visits of the same thread
+    bool achievedInterval(u64* avg_ns, u64* max_ns);
+
+    // Keep the set of live threads without listing them on every cycle
+    static void onThreadStart();
+    static void onThreadEnd();
 };
 
 #endif // _WALLCLOCK_H
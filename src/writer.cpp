@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include "ioRing.h"
 #include "writer.h"
 
 
@@ -40,23 +41,50 @@ Writer& Writer::operator<<(u64 n) {
     return *this;
 }
 
-FileWriter::FileWriter(const char* file_name) : _size(0) {
+FileWriter::FileWriter(const char* file_name, bool io_ring) : _size(0), _io_ring(NULL), _spare_buf(NULL) {
     _fd = open(file_name, O_WRONLY | O_TRUNC | O_CREAT, 0644);
     _buf = (char*)malloc(BUF_SIZE);
+    if (io_ring && _fd >= 0) {
+        openIoRing();
+    }
 }
 
-FileWriter::FileWriter(int fd) : _fd(fd), _size(0) {
+FileWriter::FileWriter(int fd) : _fd(fd), _size(0), _io_ring(NULL), _spare_buf(NULL) {
     _buf = (char*)malloc(BUF_SIZE);
 }
 
 FileWriter::~FileWriter() {
-    flush(_buf, _size);
+    flushBuffer();
+    if (_io_ring != NULL) {
+        waitIoRing();
+        delete _io_ring;
+        free(_spare_buf);
+    }
     free(_buf);
     if (_fd > STDERR_FILENO) {
         close(_fd);
     }
 }
 
+// With io_uring, a filled buffer is written asynchronously while the spare one is being filled
+void FileWriter::openIoRing() {
+    _io_ring = new IoRing();
+    if (_io_ring->open(2)) {
+        _spare_buf = (char*)malloc(BUF_SIZE);
+    }
+    if (_spare_buf == NULL) {
+        Log::debug("io_uring is not available, using synchronous writes");
+        delete _io_ring;
+        _io_ring = NULL;
+    }
+}
+
+void FileWriter::waitIoRing() {
+    if (_io_ring->wait() < 0) {
+        _err = _io_ring->error();
+    }
+}
+
 void FileWriter::flush(const char* data, size_t len) {
     while (len > 0) {
         ssize_t bytes = ::write(_fd, data, len);
@@ -69,11 +97,30 @@ void FileWriter::flush(const char* data, size_t len) {
     }
 }
 
+void FileWriter::flushBuffer() {
+    if (_io_ring == NULL) {
+        flush(_buf, _size);
+    } else if (_size > 0) {
+        waitIoRing();
+        _io_ring->write(_fd, _buf, _size, CURRENT_POSITION);
+        if (!_io_ring->submit()) {
+            _err = _io_ring->error();
+        }
+
+        char* buf = _buf;
+        _buf = _spare_buf;
+        _spare_buf = buf;
+    }
+    _size = 0;
+}
+
 void FileWriter::write(const char* data, size_t len) {
     if (_size + len > BUF_SIZE) {
-        flush(_buf, _size);
-        _size = 0;
+        flushBuffer();
         if (len > BUF_SIZE) {
+            if (_io_ring != NULL) {
+                waitIoRing();
+            }
             flush(data, len);
             return;
         }
@@ -9,6 +9,8 @@
 #include "asprof.h"
 #include "log.h"
 
+class IoRing;
+
 
 class Writer {
   protected:
@@ -36,13 +38,18 @@ class FileWriter : public Writer {
     int _fd;
     char* _buf;
     size_t _size;
+    IoRing* _io_ring;
+    char* _spare_buf;
 
     enum { BUF_SIZE = 8192 };
 
     void flush(const char* data, size_t len);
+    void flushBuffer();
+    void openIoRing();
+    void waitIoRing();
 
   public:
-    FileWriter(const char* file_name);
+    FileWriter(const char* file_name, bool io_ring = false);
     FileWriter(int fd);
     ~FileWriter();
 
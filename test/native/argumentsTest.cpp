@@ -89,3 +89,44 @@ TEST_CASE(Parse_proc_with_units) {
     Error error = args.parse(argument);
     ASSERT_EQ(args._proc, 120);
 }
+
+TEST_CASE(Parse_tracemem) {
+    Arguments args;
+    char argument[] = "start,tracemem=268435456:3,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), NULL);
+    ASSERT_EQ(args._trace_mem, 268435456);
+    ASSERT_EQ(args._trace_age, 3);
+}
+
+TEST_CASE(Parse_tracemem_with_units) {
+    Arguments args;
+    char argument[] = "start,tracemem=256m,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), NULL);
+    ASSERT_EQ(args._trace_mem, 256 * 1024 * 1024);
+    ASSERT_EQ(args._trace_age, 2);
+}
+
+TEST_CASE(Parse_tracemem_invalid_age) {
+    Arguments args;
+    char argument[] = "start,tracemem=256m:0,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), "Invalid tracemem");
+    ASSERT_EQ(args._trace_mem, 256 * 1024 * 1024);
+}
+
+TEST_CASE(Parse_wallthreads) {
+    Arguments args;
+    char argument[] = "start,wallthreads=16,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), NULL);
+    ASSERT_EQ(args._wall_threads, 16);
+}
+
+TEST_CASE(Parse_wallthreads_too_many) {
+    Arguments args;
+    char argument[] = "start,wallthreads=17,file=%f.jfr";
+    Error error = args.parse(argument);
+    ASSERT_EQ(error.message(), "wallthreads must be between 1 and 16");
+}
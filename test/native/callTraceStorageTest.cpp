@@ -0,0 +1,425 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "callTraceStorage.h"
+#include "os.h"
+#include "testRunner.hpp"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static const int THREADS = 8;
+static const int PUTS_PER_THREAD = 100000;
+
+static void makeFrames(ASGCT_CallFrame* frames, int num_frames, int seed) {
+    memset(frames, 0, num_frames * sizeof(ASGCT_CallFrame));
+    for (int i = 0; i < num_frames; i++) {
+        frames[i].bci = i;
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x1000 + seed * 64 + i);
+    }
+}
+
+static u64 totalSamples(CallTraceStorage& storage, u64* counter) {
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+
+    u64 total = 0;
+    *counter = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i]->samples;
+        *counter += samples[i]->counter;
+    }
+    return total;
+}
+
+struct PutContext {
+    CallTraceStorage* storage;
+    u32 shard;
+    int puts;
+};
+
+static void* putLoop(void* arg) {
+    PutContext* ctx = (PutContext*)arg;
+    ASGCT_CallFrame frames[4];
+    makeFrames(frames, 4, 0);
+
+    for (int i = 0; i < ctx->puts; i++) {
+        ctx->storage->put(4, frames, 10, ctx->shard);
+    }
+    return NULL;
+}
+
+// Runs put() of the same trace concurrently, returns the elapsed time in ns
+static u64 concurrentPut(CallTraceStorage& storage, int threads, int puts_per_thread) {
+    pthread_t thread[64];
+    PutContext ctx[64];
+    u64 start = OS::nanotime();
+    for (int i = 0; i < threads; i++) {
+        ctx[i].storage = &storage;
+        ctx[i].shard = i;
+        ctx[i].puts = puts_per_thread;
+        pthread_create(&thread[i], NULL, putLoop, &ctx[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    return OS::nanotime() - start;
+}
+
+TEST_CASE(CallTraceStorage_sameTraceId) {
+    CallTraceStorage storage;
+    storage.setShards(16);
+
+    ASGCT_CallFrame frames[3];
+    makeFrames(frames, 3, 1);
+
+    u32 id1 = storage.put(3, frames, 1, 0);
+    u32 id2 = storage.put(3, frames, 1, 5);
+    CHECK_EQ(id1, id2);
+    CHECK_NE(id1, 0);
+}
+
+TEST_CASE(CallTraceStorage_shardedCounters) {
+    CallTraceStorage storage;
+    storage.setShards(4);
+
+    ASGCT_CallFrame frames[2];
+    makeFrames(frames, 2, 2);
+
+    for (u32 shard = 0; shard < 10; shard++) {
+        storage.put(2, frames, 100, shard);
+    }
+
+    u64 counter;
+    CHECK_EQ(totalSamples(storage, &counter), 10);
+    CHECK_EQ(counter, 1000);
+
+    // Shards must not be counted twice on the next collection
+    CHECK_EQ(totalSamples(storage, &counter), 10);
+    CHECK_EQ(counter, 1000);
+
+    storage.resetCounters();
+    CHECK_EQ(totalSamples(storage, &counter), 0);
+    CHECK_EQ(counter, 0);
+}
+
+TEST_CASE(CallTraceStorage_shardedGrowth) {
+    CallTraceStorage storage;
+    storage.setShards(16);
+
+    // Enough distinct traces to trigger table expansion
+    const int traces = 100000;
+    ASGCT_CallFrame frames[2];
+    for (int i = 0; i < traces; i++) {
+        makeFrames(frames, 2, i);
+        storage.put(2, frames, 1, i);
+    }
+
+    u64 counter;
+    CHECK_EQ(totalSamples(storage, &counter), traces);
+    CHECK_EQ(counter, traces);
+}
+
+TEST_CASE(CallTraceStorage_concurrentPut) {
+    for (u32 shards = 0; shards <= 4; shards += 4) {
+        CallTraceStorage storage;
+        storage.setShards(shards);
+
+        // Two rounds: counters put after a merge must be merged by the next one
+        for (int round = 1; round <= 2; round++) {
+            concurrentPut(storage, THREADS, PUTS_PER_THREAD);
+
+            u64 counter;
+            CHECK_EQ(totalSamples(storage, &counter), (u64)round * THREADS * PUTS_PER_THREAD);
+            CHECK_EQ(counter, (u64)round * THREADS * PUTS_PER_THREAD * 10);
+        }
+    }
+}
+
+TEST_CASE(CallTraceStorage_concurrentPutBenchmark, benchmarksEnabled()) {
+    const int puts_per_thread = 2000000;
+    int cpus = OS::getCpuCount();
+    int max_threads = cpus < THREADS ? THREADS : cpus > 64 ? 64 : cpus;
+
+    // 1, 2, 4... threads, up to one thread per CPU
+    for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        double puts_per_sec[2];
+        for (int sharded = 0; sharded <= 1; sharded++) {
+            CallTraceStorage storage;
+            storage.setShards(sharded ? 16 : 0);
+            u64 time = concurrentPut(storage, threads, puts_per_thread);
+            puts_per_sec[sharded] = (double)threads * puts_per_thread * 1e9 / time;
+
+            u64 counter;
+            CHECK_EQ(totalSamples(storage, &counter), (u64)threads * puts_per_thread);
+        }
+        printf("threads=%d: %.1f M puts/s, sharded %.1f M puts/s\n", threads,
+               puts_per_sec[0] / 1e6, puts_per_sec[1] / 1e6);
+        if (threads == max_threads) break;
+    }
+}
+
+static void makeDeepFrames(ASGCT_CallFrame* frames, int num_frames, int leaf_frames, int seed) {
+    // Traces differ only in the top leaf_frames frames
+    makeFrames(frames, num_frames, 0);
+    for (int i = 0; i < leaf_frames; i++) {
+        frames[i].method_id = (jmethodID)(uintptr_t)(0x100000 + seed * 64 + i);
+    }
+}
+
+TEST_CASE(CallTraceStorage_compactTraces) {
+    CallTraceStorage storage;
+    storage.setCompact(true);
+
+    const int depth = 50;
+    ASGCT_CallFrame frames[depth];
+    u32 ids[10];
+    for (int i = 0; i < 10; i++) {
+        makeDeepFrames(frames, depth, 5, i);
+        ids[i] = storage.put(depth, frames, 1, 0);
+        storage.markReferenced(ids[i]);
+    }
+
+    u64 counter;
+    CHECK_EQ(totalSamples(storage, &counter), 10);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 10);
+
+    for (int i = 0; i < 10; i++) {
+        makeDeepFrames(frames, depth, 5, i);
+        CallTrace* trace = traces[ids[i]];
+        ASSERT(trace != NULL);
+        CHECK_EQ(trace->num_frames, depth);
+        for (int j = 0; j < depth; j++) {
+            CHECK_EQ(trace->frames[j].method_id, frames[j].method_id);
+            CHECK_EQ(trace->frames[j].bci, frames[j].bci);
+        }
+    }
+}
+
+TEST_CASE(CallTraceStorage_compactMemory) {
+    const int depth = 1000;
+    const int traces = 2000;
+    ASGCT_CallFrame frames[depth];
+
+    // Memory taken by stored traces, excluding fixed size structures
+    size_t used[2];
+    for (int compact = 0; compact <= 1; compact++) {
+        CallTraceStorage storage;
+        storage.setCompact(compact != 0);
+        size_t empty = storage.usedMemory();
+        for (int i = 0; i < traces; i++) {
+            makeDeepFrames(frames, depth, 10, i);
+            storage.put(depth, frames, 1, 0);
+        }
+        used[compact] = storage.usedMemory() - empty;
+    }
+
+    CHECK_LT(used[1] * 4, used[0]);
+}
+
+TEST_CASE(CallTraceStorage_resumableHash) {
+    ASGCT_CallFrame frames[20];
+    makeFrames(frames, 20, 3);
+
+    CallTraceHasher whole;
+    whole.update(frames, 20);
+
+    CallTraceHasher parts;
+    parts.update(frames, 7);
+    parts.update(frames + 7, 0);
+    parts.update(frames + 7, 13);
+    CHECK_EQ(whole.finish(), parts.finish());
+
+    CallTraceHasher shorter;
+    shorter.update(frames, 19);
+    CHECK_NE(whole.finish(), shorter.finish());
+
+    frames[10].bci++;
+    CallTraceHasher modified;
+    modified.update(frames, 20);
+    CHECK_NE(whole.finish(), modified.finish());
+}
+
+TEST_CASE(CallTraceStorage_putWithHash) {
+    CallTraceStorage storage;
+
+    ASGCT_CallFrame frames[8];
+    makeFrames(frames, 8, 4);
+
+    CallTraceHasher hasher;
+    hasher.update(frames, 8);
+    u32 id1 = storage.put(8, frames, 1, 0, hasher.finish());
+    u32 id2 = storage.put(8, frames, 1, 0);
+    CHECK_EQ(id1, id2);
+}
+
+static void collectChunk(CallTraceStorage& storage) {
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+}
+
+// Stores a call trace and references it from the current chunk, like a recorded JFR event
+static u32 record(CallTraceStorage& storage, int num_frames, ASGCT_CallFrame* frames) {
+    u32 call_trace_id = storage.put(num_frames, frames, 1, 0);
+    storage.markReferenced(call_trace_id);
+    return call_trace_id;
+}
+
+TEST_CASE(CallTraceStorage_collectReferencedTraces) {
+    CallTraceStorage storage;
+
+    ASGCT_CallFrame first[4];
+    ASGCT_CallFrame second[4];
+    makeFrames(first, 4, 7);
+    makeFrames(second, 4, 8);
+
+    u32 first_id = record(storage, 4, first);
+    u32 second_id = storage.put(4, second, 1, 0);
+
+    // A trace stored without an event is not written to the chunk
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 1);
+    CHECK(traces.find(first_id) != traces.end());
+
+    // References are reset when the chunk is collected
+    storage.markReferenced(second_id);
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 1);
+    CHECK(traces.find(second_id) != traces.end());
+
+    // Events that refer to a trace stored in an earlier chunk bring it back
+    CHECK_EQ(storage.add(first_id, 1, 1), first_id);
+    storage.markReferenced(first_id);
+    traces.clear();
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 1);
+    ASSERT(traces[first_id] != NULL);
+    CHECK_EQ(traces[first_id]->frames[0].method_id, first[0].method_id);
+}
+
+TEST_CASE(CallTraceStorage_evictIdleTraces) {
+    CallTraceStorage storage;
+
+    ASGCT_CallFrame hot[4];
+    ASGCT_CallFrame cold[4];
+    makeFrames(hot, 4, 5);
+    makeFrames(cold, 4, 6);
+
+    u32 hot_id = record(storage, 4, hot);
+    u32 cold_id = record(storage, 4, cold);
+    collectChunk(storage);
+
+    // The cold trace is not referenced in the next two chunks
+    for (int chunk = 0; chunk < 2; chunk++) {
+        record(storage, 4, hot);
+        collectChunk(storage);
+    }
+    CHECK_EQ(storage.evict(2), 1);
+
+    // Surviving traces get new IDs
+    u32 new_hot_id = record(storage, 4, hot);
+    CHECK_NE(new_hot_id, hot_id);
+    CHECK_NE(new_hot_id, cold_id);
+
+    // Samples recorded with the old ID of a surviving trace go to the same trace
+    CHECK_EQ(storage.add(hot_id, 1, 10), new_hot_id);
+    CHECK_EQ(storage.evicted(), 0);
+
+    // IDs issued before eviction are not reused
+    u32 evicted_id = storage.add(cold_id, 3, 30);
+    CHECK_NE(evicted_id, cold_id);
+    CHECK_EQ(storage.evicted(), 3);
+    CHECK_EQ(storage.add(new_hot_id, 1, 10), new_hot_id);
+    storage.markReferenced(evicted_id);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 2);
+    ASSERT(traces[new_hot_id] != NULL);
+    CHECK_EQ(traces[new_hot_id]->frames[0].method_id, hot[0].method_id);
+    ASSERT(traces[evicted_id] != NULL);
+    CHECK_EQ(traces[evicted_id]->frames[0].bci, BCI_ERROR);
+}
+
+TEST_CASE(CallTraceStorage_evictReleasesMemory) {
+    CallTraceStorage storage;
+    storage.setCompact(true);
+
+    // Enough distinct traces to trigger table expansion
+    const int traces = 100000;
+    ASGCT_CallFrame frames[16];
+    for (int i = 0; i < traces; i++) {
+        makeDeepFrames(frames, 16, 4, i);
+        record(storage, 16, frames);
+    }
+    collectChunk(storage);
+    size_t used = storage.usedMemory();
+
+    makeDeepFrames(frames, 16, 4, 0);
+    record(storage, 16, frames);
+    collectChunk(storage);
+    int evicted = storage.evict(1);
+    CHECK_GTE(evicted, traces - 1);
+    CHECK_LT(storage.usedMemory(), used);
+
+    u64 counter;
+    storage.put(16, frames, 1, 0);
+    CHECK_EQ(totalSamples(storage, &counter), 1);
+}
+
+TEST_CASE(CallTraceStorage_evictKeepsOldIds) {
+    CallTraceStorage storage;
+
+    ASGCT_CallFrame frames[4];
+    u32 ids[16];
+    for (int i = 0; i < 16; i++) {
+        makeFrames(frames, 4, 20 + i);
+        ids[i] = record(storage, 4, frames);
+    }
+    collectChunk(storage);
+
+    // Nothing is idle: the storage is not rebuilt, and IDs do not change
+    CHECK_EQ(storage.evict(1), 0);
+    CHECK_EQ(storage.add(ids[0], 1, 1), ids[0]);
+
+    // Odd traces become idle
+    for (int i = 0; i < 16; i += 2) {
+        storage.markReferenced(storage.add(ids[i], 1, 1));
+    }
+    collectChunk(storage);
+    CHECK_EQ(storage.evict(1), 8);
+
+    // Another trace becomes idle, while even traces are still referenced by their original IDs
+    makeFrames(frames, 4, 40);
+    record(storage, 4, frames);
+    collectChunk(storage);
+    for (int i = 0; i < 16; i += 2) {
+        storage.markReferenced(storage.add(ids[i], 1, 1));
+    }
+    collectChunk(storage);
+    CHECK_EQ(storage.evict(1), 1);
+
+    u32 new_ids[16];
+    for (int i = 0; i < 16; i++) {
+        new_ids[i] = storage.add(ids[i], 1, 1);
+        storage.markReferenced(new_ids[i]);
+    }
+    CHECK_EQ(storage.evicted(), 8);
+
+    std::map<u32, CallTrace*> traces;
+    storage.collectTraces(traces);
+    CHECK_EQ(traces.size(), 9);
+    for (int i = 0; i < 16; i += 2) {
+        makeFrames(frames, 4, 20 + i);
+        CHECK_NE(new_ids[i], ids[i]);
+        ASSERT(traces[new_ids[i]] != NULL);
+        CHECK_EQ(traces[new_ids[i]]->frames[0].method_id, frames[0].method_id);
+    }
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "codeCache.h"
+#include "os.h"
+#include "profiler.h"
+#include "testRunner.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const uintptr_t LIB_BASE = 0x7f0000000000ULL;
+static const uintptr_t LIB_STRIDE = 0x200000;
+static const uintptr_t LIB_SIZE = 0x100000;
+
+// Synthetic libraries with gaps between them, added in a shuffled order
+static CodeCache** createLibraries(CodeCacheArray* array, int count) {
+    CodeCache** libs = new CodeCache*[count];
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)(LIB_BASE + i * LIB_STRIDE);
+        libs[i] = new CodeCache("synthetic", i, start, start + LIB_SIZE);
+    }
+
+    int* order = new int[count];
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    srand(count);
+    for (int i = count - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (int i = 0; i < count; i++) {
+        array->add(libs[order[i]]);
+    }
+
+    delete[] order;
+    return libs;
+}
+
+static void destroyLibraries(CodeCache** libs, int count) {
+    for (int i = 0; i < count; i++) {
+        delete libs[i];
+    }
+    delete[] libs;
+}
+
+TEST_CASE(CodeCacheArray_findByAddress) {
+    const int count = 300;
+    CodeCacheArray* array = new CodeCacheArray();
+    CodeCache** libs = createLibraries(array, count);
+
+    // A library without bounds is never found
+    CodeCache empty("empty");
+    array->add(&empty);
+
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)libs[i]->minAddress();
+        CHECK_EQ(array->findByAddress(start), libs[i]);
+        CHECK_EQ(array->findByAddress(start + LIB_SIZE - 1), libs[i]);
+        CHECK_EQ(array->findByAddress(start + LIB_SIZE), (CodeCache*)NULL);
+    }
+    CHECK_EQ(array->findByAddress((const void*)(LIB_BASE - 1)), (CodeCache*)NULL);
+    CHECK_EQ(array->findByAddress(NULL), (CodeCache*)NULL);
+
+    // A range enclosing other libraries, like [kernel] or a library with a large bss
+    const char* outer_start = (const char*)LIB_BASE + LIB_STRIDE * 10 + LIB_SIZE;
+    CodeCache outer("outer", -1, outer_start, outer_start + LIB_STRIDE * 5);
+    array->add(&outer);
+    CHECK_EQ(array->findByAddress(outer_start), &outer);
+    CHECK_EQ(array->findByAddress(outer_start + LIB_STRIDE * 2), &outer);
+    CHECK_EQ(array->findByAddress(outer_start + LIB_STRIDE * 5), (CodeCache*)NULL);
+
+    const char* inner = (const char*)libs[12]->minAddress() + 1;
+    CodeCache* found = array->findByAddress(inner);
+    CHECK(found == libs[12] || found == &outer);
+
+    delete array;
+    destroyLibraries(libs, count);
+}
+
+TEST_CASE(CodeCacheArray_lookupMatchesLinearScan) {
+    const int lookups = 100000;
+    const int counts[] = {10, 100, 300, 1000, MAX_NATIVE_LIBS};
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int count = counts[c];
+        CodeCacheArray* array = new CodeCacheArray();
+        CodeCache** libs = createLibraries(array, count);
+
+        // Spread addresses across all libraries and the gaps between them
+        int found = 0;
+        for (int i = 0; i < lookups; i++) {
+            const char* address = (const char*)LIB_BASE + (u64)i * 7919 % count * LIB_STRIDE + (u64)i * 131 % LIB_STRIDE;
+            CodeCache* expected = NULL;
+            for (int j = 0; j < count; j++) {
+                if ((*array)[j]->contains(address)) {
+                    expected = (*array)[j];
+                    break;
+                }
+            }
+            CodeCache* actual = array->findByAddress(address);
+            if (actual != expected) {
+                CHECK_EQ(actual, expected);
+                break;
+            }
+            found += actual != NULL;
+        }
+        CHECK_GT(found, 0);
+        CHECK_LT(found, lookups);
+
+        delete array;
+        destroyLibraries(libs, count);
+    }
+}
+
+TEST_CASE(CodeCacheArray_lookupBenchmark, benchmarksEnabled()) {
+    const int lookups = 200000;
+    const int counts[] = {10, 100, 300, 1000, MAX_NATIVE_LIBS};
+
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        int count = counts[c];
+        CodeCacheArray* array = new CodeCacheArray();
+        CodeCache** libs = createLibraries(array, count);
+
+        // Spread addresses across all libraries, like native frames of real stacks
+        u64 start = OS::nanotime();
+        int found = 0;
+        for (int i = 0; i < lookups; i++) {
+            const char* address = (const char*)LIB_BASE + (u64)i * 7919 % count * LIB_STRIDE + i % LIB_SIZE;
+            found += array->findByAddress(address) != NULL;
+        }
+        u64 indexed = OS::nanotime() - start;
+
+        start = OS::nanotime();
+        int found_linear = 0;
+        for (int i = 0; i < lookups; i++) {
+            const char* address = (const char*)LIB_BASE + (u64)i * 7919 % count * LIB_STRIDE + i % LIB_SIZE;
+            for (int j = 0; j < count; j++) {
+                if ((*array)[j]->contains(address)) {
+                    found_linear++;
+                    break;
+                }
+            }
+        }
+        u64 linear = OS::nanotime() - start;
+
+        printf("libs=%d: indexed %.1f ns/lookup, linear %.1f ns/lookup\n", count,
+               (double)indexed / lookups, (double)linear / lookups);
+        CHECK_EQ(found, lookups);
+        CHECK_EQ(found_linear, lookups);
+
+        delete array;
+        destroyLibraries(libs, count);
+    }
+}
+
+TEST_CASE(CodeBlobIndex_find) {
+    // More stubs than the initial capacity, so that the index grows
+    const int count = 5000;
+    const uintptr_t stub_size = 0x80;
+    CodeBlobIndex* index = new CodeBlobIndex();
+    char name[] = "stub";
+
+    srand(count);
+    int* order = new int[count];
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (int i = count - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)LIB_BASE + order[i] * stub_size * 2;
+        index->add(start, start + stub_size, name);
+    }
+    CHECK_EQ(index->count(), count);
+
+    for (int i = 0; i < count; i++) {
+        const char* start = (const char*)LIB_BASE + i * stub_size * 2;
+        CodeBlob* blob = index->find(start + stub_size - 1);
+        ASSERT(blob != NULL);
+        CHECK_EQ(blob->_start, (const void*)start);
+        CHECK_EQ(blob->_name, name);
+        CHECK_EQ(index->find(start + stub_size), (CodeBlob*)NULL);
+    }
+    CHECK_EQ(index->find((const void*)(LIB_BASE - 1)), (CodeBlob*)NULL);
+
+    // A stub regenerated inside a larger one, e.g. an adapter in a buffer blob
+    const char* outer = (const char*)LIB_BASE + count * stub_size * 2;
+    index->add(outer, outer + 0x1000, name);
+    index->add(outer + 0x100, outer + 0x200, name);
+    CHECK_EQ(index->find(outer + 0x180)->_start, (const void*)(outer + 0x100));
+    CHECK_EQ(index->find(outer + 0x800)->_start, (const void*)outer);
+
+    delete[] order;
+    delete index;
+}
+
+TEST_CASE(CodeCache_moveSymbols) {
+    // Borrow the index of a loaded library to resolve library names of moved symbols
+    Profiler* profiler = Profiler::instance();
+    profiler->updateSymbols(false);
+    CodeCache* libc = profiler->findLibraryByName("libc");
+    ASSERT(libc);
+
+    const char* base = (const char*)LIB_BASE;
+    CodeCache live(libc->name(), libc->libIndex(), base, base + LIB_SIZE);
+    const char* exported = live.add(base + 0x100, 0x100, "exported");
+    live.add(base + 0x300, 0x100, "exported2");
+    live.add(base + 0x500, 0x100, "exported3");
+    live.sort();
+
+    // Full symbol table has fewer, but larger symbols
+    CodeCache staging(libc->name(), live.libIndex(), base, base + LIB_SIZE);
+    staging.add(base + 0x100, 0x300, "local");
+    staging.add(base + 0x400, 0x300, "exported3");
+    staging.sort();
+    CHECK_EQ(live.binarySearch(base + 0x280), live.name());
+
+    // Build the name index over the array that is about to be replaced
+    for (int i = 0; i <= SYMBOL_HASH_THRESHOLD; i++) {
+        CHECK_EQ(live.findSymbol("exported2"), (const void*)(base + 0x300));
+    }
+
+    live.moveSymbols(&staging);
+    CHECK_EQ(strcmp(live.binarySearch(base + 0x280), "local"), 0);
+    CHECK_EQ(strcmp(live.binarySearch(base + 0x600), "exported3"), 0);
+    CHECK_EQ(live.binarySearch(base + 0x800), live.name());
+    CHECK_EQ(live.findSymbol("exported"), (const void*)NULL);
+    CHECK_EQ(live.findSymbol("local"), (const void*)(base + 0x100));
+    for (int i = 0; i <= SYMBOL_HASH_THRESHOLD; i++) {
+        CHECK_EQ(live.findSymbol("exported3"), (const void*)(base + 0x400));
+        CHECK_EQ(live.findSymbol("exported2"), (const void*)NULL);
+    }
+
+    const char* local = live.binarySearch(base + 0x280);
+    CHECK_EQ(NativeFunc::libIndex(local), libc->libIndex());
+    const char* lib_name = profiler->getLibraryName(local);
+    ASSERT(lib_name);
+    CHECK_EQ(strncmp(lib_name, "libc", 4), 0);
+
+    // Names of replaced symbols remain valid, since call traces may refer to them
+    CHECK_EQ(strcmp(exported, "exported"), 0);
+    CHECK_EQ(staging.binarySearch(base + 0x100), staging.name());
+}
+
+// Lookups made by VMStructs and hooks at startup in a library of libjvm size
+TEST_CASE(CodeCache_findSymbolIndexed) {
+    const int count = 100000;
+    const int lookups = 200;
+    const char* base = (const char*)LIB_BASE;
+    CodeCache* cc = new CodeCache("libsynthetic.so", 0, base, base + LIB_SIZE);
+
+    char name[64];
+    char** names = new char*[count];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", i % 7 + 10, i);
+        names[i] = cc->add(base + i * 8, 8, name);
+    }
+
+    const char* end = base + count * 8;
+    cc->add(end + 0x10, 8, "_ZN4Dup1fEv.cold");
+    cc->add(end + 0x20, 8, "_ZN4Dup1fEv");
+    cc->add(end + 0x30, 8, "_ZN4Dup1fEv");
+    cc->add(end + 0x40, 8, "_ZN4Dup1gEv.cold");
+    cc->add(end + 0x50, 8, "_ZN4Dup1gEv.part.0");
+    cc->sort();
+
+    // Indexed lookups must agree with the linear scan that the index replaces,
+    // for present names as well as for names with a wrong length prefix
+    for (int i = 0; i < lookups; i++) {
+        int n = i * 499 % count;
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", (n + i % 2) % 7 + 10, n);
+        const void* expected = NULL;
+        for (int j = 0; j < count; j++) {
+            if (strcmp(names[j], name) == 0) {
+                expected = base + j * 8;
+                break;
+            }
+        }
+        CHECK_EQ(cc->findSymbol(name), expected);
+        CHECK_EQ(expected != NULL, i % 2 == 0);
+    }
+    CHECK_EQ(cc->findSymbol("_ZN10Symbol"), (const void*)NULL);
+
+    // The first of duplicate names wins
+    CHECK_EQ(cc->findSymbol("_ZN4Dup1fEv"), (const void*)(end + 0x20));
+
+    // Prefix lookup prefers symbols without a dot suffix, before and after the index is built
+    for (int i = 0; i <= SYMBOL_SORT_THRESHOLD; i++) {
+        CHECK_EQ(cc->findSymbolByPrefix("_ZN4Dup1f"), (const void*)(end + 0x20));
+        CHECK_EQ(cc->findSymbolByPrefix("_ZN4Dup1fEv."), (const void*)(end + 0x10));
+        CHECK_EQ(cc->findSymbolByPrefix("_ZN4Dup1g"), (const void*)(end + 0x50));
+        CHECK_EQ(cc->findSymbolByPrefix("_ZN11Symbol8E"), (const void*)(base + 8 * 8));
+        CHECK_EQ(cc->findSymbolByPrefix("_ZN99"), (const void*)NULL);
+    }
+
+    CHECK_GT(cc->usedMemory(), count * (sizeof(CodeBlob) + 3 * sizeof(int)));
+    delete cc;
+    delete[] names;
+}
+
+TEST_CASE(CodeCache_findSymbolBenchmark, benchmarksEnabled()) {
+    const int count = 100000;
+    const int lookups = 200;
+    const char* base = (const char*)LIB_BASE;
+    CodeCache* cc = new CodeCache("libsynthetic.so", 0, base, base + LIB_SIZE);
+
+    char name[64];
+    char** names = new char*[count];
+    for (int i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", i % 7 + 10, i);
+        names[i] = cc->add(base + i * 8, 8, name);
+    }
+    cc->sort();
+
+    // Reference implementation: the linear scan that the index replaces
+    u64 start = OS::nanotime();
+    int found_linear = 0;
+    for (int i = 0; i < lookups; i++) {
+        int n = i * 499 % count;
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", n % 7 + 10, n);
+        for (int j = 0; j < count; j++) {
+            if (strcmp(names[j], name) == 0) {
+                found_linear++;
+                break;
+            }
+        }
+    }
+    u64 linear = OS::nanotime() - start;
+
+    // Startup cost: the first lookups scan linearly, then the index is built
+    start = OS::nanotime();
+    int found = 0;
+    for (int i = 0; i < lookups; i++) {
+        int n = i * 499 % count;
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", n % 7 + 10, n);
+        found += cc->findSymbol(name) == base + n * 8;
+    }
+    u64 indexed = OS::nanotime() - start;
+
+    start = OS::nanotime();
+    for (int i = 0; i < lookups; i++) {
+        int n = i * 499 % count;
+        snprintf(name, sizeof(name), "_ZN%dSymbol%dE", n % 7 + 10, n);
+        found += cc->findSymbol(name) == base + n * 8;
+    }
+    u64 warm = OS::nanotime() - start;
+
+    printf("symbols=%d, lookups=%d: linear %.1f ms, indexed %.1f ms including index build, %.2f us/lookup warm\n",
+           count, lookups, linear / 1e6, indexed / 1e6, (double)warm / lookups / 1000);
+    CHECK_EQ(found, lookups * 2);
+    CHECK_EQ(found_linear, lookups);
+
+    delete cc;
+    delete[] names;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "dwarf.h"
+#include "testRunner.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char BUILD_ID[] = {0x12, 0x34, 0x56, 0x78, (char)0x9a, (char)0xbc, (char)0xde, (char)0xf0};
+
+// Functions with a typical prologue/epilogue sequence, so that rules repeat a lot
+static FrameDesc* createRecords(int functions, int* count) {
+    FrameDesc* records = (FrameDesc*)malloc(functions * 3 * sizeof(FrameDesc));
+    for (int i = 0; i < functions; i++) {
+        u32 start = i * 0x100;
+        records[i * 3] = FrameDesc::empty_frame;
+        records[i * 3].loc = start;
+        records[i * 3 + 1] = FrameDesc::default_frame;
+        records[i * 3 + 1].loc = start + 4;
+        records[i * 3 + 2] = FrameDesc::default_frame;
+        records[i * 3 + 2].cfa += (i % 16) << 11;
+        records[i * 3 + 2].loc = start + 8;
+    }
+    *count = functions * 3;
+    return records;
+}
+
+static bool lookupsMatch(DwarfTable* table, FrameDesc* records, int count) {
+    if (table->count != (u32)count) {
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        u32 end = i + 1 < count ? records[i + 1].loc : records[i].loc + 0x100;
+        for (u32 loc = records[i].loc; loc < end; loc += 3) {
+            FrameDesc* f = table->find(loc);
+            if (f == NULL || f->cfa != records[i].cfa || f->fp_off != records[i].fp_off || f->pc_off != records[i].pc_off) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+TEST_CASE(DwarfTable_compact) {
+    int count;
+    FrameDesc* records = createRecords(10000, &count);
+
+    DwarfTable* table = DwarfTable::create(records, count, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(table != NULL);
+    CHECK_EQ(table->rule_count, 17);
+    CHECK_LT(table->size, count * sizeof(FrameDesc) / 2);
+    CHECK(lookupsMatch(table, records, count));
+
+    // Records are relative to the library start, nothing precedes the first one
+    records[0].loc = 2;
+    DwarfTable* shifted = DwarfTable::create(records, count, NULL, 0);
+    CHECK_EQ(shifted->find(1), (FrameDesc*)NULL);
+    CHECK(shifted->find(2) != NULL);
+
+    DwarfTable::destroy(shifted);
+    DwarfTable::destroy(table);
+    free(records);
+}
+
+// More distinct rules than a 16-bit index can address
+TEST_CASE(DwarfTable_uncompressed) {
+    int count = 70000;
+    FrameDesc* records = (FrameDesc*)malloc(count * sizeof(FrameDesc));
+    for (int i = 0; i < count; i++) {
+        records[i] = FrameDesc::default_frame;
+        records[i].cfa = DW_REG_SP | (i + 1) << 8;
+        records[i].loc = i * 0x10;
+    }
+
+    DwarfTable* table = DwarfTable::create(records, count, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(table != NULL);
+    CHECK_FALSE(table->indexed());
+    CHECK_EQ(table->rule_count, count);
+    CHECK(lookupsMatch(table, records, count));
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/dwarfTableTest.%d", (int)getpid());
+    ASSERT(table->save(path));
+    DwarfTable* loaded = DwarfTable::load(path, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(loaded != NULL);
+    CHECK(lookupsMatch(loaded, records, count));
+
+    unlink(path);
+    DwarfTable::destroy(loaded);
+    DwarfTable::destroy(table);
+    free(records);
+}
+
+TEST_CASE(DwarfTable_saveAndLoad) {
+    int count;
+    FrameDesc* records = createRecords(1000, &count);
+    DwarfTable* table = DwarfTable::create(records, count, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(table != NULL);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/dwarfTableTest.%d", (int)getpid());
+    ASSERT(table->save(path));
+
+    DwarfTable* loaded = DwarfTable::load(path, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(loaded != NULL);
+    CHECK_EQ(loaded->size, table->size);
+    CHECK(lookupsMatch(loaded, records, count));
+
+    // The loaded table is a mapping of the file; replacing the file must not affect it
+    DwarfTable* other = DwarfTable::create(&FrameDesc::empty_frame, 1, BUILD_ID, sizeof(BUILD_ID));
+    ASSERT(other != NULL);
+    ASSERT(other->save(path));
+    CHECK(lookupsMatch(loaded, records, count));
+    DwarfTable::destroy(other);
+    DwarfTable::destroy(loaded);
+    ASSERT(table->save(path));
+
+    // A different library with the same file name
+    CHECK_EQ(DwarfTable::load(path, BUILD_ID, sizeof(BUILD_ID) - 1), (DwarfTable*)NULL);
+
+    // Truncated file
+    ASSERT(truncate(path, table->size - 1) == 0);
+    CHECK_EQ(DwarfTable::load(path, BUILD_ID, sizeof(BUILD_ID)), (DwarfTable*)NULL);
+
+    unlink(path);
+    DwarfTable::destroy(table);
+    free(records);
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "callTraceStorage.h"
+#include "flameGraph.h"
+#include "os.h"
+#include "testRunner.hpp"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int NAMES = 20000;
+static const int MAX_FRAMES = 40;
+
+static void addTrace(FlameGraph& fg, const char** names, int num_frames, const int* name_ids, u64 counter) {
+    Trie* f = fg.root();
+    for (int j = 0; j < num_frames; j++) {
+        FrameTypeId type = j < 3 ? FRAME_NATIVE : (FrameTypeId)(FRAME_INTERPRETED + j % 4);
+        f = fg.addChild(f, names[name_ids[j]], type, counter);
+    }
+    f->_total += counter;
+    f->_self += counter;
+}
+
+TEST_CASE(FlameGraph_output) {
+    const char* names[] = {"main", "foo", "bar", "baz_[j]"};
+    FlameGraph fg("Test", COUNTER_SAMPLES, 0, false, false);
+
+    const int trace1[] = {0, 1, 2};
+    const int trace2[] = {0, 1, 3};
+    const int trace3[] = {0, 2};
+    addTrace(fg, names, 3, trace1, 5);
+    addTrace(fg, names, 3, trace2, 3);
+    addTrace(fg, names, 2, trace3, 2);
+
+    BufferWriter out;
+    fg.dump(out, false);
+    out << '\0';
+    const char* html = out.buf();
+
+    // Names are sorted and stored without the common prefix with the previous one;
+    // the type suffix of "baz_[j]" is dropped
+    CHECK(strstr(html, "'all',\n' bar',\n'\"z',\n' foo',\n' main'\n") != NULL);
+
+    // Children are ordered by name
+    CHECK(strstr(html, "n(3,10)\nu(35)\nu(11,2)\nn(27,8)\nu(11,5)\nn(19,3)\n") != NULL);
+}
+
+static char** makeNames() {
+    char** names = new char*[NAMES];
+    for (int i = 0; i < NAMES; i++) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "org/example/package%d/SomeClass%d.someMethod%d", i % 50, i % 700, i);
+        names[i] = strdup(buf);
+    }
+    return names;
+}
+
+static void freeNames(char** names) {
+    for (int i = 0; i < NAMES; i++) {
+        free(names[i]);
+    }
+    delete[] names;
+}
+
+// Traces share most of their frames from the root, like real applications;
+// the larger the shared depth, the fewer distinct branches near the root
+static void putTraces(CallTraceStorage& storage, int traces, int shared_depth) {
+    ASGCT_CallFrame frames[MAX_FRAMES];
+    memset(frames, 0, sizeof(frames));
+    for (int i = 0; i < traces; i++) {
+        int num_frames = 16 + i % 25;
+        for (int j = 0; j < num_frames; j++) {
+            u32 branch = (u32)(i >> (j < shared_depth ? shared_depth - j : 0)) * 2654435761U + j * 40503;
+            frames[num_frames - 1 - j].method_id = (jmethodID)(uintptr_t)(branch % NAMES);
+        }
+        storage.put(num_frames, frames, 1000 + i % 100, 0);
+    }
+}
+
+static bool checkTotals(const Trie* f, u64* self_sum) {
+    u64 total = f->_self;
+    u32 child_count = 0;
+    for (const Trie* child = f->_first_child; child != NULL; child = child->_next_sibling) {
+        if (child->_parent != f || !checkTotals(child, self_sum)) {
+            return false;
+        }
+        total += child->_total;
+        child_count++;
+    }
+    *self_sum += f->_self;
+    return total == f->_total && child_count == f->_child_count;
+}
+
+// Many distinct stack traces, going through CallTraceStorage like Profiler::dumpFlameGraph does,
+// so that the lookup tables of the flame graph grow several times
+TEST_CASE(FlameGraph_manyTraces) {
+    const int traces = 20000;
+
+    char** names = makeNames();
+    CallTraceStorage storage;
+    putTraces(storage, traces, 15);
+
+    FlameGraph fg("Test", COUNTER_TOTAL, 0, false, false);
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    CHECK_EQ(samples.size(), traces);
+
+    u64 expected_total = 0;
+    int name_ids[MAX_FRAMES];
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i]->acquireTrace();
+        ASSERT(trace);
+        for (int j = 0; j < trace->num_frames; j++) {
+            name_ids[j] = (int)(uintptr_t)trace->frames[trace->num_frames - 1 - j].method_id;
+        }
+        addTrace(fg, (const char**)names, trace->num_frames, name_ids, samples[i]->counter);
+        expected_total += samples[i]->counter;
+    }
+
+    // Every sample is accounted once, in the self time of the frame where its trace ends
+    u64 self_sum = 0;
+    CHECK(checkTotals(fg.root(), &self_sum));
+    CHECK_EQ(self_sum, expected_total);
+    CHECK_EQ(fg.root()->_total, expected_total);
+
+    BufferWriter out(1024 * 1024);
+    fg.dump(out, false);
+    CHECK_GT(out.size(), traces * 10);
+
+    // The lookup tables are released by dump()
+    CHECK_EQ(fg.addChild(fg.root(), names[0], FRAME_NATIVE, 1), (Trie*)NULL);
+
+    freeNames(names);
+}
+
+// The call tree as it was before nodes moved to an arena: every node is a separate
+// heap object with a std::map of children, and frame names are interned in a std::map.
+// Kept here only as a baseline for the benchmark below.
+class MapTrie {
+  public:
+    std::map<u32, MapTrie*> _children;
+    u64 _total;
+    u64 _self;
+    u64 _inlined, _c1_compiled, _interpreted;
+
+    MapTrie() : _children(), _total(0), _self(0), _inlined(0), _c1_compiled(0), _interpreted(0) {
+    }
+
+    ~MapTrie() {
+        for (const auto& entry : _children) {
+            delete entry.second;
+        }
+    }
+
+    MapTrie* child(u32 name_index, FrameTypeId type) {
+        MapTrie** ptr = &_children[name_index | type << 28];
+        if (*ptr == NULL) {
+            *ptr = new MapTrie();
+        }
+        return *ptr;
+    }
+
+    int depth(u64 cutoff, u32* name_order) const {
+        int max_depth = 0;
+        for (auto it = _children.begin(); it != _children.end(); ++it) {
+            if (it->second->_total >= cutoff) {
+                name_order[it->first & ((1 << 28) - 1)] = 1;
+                int d = it->second->depth(cutoff, name_order);
+                if (d > max_depth) max_depth = d;
+            }
+        }
+        return max_depth + 1;
+    }
+};
+
+class MapFlameGraph {
+  private:
+    MapTrie _root;
+    std::map<std::string, u32> _cpool;
+    u32* _name_order;
+    int _last_level;
+    u64 _last_x;
+    u64 _last_total;
+
+    void printFrame(Writer& out, u32 key, const MapTrie& f, int level, u64 x) {
+        char buf[160];
+        u32 name_and_type = _name_order[key & ((1 << 28) - 1)] << 3 | key >> 28;
+        char* p = buf;
+        if (level == _last_level + 1 && x == _last_x) {
+            p += snprintf(p, 100, "u(%u", name_and_type);
+        } else if (level == _last_level && x == _last_x + _last_total) {
+            p += snprintf(p, 100, "n(%u", name_and_type);
+        } else {
+            p += snprintf(p, 100, "f(%u,%d,%llu", name_and_type, level, x - _last_x);
+        }
+        if (f._total != _last_total) {
+            p += snprintf(p, 50, ",%llu", f._total);
+        }
+        strcpy(p, ")\n");
+        out << buf;
+
+        _last_level = level;
+        _last_x = x;
+        _last_total = f._total;
+
+        // Children are ordered by name: the name order goes to the high half of the sort key
+        std::vector<std::pair<u64, const MapTrie*> > children;
+        children.reserve(f._children.size());
+        for (auto it = f._children.begin(); it != f._children.end(); ++it) {
+            u64 order = _name_order[it->first & ((1 << 28) - 1)];
+            children.push_back(std::make_pair(order << 32 | it->first, it->second));
+        }
+        std::sort(children.begin(), children.end());
+
+        x += f._self;
+        for (size_t i = 0; i < children.size(); i++) {
+            printFrame(out, (u32)children[i].first, *children[i].second, level + 1, x);
+            x += children[i].second->_total;
+        }
+    }
+
+  public:
+    MapFlameGraph() : _root(), _cpool(), _name_order(NULL), _last_level(0), _last_x(0), _last_total(0) {
+    }
+
+    MapTrie* root() {
+        return &_root;
+    }
+
+    MapTrie* addChild(MapTrie* f, const char* name, FrameTypeId type, u64 value) {
+        std::string s(name);
+        u32 name_index = _cpool[s];
+        if (name_index == 0) {
+            name_index = _cpool[s] = _cpool.size();
+        }
+
+        f->_total += value;
+        if (type == FRAME_INTERPRETED) {
+            (f = f->child(name_index, FRAME_JIT_COMPILED))->_interpreted += value;
+            return f;
+        } else if (type == FRAME_C1_COMPILED) {
+            (f = f->child(name_index, FRAME_JIT_COMPILED))->_c1_compiled += value;
+            return f;
+        } else if (type == FRAME_INLINED) {
+            (f = f->child(name_index, FRAME_JIT_COMPILED))->_inlined += value;
+            return f;
+        }
+        return f->child(name_index, type);
+    }
+
+    // Same order of work as the old FlameGraph::dump: mark used names, number them
+    // in sorted order while printing the constant pool, then print frames sorted by name
+    void dump(Writer& out) {
+        _name_order = new u32[_cpool.size() + 1]();
+        _root.depth(0, _name_order);
+
+        u32 index = 0;
+        out << "'all'";
+        for (auto it = _cpool.begin(); it != _cpool.end(); ++it) {
+            if (_name_order[it->second]) {
+                _name_order[it->second] = ++index;
+                out << ",\n'" << it->first.c_str() << "'";
+            }
+        }
+        _cpool = std::map<std::string, u32>();
+
+        printFrame(out, FRAME_NATIVE << 28, _root, 0, 0);
+        delete[] _name_order;
+    }
+};
+
+// Peak RSS is measured from the moment the high water mark is reset. Linux only:
+// elsewhere, and on kernels that do not support resetting the mark, peak memory is not reported.
+static long readStatusKb(const char* key) {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    long value = -1;
+    char line[256];
+    size_t key_len = strlen(key);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            value = atol(line + key_len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static long resetPeakRss() {
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (f == NULL) {
+        return -1;
+    }
+    bool ok = fputs("5", f) >= 0;
+    if (fclose(f) != 0 || !ok) {
+        return -1;
+    }
+    return readStatusKb("VmRSS");
+}
+
+static void printPeakRss(long base_kb) {
+    long peak_kb = readStatusKb("VmHWM");
+    if (base_kb >= 0 && peak_kb >= base_kb) {
+        printf(", peak memory +%.1f MB\n", (peak_kb - base_kb) / 1024.0);
+    } else {
+        printf("\n");
+    }
+}
+
+// Builds and dumps a flame graph of 100k distinct stack traces with 16-40 frames each,
+// going through CallTraceStorage like Profiler::dumpFlameGraph does,
+// with the arena-based trie and with the old map-based one
+TEST_CASE(FlameGraph_dumpBenchmark, benchmarksEnabled()) {
+    const int traces = 100000;
+
+    char** names = makeNames();
+    CallTraceStorage storage;
+    putTraces(storage, traces, 17);
+
+    std::vector<CallTraceSample*> samples;
+    storage.collectSamples(samples);
+    CHECK_EQ(samples.size(), traces);
+
+    std::vector<CallTrace*> trace_list;
+    for (size_t i = 0; i < samples.size(); i++) {
+        CallTrace* trace = samples[i]->acquireTrace();
+        ASSERT(trace);
+        trace_list.push_back(trace);
+    }
+
+    u64 arena_total;
+    size_t arena_output;
+    {
+        long base_kb = resetPeakRss();
+        u64 start = OS::nanotime();
+        FlameGraph fg("Benchmark", COUNTER_TOTAL, 0, false, false);
+        for (size_t i = 0; i < trace_list.size(); i++) {
+            CallTrace* trace = trace_list[i];
+            Trie* f = fg.root();
+            for (int j = trace->num_frames - 1; j >= 0 && f != NULL; j--) {
+                FrameTypeId type = j < 3 ? FRAME_NATIVE : (FrameTypeId)(FRAME_INTERPRETED + j % 4);
+                f = fg.addChild(f, names[(uintptr_t)trace->frames[j].method_id], type, samples[i]->counter);
+            }
+            ASSERT(f);
+            f->_total += samples[i]->counter;
+            f->_self += samples[i]->counter;
+        }
+        u64 built = OS::nanotime();
+
+        BufferWriter out(1024 * 1024);
+        fg.dump(out, false);
+        u64 dumped = OS::nanotime();
+
+        arena_total = fg.root()->_total;
+        arena_output = out.size();
+        printf("arena trie, traces=%d: build %.1f ms, dump %.1f ms, output %.1f MB", (int)samples.size(),
+               (built - start) / 1e6, (dumped - built) / 1e6, arena_output / 1048576.0);
+        printPeakRss(base_kb);
+    }
+
+    u64 map_total;
+    {
+        long base_kb = resetPeakRss();
+        u64 start = OS::nanotime();
+        MapFlameGraph* fg = new MapFlameGraph();
+        for (size_t i = 0; i < trace_list.size(); i++) {
+            CallTrace* trace = trace_list[i];
+            MapTrie* f = fg->root();
+            for (int j = trace->num_frames - 1; j >= 0; j--) {
+                FrameTypeId type = j < 3 ? FRAME_NATIVE : (FrameTypeId)(FRAME_INTERPRETED + j % 4);
+                f = fg->addChild(f, names[(uintptr_t)trace->frames[j].method_id], type, samples[i]->counter);
+            }
+            f->_total += samples[i]->counter;
+            f->_self += samples[i]->counter;
+        }
+        u64 built = OS::nanotime();
+
+        BufferWriter out(1024 * 1024);
+        fg->dump(out);
+        u64 dumped = OS::nanotime();
+
+        map_total = fg->root()->_total;
+        printf("map trie,   traces=%d: build %.1f ms, dump %.1f ms, output %.1f MB", (int)samples.size(),
+               (built - start) / 1e6, (dumped - built) / 1e6, out.size() / 1048576.0);
+        printPeakRss(base_kb);
+        delete fg;
+    }
+
+    CHECK_EQ(arena_total, map_total);
+    CHECK_GT(arena_output, traces * 10);
+
+    freeNames(names);
+}
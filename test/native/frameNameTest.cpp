@@ -0,0 +1,114 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "frameName.h"
+#include "testRunner.hpp"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+static const int CACHED_METHODS = 20000;
+
+static uintptr_t methodKey(int i) {
+    return 0x7f0000001000ULL + i * 8;
+}
+
+static bool hasName(NameCache* cache, uintptr_t key, int style, const char* expected) {
+    const char* name = cache->lookup(key, style, 1);
+    return name != NULL && strcmp(name, expected) == 0;
+}
+
+TEST_CASE(NameCache_lookupAndEvict) {
+    NameCache* cache = new NameCache();
+    CHECK_EQ(cache->lookup(methodKey(0), 0, 1), (const char*)NULL);
+    CHECK_EQ(cache->usedMemory(), 0);
+
+    char name[64];
+    for (int i = 0; i < CACHED_METHODS; i++) {
+        snprintf(name, sizeof(name), "Class%d.method%d", i % 100, i);
+        // Young methods get the later epoch
+        cache->insert(methodKey(i), 0, i < CACHED_METHODS / 2 ? 1 : 3, name);
+    }
+    // The same method in another style and a class name
+    cache->insert(methodKey(5), STYLE_DOTTED, 3, "Class5.method5");
+    cache->insert(5 << 1 | 1, STYLE_DOTTED, 3, "Class5");
+
+    // Inserting the same key again keeps the first name
+    const char* first = cache->lookup(methodKey(7), 0, 1);
+    CHECK_EQ(cache->insert(methodKey(7), 0, 1, "Other.name"), first);
+
+    for (int i = 0; i < CACHED_METHODS; i++) {
+        snprintf(name, sizeof(name), "Class%d.method%d", i % 100, i);
+        ASSERT(hasName(cache, methodKey(i), 0, name));
+    }
+    CHECK(hasName(cache, methodKey(5), STYLE_DOTTED, "Class5.method5"));
+    CHECK_GT(cache->usedMemory(), CACHED_METHODS * 16);
+
+    // Lookups above refreshed all entries to epoch 1, refresh the young ones again
+    for (int i = CACHED_METHODS / 2; i < CACHED_METHODS; i++) {
+        cache->lookup(methodKey(i), 0, 3);
+    }
+    cache->evict(3, 2);
+    CHECK_EQ(cache->lookup(methodKey(0), 0, 3), (const char*)NULL);
+    CHECK(hasName(cache, methodKey(CACHED_METHODS - 1), 0, "Class99.method19999"));
+    CHECK(hasName(cache, 5 << 1 | 1, STYLE_DOTTED, "Class5"));
+
+    cache->evict(3, 2, true);
+    CHECK_EQ(cache->lookup(5 << 1 | 1, STYLE_DOTTED, 3), (const char*)NULL);
+    CHECK(hasName(cache, methodKey(CACHED_METHODS - 1), 0, "Class99.method19999"));
+
+    // Zero max age clears everything
+    cache->evict(3, 0);
+    CHECK_EQ(cache->lookup(methodKey(CACHED_METHODS - 1), 0, 3), (const char*)NULL);
+    CHECK_EQ(cache->usedMemory(), 0);
+    delete cache;
+}
+
+struct CacheWorker {
+    NameCache* cache;
+    int offset;
+    int mismatches;
+};
+
+static void* resolveMethods(void* arg) {
+    CacheWorker* w = (CacheWorker*)arg;
+    char name[64];
+    for (int i = 0; i < CACHED_METHODS; i++) {
+        int m = (i + w->offset) % CACHED_METHODS;
+        snprintf(name, sizeof(name), "Class%d.method%d", m % 100, m);
+        const char* cached = w->cache->lookup(methodKey(m), 0, 1);
+        if (cached == NULL) {
+            cached = w->cache->insert(methodKey(m), 0, 1, name);
+        }
+        if (strcmp(cached, name) != 0) {
+            w->mismatches++;
+        }
+    }
+    return NULL;
+}
+
+// Dump threads resolve overlapping sets of methods while the table grows
+TEST_CASE(NameCache_concurrentInsert) {
+    const int threads = 4;
+    NameCache* cache = new NameCache();
+    CacheWorker workers[threads];
+    pthread_t tids[threads];
+
+    for (int i = 0; i < threads; i++) {
+        workers[i].cache = cache;
+        workers[i].offset = i * CACHED_METHODS / threads;
+        workers[i].mismatches = 0;
+        ASSERT(pthread_create(&tids[i], NULL, resolveMethods, &workers[i]) == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        CHECK_EQ(workers[i].mismatches, 0);
+    }
+
+    // Every method is cached once, so that names are interned
+    const char* name = cache->lookup(methodKey(123), 0, 1);
+    CHECK_EQ(cache->insert(methodKey(123), 0, 1, "Class23.method123"), name);
+    delete cache;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifdef __linux__
+
+#include "ioRing.h"
+#include "testRunner.hpp"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static bool ioRingSupported() {
+    IoRing ring;
+    return ring.open(4);
+}
+
+static int createTempFile() {
+    char path[] = "/tmp/ioRingTestXXXXXX";
+    int fd = mkstemp(path);
+    unlink(path);
+    return fd;
+}
+
+TEST_CASE(IoRing_batchedWrites, ioRingSupported()) {
+    IoRing ring;
+    ASSERT(ring.open(8));
+    int fd = createTempFile();
+    ASSERT_GTE(fd, 0);
+
+    // Header is patched at an explicit offset after the body is appended
+    CHECK(ring.write(fd, "----", 4, CURRENT_POSITION));
+    CHECK(ring.write(fd, "body", 4, 4));
+    CHECK_EQ(ring.submitAndWait(), 8);
+
+    CHECK(ring.write(fd, "head", 4, 0));
+    CHECK(ring.write(fd, "tail", 4, 8));
+    CHECK_EQ(ring.available(), 6);
+    CHECK_EQ(ring.submitAndWait(), 8);
+    CHECK_EQ(ring.available(), 8);
+
+    char buf[16] = {0};
+    CHECK_EQ(pread(fd, buf, sizeof(buf), 0), 12);
+    CHECK_EQ(strcmp(buf, "headbodytail"), 0);
+    close(fd);
+}
+
+TEST_CASE(IoRing_queueFull, ioRingSupported()) {
+    IoRing ring;
+    ASSERT(ring.open(2));
+    int fd = createTempFile();
+    ASSERT_GTE(fd, 0);
+
+    u32 entries = ring.available();
+    for (u32 i = 0; i < entries; i++) {
+        CHECK(ring.write(fd, "x", 1, i));
+    }
+    CHECK_FALSE(ring.write(fd, "x", 1, entries));
+    CHECK_EQ(ring.submitAndWait(), (ssize_t)entries);
+    close(fd);
+}
+
+TEST_CASE(IoRing_writeError, ioRingSupported()) {
+    IoRing ring;
+    ASSERT(ring.open(2));
+
+    CHECK(ring.write(-1, "x", 1, CURRENT_POSITION));
+    CHECK_EQ(ring.submitAndWait(), -1);
+    CHECK_EQ(ring.error(), EBADF);
+}
+
+#endif // __linux__
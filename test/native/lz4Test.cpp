@@ -0,0 +1,76 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "lz4.h"
+#include "testRunner.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool roundTrip(const char* data, size_t size, size_t* compressed_size) {
+    char* packed = (char*)malloc(LZ4::maxCompressedSize(size));
+    char* unpacked = (char*)malloc(size + 1);
+
+    *compressed_size = LZ4::compress(data, size, packed);
+    ssize_t result = LZ4::decompress(packed, *compressed_size, unpacked, size + 1);
+    bool ok = result == (ssize_t)size && memcmp(data, unpacked, size) == 0;
+
+    free(unpacked);
+    free(packed);
+    return ok;
+}
+
+TEST_CASE(LZ4_roundTripRepetitive) {
+    const size_t size = 1 << 20;
+    char* data = (char*)calloc(size, 1);
+    for (size_t i = 0; i < size; i += 32) {
+        // Event-like records with a slowly changing field
+        snprintf(data + i, size - i, "%08zx;java/lang/Thread.run;", i / 64);
+    }
+    memset(data + size - 100, 'z', 100);
+
+    size_t compressed_size;
+    CHECK(roundTrip(data, size, &compressed_size));
+    CHECK_LT(compressed_size, size / 4);
+    free(data);
+}
+
+TEST_CASE(LZ4_roundTripIncompressible) {
+    const size_t size = 100000;
+    char* data = (char*)malloc(size);
+    u32 seed = 12345;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (char)(seed >> 16);
+    }
+
+    size_t compressed_size;
+    CHECK(roundTrip(data, size, &compressed_size));
+    CHECK_LTE(compressed_size, LZ4::maxCompressedSize(size));
+
+    // Inputs too short for a match are encoded as a single literal run
+    CHECK(roundTrip(data, 0, &compressed_size));
+    CHECK_EQ(compressed_size, 1);
+    CHECK(roundTrip(data, 12, &compressed_size));
+    CHECK_EQ(compressed_size, 13);
+    free(data);
+}
+
+TEST_CASE(LZ4_malformedInput) {
+    char out[256];
+
+    // Match offset points before the start of the output
+    const char bad_offset[] = {0x14, 'a', 0x05, 0x00};
+    CHECK_EQ(LZ4::decompress(bad_offset, sizeof(bad_offset), out, sizeof(out)), -1);
+
+    // Literal run is longer than the input
+    const char truncated[] = {(char)0xf0, 0x10, 'a'};
+    CHECK_EQ(LZ4::decompress(truncated, sizeof(truncated), out, sizeof(out)), -1);
+
+    // Valid sequence that does not fit in the output
+    const char overflow[] = {0x1f, 'a', 0x01, 0x00, 0x7f};
+    CHECK_EQ(LZ4::decompress(overflow, sizeof(overflow), out, 64), -1);
+    CHECK_EQ(LZ4::decompress(overflow, sizeof(overflow), out, 1 + 4 + 15 + 0x7f), 1 + 4 + 15 + 0x7f);
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "otlp.h"
+#include "otlpWriter.h"
+#include "testRunner.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace Otlp;
+
+struct ProtoField {
+    u32 index;
+    u64 value;
+    const unsigned char* data;
+};
+
+static u64 decodeVarInt(const unsigned char*& p) {
+    u64 result = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char b = *p++;
+        result |= (u64)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) return result;
+    }
+}
+
+// Splits a message into fields; returns false if any length runs past the end
+static bool parseMessage(const unsigned char* data, size_t len, std::vector<ProtoField>& fields) {
+    const unsigned char* p = data;
+    const unsigned char* end = data + len;
+    while (p < end) {
+        u64 tag = decodeVarInt(p);
+        ProtoField f = {(u32)(tag >> 3), decodeVarInt(p), p};
+        if ((tag & 7) == LEN) {
+            if (f.value > (u64)(end - p)) return false;
+            p += f.value;
+        } else if ((tag & 7) != VARINT) {
+            return false;
+        }
+        fields.push_back(f);
+    }
+    return p == end;
+}
+
+static const ProtoField* findField(const std::vector<ProtoField>& fields, u32 index, size_t nth = 0) {
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].index == index && nth-- == 0) return &fields[i];
+    }
+    return NULL;
+}
+
+static u64 varIntField(const std::vector<ProtoField>& fields, u32 index) {
+    const ProtoField* f = findField(fields, index);
+    return f != NULL ? f->value : 0;
+}
+
+TEST_CASE(Index_internsValues) {
+    Index index(1);
+    CHECK_EQ(index.indexOf(""), 1);
+    CHECK_EQ(index.indexOf("abc"), 2);
+    CHECK_EQ(index.indexOf(std::string("abc")), 2);
+    CHECK_EQ(index.indexOf("abcdef", 3), 2);
+    CHECK_EQ(index.indexOf("ab"), 3);
+
+    char buf[32];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(buf, sizeof(buf), "value%d", i);
+        ASSERT_EQ(index.indexOf(buf), (size_t)(4 + i));
+    }
+    CHECK_EQ(index.size(), 10003);
+    CHECK_EQ(index.indexOf("value1234"), 1238);
+    CHECK_EQ(index.length(1238), 9);
+    CHECK_EQ(strncmp(index.value(1238), "value1234", 9), 0);
+    CHECK_EQ(index.length(1), 0);
+}
+
+// Reconstructs frame names of the given sample through location, function and string tables
+static std::string sampleFrames(const std::vector<ProtoField>& profile, const std::vector<ProtoField>& dictionary,
+                                size_t sample_idx) {
+    std::vector<ProtoField> sample;
+    const ProtoField* s = findField(profile, Profile::sample, sample_idx);
+    if (s == NULL || !parseMessage(s->data, s->value, sample)) return "<bad sample>";
+
+    std::vector<u64> location_indices;
+    const ProtoField* li = findField(profile, Profile::location_indices);
+    for (const unsigned char* p = li->data; p < li->data + li->value; ) {
+        location_indices.push_back(decodeVarInt(p));
+    }
+
+    std::string result;
+    u64 start = varIntField(sample, Sample::locations_start_index);
+    u64 length = varIntField(sample, Sample::locations_length);
+    for (u64 i = start; i < start + length; i++) {
+        std::vector<ProtoField> location, line, function;
+        const ProtoField* l = findField(dictionary, ProfilesDictionary::location_table, location_indices[i]);
+        parseMessage(l->data, l->value, location);
+        const ProtoField* ln = findField(location, Location::line);
+        parseMessage(ln->data, ln->value, line);
+        const ProtoField* f = findField(dictionary, ProfilesDictionary::function_table, varIntField(line, Line::function_index));
+        parseMessage(f->data, f->value, function);
+        const ProtoField* name = findField(dictionary, ProfilesDictionary::string_table, varIntField(function, Function::name_strindex));
+        if (!result.empty()) result += ';';
+        result.append((const char*)name->data, name->value);
+    }
+    return result;
+}
+
+TEST_CASE(OtlpWriter_resolvesLocations) {
+    OtlpWriter otlp(1000, 2000);
+    otlp.addSampleType("cpu", "count");
+    otlp.addSampleType("cpu", "ns");
+
+    // "cpu" is both a sample type and a function name
+    otlp.addLocation("cpu");
+    otlp.addLocation("main");
+    otlp.addSample(2, "worker", 3, 30);
+
+    // Enough samples to exceed the dictionary flush threshold
+    char name[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "function%d", i);
+        otlp.addLocation(name);
+        otlp.addLocation("main");
+        otlp.addSample(2, NULL, 1, 10);
+    }
+
+    BufferWriter out;
+    otlp.write(out);
+
+    std::vector<ProtoField> data, resource_profiles, scope_profiles, profile, dictionary;
+    ASSERT(parseMessage((const unsigned char*)out.buf(), out.size(), data));
+    const ProtoField* rp = findField(data, ProfilesData::resource_profiles);
+    const ProtoField* dict = findField(data, ProfilesData::dictionary);
+    ASSERT(rp != NULL && dict != NULL);
+    ASSERT(parseMessage(rp->data, rp->value, resource_profiles));
+    const ProtoField* sp = findField(resource_profiles, ResourceProfiles::scope_profiles);
+    ASSERT(parseMessage(sp->data, sp->value, scope_profiles));
+    const ProtoField* p = findField(scope_profiles, ScopeProfiles::profiles);
+    ASSERT(parseMessage(p->data, p->value, profile));
+    ASSERT(parseMessage(dict->data, dict->value, dictionary));
+
+    CHECK_EQ(varIntField(profile, Profile::time_nanos), 1000);
+    CHECK_EQ(varIntField(profile, Profile::duration_nanos), 2000);
+    CHECK(findField(profile, Profile::sample, 5000) != NULL);
+    CHECK(findField(profile, Profile::sample, 5001) == NULL);
+
+    std::string first = sampleFrames(profile, dictionary, 0);
+    std::string second = sampleFrames(profile, dictionary, 1);
+    std::string last = sampleFrames(profile, dictionary, 5000);
+    CHECK_EQ(first.c_str(), "cpu;main");
+    CHECK_EQ(second.c_str(), "function0;main");
+    CHECK_EQ(last.c_str(), "function4999;main");
+
+    // Each string is stored once: "", "cpu", "count", "ns", "main" and the loop functions
+    CHECK(findField(dictionary, ProfilesDictionary::string_table, 5004) != NULL);
+    CHECK(findField(dictionary, ProfilesDictionary::string_table, 5005) == NULL);
+    // Function 0 is reserved, "cpu", "main" and one per loop iteration
+    CHECK(findField(dictionary, ProfilesDictionary::function_table, 5002) != NULL);
+    CHECK(findField(dictionary, ProfilesDictionary::function_table, 5003) == NULL);
+
+    // Only the first sample has a thread attribute
+    std::vector<ProtoField> sample, attribute, value;
+    const ProtoField* s = findField(profile, Profile::sample, 0);
+    ASSERT(parseMessage(s->data, s->value, sample));
+    const ProtoField* a = findField(dictionary, ProfilesDictionary::attribute_table, varIntField(sample, Sample::attribute_indices));
+    ASSERT(parseMessage(a->data, a->value, attribute));
+    const ProtoField* v = findField(attribute, Key::value);
+    ASSERT(parseMessage(v->data, v->value, value));
+    const ProtoField* thread = findField(value, AnyValue::string_value);
+    std::string thread_name((const char*)thread->data, thread->value);
+    CHECK_EQ(thread_name.c_str(), "worker");
+}
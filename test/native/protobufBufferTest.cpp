@@ -198,3 +198,13 @@ TEST_CASE(Buffer_test_string_with_explicit_length) {
     CHECK_EQ(strncmp((const char*) buf.data() + 2, "hello", partialLength), 0);
 
 }
+
+TEST_CASE(Buffer_test_field_header) {
+    ProtoBuffer buf(100);
+
+    buf.fieldHeader(7, 300);
+
+    CHECK_EQ(buf.offset(), ProtoBuffer::fieldSize(7, 300) - 300);
+    CHECK_EQ(buf.data()[0], (7 << 3) | LEN);
+    CHECK_EQ(readVarInt(buf.data() + 1), 300);
+}
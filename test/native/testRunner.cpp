@@ -7,6 +7,7 @@
 #include "testRunner.hpp"
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 int main() {
@@ -30,6 +31,10 @@ bool fileReadable(const char* filename) {
     return r != -1;
 }
 
+bool benchmarksEnabled() {
+    return getenv("BENCHMARK") != NULL;
+}
+
 int TestRunner::runAllTests() {
     int passed = 0;
     int failed = 0;
@@ -156,4 +156,7 @@ struct TestRegistrar {
 
 bool fileReadable(const char* filename);
 
+// Benchmarks are skipped unless the BENCHMARK environment variable is set, see `make bench-cpp`
+bool benchmarksEnabled();
+
 #endif // _TESTRUNNER_HPP
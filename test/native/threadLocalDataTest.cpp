@@ -0,0 +1,57 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "os.h"
+#include "testRunner.hpp"
+#include "threadLocalData.h"
+#include <pthread.h>
+
+static int countSampleContexts() {
+    int count = 0;
+    for (SampleContext* ctx = ThreadLocalData::sampleContexts(); ctx != NULL; ctx = ctx->next) {
+        count++;
+    }
+    return count;
+}
+
+static void* initContext(void* arg) {
+    SampleContext* ctx = ThreadLocalData::initSampleContext(OS::threadId());
+    if (ctx != NULL && ThreadLocalData::getSampleContext() != ctx) {
+        ctx = NULL;
+    }
+    *(SampleContext**)arg = ctx;
+    return NULL;
+}
+
+TEST_CASE(ThreadLocalData_sampleContextReused) {
+    SampleContext* first = NULL;
+    pthread_t thread;
+    pthread_create(&thread, NULL, initContext, &first);
+    pthread_join(thread, NULL);
+
+    CHECK(first != NULL);
+    CHECK_EQ(first->owner, 0);
+    int contexts = countSampleContexts();
+
+    // A context released by a terminated thread goes to the next thread
+    SampleContext* second = NULL;
+    pthread_create(&thread, NULL, initContext, &second);
+    pthread_join(thread, NULL);
+
+    CHECK(second != NULL);
+    CHECK_EQ(countSampleContexts(), contexts);
+}
+
+TEST_CASE(ThreadLocalData_noSampleContextByDefault) {
+    SampleContext* ctx = (SampleContext*)1;
+    pthread_t thread;
+    pthread_create(&thread, NULL, [](void* arg) -> void* {
+        *(SampleContext**)arg = ThreadLocalData::getSampleContext();
+        return NULL;
+    }, &ctx);
+    pthread_join(thread, NULL);
+
+    CHECK_EQ(ctx, NULL);
+}
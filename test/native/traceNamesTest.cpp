@@ -0,0 +1,182 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "os.h"
+#include "traceNames.h"
+#include "testRunner.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const int SYMBOL_NAMES = 5000;
+static const int TRACE_FRAMES = 32;
+
+// Native frames with mangled C++ names, so that naming involves demangling like in real profiles
+static char** createNames() {
+    char** names = new char*[SYMBOL_NAMES];
+    for (int i = 0; i < SYMBOL_NAMES; i++) {
+        char cls[32];
+        char method[32];
+        char buf[128];
+        snprintf(cls, sizeof(cls), "Klass%d", i % 300);
+        snprintf(method, sizeof(method), "method%d", i);
+        if (i == SYMBOL_NAMES - 1) {
+            snprintf(buf, sizeof(buf), "excluded_function");
+        } else {
+            snprintf(buf, sizeof(buf), "_ZN7example%d%s%d%sEi", (int)strlen(cls), cls, (int)strlen(method), method);
+        }
+        names[i] = strdup(buf);
+    }
+    return names;
+}
+
+static CallTrace** createTraces(char** names, int count) {
+    CallTrace** traces = new CallTrace*[count];
+    for (int i = 0; i < count; i++) {
+        int num_frames = 4 + i % (TRACE_FRAMES - 4);
+        CallTrace* trace = (CallTrace*)malloc(sizeof(CallTrace) + (num_frames - 1) * sizeof(ASGCT_CallFrame));
+        trace->num_frames = num_frames;
+        for (int j = 0; j < num_frames; j++) {
+            trace->frames[j].bci = BCI_NATIVE_FRAME;
+            trace->frames[j].method_id = (jmethodID)names[(u32)(i * 31 + j * 7919) % SYMBOL_NAMES];
+        }
+        traces[i] = trace;
+    }
+    return traces;
+}
+
+static void destroyTraces(CallTrace** traces, int count, char** names) {
+    for (int i = 0; i < count; i++) {
+        free(traces[i]);
+    }
+    delete[] traces;
+    for (int i = 0; i < SYMBOL_NAMES; i++) {
+        free(names[i]);
+    }
+    delete[] names;
+}
+
+// Compares parallel results with names produced by a single FrameName
+static bool matchesFrameName(Arguments& args, CallTrace** traces, int count, int threads, int max_frames) {
+    Mutex thread_names_lock;
+    ThreadMap thread_names;
+    FrameName fn(args, 0, 0, thread_names_lock, thread_names);
+    TraceNames names(args, 0, 0, thread_names_lock, thread_names, threads, max_frames);
+
+    for (size_t start = 0; start < (size_t)count; start += names.batchSize()) {
+        size_t batch = count - start < names.batchSize() ? count - start : names.batchSize();
+        names.resolve(traces + start, batch);
+
+        for (size_t i = 0; i < batch; i++) {
+            CallTrace* trace = traces[start + i];
+            bool excluded = false;
+            for (int j = 0; j < trace->num_frames; j++) {
+                excluded |= strcmp((const char*)trace->frames[j].method_id, "excluded_function") == 0;
+            }
+            if (names.excluded(i) != excluded) {
+                return false;
+            }
+            if (excluded) continue;
+
+            int num_frames = trace->num_frames < max_frames ? trace->num_frames : max_frames;
+            for (int j = 0; j < num_frames; j++) {
+                if (strcmp(names.name(i, j), fn.name(trace->frames[j])) != 0 ||
+                    names.type(i, j) != fn.type(trace->frames[j])) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+TEST_CASE(TraceNames_matchesFrameName) {
+    const int count = 20000;
+    char** names = createNames();
+    CallTrace** traces = createTraces(names, count);
+
+    Arguments args;
+    args._exclude.push_back("*excluded_function*");
+
+    CHECK(matchesFrameName(args, traces, count, 1, TRACE_FRAMES));
+    CHECK(matchesFrameName(args, traces, count, 4, TRACE_FRAMES));
+    CHECK(matchesFrameName(args, traces, count, 3, 1));
+    CHECK(matchesFrameName(args, traces, 100, 4, TRACE_FRAMES));
+
+    destroyTraces(traces, count, names);
+}
+
+TEST_CASE(TraceNames_threadsFor) {
+    CHECK_LTE(TraceNames::threadsFor(0), 1);
+    CHECK_EQ(TraceNames::threadsFor(1), 1);
+    CHECK_EQ(TraceNames::threadsFor(TRACES_PER_CHUNK), 1);
+
+    int cpus = OS::getCpuCount();
+    int expected = cpus < MAX_DUMP_THREADS ? cpus : MAX_DUMP_THREADS;
+    CHECK_EQ(TraceNames::threadsFor(TRACES_PER_CHUNK * (MAX_DUMP_THREADS + 1)), expected);
+    CHECK_LTE(TraceNames::threadsFor(TRACES_PER_CHUNK + 1), 2);
+}
+
+TEST_CASE(TraceNames_defaultThreads) {
+    const int count = 100000;
+    char** names = createNames();
+    CallTrace** traces = createTraces(names, count);
+
+    // The pool size picked for a dump must produce the same names as a single FrameName
+    Arguments args;
+    args._exclude.push_back("*excluded_function*");
+    CHECK(matchesFrameName(args, traces, count, TraceNames::threadsFor(count), TRACE_FRAMES));
+
+    destroyTraces(traces, count, names);
+}
+
+// Names every frame of 100k traces with a single FrameName, then with pools of
+// 1..MAX_DUMP_THREADS threads; the pool of 1 shows the overhead of batching
+TEST_CASE(TraceNames_benchmark, benchmarksEnabled()) {
+    const int count = 100000;
+    char** names = createNames();
+    CallTrace** traces = createTraces(names, count);
+
+    Arguments args;
+    Mutex thread_names_lock;
+    ThreadMap thread_names;
+
+    u64 start = OS::nanotime();
+    size_t sequential_bytes = 0;
+    {
+        FrameName fn(args, 0, 0, thread_names_lock, thread_names);
+        for (int i = 0; i < count; i++) {
+            for (int j = traces[i]->num_frames - 1; j >= 0; j--) {
+                sequential_bytes += strlen(fn.name(traces[i]->frames[j])) + 1;
+            }
+        }
+    }
+    u64 sequential = OS::nanotime() - start;
+    printf("traces=%d: sequential %.1f ms\n", count, sequential / 1e6);
+
+    for (int threads = 1; threads <= MAX_DUMP_THREADS; threads *= 2) {
+        start = OS::nanotime();
+        size_t parallel_bytes = 0;
+        {
+            TraceNames trace_names(args, 0, 0, thread_names_lock, thread_names, threads);
+            for (size_t s = 0; s < (size_t)count; s += trace_names.batchSize()) {
+                size_t batch = count - s < trace_names.batchSize() ? count - s : trace_names.batchSize();
+                trace_names.resolve(traces + s, batch);
+                for (size_t i = 0; i < batch; i++) {
+                    for (int j = traces[s + i]->num_frames - 1; j >= 0; j--) {
+                        parallel_bytes += strlen(trace_names.name(i, j)) + 1;
+                    }
+                }
+            }
+        }
+        u64 parallel = OS::nanotime() - start;
+
+        printf("traces=%d: pool of %d threads %.1f ms (%.2fx)\n", count, threads,
+               parallel / 1e6, (double)sequential / parallel);
+        CHECK_EQ(parallel_bytes, sequential_bytes);
+    }
+
+    destroyTraces(traces, count, names);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright The async-profiler authors
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "dwarf.h"
+#include "unwindCache.h"
+#include "testRunner.hpp"
+
+TEST_CASE(UnwindCache_lookup) {
+    UnwindCache* cache = new UnwindCache();
+    FrameDesc frames[2];
+    const char* pc = (const char*)0x7f0000001234;
+
+    ASSERT(cache->tryAcquire(2));
+    CHECK_FALSE(cache->tryAcquire(2));
+    CHECK_EQ(cache->lookup(pc), (FrameDesc*)NULL);
+
+    cache->insert(pc, &frames[0]);
+    CHECK_EQ(cache->lookup(pc), &frames[0]);
+    CHECK_EQ(cache->lookup(pc + 1), (FrameDesc*)NULL);
+
+    // Colliding PC replaces the entry
+    const char* other = pc + 0x10100;
+    cache->insert(other, &frames[1]);
+    CHECK_EQ(cache->lookup(other), &frames[1]);
+    CHECK_EQ(cache->lookup(pc), (FrameDesc*)NULL);
+    cache->release();
+
+    CHECK_EQ(cache->lookups(), 5);
+    CHECK_EQ(cache->hits(), 2);
+
+    // Entries survive while the list of libraries stays the same
+    ASSERT(cache->tryAcquire(2));
+    CHECK_EQ(cache->lookup(other), &frames[1]);
+    cache->release();
+
+    // A newly loaded library invalidates everything
+    ASSERT(cache->tryAcquire(4));
+    CHECK_EQ(cache->lookup(other), (FrameDesc*)NULL);
+    cache->release();
+
+    cache->resetStats();
+    CHECK_EQ(cache->lookups(), 0);
+    delete cache;
+}
@@ -24,7 +24,9 @@ public class MetricsTest {
             String[] pair = line.split(" ");
             assert pair.length == 2 : line;
             if (pair[1].startsWith("0")) {
-                assert "samples_skipped_total".equals(pair[0]) || "calltracestorage_overflows_total".equals(pair[0]) : line;
+                assert "samples_skipped_total".equals(pair[0]) || "calltracestorage_overflows_total".equals(pair[0]) ||
+                        "calltracestorage_evicted_samples_total".equals(pair[0]) ||
+                        pair[0].startsWith("jfr_writer_") : line;
             }
 
             if (pair[0].equals("samples_total")) {
@@ -34,5 +36,6 @@ public class MetricsTest {
 
         // Should be found since we used features=stats
         assert metrics.contains("stackwalk_ns_total") : metrics;
+        assert metrics.contains("concurrency_level") : metrics;
     }
 }